@@ -5,40 +5,101 @@ cyberd-objs:= \
 	src/cyberd/configuration.o \
 	src/cyberd/daemon.o \
 	src/cyberd/daemon_conf.o \
+	src/cyberd/events.o \
 	src/cyberd/main.o \
+	src/cyberd/peers.o \
+	src/cyberd/process.o \
 	src/cyberd/signals.o \
 	src/cyberd/socket_connection_node.o \
 	src/cyberd/socket_endpoint_node.o \
-	src/cyberd/socket_node.o \
 	src/cyberd/socket_switch.o \
 	src/cyberd/spawns.o \
-	src/cyberd/tree.o
+	src/cyberd/status_page.o \
+	src/cyberd/tree.o \
+	src/cyberd/zygotes.o
+
+ifneq ($(CONFIG_DAEMON_SPAWNERS),)
+cyberd-objs+=src/cyberd/spawners.o
+endif
+
+ifneq ($(CONFIG_CONFIGURATION_SNAPSHOT_PATH),)
+cyberd-objs+=src/cyberd/snapshot.o
+endif
+
+ifneq ($(CONFIG_SOCKET_SWITCH_IO_URING),)
+cyberd-objs+=src/cyberd/socket_switch_uring.o
+endif
 
 cyberctl-objs:=src/cyberctl.o
 
-src/cyberd/daemon.o: CPPFLAGS+= \
-	-DCONFIG_DAEMON_DEFAULT_WORKDIR='"$(CONFIG_DAEMON_DEFAULT_WORKDIR)"' \
-	-DCONFIG_DAEMON_DEV_NULL='"$(CONFIG_DAEMON_DEV_NULL)"'
+src/cyberd/process.o: CPPFLAGS+=-D_GNU_SOURCE
+ifneq ($(CONFIG_DAEMON_SPAWN_VFORK),)
+src/cyberd/process.o: CPPFLAGS+=-DCONFIG_DAEMON_SPAWN_VFORK
+endif
 
-src/cyberd/daemon_conf.o: CPPFLAGS+= \
+ifneq ($(CONFIG_DAEMON_SPAWNERS),)
+src/cyberd/daemon.o src/cyberd/main.o src/cyberd/spawners.o: CPPFLAGS+=-DCONFIG_DAEMON_SPAWNERS='$(CONFIG_DAEMON_SPAWNERS)'
+endif
+
+daemon-conf-cppflags:= \
+	-DCONFIG_DAEMON_DEFAULT_WORKDIR='"$(CONFIG_DAEMON_DEFAULT_WORKDIR)"' \
+	-DCONFIG_DAEMON_DEV_NULL='"$(CONFIG_DAEMON_DEV_NULL)"' \
 	-DCONFIG_DAEMON_CONF_DEFAULT_UMASK='0$(CONFIG_DAEMON_CONF_DEFAULT_UMASK)' \
 	-DCONFIG_DAEMON_CONF_MAX_UID='$(CONFIG_DAEMON_CONF_MAX_UID)' \
-	-DCONFIG_DAEMON_CONF_MAX_GID='$(CONFIG_DAEMON_CONF_MAX_GID)'
+	-DCONFIG_DAEMON_CONF_MAX_GID='$(CONFIG_DAEMON_CONF_MAX_GID)' \
+	-DCONFIG_DAEMON_CONF_RESTART_DELAY='$(CONFIG_DAEMON_CONF_RESTART_DELAY)' \
+	-DCONFIG_DAEMON_CONF_RESTART_DELAY_MAX='$(CONFIG_DAEMON_CONF_RESTART_DELAY_MAX)' \
+	-DCONFIG_DAEMON_CONF_CRASH_LOOP_COUNT='$(CONFIG_DAEMON_CONF_CRASH_LOOP_COUNT)' \
+	-DCONFIG_DAEMON_CONF_CRASH_LOOP_WINDOW='$(CONFIG_DAEMON_CONF_CRASH_LOOP_WINDOW)' \
+	-DCONFIG_DAEMON_CONF_REPLACE_DELAY='$(CONFIG_DAEMON_CONF_REPLACE_DELAY)' \
+	-DCONFIG_DAEMON_CONF_STOP_TIMEOUT='$(CONFIG_DAEMON_CONF_STOP_TIMEOUT)'
 ifneq ($(CONFIG_DAEMON_CONF_HAS_RTSIG),)
-src/cyberd/daemon_conf.o: CPPFLAGS+=-DCONFIG_DAEMON_CONF_HAS_RTSIG
+daemon-conf-cppflags+=-DCONFIG_DAEMON_CONF_HAS_RTSIG
+endif
+src/cyberd/daemon_conf.o src/cyberd/snapshot.o: CPPFLAGS+=$(daemon-conf-cppflags)
+
+src/cyberd/status_page.o: CPPFLAGS+=-D_GNU_SOURCE
+
+ifneq ($(CONFIG_CONFIGURATION_WATCH_DELAY),)
+src/cyberd/configuration.o: CPPFLAGS+=-DCONFIG_CONFIGURATION_WATCH_DELAY='$(CONFIG_CONFIGURATION_WATCH_DELAY)'
+endif
+ifneq ($(CONFIG_CONFIGURATION_LOAD_THREADS),)
+src/cyberd/configuration.o: CPPFLAGS+=-DCONFIG_CONFIGURATION_LOAD_THREADS='$(CONFIG_CONFIGURATION_LOAD_THREADS)'
+src/cyberd/configuration.o: CFLAGS+=-pthread
+cyberd: LDLIBS+=-pthread
+endif
+ifneq ($(CONFIG_CONFIGURATION_SNAPSHOT_PATH),)
+src/cyberd/configuration.o: CPPFLAGS+=-DCONFIG_CONFIGURATION_SNAPSHOT_PATH='"$(CONFIG_CONFIGURATION_SNAPSHOT_PATH)"'
 endif
 
 src/cyberd/main.o: CPPFLAGS+= \
-	-DCONFIG_REBOOT_TIMEOUT='$(CONFIG_REBOOT_TIMEOUT)' \
 	-DCONFIG_CONFIGURATION_PATH='"$(CONFIG_CONFIGURATION_PATH)"' \
 	-DCONFIG_SOCKET_ENDPOINTS_PATH='"$(CONFIG_SOCKET_ENDPOINTS_PATH)"' \
 	-DCONFIG_SOCKET_ENDPOINTS_ROOT='"$(CONFIG_SOCKET_ENDPOINTS_ROOT)"'
 ifneq ($(CONFIG_RC_PATH),)
 src/cyberd/main.o: CPPFLAGS+=-DCONFIG_RC_PATH='"$(CONFIG_RC_PATH)"'
 endif
+ifneq ($(CONFIG_STATUS_PAGE_PATH),)
+src/cyberd/main.o: CPPFLAGS+=-DCONFIG_STATUS_PAGE_PATH='"$(CONFIG_STATUS_PAGE_PATH)"'
+endif
 
-src/cyberd/socket_connection_node.o: CPPFLAGS+= \
+ifneq ($(CONFIG_SOCKET_SWITCH_EPOLL),)
+src/cyberd/signals.o src/cyberd/socket_switch.o: CPPFLAGS+=-DCONFIG_SOCKET_SWITCH_EPOLL
+endif
+ifneq ($(CONFIG_SOCKET_SWITCH_IO_URING),)
+src/cyberd/socket_switch.o: CPPFLAGS+=-DCONFIG_SOCKET_SWITCH_IO_URING
+src/cyberd/socket_switch_uring.o: CPPFLAGS+= \
 	-DCONFIG_SOCKET_CONNECTIONS_BUFFER_SIZE='$(CONFIG_SOCKET_CONNECTIONS_BUFFER_SIZE)'
+endif
+
+socket-connection-cppflags:=-D_GNU_SOURCE \
+	-DCONFIG_SOCKET_CONNECTIONS_BUFFER_SIZE='$(CONFIG_SOCKET_CONNECTIONS_BUFFER_SIZE)' \
+	-DCONFIG_SOCKET_CONNECTIONS_REPLIES_SIZE='$(CONFIG_SOCKET_CONNECTIONS_REPLIES_SIZE)' \
+	-DCONFIG_SOCKET_CONNECTIONS_MAX='$(CONFIG_SOCKET_CONNECTIONS_MAX)'
+src/cyberd/socket_connection_node.o: CPPFLAGS+=$(socket-connection-cppflags)
+src/cyberd/peers.o: CPPFLAGS+= \
+	-DCONFIG_SOCKET_PEERS_RATE='$(CONFIG_SOCKET_PEERS_RATE)' \
+	-DCONFIG_SOCKET_PEERS_BURST='$(CONFIG_SOCKET_PEERS_BURST)'
 src/cyberd/socket_endpoint_node.o: CPPFLAGS+= \
 	-DCONFIG_SOCKET_ENDPOINTS_MAX_CONNECTIONS='$(CONFIG_SOCKET_ENDPOINTS_MAX_CONNECTIONS)'
 
@@ -87,7 +148,14 @@ endif
 ####################
 
 ifneq ($(CONFIG_CHECK),)
-tests:=test/cyberd-tree
+tests:=test/cyberd-configuration test/cyberd-daemon_conf test/cyberd-process test/cyberd-process-vfork test/cyberd-socket_connection_node test/cyberd-socket_switch test/cyberd-tree
+
+test/cyberd-configuration test/cyberd-daemon_conf: CPPFLAGS+=$(daemon-conf-cppflags)
+test/cyberd-process test/cyberd-process-vfork: CPPFLAGS+=-D_GNU_SOURCE
+test/cyberd-socket_connection_node: CPPFLAGS+=$(socket-connection-cppflags)
+ifneq ($(CONFIG_SOCKET_SWITCH_EPOLL),)
+test/cyberd-socket_switch: CPPFLAGS+=-DCONFIG_SOCKET_SWITCH_EPOLL
+endif
 
 $(tests): %: %.c
 	$(v-e) TEST-CC $@
@@ -1,17 +1,23 @@
 /* SPDX-License-Identifier: BSD-3-Clause */
-#include <stdio.h> /* snprintf, fprintf */
+#include <stdio.h> /* snprintf, fprintf, open_memstream, fwrite, ... */
 #include <stdlib.h> /* abort, exit */
 #include <string.h> /* memcpy, strcmp, ... */
 #include <stdnoreturn.h> /* noreturn */
 #include <arpa/inet.h> /* htonl */
-#include <unistd.h> /* getopt, write */
+#include <unistd.h> /* getopt, read, write */
 #include <libgen.h> /* basename */
-#include <alloca.h> /* alloca */
 #include <sys/socket.h> /* socket */
 #include <sys/un.h> /* sockaddr_un */
 #include <err.h> /* err, errx, ... */
+#include <errno.h> /* errno, EPROTOTYPE */
+#include <signal.h> /* CLD_EXITED, ... */
+#include <time.h> /* clock_gettime */
+#include <endian.h> /* be64toh */
+#include <inttypes.h> /* PRIu32, PRIu64 */
+#include <limits.h> /* NAME_MAX */
 
 #include "capabilities.h"
+#include "protocol.h"
 
 #ifndef __has_builtin
 #error "Builtin macro __has_builtin is not available"
@@ -48,6 +54,11 @@ initctl_command_id(const char *command) {
 		[COMMAND(SYSTEM_HALT)] = "halt",
 		[COMMAND(SYSTEM_REBOOT)] = "reboot",
 		[COMMAND(SYSTEM_SUSPEND)] = "suspend",
+		[COMMAND(DAEMON_CLEAR)] = "clear",
+		[COMMAND(DAEMON_RESTART)] = "restart",
+		[COMMAND(DAEMON_REPLACE)] = "replace",
+		[COMMAND(DAEMON_STATUS)] = "status",
+		[COMMAND(DAEMON_WATCH)] = "watch",
 	};
 	uint8_t id = 0;
 
@@ -58,80 +69,375 @@ initctl_command_id(const char *command) {
 	return id;
 }
 
+/**
+ * Connects to an endpoint, whether it is a SOCK_STREAM or a SOCK_SEQPACKET one.
+ * @param endpoint Name of the endpoint.
+ * @param typep Socket type of the connection.
+ * @returns The connection.
+ */
 static int
-initctl_open(const char *endpoint) {
-	const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+initctl_open(const char *endpoint, int *typep) {
+	const int types[] = { SOCK_STREAM, SOCK_SEQPACKET };
 	struct sockaddr_un addr = { .sun_family = AF_UNIX };
 
-	if (fd < 0) {
-		err(EXIT_FAILURE, "Unable to create socket for endpoint '%s'", endpoint);
-	}
-
 	const int length = snprintf(addr.sun_path, sizeof (addr.sun_path), CONFIG_SOCKET_ENDPOINTS_PATH"/%s", endpoint);
 	if ((size_t)length >= sizeof (addr.sun_path)) {
 		errx(EXIT_FAILURE, "Endpoint name '%s' is too long", endpoint);
 	}
 
-	if (connect(fd, (const struct sockaddr *)&addr, sizeof (addr)) != 0) {
-		err(EXIT_FAILURE, "Unable to connect to endpoint '%s'", endpoint);
+	for (unsigned int i = 0; i < sizeof (types) / sizeof (*types); i++) {
+		const int fd = socket(AF_UNIX, types[i], 0);
+
+		if (fd < 0) {
+			err(EXIT_FAILURE, "Unable to create socket for endpoint '%s'", endpoint);
+		}
+
+		if (connect(fd, (const struct sockaddr *)&addr, sizeof (addr)) == 0) {
+			*typep = types[i];
+			return fd;
+		}
+
+		if (errno != EPROTOTYPE) {
+			break;
+		}
+
+		close(fd);
 	}
 
-	return fd;
+	err(EXIT_FAILURE, "Unable to connect to endpoint '%s'", endpoint);
 }
 
-static void noreturn
-initctl_endpoint_create(const char *endpoint, uint8_t id, capset_t capabilities, const char *name) {
-	struct [[gnu::packed]] {
+static const char *
+initctl_status_string(uint8_t status) {
+	static const char * const strings[] = {
+		[PROTOCOL_STATUS_OK] = "Success",
+		[PROTOCOL_STATUS_INVALID] = "Invalid request",
+		[PROTOCOL_STATUS_DENIED] = "Permission denied",
+		[PROTOCOL_STATUS_NOT_FOUND] = "No such daemon",
+		[PROTOCOL_STATUS_FAILED] = "Failed",
+		[PROTOCOL_STATUS_LIMITED] = "Rate limited",
+	};
+
+	return status < sizeof (strings) / sizeof (*strings) ? strings[status] : "Unknown status";
+}
+
+/**
+ * Formats the termination of a process.
+ * @param buffer Formatted termination, '-' if none.
+ * @param size Size of @p buffer.
+ * @param code _si\_code_ of the termination, zero if none.
+ * @param status _si\_status_ of the termination.
+ */
+static void
+initctl_termination(char *buffer, size_t size, uint8_t code, uint8_t status) {
+
+	switch (code) {
+	case CLD_EXITED: snprintf(buffer, size, "exited:%u", status); break;
+	case CLD_KILLED: snprintf(buffer, size, "killed:%u", status); break;
+	case CLD_DUMPED: snprintf(buffer, size, "dumped:%u", status); break;
+	default: snprintf(buffer, size, "-"); break;
+	}
+}
+
+/**
+ * Prints an event record, on one line: the daemon's name, the event, the pid
+ * and the termination of its process, '-' for each one not available.
+ * Dropped events are printed with their count instead of a pid.
+ * @param record Record of an event reply.
+ * @param size Size of @p record.
+ */
+static void
+initctl_event_print(const uint8_t *record, size_t size) {
+	static const char * const events[] = {
+		[PROTOCOL_EVENT_STARTED] = "started",
+		[PROTOCOL_EVENT_STOPPING] = "stopping",
+		[PROTOCOL_EVENT_REAPED] = "reaped",
+		[PROTOCOL_EVENT_RESPAWNED] = "respawned",
+		[PROTOCOL_EVENT_FAILED] = "failed",
+		[PROTOCOL_EVENT_PARKED] = "parked",
+		[PROTOCOL_EVENT_RELOADED] = "reloaded",
+		[PROTOCOL_EVENT_DROPPED] = "dropped",
+	};
+	char name[NAME_MAX + 1] = "-", process[16] = "-", termination[32];
+	uint32_t pid;
+
+	if (size < PROTOCOL_EVENT_RECORD_SIZE || size != PROTOCOL_EVENT_RECORD_SIZE + record[3]) {
+		errx(EXIT_FAILURE, "Invalid event record from endpoint");
+	}
+
+	if (record[3] != 0) {
+		memcpy(name, record + PROTOCOL_EVENT_RECORD_SIZE, record[3]);
+		name[record[3]] = '\0';
+	}
+
+	memcpy(&pid, record + 4, sizeof (pid));
+	pid = ntohl(pid);
+	if (pid != 0) {
+		snprintf(process, sizeof (process), "%"PRIu32, pid);
+	}
+
+	initctl_termination(termination, sizeof (termination), record[1], record[2]);
+
+	printf("%s %s %s %s\n", name,
+		record[0] < sizeof (events) / sizeof (*events) ? events[record[0]] : "unknown", process, termination);
+	fflush(stdout);
+}
+
+/**
+ * Prints daemon status records, one line per daemon: its name, state, pid,
+ * last termination and uptime, '-' for each one not available.
+ * @param records Records of a partial reply.
+ * @param size Size of @p records.
+ */
+static void
+initctl_status_print(const uint8_t *records, size_t size) {
+	/* Names of `enum daemon_state` values. */
+	static const char * const states[] = {
+		"started", "stopped", "stopping", "failed", "starting", "restarting", "parked",
+	};
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	while (size != 0) {
+		if (size < PROTOCOL_STATUS_RECORD_SIZE || size < PROTOCOL_STATUS_RECORD_SIZE + records[3]) {
+			errx(EXIT_FAILURE, "Invalid status record from endpoint");
+		}
+
+		const int namelen = records[3];
+		uint32_t pid;
+		uint64_t startedat;
+		char process[16] = "-", termination[32], uptime[32] = "-";
+
+		memcpy(&pid, records + 4, sizeof (pid));
+		memcpy(&startedat, records + 8, sizeof (startedat));
+		pid = ntohl(pid);
+		startedat = be64toh(startedat);
+
+		initctl_termination(termination, sizeof (termination), records[1], records[2]);
+
+		if (pid != 0) {
+			const uint64_t nowns = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+			snprintf(process, sizeof (process), "%"PRIu32, pid);
+			snprintf(uptime, sizeof (uptime), "%"PRIu64"s", (nowns - startedat) / 1000000000);
+		}
+
+		printf("%.*s %s %s %s %s\n", namelen, (const char *)records + PROTOCOL_STATUS_RECORD_SIZE,
+			records[0] < sizeof (states) / sizeof (*states) ? states[records[0]] : "unknown",
+			process, termination, uptime);
+
+		records += PROTOCOL_STATUS_RECORD_SIZE + namelen;
+		size -= PROTOCOL_STATUS_RECORD_SIZE + namelen;
+	}
+}
+
+static FILE *
+initctl_requests(char **bufferp, size_t *sizep) {
+	FILE * const requests = open_memstream(bufferp, sizep);
+
+	if (requests == NULL) {
+		err(EXIT_FAILURE, "open_memstream");
+	}
+
+	fputc(PROTOCOL_V2, requests);
+
+	return requests;
+}
+
+static void
+initctl_request(FILE *requests, uint32_t request, uint8_t id, const capset_t *capabilities, const char *name) {
+	const size_t namesize = name != NULL ? strlen(name) + 1 : 0;
+	const struct [[gnu::packed]] {
+		uint32_t length;
+		uint32_t request;
 		uint8_t id;
-		uint32_t capabilities;
-		char name[];
-	} *message;
-	const size_t namelen = strlen(name);
-	const size_t messagesize = sizeof (*message) + namelen + 1;
-	const int fd = initctl_open(endpoint);
-
-	message = alloca(messagesize);
-	message->id = id;
-	message->capabilities = htonl(capabilities);
-	memcpy(message->name, name, namelen + 1);
-
-	if (write(fd, message, messagesize) != messagesize) {
-		err(EXIT_FAILURE, "Unable to write to endpoint");
+	} header = {
+		.length = htonl(sizeof (id) + (capabilities != NULL ? sizeof (*capabilities) : 0) + namesize),
+		.request = htonl(request),
+		.id = id,
+	};
+
+	fwrite(&header, sizeof (header), 1, requests);
+
+	if (capabilities != NULL) {
+		const uint32_t word = htonl(*capabilities);
+		fwrite(&word, sizeof (word), 1, requests);
+	}
+
+	if (name != NULL) {
+		fwrite(name, 1, namesize, requests);
+	}
+}
+
+static void
+initctl_read(int fd, void *buffer, size_t size) {
+	char *current = buffer;
+
+	while (size != 0) {
+		const ssize_t readval = read(fd, current, size);
+
+		if (readval < 0) {
+			err(EXIT_FAILURE, "Unable to read from endpoint");
+		}
+
+		if (readval == 0) {
+			errx(EXIT_FAILURE, "Endpoint closed the connection");
+		}
+
+		current += readval;
+		size -= readval;
 	}
+}
+
+/**
+ * Sends each request as a datagram, skipping the version byte.
+ * @param fd SOCK_SEQPACKET connection.
+ * @param buffer Requests.
+ * @param size Size of @p buffer.
+ */
+static void
+initctl_send_datagrams(int fd, const char *buffer, size_t size) {
+	size_t offset = 1;
+
+	while (offset != size) {
+		uint32_t length;
 
-	exit(EXIT_SUCCESS);
+		memcpy(&length, buffer + offset, sizeof (length));
+
+		const size_t datagram = PROTOCOL_V2_HEADER_SIZE + ntohl(length);
+		if (send(fd, buffer + offset, datagram, 0) != datagram) {
+			err(EXIT_FAILURE, "Unable to send to endpoint");
+		}
+
+		offset += datagram;
+	}
 }
 
+/**
+ * Sends pipelined requests, in one write on SOCK_STREAM endpoints,
+ * and waits for all their final replies, printing status records of partial ones.
+ * When watching, events are then printed until the endpoint closes the connection.
+ * Exits unsuccessfully if any request didn't succeed.
+ */
 static void noreturn
-initctl_daemon(const char *endpoint, uint8_t id, const char *name) {
-	struct [[gnu::packed]] {
-		uint8_t id;
-		char name[];
-	} *message;
-	const size_t namelen = strlen(name);
-	const size_t messagesize = sizeof (*message) + namelen + 1;
-	const int fd = initctl_open(endpoint);
+initctl_exchange(const char *endpoint, FILE *requests, char **bufferp, size_t *sizep, char * const *labels, uint32_t count, bool watch) {
+	int type;
+	const int fd = initctl_open(endpoint, &type);
+	bool failed = false;
 
-	message = alloca(messagesize);
-	message->id = id;
-	memcpy(message->name, name, namelen + 1);
+	if (fclose(requests) != 0) {
+		err(EXIT_FAILURE, "Unable to build requests");
+	}
 
-	if (write(fd, message, messagesize) != messagesize) {
+	if (type == SOCK_SEQPACKET) {
+		initctl_send_datagrams(fd, *bufferp, *sizep);
+	} else if (write(fd, *bufferp, *sizep) != *sizep) {
 		err(EXIT_FAILURE, "Unable to write to endpoint");
 	}
 
-	exit(EXIT_SUCCESS);
+	for (uint32_t i = 0; i < count || (watch && !failed);) {
+		struct [[gnu::packed]] {
+			uint32_t length;
+			uint32_t request;
+			uint8_t body[PROTOCOL_V2_REPLY_MAX];
+		} reply;
+		const size_t headersize = sizeof (reply) - sizeof (reply.body);
+		uint32_t length;
+
+		if (type == SOCK_SEQPACKET) {
+			/* Each reply is one datagram. */
+			const ssize_t received = recv(fd, &reply, sizeof (reply), 0);
+			if (received < 0) {
+				err(EXIT_FAILURE, "Unable to receive from endpoint");
+			}
+			if (received < headersize) {
+				errx(EXIT_FAILURE, "Invalid reply from endpoint");
+			}
+			length = ntohl(reply.length);
+			if (length != received - headersize) {
+				errx(EXIT_FAILURE, "Invalid reply from endpoint");
+			}
+		} else {
+			initctl_read(fd, &reply, headersize);
+			length = ntohl(reply.length);
+			if (length > sizeof (reply.body)) {
+				errx(EXIT_FAILURE, "Invalid reply from endpoint");
+			}
+			initctl_read(fd, reply.body, length);
+		}
+
+		const uint32_t request = ntohl(reply.request);
+		if (length == 0 || request >= count) {
+			errx(EXIT_FAILURE, "Invalid reply from endpoint");
+		}
+
+		const uint8_t status = *reply.body;
+		if (status == PROTOCOL_STATUS_MORE) {
+			initctl_status_print(reply.body + 1, length - 1);
+			continue;
+		}
+
+		if (status == PROTOCOL_STATUS_EVENT) {
+			initctl_event_print(reply.body + 1, length - 1);
+			continue;
+		}
+
+		if (status != PROTOCOL_STATUS_OK) {
+			if (labels != NULL) {
+				warnx("%s: %s", labels[request], initctl_status_string(status));
+			} else {
+				warnx("%s", initctl_status_string(status));
+			}
+			failed = true;
+		}
+
+		i++;
+	}
+
+	exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
 }
 
 static void noreturn
-initctl_system(const char *endpoint, uint8_t id) {
-	const int fd = initctl_open(endpoint);
+initctl_endpoint_create(const char *endpoint, uint8_t id, capset_t capabilities, char *name) {
+	char *buffer;
+	size_t size;
+	FILE * const requests = initctl_requests(&buffer, &size);
 
-	if (write(fd, &id, sizeof (id)) != sizeof (id)) {
-		err(EXIT_FAILURE, "Unable to write to endpoint");
+	initctl_request(requests, 0, id, &capabilities, name);
+	initctl_exchange(endpoint, requests, &buffer, &size, &name, 1, false);
+}
+
+static void noreturn
+initctl_daemons(const char *endpoint, uint8_t id, char * const *names, uint32_t count) {
+	char *buffer;
+	size_t size;
+	FILE * const requests = initctl_requests(&buffer, &size);
+
+	for (uint32_t i = 0; i < count; i++) {
+		initctl_request(requests, i, id, NULL, names[i]);
 	}
 
-	exit(EXIT_SUCCESS);
+	initctl_exchange(endpoint, requests, &buffer, &size, names, count, false);
+}
+
+static void noreturn
+initctl_system(const char *endpoint, uint8_t id) {
+	char *buffer;
+	size_t size;
+	FILE * const requests = initctl_requests(&buffer, &size);
+
+	initctl_request(requests, 0, id, NULL, NULL);
+	initctl_exchange(endpoint, requests, &buffer, &size, NULL, 1, false);
+}
+
+static void noreturn
+initctl_watch(const char *endpoint) {
+	char *buffer;
+	size_t size;
+	FILE * const requests = initctl_requests(&buffer, &size);
+
+	initctl_request(requests, 0, COMMAND(DAEMON_WATCH), NULL, NULL);
+	initctl_exchange(endpoint, requests, &buffer, &size, NULL, 1, true);
 }
 
 static void noreturn
@@ -158,21 +464,25 @@ shutdown_main(int argc, char **argv) {
 
 static void noreturn
 initctl_usage(const char *progname) {
-	fprintf(stderr, "usage: %s [-c <endpoint>] <command>\n", progname);
+	fprintf(stderr, "usage: %s [-s] [-c <endpoint>] <command>\n", progname);
 	exit(EXIT_FAILURE);
 }
 
 static void noreturn
 initctl_main(int argc, char **argv) {
 	const char *endpoint = CONFIG_SOCKET_ENDPOINTS_ROOT;
+	bool seqpacket = false;
 	uint8_t id;
 	int c;
 
-	while ((c = getopt(argc, argv, ":c:")) >= 0) {
+	while ((c = getopt(argc, argv, ":c:s")) >= 0) {
 		switch (c) {
 		case 'c':
 			endpoint = optarg;
 			break;
+		case 's':
+			seqpacket = true;
+			break;
 		case ':':
 			warnx("Option -%c requires an operand", optopt);
 			initctl_usage(*argv);
@@ -197,7 +507,7 @@ initctl_main(int argc, char **argv) {
 			initctl_usage(*argv);
 		}
 
-		for (unsigned int i = optind + 1; i < argc; i++) {
+		for (unsigned int i = optind + 2; i < argc; i++) {
 			const char * const command = argv[i];
 			const capset_t capability = 1 << initctl_command_id(command);
 
@@ -209,17 +519,36 @@ initctl_main(int argc, char **argv) {
 			capabilities |= capability;
 		}
 
+		if (seqpacket) {
+			capabilities |= PROTOCOL_ENDPOINT_SEQPACKET;
+		}
+
 		initctl_endpoint_create(endpoint, id, capabilities, argv[optind + 1]);
 	}
 
-	if (id <= COMMAND(DAEMON_END)) {
+	if (id == COMMAND(DAEMON_STATUS) && argc - optind == 1) {
+		/* Without daemons, the status of all of them. */
+		initctl_system(endpoint, id);
+	}
+
+	if (id == COMMAND(DAEMON_WATCH)) {
+
+		if (argc - optind != 1) {
+			warnx("Unexpected arguments for watch command");
+			initctl_usage(*argv);
+		}
+
+		initctl_watch(endpoint);
+	}
+
+	if (id <= COMMAND(DAEMON_END) || (id >= COMMAND(DAEMON_CLEAR) && id <= COMMAND(DAEMON_STATUS))) {
 
-		if (argc - optind != 2) {
-			warnx("Unexpected arguments for daemon command");
+		if (argc - optind < 2) {
+			warnx("Missing daemon for daemon command");
 			initctl_usage(*argv);
 		}
 
-		initctl_daemon(endpoint, id, argv[optind + 1]);
+		initctl_daemons(endpoint, id, argv + optind + 1, argc - optind - 1);
 	}
 
 	if (id <= COMMAND(SYSTEM_SUSPEND)) {
@@ -13,8 +13,13 @@
 #define CAPABILITY_SYSTEM_HALT     ((capset_t)1 << 6)
 #define CAPABILITY_SYSTEM_REBOOT   ((capset_t)1 << 7)
 #define CAPABILITY_SYSTEM_SUSPEND  ((capset_t)1 << 8)
+#define CAPABILITY_DAEMON_CLEAR    ((capset_t)1 << 9)
+#define CAPABILITY_DAEMON_RESTART  ((capset_t)1 << 10)
+#define CAPABILITY_DAEMON_REPLACE  ((capset_t)1 << 11)
+#define CAPABILITY_DAEMON_STATUS   ((capset_t)1 << 12)
+#define CAPABILITY_DAEMON_WATCH    ((capset_t)1 << 13)
 
-#define CAPSET_ALL ((CAPABILITY_SYSTEM_SUSPEND << 1) - 1)
+#define CAPSET_ALL ((CAPABILITY_DAEMON_WATCH << 1) - 1)
 
 #define CAPSET_HAS(capset, capability) (!!((capset) & (capability)))
 
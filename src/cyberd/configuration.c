@@ -2,13 +2,33 @@
 #include "configuration.h"
 
 #include "daemon.h"
+#include "events.h"
+#include "socket_switch.h"
+#ifdef CONFIG_CONFIGURATION_SNAPSHOT_PATH
+#include "snapshot.h"
+#endif
+#include "status_page.h"
 #include "tree.h"
 
-#include <string.h> /* strcmp */
+#include <stdlib.h> /* realloc, free, qsort */
+#include <string.h> /* strcmp, strncmp, strcspn, memcpy */
+#include <limits.h> /* NAME_MAX */
+#include <fnmatch.h> /* fnmatch */
 #include <syslog.h> /* syslog */
-#include <unistd.h> /* close */
+#include <unistd.h> /* close, read */
 #include <dirent.h> /* opendir, ... */
-#include <fcntl.h> /* openat */
+#include <fcntl.h> /* open, openat */
+#include <sys/stat.h> /* fstat, fstatat */
+#ifdef CONFIG_CONFIGURATION_WATCH_DELAY
+#include <sys/inotify.h> /* inotify_init1, inotify_add_watch, struct inotify_event */
+#include <sys/timerfd.h> /* timerfd_create, timerfd_settime */
+#include <stdint.h> /* uint64_t */
+#endif
+#ifdef CONFIG_CONFIGURATION_LOAD_THREADS
+#include <pthread.h> /* pthread_create, pthread_join, pthread_sigmask */
+#include <signal.h> /* sigfillset */
+#include <stdatomic.h> /* atomic_size_t, atomic_fetch_add_explicit */
+#endif
 #include <errno.h> /* errno */
 
 /*******************
@@ -35,15 +55,61 @@ daemons_compare(const tree_element_t *lhs, const tree_element_t *rhs) {
 static struct tree daemons = { .compare = daemons_compare };
 
 /**
- * Helper function to remove a daemon according to its name.
- * @param daemons Tree using @ref daemons_compare as a comparison function.
- * @param name Name of the daemon to remove.
- * @returns Tree node holding the daemon associated with @p name, or _NULL_ if not found.
+ * Visit context of @ref configuration_walk.
  */
-static struct daemon *
-daemons_remove_element(struct tree *daemons, const char *name) {
-	const struct daemon element = { .name = (char *)name }; /* Cast is safe as daemons_compare doesn't modify name */
-	return tree_remove(daemons, &element);
+struct daemons_walk {
+	void (* const visit)(const struct daemon *, void *); /**< Visit callback of the walk. */
+	void * const data; /**< Argument of @ref visit. */
+};
+
+/**
+ * Visit a daemon element.
+ * @param element Daemon.
+ * @param data Walk context.
+ */
+static void
+daemons_walk_element(const tree_element_t *element, void *data) {
+	const struct daemons_walk * const walk = data;
+	walk->visit(element, walk->data);
+}
+
+/**
+ * Selection context of @ref configuration_select.
+ */
+struct daemons_select {
+	const char * const pattern; /**< Pattern matching names, _NULL_ to select by tag. */
+	const char * const tag; /**< Tag of the selected daemons if selected by tag. */
+	const size_t prefixlen; /**< Length of the pattern's literal prefix. */
+	void (* const action)(struct daemon *, void *); /**< Action applied to selected daemons. */
+	void * const data; /**< Argument of @ref action. */
+	unsigned int count; /**< Number of selected daemons. */
+};
+
+/**
+ * Applies the selection's action to a daemon of the selection's range if it is selected.
+ * @param element Daemon, not before the selection's range.
+ * @param data Selection context.
+ * @returns Whether the daemon is still within the selection's range.
+ */
+static bool
+daemons_select_element(tree_element_t *element, void *data) {
+	struct daemons_select * const select = data;
+	struct daemon * const daemon = element;
+
+	if (select->pattern == NULL) {
+		if (daemon->conf.tag == NULL || strcmp(daemon->conf.tag, select->tag) != 0) {
+			return true;
+		}
+	} else if (strncmp(daemon->name, select->pattern, select->prefixlen) != 0) {
+		return false;
+	} else if (fnmatch(select->pattern, daemon->name, 0) != 0) {
+		return true;
+	}
+
+	select->action(daemon, select->data);
+	select->count++;
+
+	return true;
 }
 
 /**
@@ -66,6 +132,68 @@ configuration_find(const char *name) {
 	return tree_find(&daemons, &element);
 }
 
+/**
+ * Checks whether a name is a selector of @ref configuration_select.
+ * @param name Name given to a command.
+ * @returns Whether @p name is a tag or a pattern.
+ */
+bool
+configuration_selector(const char *name) {
+	return *name == '@' || name[strcspn(name, "*?[\\")] != '\0';
+}
+
+/**
+ * Applies an action to every daemon a selector selects, in the order of their names.
+ * A selector is either a tag prefixed by '@', selecting the daemons with this tag, or a pattern,
+ * see _fnmatch(3)_. Only the daemons starting with the literal prefix of a pattern are matched,
+ * found in logarithmic time. The action must not add nor remove daemons.
+ * @param selector Tag or pattern.
+ * @param action Action applied to each selected daemon.
+ * @param data Argument of @p action.
+ * @returns The number of selected daemons.
+ */
+unsigned int
+configuration_select(const char *selector, void (* const action)(struct daemon *daemon, void *data), void *data) {
+
+	if (*selector == '@') {
+		struct daemons_select select = { .tag = selector + 1, .action = action, .data = data };
+		const struct daemon lower = { .name = "" };
+
+		tree_range(&daemons, &lower, daemons_select_element, &select);
+
+		return select.count;
+	}
+
+	struct daemons_select select = {
+		.pattern = selector, .prefixlen = strcspn(selector, "*?[\\"), .action = action, .data = data,
+	};
+	char prefix[NAME_MAX + 1];
+	const struct daemon lower = { .name = prefix };
+
+	if (select.prefixlen > NAME_MAX) {
+		return 0;
+	}
+
+	memcpy(prefix, selector, select.prefixlen);
+	prefix[select.prefixlen] = '\0';
+
+	tree_range(&daemons, &lower, daemons_select_element, &select);
+
+	return select.count;
+}
+
+/**
+ * Visits every daemon, in the order of their names.
+ * Daemons must not be added or removed while visited.
+ * @param visit Visit callback.
+ * @param data Argument of @p visit.
+ */
+void
+configuration_walk(void (* const visit)(const struct daemon *daemon, void *data), void *data) {
+	struct daemons_walk walk = { .visit = visit, .data = data };
+	tree_walk(&daemons, daemons_walk_element, &walk);
+}
+
 /*********************************
  * Daemons configuration loading *
  *********************************/
@@ -76,27 +204,135 @@ configuration_find(const char *name) {
 static const char *configuration_path;
 
 /**
- * Load a new daemon's configuration.
- * This function is called during @ref configuration_load, and may start
- * a daemon, which requires all other subsystems to already be available.
- * @param name Name of the daemon.
- * @param filep Opened configuration file.
+ * Current load or reload, daemons whose configuration file wasn't found by it are removed.
+ */
+static unsigned int configuration_generation;
+
+/**
+ * Records the configuration file a daemon's configuration was parsed from.
+ * @param daemon Daemon.
+ * @param st Status of the configuration file, taken before it was parsed.
  */
 static void
-configuration_load_daemon(const char *name, FILE *filep) {
-	struct daemon * const daemon = daemon_create(name);
+configuration_source(struct daemon *daemon, const struct stat *st) {
+	daemon->source.dev = st->st_dev;
+	daemon->source.ino = st->st_ino;
+	daemon->source.size = st->st_size;
+	daemon->source.mtime = st->st_mtim;
+}
+
+/**
+ * Checks whether a daemon's configuration file changed since its configuration was parsed.
+ * The file is identified by its device and inode, so a file replaced by a rename changed too.
+ * @param daemon Daemon.
+ * @param st Status of the configuration file.
+ * @returns Whether the file is unchanged.
+ */
+static bool
+configuration_unchanged(const struct daemon *daemon, const struct stat *st) {
+	return daemon->source.dev == st->st_dev && daemon->source.ino == st->st_ino
+		&& daemon->source.size == st->st_size
+		&& daemon->source.mtime.tv_sec == st->st_mtim.tv_sec
+		&& daemon->source.mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/**
+ * Open a file from a directory
+ * @param dirfd Directory file descriptor.
+ * @param path Path to the file, from @p dirfd.
+ * @returns A valid file descriptor on success, -1 else.
+ */
+static int
+configuration_openat(int dirfd, const char *path) {
+	const int fd = openat(dirfd, path, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0) {
+		syslog(LOG_ERR, "configuration openat '%s': %m", path);
+	}
+
+	return fd;
+}
+
+/**
+ * Parses a new daemon's configuration, the daemon isn't inserted.
+ * Only touches the configuration file and the new daemon, so it may run outside the main thread.
+ * @param dirfd Configuration directory.
+ * @param name Name of the daemon, and of its configuration file.
+ * @returns The new daemon, _NULL_ on error.
+ */
+static struct daemon *
+configuration_parse_daemon(int dirfd, const char *name) {
+	const int fd = configuration_openat(dirfd, name);
 
+	if (fd < 0) {
+		goto openat_failure;
+	}
+
+	struct daemon * const daemon = daemon_create(name);
 	if (daemon == NULL) {
-		return syslog(LOG_ERR, "Failure to create daemon '%s'", name);
+		syslog(LOG_ERR, "Failure to create daemon '%s'", name);
+		goto daemon_create_failure;
 	}
 
-	if (daemon_conf_parse(&daemon->conf, filep) != 0) {
-		return daemon_destroy(daemon);
+	if (daemon_conf_parse(&daemon->conf, daemon->name, fd) != 0) {
+		goto daemon_conf_parse_failure;
 	}
 
+	close(fd);
+
+	return daemon;
+daemon_conf_parse_failure:
+	daemon_destroy(daemon);
+daemon_create_failure:
+	close(fd);
+openat_failure:
+	return NULL;
+}
+
+/**
+ * Inserts a newly parsed daemon.
+ * @param daemon Daemon, see @ref configuration_parse_daemon.
+ * @param st Status of the configuration file.
+ */
+static void
+configuration_insert_daemon(struct daemon *daemon, const struct stat *st) {
+
+	configuration_source(daemon, st);
+	daemon->generation = configuration_generation;
 	tree_insert(&daemons, daemon);
+	status_page_insert(daemon);
 
 	syslog(LOG_INFO, "'%s' loaded", daemon->name);
+}
+
+/**
+ * Load a new daemon's configuration.
+ * This function is called during @ref configuration_reload,
+ * the caller starts the daemon if required.
+ * @param dirfd Configuration directory.
+ * @param name Name of the daemon, and of its configuration file.
+ * @param st Status of the configuration file.
+ * @returns The new daemon, _NULL_ on error.
+ */
+static struct daemon *
+configuration_load_daemon(int dirfd, const char *name, const struct stat *st) {
+	struct daemon * const daemon = configuration_parse_daemon(dirfd, name);
+
+	if (daemon != NULL) {
+		configuration_insert_daemon(daemon, st);
+	}
+
+	return daemon;
+}
+
+/**
+ * Starts a daemon after the initial load if configured so.
+ * Deferred until every daemon is loaded, so templates can be found whatever the load order.
+ * @param daemon Loaded daemon.
+ * @param data Unused.
+ */
+static void
+configuration_load_start(struct daemon *daemon, void *data) {
 
 	if (daemon->conf.start.load) {
 		daemon_start(daemon);
@@ -104,107 +340,680 @@ configuration_load_daemon(const char *name, FILE *filep) {
 }
 
 /**
- * Load a new daemon's configuration, or reload it if already existing.
- * @param name Name of the daemon.
- * @param filep Opened configuration file.
- * @param olddaemons Old daemons tree, where previous daemons are stored.
+ * Reparses the configuration of an existing daemon, whose configuration file changed.
+ * The daemon keeps its previous configuration if the new one is invalid.
+ * @param daemon Daemon.
+ * @param dirfd Configuration directory.
+ * @param st Status of the configuration file.
+ * @returns Zero if the file was parsed, valid or not, -1 if it couldn't be opened.
  */
-static void
-configuration_reload_daemon(const char *name, FILE *filep, struct tree *olddaemons) {
-	struct daemon * const daemon = daemons_remove_element(olddaemons, name);
+static int
+configuration_reload_conf(struct daemon *daemon, int dirfd, const struct stat *st) {
+	const int fd = configuration_openat(dirfd, daemon->name);
 
-	if (daemon == NULL) {
-		return configuration_load_daemon(name, filep); /* New daemon. */
+	if (fd < 0) {
+		return -1;
 	}
 
-	/* Reloading existing daemon. */
 	struct daemon_conf newconf;
 	daemon_conf_init(&newconf);
 
-	if (daemon_conf_parse(&newconf, filep) == 0) {
+	if (daemon_conf_parse(&newconf, daemon->name, fd) == 0) {
 		daemon_conf_deinit(&daemon->conf);
 		daemon->conf = newconf;
+		configuration_source(daemon, st);
 
 		syslog(LOG_INFO, "'%s' reloaded", daemon->name);
-
-		if (daemon->conf.start.reload) {
-			daemon_start(daemon);
-		}
+		events_publish(PROTOCOL_EVENT_RELOADED, daemon, 0, NULL);
 	} else {
 		daemon_conf_deinit(&newconf);
 		syslog(LOG_ERR, "Unable to reload '%s'", daemon->name);
 	}
 
-	tree_insert(&daemons, daemon);
+	close(fd);
+
+	return 0;
 }
 
 /**
- * Open a FILE from a directory
- * @param dirfd Directory file descriptor.
- * @param path Path to the file, from @p dirfd.
- * @returns A valid stream on success, _NULL_ else.
- */
-static FILE *
-configuration_fopenat(int dirfd, const char *path) {
-	const int fd = openat(dirfd, path, O_RDONLY);
-	FILE *filep;
-
-	if (fd >= 0) {
-		filep = fdopen(fd, "r");
-		if (filep == NULL) {
-			close(fd);
-			syslog(LOG_ERR, "configuration fdopen '%s': %m", path);
+ * Load a new daemon's configuration, or reload it if already existing and its file changed.
+ * Unchanged configuration files are neither opened nor parsed.
+ * @param dirfd Configuration directory.
+ * @param name Name of the daemon.
+ * @param st Status of the configuration file.
+ */
+static void
+configuration_reload_daemon(int dirfd, const char *name, const struct stat *st) {
+	struct daemon * const daemon = configuration_find(name);
+
+	if (daemon == NULL) {
+		/* New daemon. */
+		struct daemon * const loaded = configuration_load_daemon(dirfd, name, st);
+		if (loaded != NULL) {
+			events_publish(PROTOCOL_EVENT_RELOADED, loaded, 0, NULL);
+			if (loaded->conf.start.load) {
+				daemon_start(loaded);
+			}
 		}
-	} else {
-		syslog(LOG_ERR, "configuration openat '%s': %m", path);
-		filep = NULL;
+		return;
+	}
+
+	/* Existing daemon, removed if its changed file can't be opened anymore. */
+	if (!configuration_unchanged(daemon, st) && configuration_reload_conf(daemon, dirfd, st) != 0) {
+		return;
 	}
+	daemon->generation = configuration_generation;
 
-	return filep;
+	if (daemon->conf.start.reload) {
+		daemon_start(daemon);
+	}
 }
 
 /**
- * Load initial configuration. Called on @ref setup.
- * This function may start daemons, and suppose all subsystems have been initialized.
+ * Removes a daemon whose configuration file is gone.
+ * @param daemon Daemon.
  */
-void
-configuration_load(const char *path) {
-	DIR *dirp;
+static void
+configuration_remove_daemon(struct daemon *daemon) {
+	tree_remove(&daemons, daemon);
+	syslog(LOG_INFO, "'%s' removed", daemon->name);
+	daemon_destroy(daemon);
+}
 
-	configuration_path = path;
-	syslog(LOG_INFO, "configuration_load %s", path);
+/**
+ * Daemons removed by a reload, see @ref configuration_reload.
+ */
+struct daemons_stale {
+	struct daemon **daemons; /**< Daemons whose configuration file wasn't found. */
+	size_t count; /**< Number of @ref daemons. */
+	size_t capacity; /**< Capacity of @ref daemons. */
+};
 
-	dirp = opendir(configuration_path);
-	if (dirp == NULL) {
-		return syslog(LOG_ERR, "configuration_load opendir '%s': %m", configuration_path);
+/**
+ * Records a daemon as stale if its configuration file wasn't found by the current reload.
+ * @param element Daemon.
+ * @param data Stale daemons.
+ */
+static void
+daemons_stale_element(const tree_element_t *element, void *data) {
+	const struct daemon * const daemon = element;
+	struct daemons_stale * const stale = data;
+
+	if (daemon->generation == configuration_generation) {
+		return;
 	}
 
+	if (stale->count == stale->capacity) {
+		const size_t capacity = stale->capacity != 0 ? stale->capacity * 2 : 16;
+		struct daemon ** const daemons = realloc(stale->daemons, capacity * sizeof (*daemons));
+
+		if (daemons == NULL) {
+			syslog(LOG_ERR, "configuration_reload: realloc: %m");
+			return;
+		}
+
+		stale->daemons = daemons;
+		stale->capacity = capacity;
+	}
+
+	stale->daemons[stale->count++] = (struct daemon *)daemon;
+}
+
+/**
+ * Number of configuration files which couldn't be stat'ed by the last @ref configuration_foreach.
+ */
+static unsigned int configuration_skipped;
+
+/**
+ * Iterates over the configuration files of the configuration directory.
+ * Hidden files are skipped, as well as files which can't be stat'ed.
+ * @param dirp Configuration directory.
+ * @param load Callback for each configuration file.
+ * @returns Zero on success, -1 if the directory couldn't be read entirely.
+ */
+static int
+configuration_foreach(DIR *dirp, void (* const load)(int dirfd, const char *name, const struct stat *st)) {
+	const int fd = dirfd(dirp);
 	struct dirent *entry;
+
+	configuration_skipped = 0;
+
 	while (errno = 0, entry = readdir(dirp), entry != NULL) {
-		FILE *filep;
+		struct stat st;
 
 		if (*entry->d_name == '.') {
 			continue;
 		}
 
-		filep = configuration_fopenat(dirfd(dirp), entry->d_name);
-		if (filep == NULL) {
+		if (fstatat(fd, entry->d_name, &st, 0) != 0) {
+			syslog(LOG_ERR, "configuration fstatat '%s': %m", entry->d_name);
+			configuration_skipped++;
 			continue;
 		}
 
-		configuration_load_daemon(entry->d_name, filep);
-		fclose(filep);
+		load(fd, entry->d_name, &st);
+	}
+
+	return errno != 0 ? -1 : 0;
+}
+
+/**
+ * Inserts a daemon parsed during @ref configuration_load.
+ * @param name Name of the daemon.
+ * @param st Status of the configuration file.
+ * @param daemon Parsed daemon, _NULL_ if its configuration file failed to parse.
+ */
+static void
+configuration_load_insert(const char *name, const struct stat *st, struct daemon *daemon) {
+
+	if (daemon != NULL) {
+		configuration_insert_daemon(daemon, st);
+	}
+
+#ifdef CONFIG_CONFIGURATION_SNAPSHOT_PATH
+	snapshot_append(name, st, daemon != NULL ? &daemon->conf : NULL);
+#else
+	(void)name;
+#endif
+}
+
+#ifdef CONFIG_CONFIGURATION_LOAD_THREADS
+/**
+ * Configuration file collected by @ref configuration_load, parsed by a loader thread.
+ */
+struct configuration_load_entry {
+	struct stat st; /**< Status of the configuration file. */
+	struct daemon *daemon; /**< Parsed daemon, _NULL_ until parsed or if invalid. */
+	char name[NAME_MAX + 1]; /**< Name of the daemon. */
+};
+
+/**
+ * Configuration files collected by @ref configuration_load, see @ref configuration_load_parse.
+ */
+struct configuration_load_batch {
+	struct configuration_load_entry *entries; /**< Collected configuration files. */
+	size_t count; /**< Number of @ref entries. */
+	size_t capacity; /**< Capacity of @ref entries. */
+	int dirfd; /**< Configuration directory. */
+	atomic_size_t next; /**< Next entry to parse by a loader thread. */
+};
+
+/**
+ * Configuration files of the initial load.
+ */
+static struct configuration_load_batch configuration_load_batch;
+
+/**
+ * Collects a daemon's configuration file during @ref configuration_load.
+ * The file is parsed immediately if it couldn't be collected.
+ * @param dirfd Configuration directory.
+ * @param name Name of the daemon.
+ * @param st Status of the configuration file.
+ */
+static void
+configuration_load_file(int dirfd, const char *name, const struct stat *st) {
+	struct configuration_load_batch * const batch = &configuration_load_batch;
+
+	if (batch->count == batch->capacity) {
+		const size_t capacity = batch->capacity != 0 ? batch->capacity * 2 : 64;
+		struct configuration_load_entry * const entries = realloc(batch->entries, capacity * sizeof (*entries));
+
+		if (entries == NULL) {
+			syslog(LOG_ERR, "configuration_load: realloc: %m");
+			configuration_load_insert(name, st, configuration_parse_daemon(dirfd, name));
+			return;
+		}
+
+		batch->entries = entries;
+		batch->capacity = capacity;
+	}
+
+	struct configuration_load_entry * const entry = &batch->entries[batch->count++];
+
+	memcpy(entry->name, name, strlen(name) + 1);
+	entry->st = *st;
+	entry->daemon = NULL;
+}
+
+/**
+ * Compares collected configuration files by name.
+ * @param lhs Left hand side operand.
+ * @param rhs Right hand side operand.
+ * @returns The comparison between @p lhs and @p rhs names, see _strcmp(3)_.
+ */
+static int
+configuration_load_entry_compare(const void *lhs, const void *rhs) {
+	const struct configuration_load_entry * const lentry = lhs, * const rentry = rhs;
+	return strcmp(lentry->name, rentry->name);
+}
+
+/**
+ * Loader thread, parses collected configuration files until none is left.
+ * Also run by the main thread, which takes its share of the batch.
+ * @param data Batch of configuration files.
+ * @returns Always _NULL_.
+ */
+static void *
+configuration_load_thread(void *data) {
+	struct configuration_load_batch * const batch = data;
+	size_t index;
+
+	while (index = atomic_fetch_add_explicit(&batch->next, 1, memory_order_relaxed), index < batch->count) {
+		struct configuration_load_entry * const entry = &batch->entries[index];
+
+		entry->daemon = configuration_parse_daemon(batch->dirfd, entry->name);
+	}
+
+	return NULL;
+}
+
+/**
+ * Parses the collected configuration files with up to CONFIG_CONFIGURATION_LOAD_THREADS threads,
+ * then inserts the daemons in name order from the main thread. Loader threads block all signals,
+ * so signals keep being received by the main thread only, with the masks of @ref signals_setup.
+ * They are joined before any daemon is started.
+ * @param fd Configuration directory.
+ */
+static void
+configuration_load_parse(int fd) {
+	struct configuration_load_batch * const batch = &configuration_load_batch;
+	pthread_t threads[CONFIG_CONFIGURATION_LOAD_THREADS];
+	sigset_t sigmask, oldmask;
+	unsigned int count = 0;
+
+	qsort(batch->entries, batch->count, sizeof (*batch->entries), configuration_load_entry_compare);
+	batch->dirfd = fd;
+	atomic_init(&batch->next, 0);
+
+	sigfillset(&sigmask);
+	pthread_sigmask(SIG_SETMASK, &sigmask, &oldmask);
+
+	/* The main thread is one of the loaders, and the only one if no thread could be created. */
+	while (count + 1 < CONFIG_CONFIGURATION_LOAD_THREADS && count + 1 < batch->count) {
+		const int error = pthread_create(&threads[count], NULL, configuration_load_thread, batch);
+
+		if (error != 0) {
+			errno = error;
+			syslog(LOG_WARNING, "configuration_load pthread_create: %m");
+			break;
+		}
+
+		count++;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+
+	configuration_load_thread(batch);
+
+	for (unsigned int i = 0; i < count; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	for (size_t i = 0; i < batch->count; i++) {
+		struct configuration_load_entry * const entry = &batch->entries[i];
+
+		configuration_load_insert(entry->name, &entry->st, entry->daemon);
 	}
 
-	if (errno != 0) {
+	free(batch->entries);
+	batch->entries = NULL;
+	batch->count = 0;
+	batch->capacity = 0;
+}
+#else
+/**
+ * Loads a daemon during @ref configuration_load.
+ * @param dirfd Configuration directory.
+ * @param name Name of the daemon.
+ * @param st Status of the configuration file.
+ */
+static void
+configuration_load_file(int dirfd, const char *name, const struct stat *st) {
+	configuration_load_insert(name, st, configuration_parse_daemon(dirfd, name));
+}
+#endif
+
+#ifdef CONFIG_CONFIGURATION_WATCH_DELAY
+/***********************************
+ * Configuration directory watching *
+ ***********************************/
+
+/**
+ * Pending files tree comparison function.
+ * @param lhs Left hand side operand.
+ * @param rhs Right hand side operand.
+ * @returns The comparison between @p lhs and @p rhs names, see _strcmp(3)_.
+ */
+static int
+configuration_watch_compare(const tree_element_t *lhs, const tree_element_t *rhs) {
+	return strcmp(lhs, rhs);
+}
+
+/**
+ * Watch of the configuration directory. Changed files are reloaded one at a time,
+ * once none of them changed for CONFIG_CONFIGURATION_WATCH_DELAY milliseconds,
+ * so the bursts of writes and renames of editors and deployments are reloaded once.
+ */
+static struct {
+	struct socket_node node; /**< Holds the inotify instance watching the directory. */
+	struct socket_node timer; /**< Holds the timerfd expiring once the directory is quiet. */
+	int dirfd; /**< Configuration directory. */
+	bool rescan; /**< Events were lost, the whole directory is reloaded. */
+	struct tree pending; /**< Names of the changed files, allocated. */
+} configuration_watch = {
+	.node = { .fd = -1 },
+	.timer = { .fd = -1 },
+	.dirfd = -1,
+	.pending = { .compare = configuration_watch_compare },
+};
+
+/**
+ * Reloads a changed configuration file, removes its daemon if it's gone
+ * or can't be opened anymore, as @ref configuration_reload would.
+ * @param element Name of the file, freed.
+ */
+static void
+configuration_watch_reload_file(tree_element_t *element) {
+	char * const name = element;
+	struct stat st;
+
+	if (fstatat(configuration_watch.dirfd, name, &st, 0) == 0) {
+		configuration_generation++;
+		configuration_reload_daemon(configuration_watch.dirfd, name, &st);
+
+		/* Only an existing daemon whose file couldn't be opened keeps its generation. */
+		struct daemon * const daemon = configuration_find(name);
+		if (daemon != NULL && daemon->generation != configuration_generation) {
+			configuration_remove_daemon(daemon);
+		}
+	} else if (errno == ENOENT) {
+		struct daemon * const daemon = configuration_find(name);
+
+		if (daemon != NULL) {
+			configuration_remove_daemon(daemon);
+		}
+	} else {
+		syslog(LOG_ERR, "configuration fstatat '%s': %m", name);
+	}
+
+	free(name);
+}
+
+/**
+ * Reloads the changed files once the directory is quiet.
+ * @param snode Timer node of the watch.
+ */
+static void
+configuration_watch_timer_operate(struct socket_node *snode) {
+	uint64_t expirations;
+
+	if (read(snode->fd, &expirations, sizeof (expirations)) < 0) {
+		return;
+	}
+
+	if (configuration_watch.rescan) {
+		syslog(LOG_WARNING, "configuration_watch: Events lost, reloading everything");
+		configuration_watch.rescan = false;
+		configuration_reload();
+		tree_mutate(&configuration_watch.pending, free);
+	} else {
+		tree_mutate(&configuration_watch.pending, configuration_watch_reload_file);
+	}
+
+	tree_deinit(&configuration_watch.pending);
+	configuration_watch.pending.root = NULL;
+}
+
+/**
+ * Records the files named by inotify events as changed, and delays their reload.
+ * @param snode Inotify node of the watch.
+ */
+static void
+configuration_watch_operate(struct socket_node *snode) {
+	_Alignas(struct inotify_event) char buffer[4096];
+	const struct itimerspec value = {
+		.it_value = {
+			.tv_sec = CONFIG_CONFIGURATION_WATCH_DELAY / 1000,
+			.tv_nsec = CONFIG_CONFIGURATION_WATCH_DELAY % 1000 * 1000000,
+		},
+	};
+	ssize_t length;
+
+	while ((length = read(snode->fd, buffer, sizeof (buffer))) > 0) {
+		for (const char *current = buffer; current < buffer + length;) {
+			const struct inotify_event * const event = (const struct inotify_event *)current;
+
+			if ((event->mask & IN_Q_OVERFLOW) != 0) {
+				configuration_watch.rescan = true;
+			} else if ((event->mask & IN_IGNORED) != 0) {
+				syslog(LOG_ERR, "configuration_watch: '%s' isn't watched anymore", configuration_path);
+			} else if (event->len != 0 && *event->name != '.'
+				&& tree_find(&configuration_watch.pending, event->name) == NULL) {
+				char * const name = strdup(event->name);
+
+				if (name != NULL) {
+					tree_insert(&configuration_watch.pending, name);
+				} else {
+					configuration_watch.rescan = true;
+				}
+			}
+
+			current += sizeof (*event) + event->len;
+		}
+	}
+
+	if (length < 0 && errno != EAGAIN) {
+		syslog(LOG_ERR, "configuration_watch: read: %m");
+	}
+
+	if (timerfd_settime(configuration_watch.timer.fd, 0, &value, NULL) != 0) {
+		syslog(LOG_ERR, "configuration_watch: timerfd_settime: %m");
+	}
+}
+
+/**
+ * Stops watching the configuration directory, when the socket switch is torn down.
+ * Changes not reloaded yet are forgotten.
+ * @param snode Inotify node of the watch.
+ */
+static void
+configuration_watch_destroy(struct socket_node *snode) {
+
+	close(snode->fd);
+	snode->fd = -1;
+
+	socket_switch_remove(&configuration_watch.timer);
+	close(configuration_watch.timer.fd);
+	configuration_watch.timer.fd = -1;
+
+	close(configuration_watch.dirfd);
+	configuration_watch.dirfd = -1;
+
+	tree_mutate(&configuration_watch.pending, free);
+	tree_deinit(&configuration_watch.pending);
+	configuration_watch.pending.root = NULL;
+}
+
+/**
+ * Configuration watch inotify node class. The node belongs to us,
+ * and is destroyed with the socket switch, so nothing is reloaded during teardown.
+ */
+static const struct socket_node_class configuration_watch_class = {
+	.operate = configuration_watch_operate,
+	.destroy = configuration_watch_destroy,
+};
+
+/**
+ * Configuration watch timer node class. The node belongs to us,
+ * and is removed along the inotify node.
+ */
+static const struct socket_node_class configuration_watch_timer_class = {
+	.operate = configuration_watch_timer_operate,
+};
+
+/**
+ * Starts watching the configuration directory, after the initial load.
+ * Reloads are still possible with _SIGHUP_ if the watch couldn't be setup.
+ */
+static void
+configuration_watch_setup(void) {
+
+	configuration_watch.dirfd = open(configuration_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (configuration_watch.dirfd < 0) {
+		syslog(LOG_ERR, "configuration_watch: open '%s': %m", configuration_path);
+		goto open_failure;
+	}
+
+	configuration_watch.node.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (configuration_watch.node.fd < 0) {
+		syslog(LOG_ERR, "configuration_watch: inotify_init1: %m");
+		goto inotify_init1_failure;
+	}
+
+	if (inotify_add_watch(configuration_watch.node.fd, configuration_path,
+		IN_CREATE | IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE | IN_ONLYDIR) < 0) {
+		syslog(LOG_ERR, "configuration_watch: inotify_add_watch '%s': %m", configuration_path);
+		goto inotify_add_watch_failure;
+	}
+
+	configuration_watch.timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (configuration_watch.timer.fd < 0) {
+		syslog(LOG_ERR, "configuration_watch: timerfd_create: %m");
+		goto timerfd_create_failure;
+	}
+
+	configuration_watch.node.class = &configuration_watch_class;
+	configuration_watch.timer.class = &configuration_watch_timer_class;
+	if (socket_switch_insert(&configuration_watch.timer) != 0) {
+		goto insert_failure;
+	}
+
+	/* On failure, the watch is destroyed along with its node. */
+	socket_switch_insert(&configuration_watch.node);
+
+	return;
+insert_failure:
+	close(configuration_watch.timer.fd);
+	configuration_watch.timer.fd = -1;
+timerfd_create_failure:
+inotify_add_watch_failure:
+	close(configuration_watch.node.fd);
+	configuration_watch.node.fd = -1;
+inotify_init1_failure:
+	close(configuration_watch.dirfd);
+	configuration_watch.dirfd = -1;
+open_failure:
+	return;
+}
+#endif
+
+/**
+ * Parses and loads the configuration files of the initial load.
+ * @param dirp Configuration directory.
+ * @returns Zero on success, -1 if the directory couldn't be read entirely.
+ */
+static int
+configuration_load_files(DIR *dirp) {
+	const int status = configuration_foreach(dirp, configuration_load_file);
+
+	if (status != 0) {
 		syslog(LOG_ERR, "configuration_load readdir: %m");
 	}
 
+#ifdef CONFIG_CONFIGURATION_LOAD_THREADS
+	configuration_load_parse(dirfd(dirp));
+#endif
+
+	return status;
+}
+
+#ifdef CONFIG_CONFIGURATION_SNAPSHOT_PATH
+/**
+ * Loads a daemon from the configuration snapshot.
+ * @param name Name of the daemon.
+ * @param st Status of the configuration file when it was parsed.
+ * @param conf Configuration, mapped from the snapshot.
+ */
+static void
+configuration_snapshot_daemon(const char *name, const struct stat *st, const struct daemon_conf *conf) {
+	struct daemon * const daemon = daemon_create(name);
+
+	if (daemon == NULL) {
+		syslog(LOG_ERR, "Failure to create daemon '%s'", name);
+		return;
+	}
+
+	daemon_conf_check(conf, name);
+	daemon->conf = *conf;
+	configuration_insert_daemon(daemon, st);
+}
+
+/**
+ * Loads the initial configuration from the snapshot at CONFIG_CONFIGURATION_SNAPSHOT_PATH if up to date,
+ * else parses the configuration files and saves a new snapshot of them, unless some couldn't be read.
+ * @param dirp Configuration directory.
+ */
+static void
+configuration_load_snapshot(DIR *dirp) {
+	const int fd = dirfd(dirp);
+	struct stat st;
+
+	if (fstat(fd, &st) != 0) {
+		syslog(LOG_ERR, "configuration_load fstat: %m");
+		configuration_load_files(dirp);
+		return snapshot_discard();
+	}
+
+	if (snapshot_load(CONFIG_CONFIGURATION_SNAPSHOT_PATH, fd, &st, configuration_snapshot_daemon) == 0) {
+		return;
+	}
+
+	if (configuration_load_files(dirp) == 0 && configuration_skipped == 0) {
+		snapshot_save(CONFIG_CONFIGURATION_SNAPSHOT_PATH, &st);
+	} else {
+		snapshot_discard();
+	}
+}
+#endif
+
+/**
+ * Load initial configuration. Called on @ref setup.
+ * This function may start daemons, and suppose all subsystems have been initialized.
+ */
+void
+configuration_load(const char *path) {
+	DIR *dirp;
+
+	configuration_path = path;
+	syslog(LOG_INFO, "configuration_load %s", path);
+
+	dirp = opendir(configuration_path);
+	if (dirp == NULL) {
+		return syslog(LOG_ERR, "configuration_load opendir '%s': %m", configuration_path);
+	}
+
+#ifdef CONFIG_CONFIGURATION_SNAPSHOT_PATH
+	configuration_load_snapshot(dirp);
+#else
+	configuration_load_files(dirp);
+#endif
+
 	closedir(dirp);
+
+	/* Started in name order. */
+	configuration_select("*", configuration_load_start, NULL);
+
+#ifdef CONFIG_CONFIGURATION_WATCH_DELAY
+	configuration_watch_setup();
+#endif
 }
 
 /**
  * Reload configurations, and load new ones if available.
+ * Daemons stay in place, only those whose configuration file changed are reparsed,
+ * and those whose configuration file wasn't found are removed.
+ * If the directory couldn't be read entirely, or one of its files couldn't be stat'ed,
+ * no daemon is removed, as its file may be the one not found.
  */
 void
 configuration_reload(void) {
@@ -217,34 +1026,27 @@ configuration_reload(void) {
 		return syslog(LOG_ERR, "configuration_reload opendir '%s': %m", configuration_path);
 	}
 
-	struct tree olddaemons = daemons;
-	daemons.root = NULL;
-
-	struct dirent *entry;
-	while (errno = 0, entry = readdir(dirp), entry != NULL) {
-		FILE *filep;
+	configuration_generation++;
 
-		if (*entry->d_name == '.') {
-			continue;
-		}
+	const int status = configuration_foreach(dirp, configuration_reload_daemon);
+	if (status != 0) {
+		syslog(LOG_ERR, "configuration_reload readdir: %m");
+	}
 
-		filep = configuration_fopenat(dirfd(dirp), entry->d_name);
-		if (filep == NULL) {
-			continue;
-		}
+	closedir(dirp);
 
-		configuration_reload_daemon(entry->d_name, filep, &olddaemons);
-		fclose(filep);
+	if (status != 0 || configuration_skipped != 0) {
+		return;
 	}
 
-	if (errno != 0) {
-		syslog(LOG_ERR, "configuration_reload readdir: %m");
-	}
+	struct daemons_stale stale = { };
+	tree_walk(&daemons, daemons_stale_element, &stale);
 
-	closedir(dirp);
+	for (size_t i = 0; i < stale.count; i++) {
+		configuration_remove_daemon(stale.daemons[i]);
+	}
 
-	tree_mutate(&olddaemons, daemons_destroy_element);
-	tree_deinit(&olddaemons);
+	free(stale.daemons);
 }
 
 #ifndef NDEBUG
@@ -5,6 +5,15 @@
 struct daemon *
 configuration_find(const char *name);
 
+bool
+configuration_selector(const char *name);
+
+unsigned int
+configuration_select(const char *selector, void (* const action)(struct daemon *daemon, void *data), void *data);
+
+void
+configuration_walk(void (* const visit)(const struct daemon *daemon, void *data), void *data);
+
 void
 configuration_load(const char *path);
 
@@ -1,180 +1,541 @@
 /* SPDX-License-Identifier: BSD-3-Clause */
 #include "daemon.h"
 
+#include "configuration.h"
+#include "events.h"
+#include "socket_switch.h"
+#include "process.h"
 #include "spawns.h"
+#include "status_page.h"
+#include "zygotes.h"
+#ifdef CONFIG_DAEMON_SPAWNERS
+#include "spawners.h"
+#endif
 
-#include <stdlib.h> /* abort, free, malloc */
-#include <stdnoreturn.h> /* noreturn */
-#include <sys/resource.h> /* setpriority */
-#include <sys/stat.h> /* umask */
+#include <stddef.h> /* offsetof */
+#include <stdlib.h> /* abort, free, malloc, random */
+#include <sys/wait.h> /* waitid, P_PIDFD, __WALL */
+#include <sys/syscall.h> /* SYS_pidfd_send_signal */
 #include <syslog.h> /* syslog */
-#include <unistd.h> /* close, chdir, setuid... */
-#include <signal.h> /* sigemptyset, sigprocmask, kill */
-#include <string.h> /* strdup */
-#include <alloca.h> /* alloca */
-#include <fcntl.h> /* open */
-#include <err.h> /* err */
+#include <unistd.h> /* close, syscall */
+#include <signal.h> /* kill */
+#include <sys/socket.h> /* socketpair */
+#include <string.h> /* strdup, strerror */
+#include <errno.h> /* errno, EINTR */
+#include <inttypes.h> /* PRIu64 */
+#include <time.h> /* clock_gettime */
+#include <sys/timerfd.h> /* timerfd_create, timerfd_settime */
 
 /**
- * Empty signal procmask of the current process.
+ * Stops watching a daemon's process, if still watched, and closes its pidfd.
+ * @param process Process of a daemon.
  */
-static int
-daemon_child_sigprocmask(void) {
-	sigset_t sigmask;
+static void
+daemon_process_unwatch(struct daemon_process *process) {
 
-	if (sigemptyset(&sigmask) != 0) {
-		return -1;
+	if (process->node.fd >= 0) {
+		socket_switch_remove(&process->node);
+		close(process->node.fd);
+		process->node.fd = -1;
 	}
+}
 
-	if (sigprocmask(SIG_SETMASK, &sigmask, NULL) != 0) {
-		return -1;
+/**
+ * Reaps a spawned daemon's process when its pidfd becomes readable.
+ * If its pidfd can't be waited for, it is not watched anymore, the process
+ * staying in spawns to be reaped on _SIGCHLD_, see @ref daemon_reaped.
+ * @param snode Socket node of the process.
+ */
+static void
+daemon_node_operate(struct socket_node *snode) {
+	struct daemon_process * const process = (struct daemon_process *)((char *)snode - offsetof (struct daemon_process, node));
+	struct daemon * const daemon = process->daemon;
+	siginfo_t info = { .si_pid = 0 };
+
+	if (waitid(P_PIDFD, snode->fd, &info, WEXITED | WNOHANG | __WALL) != 0) {
+		if (errno != EINTR) {
+			syslog(LOG_ERR, "daemon_node_operate: waitid '%s' (pid: %d): %m", daemon->name, process->pid);
+			daemon_process_unwatch(process);
+		}
+		return;
 	}
 
-	return 0;
+	if (info.si_pid == 0) {
+		/* Not terminated yet. */
+		return;
+	}
+
+	spawns_retrieve(process->pid);
+	daemon_reaped(daemon, &info);
 }
 
 /**
- * Sets up the current process state according to @p conf.
- * @param name Name of the daemon.
- * @param conf Configuration of the daemon.
- * @returns Never, exits on failure to initialize process.
+ * Daemon node class. The nodes belong to the daemon, and are
+ * only registered in the socket switch while its processes run.
  */
-static void noreturn
-daemon_child_setup(const char *name, const struct daemon_conf *conf) {
-	const char *in = conf->in,
-	           *out = conf->out,
-		   *workdir = conf->workdir;
-	char **argv = conf->arguments, **envp = conf->environment;
-	int infd, outfd, errfd;
+static const struct socket_node_class daemon_node_class = {
+	.operate = daemon_node_operate,
+};
 
-	/********************
-	 * Setting defaults *
-	 ********************/
+/**
+ * Ends a spawn begun by cyberd, once its process exec'd or failed its setup.
+ * @param snode Spawning node of the daemon.
+ */
+static void
+daemon_spawning_operate(struct socket_node *snode) {
+	struct daemon * const daemon = (struct daemon *)((char *)snode - offsetof (struct daemon, spawning));
+	siginfo_t info;
 
-	if (conf->in == NULL) {
-		in = CONFIG_DAEMON_DEV_NULL;
+	socket_switch_remove(snode);
+	process_spawn_end(snode->fd, &daemon->spawn);
+	snode->fd = -1;
+
+	const bool reaped = process_remote_answered(daemon->spawn.pid, &info);
+	daemon_spawned(daemon, &daemon->spawn, reaped ? &info : NULL);
+}
+
+/**
+ * Daemon spawning node class. The node belongs to the daemon, and is
+ * only registered in the socket switch while a spawn begun by cyberd didn't end.
+ */
+static const struct socket_node_class daemon_spawning_class = {
+	.operate = daemon_spawning_operate,
+};
+
+/**
+ * Forgets a spawn begun by cyberd, once its daemon is removed.
+ * Its process is watched as an orphan, it may still fail its setup or exec.
+ * @param daemon Removed daemon, whose spawn didn't end.
+ */
+static void
+daemon_spawning_cancel(struct daemon *daemon) {
+	siginfo_t info;
+
+	socket_switch_remove(&daemon->spawning);
+	close(daemon->spawning.fd);
+	daemon->spawning.fd = -1;
+
+	if (process_remote_answered(daemon->spawn.pid, &info)) {
+		process_orphan_reaped(&info);
+		close(daemon->spawn.pidfd);
+	} else {
+		process_orphan(daemon->spawn.pidfd);
 	}
+}
+
+/**
+ * Spawns the process of a daemon ourselves. We don't wait for the process to exec,
+ * as it may block opening its standard streams, such as a FIFO without reader.
+ * Until then, the daemon is DAEMON_STARTING, and the spawn is counted as a remote one,
+ * so its process is claimed if it is reaped before @ref daemon_spawning_operate.
+ * @param daemon Daemon to spawn.
+ * @param controlfd Control socket given to the process, -1 if none.
+ */
+static void
+daemon_spawn_local(struct daemon *daemon, int controlfd) {
 
-	if (conf->out == NULL) {
-		out = CONFIG_DAEMON_DEV_NULL;
+	if (process_spawn_begin(&daemon->conf, controlfd, false, &daemon->spawn, &daemon->spawning.fd) != 0
+		|| daemon->spawning.fd < 0) {
+		return daemon_spawned(daemon, &daemon->spawn, NULL);
 	}
 
-	if (conf->workdir == NULL) {
-		workdir = CONFIG_DAEMON_DEFAULT_WORKDIR;
+	if (socket_switch_insert(&daemon->spawning) != 0) {
+		/* Can't be watched, wait for the spawn to end. */
+		process_spawn_end(daemon->spawning.fd, &daemon->spawn);
+		daemon->spawning.fd = -1;
+		return daemon_spawned(daemon, &daemon->spawn, NULL);
 	}
 
-	if (argv == NULL) {
-		argv = alloca(sizeof (*argv) * 2);
-		argv[0] = (char *)name;
-		argv[1] = NULL;
+	process_remote_requested();
+
+	daemon->state = DAEMON_STARTING;
+	status_page_update(daemon);
+}
+
+/**
+ * Milliseconds elapsed between two monotonic times.
+ * @param since Earlier time.
+ * @param now Later time.
+ * @returns Elapsed time, in milliseconds.
+ */
+static uint64_t
+daemon_elapsed(const struct timespec *since, const struct timespec *now) {
+	return (uint64_t)(now->tv_sec - since->tv_sec) * 1000 + (now->tv_nsec - since->tv_nsec) / 1000000;
+}
+
+/**
+ * Disarms the timer of a daemon, if armed.
+ * @param daemon Daemon whose delay is cancelled or expired.
+ */
+static void
+daemon_timer_disarm(struct daemon *daemon) {
+
+	if (daemon->timer.fd >= 0) {
+		socket_switch_remove(&daemon->timer);
+		close(daemon->timer.fd);
+		daemon->timer.fd = -1;
 	}
+}
 
-	if (envp == NULL) {
-		envp = alloca(sizeof (*envp) * 1);
-		envp[0] = NULL;
+/**
+ * Arms the timer of a daemon, which must be disarmed.
+ * @param daemon Daemon to operate after the delay.
+ * @param delay Non-zero delay, in milliseconds.
+ * @returns Zero on success, -1 on error.
+ */
+static int
+daemon_timer_arm(struct daemon *daemon, uint64_t delay) {
+	const struct itimerspec value = {
+		.it_value = {
+			.tv_sec = delay / 1000,
+			.tv_nsec = delay % 1000 * 1000000,
+		},
+	};
+	const int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+	if (fd < 0) {
+		syslog(LOG_ERR, "daemon_timer_arm: timerfd_create '%s': %m", daemon->name);
+		return -1;
 	}
 
-	/*************************************
-	 * Opening standard file descriptors *
-	 *************************************/
+	if (timerfd_settime(fd, 0, &value, NULL) != 0) {
+		syslog(LOG_ERR, "daemon_timer_arm: timerfd_settime '%s': %m", daemon->name);
+		close(fd);
+		return -1;
+	}
 
-	infd = open(in, O_RDONLY | O_CLOEXEC);
-	if (infd < 0) {
-		err(-1, "open '%s'", in);
+	daemon->timer.fd = fd;
+	if (socket_switch_insert(&daemon->timer) != 0) {
+		close(fd);
+		daemon->timer.fd = -1;
+		return -1;
 	}
 
-	outfd = open(out, O_WRONLY | O_CLOEXEC);
-	if (outfd < 0) {
-		err(-1, "open '%s'", out);
+	return 0;
+}
+
+/**
+ * Sends a signal to a spawned daemon's process through its pidfd.
+ * A process not watched anymore is signaled by its pid, which can't
+ * be reused until it is reaped.
+ * @param process Running process.
+ * @param signo Signal to send.
+ */
+static void
+daemon_signal(const struct daemon_process *process, int signo) {
+	const int sent = process->node.fd >= 0 ? syscall(SYS_pidfd_send_signal, process->node.fd, signo, NULL, 0)
+		: kill(process->pid, signo);
+
+	if (sent != 0) {
+		syslog(LOG_ERR, "daemon_signal: '%s' (pid: %d) signal %d: %m", process->daemon->name, process->pid, signo);
 	}
+}
 
-	if (conf->err != NULL) {
-		errfd = open(conf->err, O_WRONLY | O_CLOEXEC);
-		if (errfd < 0) {
-			err(-1, "open '%s'", conf->err);
-		}
-	} else {
-		errfd = outfd;
+/**
+ * Kills the processes of a spawned daemon, its predecessor included.
+ * @param daemon Spawned daemon.
+ */
+static void
+daemon_kill(struct daemon *daemon) {
+
+	daemon_signal(&daemon->process, SIGKILL);
+	if (daemon->predecessor.pid > 0) {
+		daemon_signal(&daemon->predecessor, SIGKILL);
 	}
+}
 
-	/**************************************
-	 * Replacing default file descriptors *
-	 **************************************/
+/**
+ * Starts watching a daemon's process through its pidfd in the socket switch.
+ * If it can't be watched, its pidfd is closed and the process is reaped on _SIGCHLD_,
+ * like one whose pidfd can't be waited for, see @ref daemon_node_operate.
+ * @param process Process of a daemon, not watched.
+ * @param pidfd Pidfd of the process.
+ */
+static void
+daemon_process_watch(struct daemon_process *process, int pidfd) {
 
-	if (dup2(infd, STDIN_FILENO) < 0) {
-		err(-1, "dup2 STDIN_FILENO");
+	process->node.fd = pidfd;
+	if (socket_switch_insert(&process->node) != 0) {
+		syslog(LOG_WARNING, "'%s' (pid: %d) can't be watched, reaping it on SIGCHLD", process->daemon->name, process->pid);
+		close(pidfd);
+		process->node.fd = -1;
 	}
+}
 
-	if (dup2(outfd, STDOUT_FILENO) < 0) {
-		err(-1, "dup2 STDOUT_FILENO");
+/**
+ * Moves a running process of a daemon, recorded in spawns and watched in the socket switch, to another slot.
+ * @param from Running process, its pid is -1 afterwards.
+ * @param to Process slot, taking over @p from.
+ */
+static void
+daemon_process_move(struct daemon_process *from, struct daemon_process *to) {
+	const int pidfd = from->node.fd;
+
+	spawns_retrieve(from->pid);
+	if (pidfd >= 0) {
+		socket_switch_remove(&from->node);
 	}
 
-	if (dup2(errfd, STDERR_FILENO) < 0) {
-		err(-1, "dup2 STDERR_FILENO");
+	to->pid = from->pid;
+	to->node.fd = -1;
+	from->pid = -1;
+	from->node.fd = -1;
+
+	if (pidfd >= 0) {
+		daemon_process_watch(to, pidfd);
 	}
+	spawns_record(to);
+}
 
-	/***********************************************
-	 * Parent process-inherited capabilities reset *
-	 ***********************************************/
+/**
+ * Aborts the replace of a daemon, its predecessor is its process again.
+ * @param daemon Daemon whose new process failed to start, or terminated too early.
+ */
+static void
+daemon_replace_abort(struct daemon *daemon) {
 
-	umask(conf->umask);
+	daemon_timer_disarm(daemon);
+	daemon_process_move(&daemon->predecessor, &daemon->process);
+	daemon->replacing = 0;
+	daemon->state = DAEMON_STARTED;
+	status_page_update(daemon);
 
-	if (chdir(workdir) < 0) {
-		err(-1, "chdir '%s'", workdir);
+	syslog(LOG_WARNING, "daemon_replace: '%s' replace failed, keeping pid: %d", daemon->name, daemon->process.pid);
+}
+
+/**
+ * Stops the predecessor of a daemon, once its new process ran for its replace delay.
+ * @param daemon Daemon being replaced.
+ */
+static void
+daemon_replace_finish(struct daemon *daemon) {
+
+	syslog(LOG_INFO, "daemon_replace: '%s' stopping pid: %d with signal %d", daemon->name, daemon->predecessor.pid, daemon->conf.sigfinish);
+	daemon_signal(&daemon->predecessor, daemon->conf.sigfinish);
+	daemon->replacing = 0;
+}
+
+/**
+ * Fails the start of a daemon, whose process couldn't be created or failed before its exec.
+ * The control socket of a zygote is closed. A replace is aborted instead of failing the daemon.
+ * @param daemon Daemon which failed to start.
+ */
+static void
+daemon_spawn_failed(struct daemon *daemon) {
+
+	syslog(LOG_INFO, "daemon_start: '%s' start failed", daemon->name);
+
+	if (daemon->zygote != NULL) {
+		zygote_destroy(daemon->zygote);
+		daemon->zygote = NULL;
 	}
 
-	if (daemon_child_sigprocmask() < 0) {
-		err(-1, "daemon_child_sigprocmask");
+	/* The predecessor keeps running, the daemon didn't fail. */
+	if (daemon->replacing) {
+		return daemon_replace_abort(daemon);
 	}
 
-	/**************************************
-	 * Process credentials and scheduling *
-	 **************************************/
+	daemon->state = DAEMON_FAILED;
+	status_page_update(daemon);
+	events_publish(PROTOCOL_EVENT_FAILED, daemon, 0, NULL);
+}
+
+/**
+ * Requests the zygote of a templated daemon to fork its process.
+ * The zygote daemon is started first if needed.
+ * @param daemon Daemon to spawn, with a template.
+ * @returns Zero if the spawn was requested, -1 on error.
+ */
+static int
+daemon_spawn_template(struct daemon *daemon) {
+	struct daemon * const template = configuration_find(daemon->conf.template);
 
-	if (setuid(conf->uid) < 0) {
-		err(-1, "setuid %d", conf->uid);
+	if (template == NULL) {
+		syslog(LOG_ERR, "daemon_spawn: '%s' template '%s' not found", daemon->name, daemon->conf.template);
+		return -1;
 	}
 
-	if (setgid(conf->gid) < 0) {
-		err(-1, "setgid %d", conf->gid);
+	if (!template->conf.zygote) {
+		syslog(LOG_ERR, "daemon_spawn: '%s' template '%s' is not a zygote", daemon->name, template->name);
+		return -1;
 	}
 
-	if (!conf->nosid && setsid() < 0) {
-		err(-1, "setsid");
+	if (template->state == DAEMON_STOPPED || template->state == DAEMON_FAILED) {
+		daemon_start(template);
 	}
 
-	if (setpriority(PRIO_PROCESS, 0, conf->priority) != 0) {
-		err(-1, "setpriority %d", conf->priority);
+	if (template->zygote == NULL) {
+		syslog(LOG_ERR, "daemon_spawn: '%s' zygote '%s' is not running", daemon->name, template->name);
+		return -1;
 	}
 
-	/********
-	 * Exec *
-	 ********/
+	return zygote_request(template->zygote, daemon);
+}
 
-	execve(conf->path, argv, envp);
-	err(-1, "execve '%s'", conf->path);
+/**
+ * Spawns a zygote daemon, with its end of a control socket.
+ * The control socket is watched right away, so templated daemons can be
+ * requested while the zygote is DAEMON_STARTING, they fail if it does.
+ * @param daemon Daemon to spawn, a zygote.
+ */
+static void
+daemon_spawn_zygote(struct daemon *daemon) {
+	int fds[2];
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) != 0) {
+		syslog(LOG_ERR, "daemon_spawn: '%s' socketpair: %m", daemon->name);
+		goto failure;
+	}
+
+	daemon->zygote = zygote_create(daemon, fds[0]);
+	if (daemon->zygote == NULL) {
+		close(fds[0]);
+		close(fds[1]);
+		goto failure;
+	}
+
+	daemon_spawn_local(daemon, fds[1]);
+	close(fds[1]);
+
+	return;
+failure:
+	daemon_spawn_failed(daemon);
 }
 
 /**
- * Spawns the process, doesn't return from the child.
+ * Spawns the process of a daemon. Zygotes are spawned by cyberd with their control socket,
+ * and templated daemons are forked by their zygote, DAEMON_STARTING until @ref daemon_spawned.
+ * Else, if spawners are available, the spawn is delegated to one of them and the daemon is
+ * DAEMON_STARTING until @ref daemon_spawned, else it is spawned by cyberd, see @ref daemon_spawn_local.
+ * Spawn plans too large for a spawner are spawned by cyberd too.
  * @param daemon Daemon to spawn.
- * @returns Doesn't return from child. In the parent: zero if successful, non-zero on error to _fork(2)_.
  */
-static int
+static void
 daemon_spawn(struct daemon *daemon) {
-	const pid_t pid = fork();
 
-	switch (pid) {
-	case -1: /* failure */
-		return -1;
-	case 0: /* success-child */
-		daemon_child_setup(daemon->name, &daemon->conf);
-	default: /* success-parent */
-		daemon->pid = pid;
-		daemon->state = DAEMON_STARTED;
-		spawns_record(daemon);
-		return 0;
+	if (daemon->conf.template != NULL) {
+		if (daemon_spawn_template(daemon) == 0) {
+			daemon->state = DAEMON_STARTING;
+			status_page_update(daemon);
+		} else {
+			daemon_spawn_failed(daemon);
+		}
+		return;
+	}
+
+	if (daemon->conf.zygote) {
+		return daemon_spawn_zygote(daemon);
+	}
+
+#ifdef CONFIG_DAEMON_SPAWNERS
+	if (spawners_request(daemon) == 0) {
+		daemon->state = DAEMON_STARTING;
+		status_page_update(daemon);
+		return;
+	}
+#endif
+
+	daemon_spawn_local(daemon, -1);
+}
+
+/**
+ * Operates a daemon once its timer expired.
+ * @param snode Timer node of the daemon.
+ */
+static void
+daemon_timer_operate(struct socket_node *snode) {
+	struct daemon * const daemon = (struct daemon *)((char *)snode - offsetof (struct daemon, timer));
+
+	daemon_timer_disarm(daemon);
+
+	switch (daemon->state) {
+	case DAEMON_RESTARTING:
+		events_publish(PROTOCOL_EVENT_RESPAWNED, daemon, 0, NULL);
+		daemon_spawn(daemon);
+		break;
+	case DAEMON_STARTED:
+		daemon_replace_finish(daemon);
+		break;
+	case DAEMON_STOPPING:
+		syslog(LOG_WARNING, "'%s' didn't stop within %ums, killing it", daemon->name, daemon->conf.stoptimeout);
+		daemon_kill(daemon);
+		break;
+	default:
+		abort();
+	}
+}
+
+/**
+ * Daemon timer node class. The node belongs to the daemon, and is
+ * only registered in the socket switch while its timer is armed.
+ */
+static const struct socket_node_class daemon_timer_class = {
+	.operate = daemon_timer_operate,
+};
+
+/**
+ * Restarts a reaped daemon automatically, after a delay doubling with each consecutive
+ * restart, randomized so daemons failing together don't restart together.
+ * The delay is reset once the daemon ran for the maximum delay.
+ * A daemon failing too often within its crash window is parked instead.
+ * @param daemon Reaped daemon, DAEMON_STOPPED.
+ * @param failure Whether the process failed, exiting unsuccessfully, killed or dumping core.
+ */
+static void
+daemon_autorestart(struct daemon *daemon, bool failure) {
+	const unsigned int delaymax = daemon->conf.start.delaymax;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if (failure && daemon->conf.start.crashcount != 0) {
+		if (daemon->crashes == 0 || daemon_elapsed(&daemon->crashedat, &now) >= (uint64_t)daemon->conf.start.crashwindow * 1000) {
+			daemon->crashedat = now;
+			daemon->crashes = 0;
+		}
+
+		daemon->crashes++;
+		if (daemon->crashes >= daemon->conf.start.crashcount) {
+			syslog(LOG_WARNING, "'%s' parked after %u failures within %us, clear it to start it again",
+				daemon->name, daemon->crashes, daemon->conf.start.crashwindow);
+			daemon->state = DAEMON_PARKED;
+			status_page_update(daemon);
+			events_publish(PROTOCOL_EVENT_PARKED, daemon, 0, NULL);
+			return;
+		}
+	}
+
+	if (daemon_elapsed(&daemon->startedat, &now) >= delaymax) {
+		daemon->restarts = 0;
+	}
+
+	uint64_t delay = daemon->conf.start.delay;
+	for (unsigned int i = 0; i < daemon->restarts && delay != 0 && delay < delaymax; i++) {
+		delay *= 2;
+	}
+
+	if (delay < delaymax) {
+		daemon->restarts++;
+	} else {
+		delay = delaymax;
+	}
+
+	if (delay == 0) {
+		events_publish(PROTOCOL_EVENT_RESPAWNED, daemon, 0, NULL);
+		return daemon_start(daemon);
+	}
+
+	/* Wait between half and the whole delay. */
+	delay -= random() % (delay / 2 + 1);
+
+	if (daemon_timer_arm(daemon, delay) != 0) {
+		events_publish(PROTOCOL_EVENT_RESPAWNED, daemon, 0, NULL);
+		return daemon_start(daemon);
 	}
+
+	syslog(LOG_INFO, "'%s' restarting in %"PRIu64"ms", daemon->name, delay);
+	daemon->state = DAEMON_RESTARTING;
+	status_page_update(daemon);
 }
 
 /**
@@ -197,7 +558,34 @@ daemon_create(const char *name) {
 
 	daemon->state = DAEMON_STOPPED;
 	daemon->name = copy;
+	daemon->process.pid = -1;
+	daemon->process.node.class = &daemon_node_class;
+	daemon->process.node.fd = -1;
+	daemon->process.daemon = daemon;
+	daemon->predecessor.pid = -1;
+	daemon->predecessor.node.class = &daemon_node_class;
+	daemon->predecessor.node.fd = -1;
+	daemon->predecessor.daemon = daemon;
+	daemon->overlapms = 0;
+	daemon->zygote = NULL;
+	daemon->timer.class = &daemon_timer_class;
+	daemon->timer.fd = -1;
+	daemon->spawning.class = &daemon_spawning_class;
+	daemon->spawning.fd = -1;
+	daemon->statusslot = -1;
+	daemon->startedat = (struct timespec) { };
+	daemon->exitcode = 0;
+	daemon->exitstatus = 0;
+	daemon->restarts = 0;
+	daemon->crashes = 0;
+	daemon->pendingstart = 0;
+	daemon->replacing = 0;
 	daemon_conf_init(&daemon->conf);
+	daemon->source.dev = 0;
+	daemon->source.ino = 0;
+	daemon->source.size = 0;
+	daemon->source.mtime = (struct timespec) { };
+	daemon->generation = 0;
 
 	return daemon;
 strdup_failure:
@@ -208,16 +596,54 @@ malloc_failure:
 
 /**
  * Frees every field of the struct, dereference
- * in spawns if not DAEMON_STOPPED, frees the structure
+ * in spawns if spawned, frees the structure
  * @param daemon A previously daemon_create()'d daemon
  */
 void
 daemon_destroy(struct daemon *daemon) {
 
-	if (daemon->state != DAEMON_STOPPED) {
-		/* Remove daemon index in spawns if previously spawned. */
-		spawns_retrieve(daemon->pid);
+	daemon_timer_disarm(daemon);
+
+	if (daemon->predecessor.pid > 0) {
+		spawns_retrieve(daemon->predecessor.pid);
+		if (daemon->predecessor.node.fd >= 0) {
+			socket_switch_remove(&daemon->predecessor.node);
+			process_orphan(daemon->predecessor.node.fd);
+		}
 	}
+
+	switch (daemon->state) {
+	case DAEMON_STARTED: [[fallthrough]];
+	case DAEMON_STOPPING:
+		/* Remove daemon index in spawns if previously spawned,
+		 * and keep watching its process until it is reaped. */
+		spawns_retrieve(daemon->process.pid);
+		if (daemon->process.node.fd >= 0) {
+			socket_switch_remove(&daemon->process.node);
+			process_orphan(daemon->process.node.fd);
+		}
+		if (daemon->zygote != NULL) {
+			zygote_destroy(daemon->zygote);
+		}
+		break;
+	case DAEMON_STARTING:
+		/* Its process will be watched as an orphan once spawned. */
+		if (daemon->spawning.fd >= 0) {
+			daemon_spawning_cancel(daemon);
+		}
+#ifdef CONFIG_DAEMON_SPAWNERS
+		spawners_cancel(daemon);
+#endif
+		zygotes_cancel(daemon);
+		if (daemon->zygote != NULL) {
+			zygote_destroy(daemon->zygote);
+		}
+		break;
+	default:
+		break;
+	}
+
+	status_page_remove(daemon);
 	free(daemon->name);
 	daemon_conf_deinit(&daemon->conf);
 
@@ -225,8 +651,8 @@ daemon_destroy(struct daemon *daemon) {
 }
 
 /**
- * Spawns a daemon if it was DAEMON_STOPPED.
- * If successful, records it into spawns, else does nothing.
+ * Spawns a daemon if it was DAEMON_STOPPED or DAEMON_FAILED.
+ * If successful, records it into spawns, else the daemon is DAEMON_FAILED.
  * @param daemon Daemon to start
  */
 void
@@ -236,16 +662,24 @@ daemon_start(struct daemon *daemon) {
 	case DAEMON_STARTED:
 		syslog(LOG_INFO, "daemon_start: '%s' already started", daemon->name);
 		break;
-	case DAEMON_STOPPED:
-		if (daemon_spawn(daemon) == 0) {
-			syslog(LOG_INFO, "daemon_start: '%s' started with pid: %d", daemon->name, daemon->pid);
-		} else {
-			syslog(LOG_INFO, "daemon_start: '%s' start failed", daemon->name);
-		}
+	case DAEMON_STOPPED: [[fallthrough]];
+	case DAEMON_FAILED:
+		daemon_spawn(daemon);
+		break;
+	case DAEMON_STARTING:
+		syslog(LOG_INFO, "daemon_start: '%s' is starting", daemon->name);
 		break;
 	case DAEMON_STOPPING:
 		syslog(LOG_INFO, "daemon_start: '%s' is stopping", daemon->name);
 		break;
+	case DAEMON_RESTARTING:
+		syslog(LOG_INFO, "daemon_start: '%s' restarting now", daemon->name);
+		daemon_timer_disarm(daemon);
+		daemon_spawn(daemon);
+		break;
+	case DAEMON_PARKED:
+		syslog(LOG_INFO, "daemon_start: '%s' is parked, clear it first", daemon->name);
+		break;
 	default:
 		abort();
 	}
@@ -253,23 +687,63 @@ daemon_start(struct daemon *daemon) {
 
 /**
  * Send the finish signal if DAEMON_STARTED, and set it to DAEMON_STOPPING.
+ * The process is killed if it didn't terminate within its stop timeout,
+ * right away if the timeout is zero.
+ * A start pending for a @ref daemon_restart is cancelled.
  * @param daemon Daemon to stop
  */
 void
 daemon_stop(struct daemon *daemon) {
 
+	if (daemon->pendingstart) {
+		syslog(LOG_INFO, "daemon_stop: '%s' pending start cancelled", daemon->name);
+		daemon->pendingstart = 0;
+	}
+
 	switch (daemon->state) {
 	case DAEMON_STARTED:
-		syslog(LOG_INFO, "daemon_stop: '%s' stopping with signal %d", daemon->name, daemon->conf.sigfinish);
-		kill(daemon->pid, daemon->conf.sigfinish);
+		if (daemon->replacing) {
+			daemon_timer_disarm(daemon);
+			daemon_replace_finish(daemon);
+		}
 		daemon->state = DAEMON_STOPPING;
+		status_page_update(daemon);
+		events_publish(PROTOCOL_EVENT_STOPPING, daemon, daemon->process.pid, NULL);
+		if (daemon->conf.stoptimeout == 0) {
+			syslog(LOG_INFO, "daemon_stop: '%s' stopping with signal %d", daemon->name, SIGKILL);
+			daemon_kill(daemon);
+			break;
+		}
+		syslog(LOG_INFO, "daemon_stop: '%s' stopping with signal %d", daemon->name, daemon->conf.sigfinish);
+		daemon_signal(&daemon->process, daemon->conf.sigfinish);
+		if (daemon_timer_arm(daemon, daemon->conf.stoptimeout) != 0) {
+			/* Without its stop timeout, the daemon could stop forever. */
+			syslog(LOG_WARNING, "daemon_stop: '%s' stop timeout unavailable, stopping with signal %d", daemon->name, SIGKILL);
+			daemon_kill(daemon);
+		}
 		break;
 	case DAEMON_STOPPED:
 		syslog(LOG_INFO, "daemon_stop: '%s' already stopped", daemon->name);
 		break;
+	case DAEMON_FAILED:
+		syslog(LOG_INFO, "daemon_stop: '%s' failed to start", daemon->name);
+		break;
+	case DAEMON_STARTING:
+		syslog(LOG_INFO, "daemon_stop: '%s' is starting", daemon->name);
+		break;
 	case DAEMON_STOPPING:
 		syslog(LOG_INFO, "daemon_stop: '%s' is stopping", daemon->name);
 		break;
+	case DAEMON_RESTARTING:
+		syslog(LOG_INFO, "daemon_stop: '%s' restart cancelled", daemon->name);
+		daemon_timer_disarm(daemon);
+		daemon->state = DAEMON_STOPPED;
+		daemon->restarts = 0;
+		status_page_update(daemon);
+		break;
+	case DAEMON_PARKED:
+		syslog(LOG_INFO, "daemon_stop: '%s' is parked", daemon->name);
+		break;
 	default:
 		abort();
 	}
@@ -285,21 +759,35 @@ daemon_reload(struct daemon *daemon) {
 	switch (daemon->state) {
 	case DAEMON_STARTED:
 		syslog(LOG_INFO, "daemon_reload: '%s' reloading with signal %d", daemon->name, daemon->conf.sigreload);
-		kill(daemon->pid, daemon->conf.sigreload);
+		daemon_signal(&daemon->process, daemon->conf.sigreload);
 		break;
 	case DAEMON_STOPPED:
 		syslog(LOG_INFO, "daemon_reload: '%s' is stopped", daemon->name);
 		break;
+	case DAEMON_FAILED:
+		syslog(LOG_INFO, "daemon_reload: '%s' failed to start", daemon->name);
+		break;
+	case DAEMON_STARTING:
+		syslog(LOG_INFO, "daemon_reload: '%s' is starting", daemon->name);
+		break;
 	case DAEMON_STOPPING:
 		syslog(LOG_INFO, "daemon_reload: '%s' is stopping", daemon->name);
 		break;
+	case DAEMON_RESTARTING:
+		syslog(LOG_INFO, "daemon_reload: '%s' is restarting", daemon->name);
+		break;
+	case DAEMON_PARKED:
+		syslog(LOG_INFO, "daemon_reload: '%s' is parked", daemon->name);
+		break;
 	default:
 		abort();
 	}
 }
 
 /**
- * Force kill of the process if not DAEMON_STOPPED
+ * Force kill of the process if not DAEMON_STOPPED.
+ * A process spawned by cyberd which didn't exec yet is killed too,
+ * the daemon is DAEMON_STARTED once its spawn ended, until it is reaped.
  * @param daemon Daemon to end
  */
 void
@@ -308,16 +796,279 @@ daemon_end(struct daemon *daemon) {
 	switch (daemon->state) {
 	case DAEMON_STARTED:
 		syslog(LOG_INFO, "daemon_end: '%s' was running, ending...", daemon->name);
+		if (daemon->replacing) {
+			daemon_timer_disarm(daemon);
+			daemon->replacing = 0;
+		}
 		break;
 	case DAEMON_STOPPED:
 		syslog(LOG_INFO, "daemon_end: '%s' is stopped", daemon->name);
 		return;
+	case DAEMON_FAILED:
+		syslog(LOG_INFO, "daemon_end: '%s' failed to start", daemon->name);
+		return;
+	case DAEMON_STARTING:
+		if (daemon->spawning.fd >= 0) {
+			syslog(LOG_INFO, "daemon_end: '%s' is starting, killing its process", daemon->name);
+			if (syscall(SYS_pidfd_send_signal, daemon->spawn.pidfd, SIGKILL, NULL, 0) != 0) {
+				syslog(LOG_ERR, "daemon_end: '%s' (pid: %d) signal %d: %m", daemon->name, daemon->spawn.pid, SIGKILL);
+			}
+		} else {
+			syslog(LOG_INFO, "daemon_end: '%s' is starting", daemon->name);
+		}
+		return;
 	case DAEMON_STOPPING:
 		syslog(LOG_INFO, "daemon_end: '%s' ending...", daemon->name);
 		break;
+	case DAEMON_RESTARTING:
+		syslog(LOG_INFO, "daemon_end: '%s' is restarting", daemon->name);
+		return;
+	case DAEMON_PARKED:
+		syslog(LOG_INFO, "daemon_end: '%s' is parked", daemon->name);
+		return;
 	default:
 		abort();
 	}
 
-	kill(daemon->pid, SIGKILL);
+	daemon_kill(daemon);
+}
+
+/**
+ * Stops a daemon and starts it again as soon as its process is reaped.
+ * A stopped daemon is started right away.
+ * @param daemon Daemon to restart
+ */
+void
+daemon_restart(struct daemon *daemon) {
+
+	switch (daemon->state) {
+	case DAEMON_STARTED:
+		daemon_stop(daemon);
+		[[fallthrough]];
+	case DAEMON_STOPPING:
+		syslog(LOG_INFO, "daemon_restart: '%s' start pending", daemon->name);
+		daemon->pendingstart = 1;
+		break;
+	case DAEMON_STOPPED: [[fallthrough]];
+	case DAEMON_FAILED: [[fallthrough]];
+	case DAEMON_RESTARTING: [[fallthrough]];
+	case DAEMON_PARKED:
+		daemon_start(daemon);
+		break;
+	case DAEMON_STARTING:
+		syslog(LOG_INFO, "daemon_restart: '%s' is starting", daemon->name);
+		break;
+	default:
+		abort();
+	}
+}
+
+/**
+ * Replaces the process of a started daemon without downtime. A new process is started
+ * alongside the current one, which is only stopped once the new one ran for the replace delay.
+ * If the new process fails to start, or terminates during the delay, the current one is kept.
+ * A daemon which isn't running is started.
+ * @param daemon Daemon to replace
+ * @returns Zero, -1 if the new process already failed, or the daemon failed to start.
+ */
+int
+daemon_replace(struct daemon *daemon) {
+
+	switch (daemon->state) {
+	case DAEMON_STARTED:
+		break;
+	case DAEMON_STOPPED: [[fallthrough]];
+	case DAEMON_FAILED: [[fallthrough]];
+	case DAEMON_RESTARTING: [[fallthrough]];
+	case DAEMON_PARKED:
+		daemon_start(daemon);
+		return daemon->state != DAEMON_FAILED ? 0 : -1;
+	case DAEMON_STARTING:
+		syslog(LOG_INFO, "daemon_replace: '%s' is starting", daemon->name);
+		return 0;
+	case DAEMON_STOPPING:
+		syslog(LOG_INFO, "daemon_replace: '%s' is stopping", daemon->name);
+		return 0;
+	default:
+		abort();
+	}
+
+	if (daemon->predecessor.pid > 0) {
+		syslog(LOG_INFO, "daemon_replace: '%s' is still replacing pid: %d", daemon->name, daemon->predecessor.pid);
+		return 0;
+	}
+
+	if (daemon->conf.zygote) {
+		syslog(LOG_INFO, "daemon_replace: '%s' is a zygote, it can't be replaced", daemon->name);
+		return 0;
+	}
+
+	syslog(LOG_INFO, "daemon_replace: '%s' replacing pid: %d", daemon->name, daemon->process.pid);
+	daemon_process_move(&daemon->process, &daemon->predecessor);
+	daemon->replacing = 1;
+
+	daemon_spawn(daemon);
+
+	/* An aborted replace gave the predecessor back. */
+	return daemon->predecessor.pid > 0 ? 0 : -1;
+}
+
+/**
+ * Clears the crash-loop detection and the restart delay of a daemon.
+ * A parked daemon is stopped, and can be started again.
+ * @param daemon Daemon to clear
+ */
+void
+daemon_clear(struct daemon *daemon) {
+
+	daemon->restarts = 0;
+	daemon->crashes = 0;
+
+	if (daemon->state == DAEMON_PARKED) {
+		syslog(LOG_INFO, "daemon_clear: '%s' unparked", daemon->name);
+		daemon->state = DAEMON_STOPPED;
+	} else {
+		syslog(LOG_INFO, "daemon_clear: '%s' cleared", daemon->name);
+	}
+
+	status_page_update(daemon);
+}
+
+/**
+ * Daemon spawned.
+ * Completes the start of a daemon once its process was spawned, by us, by a spawner or by a zygote.
+ * The process is watched through its pidfd in the socket switch, and recorded in spawns.
+ * If the process couldn't be created, or failed before its exec, the daemon is DAEMON_FAILED,
+ * and a process which failed its setup is reaped right away.
+ * @param daemon Daemon which was spawned.
+ * @param spawn Outcome of the spawn, ownership of its pidfd is taken.
+ * @param reaped Informations of the process if it was already reaped, _NULL_ else.
+ */
+void
+daemon_spawned(struct daemon *daemon, const struct process_spawn *spawn, const siginfo_t *reaped) {
+
+	if (spawn->pid < 0) {
+		syslog(LOG_ERR, "daemon_spawn: '%s': %s", daemon->name, strerror(spawn->errnum));
+		return daemon_spawn_failed(daemon);
+	}
+
+	if (spawn->errnum != 0) {
+		siginfo_t info;
+
+		/* The child already exited, or is about to, reap it right away. */
+		while (waitid(P_PIDFD, spawn->pidfd, &info, WEXITED | __WALL) != 0 && errno == EINTR);
+		close(spawn->pidfd);
+		syslog(LOG_ERR, "daemon_spawn: '%s' failed to %s: %s", daemon->name, process_step_name(spawn->step), strerror(spawn->errnum));
+		return daemon_spawn_failed(daemon);
+	}
+
+	daemon->process.pid = spawn->pid;
+	daemon->state = DAEMON_STARTED;
+	daemon->spawnns = spawn->ns;
+	clock_gettime(CLOCK_MONOTONIC, &daemon->startedat);
+	status_page_update(daemon);
+
+	syslog(LOG_INFO, "daemon_start: '%s' started with pid: %d in %"PRIu64"ns", daemon->name, daemon->process.pid, daemon->spawnns);
+	events_publish(PROTOCOL_EVENT_STARTED, daemon, daemon->process.pid, NULL);
+
+	if (reaped != NULL) {
+		/* Reaped before the spawner or zygote answered. */
+		if (spawn->pidfd >= 0) {
+			close(spawn->pidfd);
+		}
+		return daemon_reaped(daemon, reaped);
+	}
+
+	daemon_process_watch(&daemon->process, spawn->pidfd);
+	spawns_record(&daemon->process);
+
+	if (daemon->replacing && (daemon->conf.start.replacedelay == 0
+		|| daemon_timer_arm(daemon, daemon->conf.start.replacedelay) != 0)) {
+		daemon_replace_finish(daemon);
+	}
+}
+
+/**
+ * Daemon reaped.
+ * Stops watching its pidfd, logs informations about a reaped daemon,
+ * and starts the daemon again if a start is pending, see @ref daemon_restart,
+ * or restarts it if configured so, see @ref daemon_autorestart.
+ * During a replace, the termination of the predecessor completes it, and a new process
+ * terminating before its replace delay aborts it.
+ * @param daemon Daemon whose process was reaped, not recorded in spawns anymore.
+ * @param info Informations of the reaped process, from _waitid(2)_.
+ */
+void
+daemon_reaped(struct daemon *daemon, const siginfo_t *info) {
+
+	if (info->si_pid == daemon->predecessor.pid) {
+		struct timespec now;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		daemon->overlapms = daemon_elapsed(&daemon->startedat, &now);
+
+		daemon_process_unwatch(&daemon->predecessor);
+		daemon->predecessor.pid = -1;
+
+		syslog(LOG_INFO, "'%s' (pid: %d) replaced, overlap: %"PRIu64"ms", daemon->name, info->si_pid, daemon->overlapms);
+		events_publish(PROTOCOL_EVENT_REAPED, daemon, info->si_pid, info);
+
+		if (daemon->replacing) {
+			/* Terminated by itself before its replacement was ready. */
+			daemon_timer_disarm(daemon);
+			daemon->replacing = 0;
+		}
+		return;
+	}
+
+	daemon_process_unwatch(&daemon->process);
+
+	if (daemon->zygote != NULL) {
+		zygote_destroy(daemon->zygote);
+		daemon->zygote = NULL;
+	}
+
+	const bool stopping = daemon->state == DAEMON_STOPPING;
+	bool restart;
+
+	if (stopping) {
+		daemon_timer_disarm(daemon);
+		if (daemon->predecessor.pid > 0) {
+			/* Its stop timeout is gone with the timer. */
+			daemon_signal(&daemon->predecessor, SIGKILL);
+		}
+	}
+
+	daemon->state = DAEMON_STOPPED;
+	daemon->exitcode = info->si_code;
+	daemon->exitstatus = info->si_status;
+	status_page_update(daemon);
+	events_publish(PROTOCOL_EVENT_REAPED, daemon, info->si_pid, info);
+
+	switch (info->si_code) {
+	case CLD_EXITED:
+		syslog(LOG_INFO, "'%s' (pid: %d) terminated with exit status %d", daemon->name, info->si_pid, info->si_status);
+		restart = info->si_status == 0 ? daemon->conf.start.exitsuccess : daemon->conf.start.exitfailure;
+		break;
+	case CLD_KILLED:
+		syslog(LOG_INFO, "'%s' (pid: %d) killed by signal %d", daemon->name, info->si_pid, info->si_status);
+		restart = daemon->conf.start.killed;
+		break;
+	case CLD_DUMPED:
+		syslog(LOG_INFO, "'%s' (pid: %d) dumped core", daemon->name, info->si_pid);
+		restart = daemon->conf.start.dumped;
+		break;
+	default:
+		abort();
+	}
+
+	if (daemon->replacing) {
+		daemon_replace_abort(daemon);
+	} else if (daemon->pendingstart) {
+		daemon->pendingstart = 0;
+		daemon_start(daemon);
+	} else if (restart) {
+		/* Processes we stopped didn't fail, whatever their termination. */
+		daemon_autorestart(daemon, !stopping && (info->si_code != CLD_EXITED || info->si_status != 0));
+	}
 }
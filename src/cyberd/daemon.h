@@ -2,15 +2,36 @@
 #ifndef DAEMON_H
 #define DAEMON_H
 
-#include <sys/types.h> /* pid_t */
+#include <sys/types.h> /* pid_t, dev_t, ino_t, off_t */
+#include <stdint.h> /* uint64_t */
+#include <signal.h> /* siginfo_t */
+#include <time.h> /* struct timespec */
 
 #include "daemon_conf.h"
+#include "process.h"
+#include "socket_node.h"
+
+struct zygote;
 
 /** State of the daemon, ensures only one spawns for each daemon. */
 enum daemon_state {
 	DAEMON_STARTED,  /**< Has a pid, spawned. */
 	DAEMON_STOPPED,  /**< Was cleared, no process running. */
 	DAEMON_STOPPING, /**< Sent a signal to shut it, spawned. */
+	DAEMON_FAILED,   /**< Failed to setup or exec its process, no process running. */
+	DAEMON_STARTING, /**< Spawn requested to a spawner or a zygote, or its process not exec'd yet, no pid yet. */
+	DAEMON_RESTARTING, /**< Waiting for its automatic restart delay, no process running. */
+	DAEMON_PARKED,   /**< Crash-looping, not started until cleared, no process running. */
+};
+
+/**
+ * A process of a daemon. Recorded in spawns, indexed by its pid,
+ * and watched through its pidfd in the socket switch while running.
+ */
+struct daemon_process {
+	pid_t pid; /**< Pid of the process, index for spawns. */
+	struct socket_node node; /**< Holds the pidfd of the process, registered in the socket switch while running. */
+	struct daemon *daemon; /**< Daemon the process belongs to. */
 };
 
 /**
@@ -21,9 +42,33 @@ struct daemon {
 	enum daemon_state state; /**< Daemon's running state. */
 
 	char *name; /**< Daemon's name, index for configuration. */
-	pid_t pid;  /**< Daemon's pid if state == DAEMON_RUNNING, index for spawns. */
+	struct daemon_process process; /**< Daemon's process if spawned. */
+	struct daemon_process predecessor; /**< Process being replaced by @ref process, its pid is -1 if none. */
+	uint64_t spawnns; /**< Fork-to-exec time of the last successful spawn, in nanoseconds. */
+	uint64_t overlapms; /**< Time both processes ran during the last replace, in milliseconds. */
+	struct zygote *zygote; /**< Control of the process if it is a spawned zygote, _NULL_ else. */
+	struct socket_node timer; /**< Holds a timerfd while a delay is armed, registered in the socket switch meanwhile. */
+	struct socket_node spawning; /**< Holds the result pipe of a spawn begun by cyberd until it ended, registered in the socket switch meanwhile. */
+	struct process_spawn spawn; /**< Spawn begun by cyberd, meaningful while @ref spawning holds its pipe. */
+
+	int statusslot; /**< Slot of the daemon in the status page, -1 if not published. */
+	struct timespec startedat; /**< When the last successful spawn completed. */
+	int exitcode; /**< _si\_code_ of the last termination of its process, zero if none yet. */
+	int exitstatus; /**< _si\_status_ of the last termination of its process. */
+	unsigned int restarts; /**< Consecutive automatic restarts, doubling the restart delay. */
+	unsigned int crashes; /**< Failures counted in the current crash window. */
+	unsigned int pendingstart : 1; /**< Start the daemon as soon as its process is reaped. */
+	unsigned int replacing : 1; /**< The predecessor waits for the new process to run for its replace delay. */
+	struct timespec crashedat; /**< Beginning of the current crash window. */
 
 	struct daemon_conf conf; /**< Daemon's configuration. */
+	struct {
+		dev_t dev; /**< Device of the file. */
+		ino_t ino; /**< Inode of the file. */
+		off_t size; /**< Size of the file. */
+		struct timespec mtime; /**< Last modification of the file. */
+	} source; /**< Configuration file the configuration was parsed from, reloads skip it while unchanged. */
+	unsigned int generation; /**< Last configuration load or reload which found its configuration file. */
 };
 
 struct daemon *
@@ -44,5 +89,20 @@ daemon_reload(struct daemon *daemon);
 void
 daemon_end(struct daemon *daemon);
 
+void
+daemon_restart(struct daemon *daemon);
+
+int
+daemon_replace(struct daemon *daemon);
+
+void
+daemon_clear(struct daemon *daemon);
+
+void
+daemon_spawned(struct daemon *daemon, const struct process_spawn *spawn, const siginfo_t *reaped);
+
+void
+daemon_reaped(struct daemon *daemon, const siginfo_t *info);
+
 /* DAEMON_H */
 #endif
@@ -8,16 +8,33 @@
 #include <syslog.h> /* syslog */
 #include <alloca.h> /* alloca */
 #include <ctype.h> /* isspace, isdigit */
-#include <pwd.h> /* getpwnam */
-#include <grp.h> /* getgrnam */
-#include <errno.h> /* errno */
+#include <pwd.h> /* getpwnam_r */
+#include <grp.h> /* getgrnam_r */
+#include <errno.h> /* errno, ERANGE, ENOENT, ESRCH */
+#include <limits.h> /* INT_MAX, UINT_MAX */
+#include <sys/stat.h> /* stat, fstat */
+#include <unistd.h> /* read, sysconf */
 
 #ifndef NSIG
-#include <limits.h> /* INT_MAX */
 /* For platforms without NSIG, just avoid overflows on parsing. */
 #define NSIG INT_MAX
 #endif
 
+/**
+ * Size of the buffers of user and group database lookups, if the system doesn't suggest one.
+ * Lookups are reentrant, as configurations may be parsed concurrently during @ref configuration_load.
+ */
+#define DAEMON_CONF_DATABASE_BUFFER_SIZE 4096
+
+/** Maximum size the buffers of user and group database lookups grow to. */
+#define DAEMON_CONF_DATABASE_BUFFER_MAX 1048576
+
+/**
+ * Size of the stack buffer configuration files are read into,
+ * larger files are read into an allocated buffer.
+ */
+#define DAEMON_CONF_PARSE_BUFFER_SIZE 4096
+
 /** Helper macro to describe a signal. */
 #define SIGNAL_DESCRIPTION(desc) { SIG##desc, #desc }
 
@@ -28,6 +45,7 @@ struct daemon_conf_value {
 
 struct daemon_conf_section {
 	const struct daemon_conf_value * const values;
+	const struct daemon_conf_value * const any;
 	const char * const name;
 };
 
@@ -119,6 +137,32 @@ daemon_conf_path(const char *value, char **pathp) {
 	return 0;
 }
 
+/**
+ * Parses a positive integer value.
+ * @param value Associative value, _NULL_ if scalar.
+ * @param[out] integerp Parsed value.
+ * @returns Zero on success, -1 on error.
+ */
+static int
+daemon_conf_integer(const char *value, unsigned int *integerp) {
+	unsigned long integer;
+	char *end;
+
+	if (value == NULL || !isdigit(*value)) {
+		return -1;
+	}
+
+	errno = 0;
+	integer = strtoul(value, &end, 10);
+	if (*end != '\0' || errno != 0 || integer > UINT_MAX) {
+		return -1;
+	}
+
+	*integerp = integer;
+
+	return 0;
+}
+
 /**
  * Resolves a signal name to a signal number.
  * @param signame Signal name description.
@@ -305,34 +349,94 @@ failure:
 	return -1;
 }
 
+/**
+ * Allocates, or grows, the buffer of a user or group database lookup.
+ * The first buffer has the size suggested by _sysconf(3)_, it is then doubled
+ * each time the lookup fails with ERANGE, up to @ref DAEMON_CONF_DATABASE_BUFFER_MAX.
+ * @param bufferp Buffer, _NULL_ before the first lookup, freed on error.
+ * @param sizep Size of the buffer, zero before the first lookup.
+ * @param suggested _sysconf(3)_ name of the suggested size.
+ * @returns Zero on success, -1 on error.
+ */
+static int
+daemon_conf_database_buffer(char **bufferp, size_t *sizep, int suggested) {
+	size_t size;
+
+	if (*sizep == 0) {
+		const long lsize = sysconf(suggested);
+		size = lsize > 0 ? (size_t)lsize : DAEMON_CONF_DATABASE_BUFFER_SIZE;
+	} else if (*sizep < DAEMON_CONF_DATABASE_BUFFER_MAX) {
+		size = *sizep * 2;
+	} else {
+		goto realloc_failure;
+	}
+
+	char * const buffer = realloc(*bufferp, size);
+	if (buffer == NULL) {
+		goto realloc_failure;
+	}
+
+	*bufferp = buffer;
+	*sizep = size;
+
+	return 0;
+realloc_failure:
+	free(*bufferp);
+	*bufferp = NULL;
+	return -1;
+}
+
+/**
+ * Checks whether a user or group database lookup found nothing, see _getpwnam\_r(3)_.
+ * @param error Error of a lookup without result.
+ * @returns Whether no entry exists, false if the lookup failed.
+ */
+static inline bool
+daemon_conf_database_missing(int error) {
+	return error == 0 || error == ENOENT || error == ESRCH;
+}
+
 static int
 daemon_conf_parse_general_group(struct daemon_conf *conf, const char *key, const char *value) {
-	struct group *group;
+	struct group entry, *group;
+	char *buffer = NULL;
+	size_t size = 0;
+	int error;
 
 	if (value == NULL) {
 		return -1;
 	}
 
-	errno = 0;
-	group = getgrnam(value);
+	do {
+		if (daemon_conf_database_buffer(&buffer, &size, _SC_GETGR_R_SIZE_MAX) != 0) {
+			return -1;
+		}
+		error = getgrnam_r(value, &entry, buffer, size, &group);
+	} while (error == ERANGE);
 
 	if (group != NULL) {
 		conf->gid = group->gr_gid;
+		free(buffer);
 		return 0;
 	}
 
-	if (errno == 0) {
-		/* No entry found, treat as decimal gid. */
-		char *end;
-		const unsigned long lgid = strtoul(value, &end, 10);
+	free(buffer);
 
-		if (*end != '\0' || lgid > CONFIG_DAEMON_CONF_MAX_GID) {
-			return -1;
-		}
+	if (!daemon_conf_database_missing(error)) {
+		syslog(LOG_ERR, "daemon_conf: getgrnam_r '%s': %s", value, strerror(error));
+		return -1;
+	}
 
-		conf->gid = (gid_t)lgid;
+	/* No entry found, treat as decimal gid. */
+	char *end;
+	const unsigned long lgid = strtoul(value, &end, 10);
+
+	if (*end != '\0' || lgid > CONFIG_DAEMON_CONF_MAX_GID) {
+		return -1;
 	}
 
+	conf->gid = (gid_t)lgid;
+
 	return 0;
 }
 
@@ -396,6 +500,49 @@ daemon_conf_parse_general_stderr(struct daemon_conf *conf, const char *key, cons
 	return daemon_conf_path(value, &conf->err);
 }
 
+static int
+daemon_conf_parse_general_stoptimeout(struct daemon_conf *conf, const char *key, const char *value) {
+	return daemon_conf_integer(value, &conf->stoptimeout);
+}
+
+static int
+daemon_conf_parse_general_tag(struct daemon_conf *conf, const char *key, const char *value) {
+	char *tag;
+
+	if (value == NULL || *value == '\0') {
+		return -1;
+	}
+
+	tag = strdup(value);
+	if (tag == NULL) {
+		return -1;
+	}
+
+	free(conf->tag);
+	conf->tag = tag;
+
+	return 0;
+}
+
+static int
+daemon_conf_parse_general_template(struct daemon_conf *conf, const char *key, const char *value) {
+	char *template;
+
+	if (value == NULL || *value == '\0' || strchr(value, '/') != NULL) {
+		return -1;
+	}
+
+	template = strdup(value);
+	if (template == NULL) {
+		return -1;
+	}
+
+	free(conf->template);
+	conf->template = template;
+
+	return 0;
+}
+
 static int
 daemon_conf_parse_general_umask(struct daemon_conf *conf, const char *key, const char *value) {
 	unsigned long cmask;
@@ -417,32 +564,45 @@ daemon_conf_parse_general_umask(struct daemon_conf *conf, const char *key, const
 
 static int
 daemon_conf_parse_general_user(struct daemon_conf *conf, const char *key, const char *value) {
-	struct passwd *passwd;
+	struct passwd entry, *passwd;
+	char *buffer = NULL;
+	size_t size = 0;
+	int error;
 
 	if (value == NULL) {
 		return -1;
 	}
 
-	errno = 0;
-	passwd = getpwnam(value);
+	do {
+		if (daemon_conf_database_buffer(&buffer, &size, _SC_GETPW_R_SIZE_MAX) != 0) {
+			return -1;
+		}
+		error = getpwnam_r(value, &entry, buffer, size, &passwd);
+	} while (error == ERANGE);
 
 	if (passwd != NULL) {
 		conf->uid = passwd->pw_uid;
+		free(buffer);
 		return 0;
 	}
 
-	if (errno == 0) {
-		/* No entry found, treat as decimal uid. */
-		char *end;
-		const unsigned long luid = strtoul(value, &end, 10);
+	free(buffer);
 
-		if (*end != '\0' || luid > CONFIG_DAEMON_CONF_MAX_UID) {
-			return -1;
-		}
+	if (!daemon_conf_database_missing(error)) {
+		syslog(LOG_ERR, "daemon_conf: getpwnam_r '%s': %s", value, strerror(error));
+		return -1;
+	}
 
-		conf->uid = (uid_t)luid;
+	/* No entry found, treat as decimal uid. */
+	char *end;
+	const unsigned long luid = strtoul(value, &end, 10);
+
+	if (*end != '\0' || luid > CONFIG_DAEMON_CONF_MAX_UID) {
+		return -1;
 	}
 
+	conf->uid = (uid_t)luid;
+
 	return 0;
 }
 
@@ -451,6 +611,17 @@ daemon_conf_parse_general_workdir(struct daemon_conf *conf, const char *key, con
 	return daemon_conf_path(value, &conf->workdir);
 }
 
+static int
+daemon_conf_parse_general_zygote(struct daemon_conf *conf, const char *key, const char *value) {
+
+	if (value != NULL) {
+		return -1;
+	}
+	conf->zygote = 1;
+
+	return 0;
+}
+
 /*****************************
  * Parse environment section *
  *****************************/
@@ -503,6 +674,31 @@ daemon_conf_parse_start_any_exit(struct daemon_conf *conf, const char *key, cons
 	return 0;
 }
 
+static int
+daemon_conf_parse_start_crash_loop(struct daemon_conf *conf, const char *key, const char *value) {
+	return daemon_conf_integer(value, &conf->start.crashcount);
+}
+
+static int
+daemon_conf_parse_start_crash_window(struct daemon_conf *conf, const char *key, const char *value) {
+	return daemon_conf_integer(value, &conf->start.crashwindow);
+}
+
+static int
+daemon_conf_parse_start_delay(struct daemon_conf *conf, const char *key, const char *value) {
+	return daemon_conf_integer(value, &conf->start.delay);
+}
+
+static int
+daemon_conf_parse_start_delay_max(struct daemon_conf *conf, const char *key, const char *value) {
+	return daemon_conf_integer(value, &conf->start.delaymax);
+}
+
+static int
+daemon_conf_parse_start_replace_delay(struct daemon_conf *conf, const char *key, const char *value) {
+	return daemon_conf_integer(value, &conf->start.replacedelay);
+}
+
 static int
 daemon_conf_parse_start_dumped(struct daemon_conf *conf, const char *key, const char *value) {
 
@@ -599,13 +795,18 @@ daemon_conf_init(struct daemon_conf *conf) {
 	conf->in = NULL;
 	conf->out = NULL;
 	conf->err = NULL;
+	conf->template = NULL;
+	conf->tag = NULL;
 
 	conf->sigfinish = SIGTERM;
 	conf->sigreload = SIGHUP;
+	conf->stoptimeout = CONFIG_DAEMON_CONF_STOP_TIMEOUT;
 
 	conf->uid = 0;
 	conf->gid = 0;
 	conf->nosid = 0;
+	conf->zygote = 0;
+	conf->mapped = 0;
 
 	conf->umask = CONFIG_DAEMON_CONF_DEFAULT_UMASK;
 	conf->priority = 0;
@@ -616,90 +817,187 @@ daemon_conf_init(struct daemon_conf *conf) {
 	conf->start.exitfailure = 0;
 	conf->start.killed = 0;
 	conf->start.dumped = 0;
+	conf->start.delay = CONFIG_DAEMON_CONF_RESTART_DELAY;
+	conf->start.delaymax = CONFIG_DAEMON_CONF_RESTART_DELAY_MAX;
+	conf->start.crashcount = CONFIG_DAEMON_CONF_CRASH_LOOP_COUNT;
+	conf->start.crashwindow = CONFIG_DAEMON_CONF_CRASH_LOOP_WINDOW;
+	conf->start.replacedelay = CONFIG_DAEMON_CONF_REPLACE_DELAY;
 }
 
 /**
  * Deinitializes a configuration, freeing all used data.
+ * Configurations mapped from a snapshot own nothing.
  * @param conf Configuration to deinitialize.
  */
 void
 daemon_conf_deinit(struct daemon_conf *conf) {
+
+	if (conf->mapped) {
+		return;
+	}
+
 	free(conf->path);
 	free(conf->workdir);
+	free(conf->in);
+	free(conf->out);
+	free(conf->err);
+	free(conf->template);
+	free(conf->tag);
 	daemon_conf_list_free(conf->arguments);
 	daemon_conf_list_free(conf->environment);
 }
 
+/**************************
+ * Daemon conf spawn plan *
+ **************************/
+
+/**
+ * Checks a file exists and is of the expected type, logs if not.
+ * Only a diagnostic, the file may still be provided by a later mount.
+ * @param name Name of the daemon.
+ * @param path Path of the file.
+ * @param what Description of the file in logs.
+ * @param executable Whether the file must be an executable regular file.
+ */
+static void
+daemon_conf_prepare_check(const char *name, const char *path, const char *what, bool executable) {
+	struct stat st;
+
+	if (stat(path, &st) != 0) {
+		syslog(LOG_WARNING, "daemon_conf: '%s' %s '%s': %m", name, what, path);
+	} else if (executable && (!S_ISREG(st.st_mode) || (st.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH)) == 0)) {
+		syslog(LOG_WARNING, "daemon_conf: '%s' %s '%s' is not an executable file", name, what, path);
+	}
+}
+
+/**
+ * Checks the executable and standard streams of a spawn plan, logs those missing.
+ * Done when the configuration is loaded, be it parsed or mapped from a snapshot.
+ * @param conf Spawn plan.
+ * @param name Name of the daemon.
+ */
+void
+daemon_conf_check(const struct daemon_conf *conf, const char *name) {
+
+	if (conf->template == NULL) {
+		daemon_conf_prepare_check(name, conf->path, "executable", true);
+	}
+	daemon_conf_prepare_check(name, conf->in, "stdin", false);
+	daemon_conf_prepare_check(name, conf->out, "stdout", false);
+	if (conf->err != NULL) {
+		daemon_conf_prepare_check(name, conf->err, "stderr", false);
+	}
+}
+
+/**
+ * Compiles a parsed configuration into a spawn plan.
+ * All defaults are resolved once here, so spawning a daemon
+ * only replays a fixed sequence of system calls without allocating.
+ * Executable and standard streams are checked, so errors are reported at load time.
+ * @param conf Parsed configuration.
+ * @param name Name of the daemon, default first argument.
+ * @returns Zero on success, non-zero on allocation failure.
+ */
+static int
+daemon_conf_prepare(struct daemon_conf *conf, const char *name) {
+
+	if (conf->arguments == NULL && daemon_conf_list_append(&conf->arguments, name) != 0) {
+		return -1;
+	}
+
+	if (conf->environment == NULL) {
+		conf->environment = calloc(1, sizeof (*conf->environment));
+		if (conf->environment == NULL) {
+			return -1;
+		}
+	}
+
+	if (conf->workdir == NULL && daemon_conf_path(CONFIG_DAEMON_DEFAULT_WORKDIR, &conf->workdir) != 0) {
+		return -1;
+	}
+
+	if (conf->in == NULL && daemon_conf_path(CONFIG_DAEMON_DEV_NULL, &conf->in) != 0) {
+		return -1;
+	}
+
+	if (conf->out == NULL && daemon_conf_path(CONFIG_DAEMON_DEV_NULL, &conf->out) != 0) {
+		return -1;
+	}
+
+	daemon_conf_check(conf, name);
+
+	return 0;
+}
+
 /***********************
  * Daemon conf parsing *
  ***********************/
 
 /**
- * Trim and parse a configuration line.
- * @param line Line to trim and parse.
- * @param length Length of @p line.
+ * Trim and parse a configuration line in place, without copying it.
+ * @param line Line to trim and parse, without its line feed.
+ * @param length Length of @p line, the byte following it is overwritten.
  * @param[out] keyp Parsed section name or key if associative value, whole value if scalar value.
+ * @param[out] keylenp Length of @p keyp.
  * @param[out] valuep Parsed value if associative value, _NULL_ else.
  * @returns Zero on section start, non-zero if value.
  */
 static int
-daemon_conf_parse_line(char *line, size_t length, const char **keyp, const char **valuep) {
+daemon_conf_parse_line(char *line, size_t length, const char **keyp, size_t *keylenp, const char **valuep) {
 
-	{ /* Trimming and comment exclusion. */
-		/* Shorten up to the comment if there is one. */
-		const char * const comment = strchr(line, '#');
-		if (comment != NULL) {
-			length = comment - line;
-		}
-
-		/* Trim the beginning. */
-		while (isspace(*line)) {
-			length--;
-			line++;
-		}
+	/* Shorten up to the comment if there is one. */
+	const char * const comment = memchr(line, '#', length);
+	if (comment != NULL) {
+		length = comment - line;
+	}
 
-		/* Trim the end. */
-		while (isspace(line[length - 1])) {
-			length--;
-		}
+	/* Trim the beginning and the end. */
+	while (length != 0 && isspace(*line)) {
+		length--;
+		line++;
+	}
 
-		/* If there wasn't anything to end-trim, no problem,
-		 * we are just replacing the previous nul delimiter. */
-		line[length] = '\0';
+	while (length != 0 && isspace(line[length - 1])) {
+		length--;
 	}
 
-	if (*line == '[' && line[length - 1] == ']') { /* Section delimiter. */
-		/* Trim begnning of section name. */
-		do {
+	line[length] = '\0';
+
+	if (length >= 2 && *line == '[' && line[length - 1] == ']') { /* Section delimiter. */
+		/* Trim section name. */
+		length -= 2;
+		line++;
+
+		while (length != 0 && isspace(*line)) {
 			length--;
 			line++;
-		} while (isspace(*line));
+		}
 
-		/* Trim end of section name. */
-		do {
+		while (length != 0 && isspace(line[length - 1])) {
 			length--;
-		} while (isspace(line[length - 1]));
+		}
 		line[length] = '\0';
 
 		*keyp = line;
+		*keylenp = length;
 
 		return 0;
 	} else { /* Scalar or associative value. */
 		/* Assign to key. */
 		*keyp = line;
+		*keylenp = length;
 
 		/* Assign to value. */
-		char *separator = strchr(line, '=');
+		char *separator = memchr(line, '=', length);
 		if (separator != NULL) {
-			char *preseparator = separator - 1;
+			char *keyend = separator;
 
 			/* Trim the end of key. */
-			if (preseparator != line) {
-				while (isspace(*preseparator)) {
-					preseparator--;
-				}
+			while (keyend != line && isspace(keyend[-1])) {
+				keyend--;
 			}
-			preseparator[1] = '\0';
+			*keyend = '\0';
+			*keylenp = keyend - line;
 
 			/* Trim the beginning of value. */
 			do {
@@ -712,108 +1010,237 @@ daemon_conf_parse_line(char *line, size_t length, const char **keyp, const char
 	}
 }
 
-static const struct daemon_conf_value general_values[] = {
-	{ daemon_conf_parse_general_arguments, "arguments" },
-	{ daemon_conf_parse_general_group,     "group" },
-	{ daemon_conf_parse_general_nosid,     "nosid" },
-	{ daemon_conf_parse_general_path,      "path" },
-	{ daemon_conf_parse_general_priority,  "priority" },
-	{ daemon_conf_parse_general_sigfinish, "sigfinish" },
-	{ daemon_conf_parse_general_sigreload, "sigreload" },
-	{ daemon_conf_parse_general_stdin,     "stdin" },
-	{ daemon_conf_parse_general_stdout,    "stdout" },
-	{ daemon_conf_parse_general_stderr,    "stderr" },
-	{ daemon_conf_parse_general_umask,     "umask" },
-	{ daemon_conf_parse_general_user,      "user" },
-	{ daemon_conf_parse_general_workdir,   "workdir" },
-	{ },
+/**
+ * Number of entries of a section's values table, a power of two.
+ */
+#define DAEMON_CONF_HASH_SIZE 64
+
+/**
+ * Perfect hash of the keys of a section, values are indexed by it.
+ * Computed from a key's length and its first and last characters,
+ * so tables are laid out at compile time with designated initializers.
+ * No two keys of a section share a hash, a new key may require changing it.
+ */
+#define DAEMON_CONF_HASH(length, first, last) (((length) + 6 * ((first) + (last))) & (DAEMON_CONF_HASH_SIZE - 1))
+
+static const struct daemon_conf_value general_values[DAEMON_CONF_HASH_SIZE] = {
+	[DAEMON_CONF_HASH(9, 'a', 's')]  = { daemon_conf_parse_general_arguments, "arguments" },
+	[DAEMON_CONF_HASH(5, 'g', 'p')]  = { daemon_conf_parse_general_group,     "group" },
+	[DAEMON_CONF_HASH(5, 'n', 'd')]  = { daemon_conf_parse_general_nosid,     "nosid" },
+	[DAEMON_CONF_HASH(4, 'p', 'h')]  = { daemon_conf_parse_general_path,      "path" },
+	[DAEMON_CONF_HASH(8, 'p', 'y')]  = { daemon_conf_parse_general_priority,  "priority" },
+	[DAEMON_CONF_HASH(9, 's', 'h')]  = { daemon_conf_parse_general_sigfinish, "sigfinish" },
+	[DAEMON_CONF_HASH(9, 's', 'd')]  = { daemon_conf_parse_general_sigreload, "sigreload" },
+	[DAEMON_CONF_HASH(5, 's', 'n')]  = { daemon_conf_parse_general_stdin,     "stdin" },
+	[DAEMON_CONF_HASH(6, 's', 't')]  = { daemon_conf_parse_general_stdout,    "stdout" },
+	[DAEMON_CONF_HASH(6, 's', 'r')]  = { daemon_conf_parse_general_stderr,    "stderr" },
+	[DAEMON_CONF_HASH(11, 's', 't')] = { daemon_conf_parse_general_stoptimeout, "stoptimeout" },
+	[DAEMON_CONF_HASH(3, 't', 'g')]  = { daemon_conf_parse_general_tag,       "tag" },
+	[DAEMON_CONF_HASH(8, 't', 'e')]  = { daemon_conf_parse_general_template,  "template" },
+	[DAEMON_CONF_HASH(5, 'u', 'k')]  = { daemon_conf_parse_general_umask,     "umask" },
+	[DAEMON_CONF_HASH(4, 'u', 'r')]  = { daemon_conf_parse_general_user,      "user" },
+	[DAEMON_CONF_HASH(7, 'w', 'r')]  = { daemon_conf_parse_general_workdir,   "workdir" },
+	[DAEMON_CONF_HASH(6, 'z', 'e')]  = { daemon_conf_parse_general_zygote,    "zygote" },
 };
 
 static const struct daemon_conf_value environment_values[] = {
-	{ daemon_conf_parse_environment },
+	{ daemon_conf_parse_environment, NULL },
 };
 
-static const struct daemon_conf_value start_values[] = {
-	{ daemon_conf_parse_start_any_exit,     "any exit" },
-	{ daemon_conf_parse_start_dumped,       "dumped" },
-	{ daemon_conf_parse_start_exit,         "exit" },
-	{ daemon_conf_parse_start_exit_failure, "exit failure" },
-	{ daemon_conf_parse_start_exit_success, "exit success" },
-	{ daemon_conf_parse_start_killed,       "killed" },
-	{ daemon_conf_parse_start_load,         "load" },
-	{ daemon_conf_parse_start_reload,       "reload" },
-	{ },
+static const struct daemon_conf_value start_values[DAEMON_CONF_HASH_SIZE] = {
+	[DAEMON_CONF_HASH(8, 'a', 't')]  = { daemon_conf_parse_start_any_exit,     "any exit" },
+	[DAEMON_CONF_HASH(10, 'c', 'p')] = { daemon_conf_parse_start_crash_loop,   "crash loop" },
+	[DAEMON_CONF_HASH(12, 'c', 'w')] = { daemon_conf_parse_start_crash_window, "crash window" },
+	[DAEMON_CONF_HASH(5, 'd', 'y')]  = { daemon_conf_parse_start_delay,        "delay" },
+	[DAEMON_CONF_HASH(9, 'd', 'x')]  = { daemon_conf_parse_start_delay_max,    "delay max" },
+	[DAEMON_CONF_HASH(6, 'd', 'd')]  = { daemon_conf_parse_start_dumped,       "dumped" },
+	[DAEMON_CONF_HASH(4, 'e', 't')]  = { daemon_conf_parse_start_exit,         "exit" },
+	[DAEMON_CONF_HASH(12, 'e', 'e')] = { daemon_conf_parse_start_exit_failure, "exit failure" },
+	[DAEMON_CONF_HASH(12, 'e', 's')] = { daemon_conf_parse_start_exit_success, "exit success" },
+	[DAEMON_CONF_HASH(6, 'k', 'd')]  = { daemon_conf_parse_start_killed,       "killed" },
+	[DAEMON_CONF_HASH(4, 'l', 'd')]  = { daemon_conf_parse_start_load,         "load" },
+	[DAEMON_CONF_HASH(6, 'r', 'd')]  = { daemon_conf_parse_start_reload,       "reload" },
+	[DAEMON_CONF_HASH(13, 'r', 'y')] = { daemon_conf_parse_start_replace_delay, "replace delay" },
 };
 
 /**
- * Sections and values descriptions, each section group
- * defines a list of matching parsers for each key,
- * the last entry of each list is a 'match-all' entry with a NULL key.
- * Function parsers are optional, and can receive both scalars and associatives values,
+ * Sections and values descriptions, each section
+ * defines a table of parsers for its keys, indexed by @ref DAEMON_CONF_HASH,
+ * and an optional 'match-all' entry with a NULL key, for keys absent from its table.
+ * Function parsers can receive both scalars and associatives values,
  * depending on whether the given value parameter is NULL.
  */
 static const struct daemon_conf_section sections[] = {
-	{ general_values,     "general" }, /* First one is defaut, begin in general section. */
-	{ environment_values, "environment" },
-	{ start_values,       "start" },
+	{ general_values, NULL,               "general" }, /* First one is defaut, begin in general section. */
+	{ NULL,           environment_values, "environment" },
+	{ start_values,   NULL,               "start" },
 };
 
 /**
- * Tries parsing a daemon_conf from a file.
- * @param conf Configuration to parse.
- * @param filep File to read and parse from.
- * @return Zero on success, non-zero on failure.
+ * Finds the parser of a key.
+ * @param section Current section.
+ * @param key Key, not empty.
+ * @param keylen Length of @p key.
+ * @returns The key's parser, _NULL_ if the key is ignored.
  */
-int
-daemon_conf_parse(struct daemon_conf *conf, FILE *filep) {
-	const struct daemon_conf_section *section = sections;
-	char *line = NULL;
-	size_t n = 0;
+static const struct daemon_conf_value *
+daemon_conf_parser(const struct daemon_conf_section *section, const char *key, size_t keylen) {
 
-	ssize_t length;
-	while (length = getline(&line, &n, filep), length >= 0) {
-		const char *key, *value;
-		int i;
+	if (section->values != NULL) {
+		const struct daemon_conf_value * const value = section->values
+			+ DAEMON_CONF_HASH(keylen, (unsigned char)*key, (unsigned char)key[keylen - 1]);
 
-		if (daemon_conf_parse_line(line, length, &key, &value) == 0) {
-			/* Section specifier. */
+		if (value->key != NULL && strcmp(value->key, key) == 0) {
+			return value;
+		}
+	}
 
-			i = 0;
-			while (i < sizeof (sections) / sizeof (*sections) && strcmp(sections[i].name, key) != 0) {
-				i++;
-			}
+	return section->any;
+}
 
-			if (i < sizeof (sections) / sizeof (*sections)) {
-				section = sections + i;
-			} else {
-				section = NULL;
-			}
-			continue;
+/**
+ * Parses a configuration line, and applies it.
+ * @param conf Configuration to parse.
+ * @param[in,out] sectionp Current section, _NULL_ if invalid.
+ * @param line Line, without its line feed.
+ * @param length Length of @p line, the byte following it is overwritten.
+ */
+static void
+daemon_conf_parse_entry(struct daemon_conf *conf, const struct daemon_conf_section **sectionp, char *line, size_t length) {
+	const struct daemon_conf_section *section = *sectionp;
+	const char *key, *value;
+	size_t keylen;
+
+	if (daemon_conf_parse_line(line, length, &key, &keylen, &value) == 0) {
+		/* Section specifier. */
+		size_t i = 0;
+
+		while (i < sizeof (sections) / sizeof (*sections) && strcmp(sections[i].name, key) != 0) {
+			i++;
 		}
 
-		/* Skip if section is not valid,
-		 * or if the key is an empty one. */
-		if (section == NULL || *key == '\0') {
-			continue;
+		if (i < sizeof (sections) / sizeof (*sections)) {
+			*sectionp = sections + i;
+		} else {
+			*sectionp = NULL;
 		}
+		return;
+	}
 
-		i = 0;
-		while (section->values[i].key != NULL && strcmp(section->values[i].key, key) != 0) {
-			i++;
+	/* Skip if section is not valid,
+	 * or if the key is an empty one. */
+	if (section == NULL || keylen == 0) {
+		return;
+	}
+
+	const struct daemon_conf_value * const parser = daemon_conf_parser(section, key, keylen);
+	if (parser != NULL && parser->parse(conf, key, value) != 0) {
+		syslog(LOG_ERR, "daemon_conf: Error while parsing key '%s' of section '%s' for value '%s'", key, section->name, value);
+	}
+}
+
+/**
+ * Reads a configuration file entirely, and parses its lines. The file is read at once,
+ * lines are found with _memchr(3)_ and parsed in place, terminated where their line feed was.
+ * @param conf Configuration to parse.
+ * @param fd Configuration file.
+ * @returns Zero on success, -1 if the file couldn't be read.
+ */
+static int
+daemon_conf_parse_file(struct daemon_conf *conf, int fd) {
+	const struct daemon_conf_section *section = sections;
+	char small[DAEMON_CONF_PARSE_BUFFER_SIZE];
+	struct stat st;
+
+	if (fstat(fd, &st) != 0) {
+		syslog(LOG_ERR, "daemon_conf: fstat: %m");
+		goto fstat_failure;
+	}
+
+	/* One more byte to terminate the last line. */
+	const size_t capacity = st.st_size + 1;
+	char * const buffer = capacity <= sizeof (small) ? small : malloc(capacity);
+	if (buffer == NULL) {
+		syslog(LOG_ERR, "daemon_conf: malloc: %m");
+		goto fstat_failure;
+	}
+
+	size_t size = 0;
+	ssize_t readval;
+	while (readval = read(fd, buffer + size, capacity - 1 - size), readval != 0) {
+		if (readval < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			syslog(LOG_ERR, "daemon_conf: read: %m");
+			goto read_failure;
 		}
 
-		if (section->values[i].parse != NULL
-			&& section->values[i].parse(conf, key, value) != 0) {
-			syslog(LOG_ERR, "daemon_conf: Error while parsing key '%s' of section '%s' for value '%s'", key, section->name, value);
+		size += readval;
+		if (size == capacity - 1) {
+			break;
 		}
 	}
 
-	free(line);
+	char *line = buffer, *feed;
+	const char * const end = buffer + size;
+
+	while (feed = memchr(line, '\n', end - line), feed != NULL) {
+		daemon_conf_parse_entry(conf, &section, line, feed - line);
+		line = feed + 1;
+	}
+
+	if (line != end) {
+		/* Last line without line feed. */
+		daemon_conf_parse_entry(conf, &section, line, end - line);
+	}
+
+	if (buffer != small) {
+		free(buffer);
+	}
+
+	return 0;
+read_failure:
+	if (buffer != small) {
+		free(buffer);
+	}
+fstat_failure:
+	return -1;
+}
+
+/**
+ * Tries parsing a daemon_conf from a file, and compiles its spawn plan.
+ * @param conf Configuration to parse.
+ * @param name Name of the daemon.
+ * @param fd File to read and parse from.
+ * @return Zero on success, non-zero on failure.
+ */
+int
+daemon_conf_parse(struct daemon_conf *conf, const char *name, int fd) {
+
+	if (daemon_conf_parse_file(conf, fd) != 0) {
+		return -1;
+	}
 
-	if (conf->path == NULL) {
+	if (conf->path == NULL && conf->template == NULL) {
 		syslog(LOG_ERR, "daemon_conf: Missing binary executable path");
 		return -1;
 	}
 
+	if (conf->start.delay > conf->start.delaymax) {
+		syslog(LOG_WARNING, "daemon_conf: '%s' restart delay is greater than its maximum", name);
+		conf->start.delay = conf->start.delaymax;
+	}
+
+	if (conf->zygote && conf->template != NULL) {
+		syslog(LOG_ERR, "daemon_conf: A zygote can't be started from a template");
+		return -1;
+	}
+
+	if (daemon_conf_prepare(conf, name) != 0) {
+		syslog(LOG_ERR, "daemon_conf: Unable to prepare spawn plan");
+		return -1;
+	}
+
 	return 0;
 }
@@ -2,25 +2,33 @@
 #ifndef DAEMON_CONF_H
 #define DAEMON_CONF_H
 
-#include <stdio.h> /* FILE */
 #include <sys/types.h> /* uid_t, gid_t, mask_t */
 
-/** Structure which contains configurations for a daemon */
+/**
+ * Structure which contains configurations for a daemon.
+ * Once successfully parsed, it is also the spawn plan of the daemon:
+ * every field used when spawning has its default resolved.
+ */
 struct daemon_conf {
-	char *path; /**< Path of the executable file */
-	char **arguments; /**< Command line arguments, including process name */
-	char **environment; /**< Command line environment variables */
+	char *path; /**< Path of the executable file, unused if started from a template */
+	char **arguments; /**< Command line arguments, including process name, defaults to the daemon's name */
+	char **environment; /**< Command line environment variables, defaults to an empty list */
 	char *workdir; /**< Working directory of the process */
 	char *in; /**< Standard input of the process */
 	char *out; /**< Standard output of the process */
-	char *err; /**< Standard error of the process */
+	char *err; /**< Standard error of the process, _NULL_ to share standard output */
+	char *template; /**< Name of the zygote daemon forking the process, _NULL_ to exec path */
+	char *tag; /**< Tag selecting the daemon in bulk commands, _NULL_ if none */
 
 	int sigfinish; /**< Signal used to terminate the process, default SIGTERM */
 	int sigreload; /**< Signal used to reload the process configuration, default SIGHUP */
+	unsigned int stoptimeout; /**< Time given to the process to terminate once stopped before it is killed, in milliseconds, zero kills it right away */
 
 	uid_t uid; /**< User-id the process wil be executed with */
 	gid_t gid; /**< Group-id the process will be executed with */
 	unsigned int nosid : 1; /**< Do not setsid when the process is forked */
+	unsigned int zygote : 1; /**< The process is a zygote, given a control socket to fork templated daemons */
+	unsigned int mapped : 1; /**< Strings and lists are mapped from a configuration snapshot, and never freed */
 
 	mode_t umask; /**< umask of the daemon */
 	int priority; /**< Scheduling priority of the daemon */
@@ -32,7 +40,12 @@ struct daemon_conf {
 		unsigned int exitfailure : 1; /**< Must be started when it stopped unsuccessfully */
 		unsigned int killed : 1;      /**< Must be started when it was stopped by a signal */
 		unsigned int dumped : 1;      /**< Must be started when it dumped core */
-	} start; /**< Bitmask holding when a daemon wants to be started */
+		unsigned int delay;       /**< First automatic restart delay, in milliseconds, doubled for each consecutive restart */
+		unsigned int delaymax;    /**< Maximum automatic restart delay, in milliseconds, also the run time resetting the delay */
+		unsigned int crashcount;  /**< Failures within crashwindow parking the daemon, zero to never park it */
+		unsigned int crashwindow; /**< Window of the crash-loop detection, in seconds */
+		unsigned int replacedelay; /**< Time a replacing process must run before its predecessor is stopped, in milliseconds */
+	} start; /**< Bitmask holding when a daemon wants to be started, and how to restart it */
 };
 
 void
@@ -42,7 +55,10 @@ void
 daemon_conf_deinit(struct daemon_conf *conf);
 
 int
-daemon_conf_parse(struct daemon_conf *conf, FILE *filep);
+daemon_conf_parse(struct daemon_conf *conf, const char *name, int fd);
+
+void
+daemon_conf_check(const struct daemon_conf *conf, const char *name);
 
 /* DAEMON_CONF_H */
 #endif
@@ -0,0 +1,68 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#include "events.h"
+
+#include "daemon.h"
+
+#include <string.h> /* memcpy, strlen */
+#include <limits.h> /* NAME_MAX */
+#include <arpa/inet.h> /* htonl */
+
+/** Subscribers of daemons' events, in no particular order. */
+static struct events_subscriber *events_subscribers;
+
+/**
+ * Registers a subscriber, which receives events until unsubscribed.
+ * @param subscriber Subscriber, not registered yet.
+ */
+void
+events_subscribe(struct events_subscriber *subscriber) {
+	subscriber->next = events_subscribers;
+	events_subscribers = subscriber;
+}
+
+/**
+ * Unregisters a subscriber.
+ * @param subscriber Registered subscriber.
+ */
+void
+events_unsubscribe(struct events_subscriber *subscriber) {
+	struct events_subscriber **subscriberp = &events_subscribers;
+
+	while (*subscriberp != subscriber) {
+		subscriberp = &(*subscriberp)->next;
+	}
+
+	*subscriberp = subscriber->next;
+}
+
+/**
+ * Encodes an event record once, and delivers it to every subscriber.
+ * Nothing is done if there is no subscriber.
+ * @param event Event.
+ * @param daemon Daemon of the event.
+ * @param pid Process of the event, zero if none.
+ * @param info Termination of the process if it was reaped, _NULL_ else.
+ */
+void
+events_publish(enum protocol_event event, const struct daemon *daemon, pid_t pid, const siginfo_t *info) {
+	char record[PROTOCOL_EVENT_RECORD_SIZE + NAME_MAX];
+
+	if (events_subscribers == NULL) {
+		return;
+	}
+
+	const size_t namelen = strlen(daemon->name);
+	const uint32_t word = htonl(pid > 0 ? pid : 0);
+
+	record[0] = event;
+	record[1] = info != NULL ? info->si_code : 0;
+	record[2] = info != NULL ? info->si_status : 0;
+	record[3] = namelen;
+	memcpy(record + 4, &word, sizeof (word));
+	memcpy(record + PROTOCOL_EVENT_RECORD_SIZE, daemon->name, namelen);
+
+	/* A subscriber can't unsubscribe itself while receiving. */
+	for (struct events_subscriber *subscriber = events_subscribers; subscriber != NULL; subscriber = subscriber->next) {
+		subscriber->receive(subscriber, record, PROTOCOL_EVENT_RECORD_SIZE + namelen);
+	}
+}
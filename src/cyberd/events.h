@@ -0,0 +1,31 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include <stddef.h> /* size_t */
+#include <signal.h> /* siginfo_t */
+
+#include "protocol.h"
+
+struct daemon;
+
+/**
+ * A subscriber of daemons' events. Subscribers must queue records
+ * without blocking, and drop them if they can't.
+ */
+struct events_subscriber {
+	struct events_subscriber *next; /**< Next subscriber. */
+	void (*receive)(struct events_subscriber *subscriber, const char *record, size_t size); /**< Queues an event record. */
+};
+
+void
+events_subscribe(struct events_subscriber *subscriber);
+
+void
+events_unsubscribe(struct events_subscriber *subscriber);
+
+void
+events_publish(enum protocol_event event, const struct daemon *daemon, pid_t pid, const siginfo_t *info);
+
+/* EVENTS_H */
+#endif
@@ -4,6 +4,11 @@
 #include "signals.h"
 #include "spawns.h"
 #include "daemon.h"
+#include "process.h"
+#include "status_page.h"
+#ifdef CONFIG_DAEMON_SPAWNERS
+#include "spawners.h"
+#endif
 
 /**
  * @mainpage Cyberd init
@@ -17,89 +22,42 @@
  * Cyberd's init source code can be decomposed in three core components:
  * - The configuration: Where daemons are loaded/reloaded and configuration parsed.
  * - The socket switch: Where endpoints and connections are recorded and operated.
- * - The signal handlers: Where "process events" are received. Such as: system termination, configuration reloading and child processes reaping.
+ * - The signal handlers: Where "process events" are received. Such as: system termination, configuration reloading and orphan processes reaping.
+ *
+ * Spawned daemons are watched through their pidfds, which are registered as nodes of the socket switch.
+ * Their termination is thus delivered directly to their daemon, orphans are reaped on _SIGCHLD_,
+ * along with daemons whose termination was not yet operated through their pidfd.
+ * If configured, daemons are spawned in parallel by spawner processes, forked at setup,
+ * whose answers are also received through the socket switch.
  *
  * The process runs in one of two-states: Signal-handling and non signal-handling.
  * Both modes have different signal masks to avoid spurious interruptions and potential collisions in data structures.
  * When non signal-handling (cf the @ref main loop in `src/cyberd/main.c`), all signals are blocked or ignored.
  * Only when the call to _pselect(2)_ is done, the signal masks changes and allows for handling of termination signals (_SIGTERM_),
  * configuration reload signal (_SIGHUP_) and child processes reaping (_SIGCHLD_).
+ * If the socket switch uses _epoll(7)_, signals are never delivered, but read from a _signalfd(2)_ registered as a socket node,
+ * and ready nodes are operated without looking them up, whatever the number of connections.
+ * If configured, io_uring accepts connections and receives their commands itself, falling back to epoll if unavailable.
  */
 
 #include <stdlib.h> /* exit */
 #include <stdnoreturn.h> /* noreturn */
 #include <sys/reboot.h> /* reboot */
-#include <sys/wait.h> /* waitpid */
+#include <sys/wait.h> /* waitid, __WALL */
 #include <signal.h> /* kill */
 #include <syslog.h> /* syslog, ... */
 #include <libgen.h> /* basename */
 #include <unistd.h> /* setsid, sync */
 #include <errno.h> /* ECHILD, EINTR */
 
-/**
- * Daemon reaped.
- * Logs informations about a reaped daemon,
- * and starts the daemon again if configured so.
- */
-static void
-reaped_daemon(const siginfo_t *info, struct daemon *daemon) {
-
-	switch (info->si_code) {
-	case CLD_EXITED:
-		daemon->state = DAEMON_STOPPED;
-		syslog(LOG_INFO, "'%s' (pid: %d) terminated with exit status %d", daemon->name, info->si_pid, info->si_status);
-		if (info->si_status == 0) {
-			if (daemon->conf.start.exitsuccess == 1) {
-				daemon_start(daemon);
-			}
-		} else if (daemon->conf.start.exitfailure == 1) {
-			daemon_start(daemon);
-		}
-		break;
-	case CLD_KILLED:
-		daemon->state = DAEMON_STOPPED;
-		syslog(LOG_INFO, "'%s' (pid: %d) killed by signal %d", daemon->name, info->si_pid, info->si_status);
-		if (daemon->conf.start.killed == 1) {
-			daemon_start(daemon);
-		}
-		break;
-	case CLD_DUMPED:
-		daemon->state = DAEMON_STOPPED;
-		syslog(LOG_INFO, "'%s' (pid: %d) dumped core", daemon->name, info->si_pid);
-		if (daemon->conf.start.dumped == 1) {
-			daemon_start(daemon);
-		}
-		break;
-	default:
-		abort();
-	}
-}
-
-/**
- * Orphan reaped.
- * Logs informations about a reaped orphan process.
- */
-static void
-reaped_orphan(const siginfo_t *info) {
-
-	switch (info->si_code) {
-	case CLD_EXITED:
-		syslog(LOG_INFO, "Orphan %d terminated with exit status %d", info->si_pid, info->si_status);
-		break;
-	case CLD_KILLED:
-		syslog(LOG_INFO, "Orphan %d killed by signal %d", info->si_pid, info->si_status);
-		break;
-	case CLD_DUMPED:
-		syslog(LOG_INFO, "Orphan %d dumped core", info->si_pid);
-		break;
-	default:
-		abort();
-	}
-}
-
 /**
  * Reap available children.
  * Perform a wait until all children or error.
+ * Spawned daemons are reaped through their pidfd in the socket switch,
+ * but as _execve(2)_ resets their termination signal to _SIGCHLD_, they may be reaped
+ * here first. So this reaps orphans, reparented to us, and dispatches daemons found in spawns.
+ * Processes reaped while remote spawns are pending are claimed, as they may be their daemons.
+ * Daemons failing before their exec send no signal, and are not waited for unless @p options has __WALL.
  * @param options Forwarded to waitid(2). Usually 0 or WNOHANG, to avoid blocking if necessary.
  * @returns The last waitid(2) returned value, with errno in case of error.
  */
@@ -110,12 +68,12 @@ reap_children(int options) {
 
 	options |= WEXITED;
 	while ((status = waitid(P_ALL, 0, &info, options)) == 0 && info.si_pid != 0) {
-		struct daemon * const daemon = spawns_retrieve(info.si_pid);
+		struct daemon_process * const process = spawns_retrieve(info.si_pid);
 
-		if (daemon != NULL) {
-			reaped_daemon(&info, daemon);
-		} else {
-			reaped_orphan(&info);
+		if (process != NULL) {
+			daemon_reaped(process->daemon, &info);
+		} else if (!process_remote_claim(&info)) {
+			process_orphan_reaped(&info);
 		}
 	}
 
@@ -138,10 +96,14 @@ rc(const char *path) {
 	struct daemon daemon = {
 		.state = DAEMON_STARTED,
 		.name = *argv,
-		.pid = fork(),
+		.statusslot = -1,
+		.process = {
+			.pid = fork(),
+			.node = { .fd = -1 },
+		},
 	};
 
-	switch (daemon.pid) {
+	switch (daemon.process.pid) {
 	case 0:
 		execv(path, argv);
 		syslog(LOG_ERR, "execv: %m");
@@ -153,30 +115,29 @@ rc(const char *path) {
 		break;
 	}
 
-	spawns_record(&daemon);
+	/* Orphans it may leave are reaped by the main loop,
+	 * as their SIGCHLD is kept pending until then. */
+	siginfo_t info;
+	while (waitid(P_PID, daemon.process.pid, &info, WEXITED) != 0) {
+		if (errno != EINTR) {
+			syslog(LOG_ERR, "waitid: %m");
+			return;
+		}
+	}
 
-	/* Keep same signal mask during
-	 * sigsuspend(2), except for SIGCHLD. */
-	sigset_t sigmask;
-	sigprocmask(0, NULL, &sigmask);
-	sigdelset(&sigmask, SIGCHLD);
-	do {
-		sigsuspend(&sigmask);
-		reap_children(WNOHANG);
-	} while (!spawns_empty());
-	/* Clean SIGCHLD marker. */
-	sigchld = 0;
+	daemon_reaped(&daemon, &info);
 }
 #endif
 
 /**
  * Setup all subsystems.
  * Opens log subsystem. If configured, run commands.
- * Setup signal handlers. Create first endpoint.
+ * Initialize the socket switch, setup signal handlers. If configured, fork spawners. Create first endpoint,
+ * and if configured, the status page.
  * And finally, load our configuration.
  * @param argc Arguments count.
  * @param argv Arguments values.
- * @param[out] sigmaskp Signals not blocked during _pselect(2)_.
+ * @param[out] sigmaskp Signals not blocked while waiting for the socket switch.
  */
 static void
 setup(int argc, char **argv, sigset_t *sigmaskp) {
@@ -194,8 +155,15 @@ setup(int argc, char **argv, sigset_t *sigmaskp) {
 		syslog(LOG_ERR, "setsid: %m");
 	}
 
+	socket_switch_init();
 	signals_setup(sigmaskp);
+#ifdef CONFIG_DAEMON_SPAWNERS
+	spawners_setup();
+#endif
 	socket_switch_setup(CONFIG_SOCKET_ENDPOINTS_PATH, CONFIG_SOCKET_ENDPOINTS_ROOT);
+#ifdef CONFIG_STATUS_PAGE_PATH
+	status_page_setup(CONFIG_STATUS_PAGE_PATH);
+#endif
 
 #ifdef CONFIG_RC_PATH
 	rc(CONFIG_RC_PATH);
@@ -204,6 +172,15 @@ setup(int argc, char **argv, sigset_t *sigmaskp) {
 	configuration_load(CONFIG_CONFIGURATION_PATH);
 }
 
+/**
+ * Check if daemons are still running, or about to be.
+ * @returns true if some daemons are spawned or being spawned, false else.
+ */
+static bool
+daemons_running(void) {
+	return !spawns_empty() || process_remote_pending();
+}
+
 /**
  * Teardown system, synchronizes filesystems to persistent storage.
  * Note some structures (configuration) may not be freed by default, because
@@ -218,25 +195,36 @@ teardown(void) {
 	syslog(LOG_NOTICE, "Stopping daemons...");
 	spawns_stop();
 
-	/* Destroying socket switch, to unlink endpoints. */
+	/* Destroying socket switch, to unlink endpoints.
+	 * Daemons' pidfds are kept to be notified of their termination,
+	 * and spawners' and zygotes' sockets to receive pending spawns. */
 	socket_switch_teardown();
-	/* Setup SIGALRM handler and planify timeout alarm. */
-	signals_alarm(&sigmask, CONFIG_REBOOT_TIMEOUT);
+	status_page_teardown();
+	signals_teardown(&sigmask);
+
+	/* While we still have daemons running, reap daemons through their pidfds
+	 * and orphans on SIGCHLD. Daemons' timers are kept too, so each one is killed
+	 * once its own stop timeout expired, and we only wait as long as needed. */
+	while (daemons_running()) {
+		if (socket_switch_wait(&sigmask) != 0 && errno != EINTR) {
+			syslog(LOG_ERR, "socket_switch_wait: %m");
+		}
+		if (sigchld) {
+			reap_children(WNOHANG);
+			sigchld = 0;
+		}
+	}
 
-	/* While there are children, the alarm didn't ring,
-	 * and we still have daemons running, reap children. */
-	bool children;
-	do {
-		sigsuspend(&sigmask);
-		children = reap_children(WNOHANG) == 0 || errno != ECHILD;
-	} while (children && !sigalrm && !spawns_empty());
+#ifdef CONFIG_DAEMON_SPAWNERS
+	spawners_teardown();
+#endif
 
-	if (children) {
+	if (reap_children(WNOHANG | __WALL) == 0 || errno != ECHILD) {
 		/* Kill everyone left. This way, we are ready for @ref _sync(2)_. */
 		syslog(LOG_NOTICE, "Ending remaining processes...");
 		kill(-1, SIGKILL);
-		/* Reap remaining children. */
-		reap_children(0);
+		/* Reap remaining children, daemons included. */
+		reap_children(__WALL);
 	}
 
 #ifndef NDEBUG
@@ -271,25 +259,16 @@ main(int argc, char *argv[]) {
 	setup(argc, argv, &sigmask);
 
 	do {
-		fd_set *readfds;
-		int fds = socket_switch_prepare(&readfds);
-
-		errno = 0;
-		fds = pselect(fds, readfds, NULL, NULL, NULL, &sigmask);
-
-		if (fds >= 0) {
-			socket_switch_operate(fds);
-		} else if (errno == EINTR) {
-			if (sighup) {
-				configuration_reload();
-				sighup = 0;
-			}
-			if (sigchld) {
-				reap_children(WNOHANG);
-				sigchld = 0;
-			}
-		} else {
-			syslog(LOG_ERR, "pselect: %m");
+		if (socket_switch_wait(&sigmask) != 0 && errno != EINTR) {
+			syslog(LOG_ERR, "socket_switch_wait: %m");
+		}
+		if (sighup) {
+			configuration_reload();
+			sighup = 0;
+		}
+		if (sigchld) {
+			reap_children(WNOHANG);
+			sigchld = 0;
 		}
 	} while (!sigreboot);
 
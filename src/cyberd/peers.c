@@ -0,0 +1,146 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#include "peers.h"
+
+#include "tree.h"
+
+#include <stdint.h> /* uint64_t */
+#include <stdlib.h> /* malloc, free */
+#include <syslog.h> /* syslog */
+#include <time.h> /* clock_gettime */
+
+/**
+ * A peer of socket connections, all its connections share a token bucket
+ * limiting the rate of their requests.
+ */
+struct peer {
+	uid_t uid; /**< User of the peer, from the connections' credentials, index for peers. */
+	unsigned int connections; /**< Number of connections of the peer. */
+	unsigned int tokens; /**< Requests the peer can make right away. */
+	uint64_t refilledat; /**< When tokens were last refilled, in nanoseconds. */
+	bool limited; /**< The peer ran out of tokens, and was not admitted since. */
+};
+
+/**
+ * Peers tree comparison function. Identifies by the peer's uid.
+ * @param lhs Left hand side operand.
+ * @param rhs Right hand side operand.
+ * @returns The comparison between @p lhs and @p rhs uids.
+ */
+static int
+peers_compare(const tree_element_t *lhs, const tree_element_t *rhs) {
+	const struct peer * const lpeer = lhs, * const rpeer = rhs;
+
+	return (lpeer->uid > rpeer->uid) - (lpeer->uid < rpeer->uid);
+}
+
+/**
+ * Peers storage, indexed by uid. A peer whose bucket isn't full is kept
+ * after its last connection closed, so reconnecting doesn't refill it.
+ */
+static struct tree peers = { .compare = peers_compare };
+
+static uint64_t
+peers_now(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Refills a peer's bucket with the tokens earned since its last refill.
+ * @param peer Peer to refill.
+ */
+static void
+peers_refill(struct peer *peer) {
+	const uint64_t now = peers_now();
+	const uint64_t earned = (now - peer->refilledat) * CONFIG_SOCKET_PEERS_RATE / 1000000000;
+
+	if (earned == 0) {
+		return;
+	}
+
+	if (peer->tokens + earned >= CONFIG_SOCKET_PEERS_BURST) {
+		peer->tokens = CONFIG_SOCKET_PEERS_BURST;
+		peer->refilledat = now;
+	} else {
+		/* Keep the remainder of the elapsed time for the next token. */
+		peer->tokens += earned;
+		peer->refilledat += earned * 1000000000 / CONFIG_SOCKET_PEERS_RATE;
+	}
+}
+
+/**
+ * Acquires the peer of a new connection, creating it with a full bucket if needed.
+ * @param uid User of the connection.
+ * @returns The peer, _NULL_ on error.
+ */
+struct peer *
+peers_acquire(uid_t uid) {
+	const struct peer element = { .uid = uid };
+	struct peer *peer = tree_find(&peers, &element);
+
+	if (peer == NULL) {
+		peer = malloc(sizeof (*peer));
+		if (peer == NULL) {
+			syslog(LOG_ERR, "peers_acquire: malloc: %m");
+			return NULL;
+		}
+
+		peer->uid = uid;
+		peer->connections = 0;
+		peer->tokens = CONFIG_SOCKET_PEERS_BURST;
+		peer->refilledat = peers_now();
+		peer->limited = false;
+
+		tree_insert(&peers, peer);
+	}
+
+	peer->connections++;
+
+	return peer;
+}
+
+/**
+ * Releases the peer of a closed connection.
+ * @param peer Peer of the connection.
+ */
+void
+peers_release(struct peer *peer) {
+
+	peer->connections--;
+	if (peer->connections != 0) {
+		return;
+	}
+
+	peers_refill(peer);
+	if (peer->tokens == CONFIG_SOCKET_PEERS_BURST) {
+		tree_remove(&peers, peer);
+		free(peer);
+	}
+}
+
+/**
+ * Admits a request of a peer, if its bucket has a token left.
+ * @param peer Peer making the request.
+ * @returns Whether the request can be executed.
+ */
+bool
+peers_admit(struct peer *peer) {
+
+	peers_refill(peer);
+
+	if (peer->tokens == 0) {
+		if (!peer->limited) {
+			syslog(LOG_WARNING, "Requests of uid %u are rate limited", (unsigned int)peer->uid);
+			peer->limited = true;
+		}
+		return false;
+	}
+
+	peer->tokens--;
+	peer->limited = false;
+
+	return true;
+}
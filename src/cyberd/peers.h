@@ -0,0 +1,19 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#ifndef PEERS_H
+#define PEERS_H
+
+#include <sys/types.h> /* uid_t */
+
+struct peer;
+
+struct peer *
+peers_acquire(uid_t uid);
+
+void
+peers_release(struct peer *peer);
+
+bool
+peers_admit(struct peer *peer);
+
+/* PEERS_H */
+#endif
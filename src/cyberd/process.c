@@ -0,0 +1,576 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#include "process.h"
+
+#include "daemon_conf.h"
+#include "socket_switch.h"
+#include "socket_node.h"
+#include "signals.h"
+
+#include <stdlib.h> /* abort, free, malloc, realloc */
+#include <stdnoreturn.h> /* noreturn */
+#include <sys/resource.h> /* setpriority */
+#include <sys/stat.h> /* umask */
+#include <sys/wait.h> /* waitid, P_PIDFD, __WALL */
+#include <sys/syscall.h> /* SYS_clone3 */
+#include <syslog.h> /* syslog */
+#include <unistd.h> /* close, chdir, setuid, _exit... */
+#include <signal.h> /* sigemptyset, sigprocmask */
+#include <fcntl.h> /* open, fcntl */
+#include <errno.h> /* errno, EINTR */
+#include <time.h> /* clock_gettime */
+
+#ifdef CONFIG_DAEMON_SPAWN_VFORK
+#include <sched.h> /* clone, CLONE_VM, CLONE_VFORK, CLONE_PIDFD */
+
+/** Size of the stack used by children sharing our address space until they exec. */
+#define PROCESS_CLONE_STACK_SIZE 65536
+
+/**
+ * Stack of vfork-like children. As the parent is suspended
+ * until the child either execs or exits, only one child uses it at a time.
+ */
+[[gnu::aligned(16)]] static char process_clone_stack[PROCESS_CLONE_STACK_SIZE];
+#else
+#include <linux/sched.h> /* struct clone_args, CLONE_PIDFD */
+#endif
+
+/**
+ * Empty signal procmask of the current process.
+ */
+static int
+process_child_sigprocmask(void) {
+	sigset_t sigmask;
+
+	if (sigemptyset(&sigmask) != 0) {
+		return -1;
+	}
+
+	if (sigprocmask(SIG_SETMASK, &sigmask, NULL) != 0) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Result of a child setup, as received by its parent. */
+struct process_child_result {
+	enum process_step step; /**< Failing step, meaningless on success. */
+	int errnum; /**< errno of the failing step, zero on success. */
+};
+
+/** Context shared by a spawning child and its parent. */
+struct process_child {
+	const struct daemon_conf *conf; /**< Spawn plan of the child. */
+	int controlfd; /**< Control socket given to the child, -1 if none. */
+	struct process_child_result result; /**< Result of the child, filled when the parent resumes. */
+#ifndef CONFIG_DAEMON_SPAWN_VFORK
+	int resultfd; /**< Close-on-exec pipe where the child writes its result, if failing. */
+#endif
+};
+
+/**
+ * Reports a failure while setting up a child to its parent, and exits the child.
+ * The child may share its address space with cyberd, so it must
+ * neither run atexit(3) handlers nor flush stdio buffers, hence _exit(2).
+ * @param child Context of the child.
+ * @param step Failing step, errno must hold its error.
+ * @returns Never.
+ */
+static void noreturn
+process_child_abort(struct process_child *child, enum process_step step) {
+	const struct process_child_result result = { .step = step, .errnum = errno };
+
+#ifdef CONFIG_DAEMON_SPAWN_VFORK
+	/* We share our parent's address space, write directly in its context. */
+	child->result = result;
+#else
+	/* Writes smaller than PIPE_BUF are atomic, nothing to do if it fails. */
+	[[maybe_unused]] const ssize_t written = write(child->resultfd, &result, sizeof (result));
+#endif
+
+	_exit(-1);
+}
+
+/**
+ * Sets up the current process state according to the spawn plan of @p child.
+ * @param child Context of the child.
+ * @returns Never, exits on failure to initialize process.
+ */
+static void noreturn
+process_child_setup(struct process_child *child) {
+	const struct daemon_conf * const conf = child->conf;
+	int infd, outfd, errfd;
+
+	/*************************************
+	 * Opening standard file descriptors *
+	 *************************************/
+
+	infd = open(conf->in, O_RDONLY | O_CLOEXEC);
+	if (infd < 0) {
+		process_child_abort(child, PROCESS_STEP_OPEN_STDIN);
+	}
+
+	outfd = open(conf->out, O_WRONLY | O_CLOEXEC);
+	if (outfd < 0) {
+		process_child_abort(child, PROCESS_STEP_OPEN_STDOUT);
+	}
+
+	if (conf->err != NULL) {
+		errfd = open(conf->err, O_WRONLY | O_CLOEXEC);
+		if (errfd < 0) {
+			process_child_abort(child, PROCESS_STEP_OPEN_STDERR);
+		}
+	} else {
+		errfd = outfd;
+	}
+
+	/**************************************
+	 * Replacing default file descriptors *
+	 **************************************/
+
+	if (dup2(infd, STDIN_FILENO) < 0
+		|| dup2(outfd, STDOUT_FILENO) < 0
+		|| dup2(errfd, STDERR_FILENO) < 0) {
+		process_child_abort(child, PROCESS_STEP_DUP2);
+	}
+
+	if (child->controlfd >= 0) {
+#ifndef CONFIG_DAEMON_SPAWN_VFORK
+		if (child->resultfd == PROCESS_CONTROL_FILENO) {
+			child->resultfd = fcntl(child->resultfd, F_DUPFD_CLOEXEC, PROCESS_CONTROL_FILENO + 1);
+		}
+#endif
+		/* dup2(2) doesn't clear close-on-exec if both descriptors are the same. */
+		if (child->controlfd == PROCESS_CONTROL_FILENO ? fcntl(child->controlfd, F_SETFD, 0) != 0
+			: dup2(child->controlfd, PROCESS_CONTROL_FILENO) < 0) {
+			process_child_abort(child, PROCESS_STEP_DUP2);
+		}
+	}
+
+	/***********************************************
+	 * Parent process-inherited capabilities reset *
+	 ***********************************************/
+
+	umask(conf->umask);
+
+	if (chdir(conf->workdir) < 0) {
+		process_child_abort(child, PROCESS_STEP_CHDIR);
+	}
+
+	if (process_child_sigprocmask() < 0) {
+		process_child_abort(child, PROCESS_STEP_SIGPROCMASK);
+	}
+
+	/**************************************
+	 * Process credentials and scheduling *
+	 **************************************/
+
+	if (setuid(conf->uid) < 0) {
+		process_child_abort(child, PROCESS_STEP_SETUID);
+	}
+
+	if (setgid(conf->gid) < 0) {
+		process_child_abort(child, PROCESS_STEP_SETGID);
+	}
+
+	if (!conf->nosid && setsid() < 0) {
+		process_child_abort(child, PROCESS_STEP_SETSID);
+	}
+
+	if (setpriority(PRIO_PROCESS, 0, conf->priority) != 0) {
+		process_child_abort(child, PROCESS_STEP_SETPRIORITY);
+	}
+
+	/********
+	 * Exec *
+	 ********/
+
+	execve(conf->path, conf->arguments, conf->environment);
+	process_child_abort(child, PROCESS_STEP_EXEC);
+}
+
+#ifdef CONFIG_DAEMON_SPAWN_VFORK
+/**
+ * Entry point of a vfork-like child.
+ * Signal handlers are not shared with the parent, but they still point
+ * to its code and data, reset them before unblocking any signal.
+ * @param arg Context of the child.
+ * @returns Never.
+ */
+static int
+process_child_main(void *arg) {
+	signals_default();
+	process_child_setup(arg);
+}
+
+/**
+ * Spawns the process with a vfork-like _clone(2)_, the child shares
+ * our address space and we are suspended until it either execs or exits.
+ * This avoids copying page tables and taking copy-on-write faults on each spawn,
+ * but we are also suspended while the child opens its standard streams.
+ * When we resume, the child already wrote its result if it failed.
+ * The child sends no signal if it fails before its exec, see @ref process_spawn_begin.
+ * @param child Context of the child, its result is filled on return.
+ * @param flags Additional _clone(2)_ flags.
+ * @param[out] pidfdp Pidfd of the child.
+ * @param[out] resultfdp Always -1, the spawn ended on return.
+ * @returns The pid of the child, -1 on error to _clone(2)_.
+ */
+static pid_t
+process_clone(struct process_child *child, int flags, int *pidfdp, int *resultfdp) {
+	child->result.errnum = 0;
+	*resultfdp = -1;
+
+	return clone(process_child_main, process_clone_stack + sizeof (process_clone_stack),
+		CLONE_VM | CLONE_VFORK | CLONE_PIDFD | flags, child, pidfdp);
+}
+#else
+/**
+ * Spawns the process with a fork-like _clone3(2)_, doesn't return from the child.
+ * A close-on-exec pipe is shared with the child, its write end is closed
+ * either by a successful exec, or after the child wrote its failure.
+ * We don't wait for the child, its result is read from the pipe by @ref process_spawn_end.
+ * The child sends no signal if it fails before its exec, see @ref process_spawn_begin.
+ * @param child Context of the child.
+ * @param flags Additional _clone(2)_ flags.
+ * @param[out] pidfdp Pidfd of the child.
+ * @param[out] resultfdp Read end of the pipe.
+ * @returns Doesn't return from child. In the parent: the pid of the child, -1 on error to _pipe2(2)_ or _clone3(2)_.
+ */
+static pid_t
+process_clone(struct process_child *child, int flags, int *pidfdp, int *resultfdp) {
+	struct clone_args args = {
+		.flags = CLONE_PIDFD | flags,
+		.pidfd = (uintptr_t)pidfdp,
+		.exit_signal = 0,
+	};
+	int fds[2];
+
+	if (pipe2(fds, O_CLOEXEC) != 0) {
+		return -1;
+	}
+
+	const pid_t pid = syscall(SYS_clone3, &args, sizeof (args));
+	switch (pid) {
+	case -1:
+		close(fds[0]);
+		break;
+	case 0:
+		close(fds[0]);
+		child->resultfd = fds[1];
+		process_child_setup(child);
+	default:
+		*resultfdp = fds[0];
+		break;
+	}
+
+	close(fds[1]);
+
+	return pid;
+}
+#endif
+
+/**
+ * Monotonic time, in nanoseconds.
+ * @returns The current monotonic time.
+ */
+static uint64_t
+process_now(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Begins the spawn of a process according to the spawn plan @p conf.
+ * The process sends no signal if it fails before its exec, so it is never reaped by
+ * the orphans' _waitid(2)_ of cyberd, but only through its pidfd. Note _execve(2)_
+ * resets the termination signal to _SIGCHLD_, so exec'd processes may be reaped by both.
+ * On success, the process exists even if its setup failed: it must be reaped
+ * through its pidfd by its parent, which is the caller, or the caller's parent if @p parent is set.
+ * If the spawn didn't end yet, the caller is given the read end of a pipe, readable once the
+ * process exec'd or failed its setup, which must be given to @ref process_spawn_end.
+ * Until then, the process may block opening its standard streams, such as a FIFO without reader.
+ * @param conf Spawn plan of the process.
+ * @param controlfd Control socket given to the process as @ref PROCESS_CONTROL_FILENO, -1 if none.
+ * @param parent Whether the process is a child of the caller's parent instead of the caller's, see _CLONE_PARENT_.
+ * @param[out] spawn Outcome of the spawn, the setup failed if its errnum is non-zero, only its pid and pidfd are set until it ended.
+ * @param[out] resultfdp Read end of the pipe if the spawn didn't end yet, -1 else.
+ * @returns Zero if a process was created, -1 on error with errno set, the pid of @p spawn is then -1.
+ */
+int
+process_spawn_begin(const struct daemon_conf *conf, int controlfd, bool parent, struct process_spawn *spawn, int *resultfdp) {
+	struct process_child child = { .conf = conf, .controlfd = controlfd };
+
+	spawn->ns = process_now();
+	*resultfdp = -1;
+
+	const pid_t pid = process_clone(&child, parent ? CLONE_PARENT : 0, &spawn->pidfd, resultfdp);
+	if (pid < 0) {
+		spawn->pid = -1;
+		spawn->errnum = errno;
+		return -1;
+	}
+
+	spawn->pid = pid;
+
+	if (*resultfdp < 0) {
+		spawn->ns = process_now() - spawn->ns;
+		spawn->step = child.result.step;
+		spawn->errnum = child.result.errnum;
+	}
+
+	return 0;
+}
+
+/**
+ * Ends a spawn begun by @ref process_spawn_begin, reading the result of its process.
+ * Blocks until the process exec'd or failed its setup, unless its pipe is readable.
+ * @param resultfd Read end of the pipe, closed on return.
+ * @param[in,out] spawn Outcome of the spawn, completed on return.
+ */
+void
+process_spawn_end(int resultfd, struct process_spawn *spawn) {
+	struct process_child_result result;
+	ssize_t readval;
+
+	while (readval = read(resultfd, &result, sizeof (result)), readval < 0 && errno == EINTR);
+	close(resultfd);
+
+	spawn->ns = process_now() - spawn->ns;
+
+	if (readval == sizeof (result)) {
+		spawn->step = result.step;
+		spawn->errnum = result.errnum;
+	} else {
+		/* End of file, the child successfully exec'd. */
+		spawn->errnum = 0;
+	}
+}
+
+/**
+ * Spawns a process according to the spawn plan @p conf, waiting for its exec.
+ * See @ref process_spawn_begin.
+ * @param conf Spawn plan of the process.
+ * @param controlfd Control socket given to the process as @ref PROCESS_CONTROL_FILENO, -1 if none.
+ * @param parent Whether the process is a child of the caller's parent instead of the caller's, see _CLONE_PARENT_.
+ * @param[out] spawn Outcome of the spawn, the setup failed if its errnum is non-zero.
+ * @returns Zero if a process was created, -1 on error with errno set, the pid of @p spawn is then -1.
+ */
+int
+process_spawn(const struct daemon_conf *conf, int controlfd, bool parent, struct process_spawn *spawn) {
+	int resultfd;
+
+	if (process_spawn_begin(conf, controlfd, parent, spawn, &resultfd) != 0) {
+		return -1;
+	}
+
+	if (resultfd >= 0) {
+		process_spawn_end(resultfd, spawn);
+	}
+
+	return 0;
+}
+
+/**
+ * Describes a failing step of a process setup.
+ * @param step Failing step.
+ * @returns A description of the step, suitable for logs.
+ */
+const char *
+process_step_name(enum process_step step) {
+	static const char * const steps[] = {
+		[PROCESS_STEP_OPEN_STDIN]   = "open stdin",
+		[PROCESS_STEP_OPEN_STDOUT]  = "open stdout",
+		[PROCESS_STEP_OPEN_STDERR]  = "open stderr",
+		[PROCESS_STEP_DUP2]         = "dup2",
+		[PROCESS_STEP_CHDIR]        = "chdir",
+		[PROCESS_STEP_SIGPROCMASK]  = "sigprocmask",
+		[PROCESS_STEP_SETUID]       = "setuid",
+		[PROCESS_STEP_SETGID]       = "setgid",
+		[PROCESS_STEP_SETSID]       = "setsid",
+		[PROCESS_STEP_SETPRIORITY]  = "setpriority",
+		[PROCESS_STEP_EXEC]         = "exec",
+	};
+
+	if ((unsigned int)step < sizeof (steps) / sizeof (*steps)) {
+		return steps[step];
+	}
+
+	return "setup";
+}
+
+/**
+ * Orphan reaped.
+ * Logs informations about a reaped orphan process.
+ * @param info Informations of the reaped process, from _waitid(2)_.
+ */
+void
+process_orphan_reaped(const siginfo_t *info) {
+
+	switch (info->si_code) {
+	case CLD_EXITED:
+		syslog(LOG_INFO, "Orphan %d terminated with exit status %d", info->si_pid, info->si_status);
+		break;
+	case CLD_KILLED:
+		syslog(LOG_INFO, "Orphan %d killed by signal %d", info->si_pid, info->si_status);
+		break;
+	case CLD_DUMPED:
+		syslog(LOG_INFO, "Orphan %d dumped core", info->si_pid);
+		break;
+	default:
+		abort();
+	}
+}
+
+/**
+ * Reaps a process nobody owns anymore, when its pidfd becomes readable.
+ * The process may already have been reaped by the orphans' _waitid(2)_.
+ * @param snode Orphan's socket node.
+ */
+static void
+process_orphan_node_operate(struct socket_node *snode) {
+	siginfo_t info = { .si_pid = 0 };
+
+	if (waitid(P_PIDFD, snode->fd, &info, WEXITED | WNOHANG | __WALL) != 0) {
+		/* Stop watching it, its pidfd would stay readable. Unless already reaped,
+		 * the orphan is then reaped on SIGCHLD. */
+		if (errno != ECHILD) {
+			syslog(LOG_ERR, "process_orphan_node_operate: waitid: %m");
+		}
+		socket_switch_remove(snode);
+		return;
+	}
+
+	if (info.si_pid != 0) {
+		process_orphan_reaped(&info);
+		socket_switch_remove(snode);
+	}
+}
+
+/** Closes and frees an orphan's socket node. */
+static void
+process_orphan_node_destroy(struct socket_node *snode) {
+	close(snode->fd);
+	free(snode);
+}
+
+/**
+ * Keeps watching a process whose daemon was removed, until it is reaped.
+ * @param pidfd Pidfd of the process, owned by the socket switch on return.
+ */
+void
+process_orphan(int pidfd) {
+	static const struct socket_node_class process_orphan_node_class = {
+		.operate = process_orphan_node_operate,
+		.destroy = process_orphan_node_destroy,
+	};
+	struct socket_node * const orphan = malloc(sizeof (*orphan));
+
+	if (orphan == NULL) {
+		syslog(LOG_ERR, "process_orphan: Unable to watch pidfd %d", pidfd);
+		close(pidfd);
+		return;
+	}
+
+	orphan->class = &process_orphan_node_class;
+	orphan->fd = pidfd;
+	if (socket_switch_insert(orphan) != 0) {
+		syslog(LOG_WARNING, "process_orphan: Unable to watch pidfd %d, reaping it on SIGCHLD", pidfd);
+	}
+}
+
+/*****************
+ * Remote spawns *
+ *****************/
+
+/**
+ * Count of spawns requested to other processes, such as spawners or zygotes, and not answered yet.
+ * Spawns begun by cyberd itself are counted too, until their process exec'd or failed.
+ */
+static unsigned int process_remote_count;
+
+/**
+ * Processes reaped by the orphans' _waitid(2)_ while remote spawns were pending.
+ * A process can terminate before the answer of its spawn is received,
+ * so these may be pending daemons, they are orphans once no spawn is pending.
+ */
+static siginfo_t *process_remote_claims;
+
+/** Number of claimed processes. */
+static unsigned int process_remote_claims_count;
+
+/** Records a spawn requested to another process. */
+void
+process_remote_requested(void) {
+	process_remote_count++;
+}
+
+/**
+ * Records the answer to a remote spawn, and takes back its process if it was already reaped.
+ * Once no spawn is pending, remaining claimed processes are orphans.
+ * @param pid Pid of the spawned process, -1 if none.
+ * @param[out] info Informations of the reaped process, if it was claimed.
+ * @returns true if the process was claimed, false else.
+ */
+bool
+process_remote_answered(pid_t pid, siginfo_t *info) {
+	bool claimed = false;
+
+	for (unsigned int i = 0; i < process_remote_claims_count; i++) {
+		if (process_remote_claims[i].si_pid == pid) {
+			*info = process_remote_claims[i];
+			process_remote_claims[i] = process_remote_claims[--process_remote_claims_count];
+			claimed = true;
+			break;
+		}
+	}
+
+	if (--process_remote_count == 0) {
+		for (unsigned int i = 0; i < process_remote_claims_count; i++) {
+			process_orphan_reaped(process_remote_claims + i);
+		}
+
+		free(process_remote_claims);
+		process_remote_claims = NULL;
+		process_remote_claims_count = 0;
+	}
+
+	return claimed;
+}
+
+/**
+ * Check if remote spawns are still pending.
+ * @returns true if some spawns were requested and not answered yet, false else.
+ */
+bool
+process_remote_pending(void) {
+	return process_remote_count != 0;
+}
+
+/**
+ * Claims a process reaped by the orphans' _waitid(2)_, if it may be a daemon whose spawn is pending.
+ * @param info Informations of the reaped process.
+ * @returns true if the process was claimed, false if it is an orphan.
+ */
+bool
+process_remote_claim(const siginfo_t *info) {
+
+	if (process_remote_count == 0) {
+		return false;
+	}
+
+	siginfo_t * const claims = realloc(process_remote_claims, (process_remote_claims_count + 1) * sizeof (*claims));
+	if (claims == NULL) {
+		syslog(LOG_ERR, "process_remote_claim: realloc: %m");
+		return false;
+	}
+
+	claims[process_remote_claims_count] = *info;
+	process_remote_claims = claims;
+	process_remote_claims_count++;
+
+	return true;
+}
@@ -0,0 +1,69 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#ifndef PROCESS_H
+#define PROCESS_H
+
+#include <sys/types.h> /* pid_t */
+#include <stdint.h> /* uint64_t */
+#include <signal.h> /* siginfo_t */
+
+/** File descriptor of the control socket in processes given one, such as zygotes. */
+#define PROCESS_CONTROL_FILENO 3
+
+struct daemon_conf;
+
+/** Steps of a process setup which may fail, reported to its parent. */
+enum process_step {
+	PROCESS_STEP_OPEN_STDIN,
+	PROCESS_STEP_OPEN_STDOUT,
+	PROCESS_STEP_OPEN_STDERR,
+	PROCESS_STEP_DUP2,
+	PROCESS_STEP_CHDIR,
+	PROCESS_STEP_SIGPROCMASK,
+	PROCESS_STEP_SETUID,
+	PROCESS_STEP_SETGID,
+	PROCESS_STEP_SETSID,
+	PROCESS_STEP_SETPRIORITY,
+	PROCESS_STEP_EXEC,
+};
+
+/** Outcome of a process spawn. */
+struct process_spawn {
+	pid_t pid; /**< Pid of the process. */
+	int pidfd; /**< Pidfd of the process. */
+	uint64_t ns; /**< Fork-to-exec time of the spawn, in nanoseconds, its monotonic beginning until it ended. */
+	enum process_step step; /**< Failing step, meaningless on success. */
+	int errnum; /**< errno of the failing step, zero on success. */
+};
+
+int
+process_spawn_begin(const struct daemon_conf *conf, int controlfd, bool parent, struct process_spawn *spawn, int *resultfdp);
+
+void
+process_spawn_end(int resultfd, struct process_spawn *spawn);
+
+int
+process_spawn(const struct daemon_conf *conf, int controlfd, bool parent, struct process_spawn *spawn);
+
+const char *
+process_step_name(enum process_step step);
+
+void
+process_orphan_reaped(const siginfo_t *info);
+
+void
+process_orphan(int pidfd);
+
+void
+process_remote_requested(void);
+
+bool
+process_remote_answered(pid_t pid, siginfo_t *info);
+
+bool
+process_remote_pending(void);
+
+bool
+process_remote_claim(const siginfo_t *info);
+
+/* PROCESS_H */
+#endif
@@ -0,0 +1,115 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h> /* uint32_t, uint64_t */
+#include <stdatomic.h> /* _Atomic */
+#include <limits.h> /* NAME_MAX */
+
+/**
+ * Flag of an endpoint creation's capability set, the endpoint is created
+ * with SOCK_SEQPACKET instead of SOCK_STREAM. Each datagram sent to it is then
+ * one version 2 request, and each datagram received from it one version 2 reply.
+ */
+#define PROTOCOL_ENDPOINT_SEQPACKET ((uint32_t)1 << 31)
+
+/**
+ * First byte sent on a connection by version 2 clients.
+ * It is not a command, which tells them apart from version 1 clients.
+ */
+#define PROTOCOL_V2 0x82
+
+/** Size of a version 2 frame header, its big endian body length followed by its big endian request identifier. */
+#define PROTOCOL_V2_HEADER_SIZE 8
+
+/** Maximum size of a version 2 request body, an endpoint creation with the longest name. */
+#define PROTOCOL_V2_REQUEST_MAX (1 + 4 + NAME_MAX + 1)
+
+/** Maximum size of a version 2 reply body, partial replies of a status are split to fit. */
+#define PROTOCOL_V2_REPLY_MAX 1024
+
+/**
+ * Size of a daemon status record, without its name. A record is, in order:
+ * - The daemon's state, one byte, see `enum daemon_state`.
+ * - The _si\_code_ of its last termination, one byte, zero if none yet.
+ * - The _si\_status_ of its last termination, one byte.
+ * - The length of its name, one byte.
+ * - The pid of its process, four bytes, MSB, zero if not spawned.
+ * - When it was last started, eight bytes, MSB, CLOCK_MONOTONIC nanoseconds, zero if never.
+ * - Its name, without terminating nul byte.
+ */
+#define PROTOCOL_STATUS_RECORD_SIZE 16
+
+/**
+ * Size of a daemon event record, without its name. A record is, in order:
+ * - The event, one byte, see @ref protocol_event.
+ * - The _si\_code_ of the termination of a reaped process, one byte, zero else.
+ * - The _si\_status_ of the termination of a reaped process, one byte, zero else.
+ * - The length of the daemon's name, one byte.
+ * - The pid of the process, four bytes, MSB, zero if none, the number of dropped events for PROTOCOL_EVENT_DROPPED.
+ * - The daemon's name, without terminating nul byte.
+ */
+#define PROTOCOL_EVENT_RECORD_SIZE 8
+
+/** Event of a daemon, first byte of an event record. */
+enum protocol_event {
+	PROTOCOL_EVENT_STARTED,   /**< A process of the daemon was spawned. */
+	PROTOCOL_EVENT_STOPPING,  /**< The daemon's process was signaled to stop. */
+	PROTOCOL_EVENT_REAPED,    /**< A process of the daemon terminated. */
+	PROTOCOL_EVENT_RESPAWNED, /**< The daemon is restarted automatically, its start follows. */
+	PROTOCOL_EVENT_FAILED,    /**< The daemon failed to start. */
+	PROTOCOL_EVENT_PARKED,    /**< The daemon crash-looped, it won't restart until cleared. */
+	PROTOCOL_EVENT_RELOADED,  /**< The daemon's configuration was reloaded, or loaded during a reload. */
+	PROTOCOL_EVENT_DROPPED,   /**< Events were dropped as the subscriber didn't read them, no daemon. */
+};
+
+/** Status of a version 2 reply, first byte of its body. */
+enum protocol_status {
+	PROTOCOL_STATUS_OK,        /**< The command was applied. */
+	PROTOCOL_STATUS_INVALID,   /**< The request is malformed, or its command unknown. */
+	PROTOCOL_STATUS_DENIED,    /**< The endpoint doesn't have the command's capability. */
+	PROTOCOL_STATUS_NOT_FOUND, /**< No daemon has the requested name. */
+	PROTOCOL_STATUS_FAILED,    /**< The command was applied, but the daemon failed, or the endpoint couldn't be created. */
+	PROTOCOL_STATUS_LIMITED,   /**< The peer exceeded its rate limit, the command wasn't applied. */
+	PROTOCOL_STATUS_MORE,      /**< Partial reply, followed by status records, the final reply comes later. */
+	PROTOCOL_STATUS_EVENT,     /**< Event of a subscription, followed by an event record, the subscription's final reply came before. */
+};
+
+/** First word of the status page, "cyst" in ASCII, in host byte order. */
+#define PROTOCOL_STATUS_PAGE_MAGIC 0x74737963
+
+/** Version of the status page's layout, second word of the status page. */
+#define PROTOCOL_STATUS_PAGE_VERSION 1
+
+/**
+ * Record of a daemon in the status page. All values are in host byte order.
+ * A record is written under a seqlock, a reader copies it, and retries
+ * if its sequence was odd or changed meanwhile.
+ */
+struct protocol_status_slot {
+	_Atomic uint32_t sequence; /**< Incremented before and after each write, odd while written. */
+	uint8_t state;      /**< The daemon's state, see `enum daemon_state`. */
+	uint8_t exitcode;   /**< The _si\_code_ of its last termination, zero if none yet. */
+	uint8_t exitstatus; /**< The _si\_status_ of its last termination. */
+	uint8_t namelen;    /**< The length of its name, zero if the slot is free. */
+	int32_t pid;        /**< The pid of its process, zero if not spawned. */
+	uint32_t restarts;  /**< Its consecutive automatic restarts. */
+	uint64_t startedat; /**< When it was last started, CLOCK_MONOTONIC nanoseconds, zero if never. */
+	char name[NAME_MAX + 1]; /**< Its name, nul terminated. */
+};
+
+/**
+ * Status page, a file cyberd maps and updates in place, which monitors map read-only.
+ * Slots are only appended, the file grows before @ref count does, so a reader whose
+ * mapping is too small for @ref count slots maps it again.
+ */
+struct protocol_status_page {
+	uint32_t magic;   /**< @ref PROTOCOL_STATUS_PAGE_MAGIC. */
+	uint32_t version; /**< @ref PROTOCOL_STATUS_PAGE_VERSION. */
+	uint32_t size;    /**< Size of a slot. */
+	_Atomic uint32_t count; /**< Number of slots following, used or free. */
+	struct protocol_status_slot slots[]; /**< Slots, in no particular order. */
+};
+
+/* PROTOCOL_H */
+#endif
@@ -1,20 +1,31 @@
 /* SPDX-License-Identifier: BSD-3-Clause */
 #include "signals.h"
 
+#ifdef CONFIG_SOCKET_SWITCH_EPOLL
+#include "socket_switch.h"
+#include "socket_node.h"
+#endif
+
 #include <sys/reboot.h> /* reboot */
 #include <assert.h> /* static_assert */
-#include <unistd.h> /* alarm */
 #include <stddef.h> /* NULL */
+#ifdef CONFIG_SOCKET_SWITCH_EPOLL
+#include <stdlib.h> /* abort */
+#include <syslog.h> /* syslog */
+#include <unistd.h> /* read */
+#include <sys/signalfd.h> /* signalfd, struct signalfd_siginfo */
+#endif
 
-volatile sig_atomic_t sigreboot, sigchld, sighup, sigalrm;
+volatile sig_atomic_t sigreboot, sigchld, sighup;
 
 /**
  * SIGTERM. Checks for additional informations from a potential _sigqueue(2)_
  * to determine which _reboot(2)_ action to engage.
- * @param siginfo Signal informations.
+ * @param code Origin of the signal.
+ * @param value Value of the signal if queued.
  */
 static void
-sigterm_handler(int, siginfo_t *siginfo, void *) {
+sigterm_received(int code, int value) {
 
 	/* Obviously, the @ref main loop is broken
 	 * if any one of these supported actions equals zero. */
@@ -23,9 +34,7 @@ sigterm_handler(int, siginfo_t *siginfo, void *) {
 	static_assert (RB_POWER_OFF != 0);
 	static_assert (RB_SW_SUSPEND != 0);
 
-	if (siginfo->si_code == SI_QUEUE) {
-		const int value = siginfo->si_value.sival_int;
-
+	if (code == SI_QUEUE) {
 		switch (value) {
 		case RB_AUTOBOOT:    [[fallthrough]];
 		case RB_HALT_SYSTEM: [[fallthrough]];
@@ -44,6 +53,15 @@ sigterm_handler(int, siginfo_t *siginfo, void *) {
 	}
 }
 
+/**
+ * SIGTERM handler.
+ * @param siginfo Signal informations.
+ */
+static void
+sigterm_handler(int, siginfo_t *siginfo, void *) {
+	sigterm_received(siginfo->si_code, siginfo->si_value.sival_int);
+}
+
 /** SIGCHLD handler, child processes reaping. */
 static void
 sigchld_handler(int) {
@@ -56,15 +74,51 @@ sighup_handler(int) {
 	sighup = 1;
 }
 
-/** SIGALRM handler, teardown timeout alarm. */
+#ifdef CONFIG_SOCKET_SWITCH_EPOLL
+/**
+ * Reads signals received through the signalfd, raising the same flags as the handlers.
+ * @param snode Signals node.
+ */
 static void
-sigalrm_handler(int) {
-	sigalrm = 1;
+signals_node_operate(struct socket_node *snode) {
+	struct signalfd_siginfo siginfo;
+
+	while (read(snode->fd, &siginfo, sizeof (siginfo)) == sizeof (siginfo)) {
+		switch (siginfo.ssi_signo) {
+		case SIGTERM:
+			sigterm_received(siginfo.ssi_code, siginfo.ssi_int);
+			break;
+		case SIGCHLD:
+			sigchld = 1;
+			break;
+		case SIGHUP:
+			sighup = 1;
+			break;
+		default:
+			break;
+		}
+	}
 }
 
 /**
- * Setup signal handlers, procmask, and returns @ref main loop's _pselect(2)_.
- * @param[out] sigmaskp Signal mask used during @ref main loop's _pselect(2)_.
+ * Signals node class. The node belongs to us,
+ * and is kept in the socket switch during teardown.
+ */
+static const struct socket_node_class signals_node_class = {
+	.operate = signals_node_operate,
+};
+
+/** Signals node, holding our signalfd. */
+static struct socket_node signals_node = {
+	.class = &signals_node_class,
+	.fd = -1,
+};
+#endif
+
+/**
+ * Setup signal handlers, procmask, and returns @ref main loop's wait signal mask.
+ * With epoll, signals are never delivered, but read from a signalfd in the socket switch.
+ * @param[out] sigmaskp Signal mask used during @ref main loop's wait.
  */
 void
 signals_setup(sigset_t *sigmaskp) {
@@ -104,35 +158,50 @@ signals_setup(sigset_t *sigmaskp) {
 	action.sa_handler = sighup_handler;
 	sigaction(SIGHUP, &action, NULL);
 
+#ifdef CONFIG_SOCKET_SWITCH_EPOLL
+	/* Signals stay blocked, and are read from the socket switch. */
+	signals_node.fd = signalfd(-1, sigmaskp, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (signals_node.fd < 0) {
+		syslog(LOG_ERR, "signals_setup: signalfd: %m");
+		abort();
+	}
+	socket_switch_insert(&signals_node);
+#else
 	/* Delivery signal mask. */
 	sigemptyset(sigmaskp);
+#endif
 }
 
 /**
- * Timeout alarm.
- * Sets the process mask to block SIGALRM,
- * setup its signal handler and planify an alarm.
- * @param[out] sigmaskp Signal mask used during @ref teardown loop's _sigsuspend(2)_.
+ * Teardown signal mask.
+ * Only SIGCHLD is delivered while daemons are reaped,
+ * they are killed individually once their stop timeout expired.
+ * @param[out] sigmaskp Signal mask used during @ref teardown loop's wait.
  */
 void
-signals_alarm(sigset_t *sigmaskp, unsigned int seconds) {
-	struct sigaction action;
-	sigset_t oldmask;
+signals_teardown(sigset_t *sigmaskp) {
 
-	/* Add SIGALRM to process signal mask. */
-	sigemptyset(sigmaskp);
-	sigaddset(sigmaskp, SIGALRM);
-	sigprocmask(SIG_BLOCK, sigmaskp, &oldmask);
+	sigprocmask(SIG_SETMASK, NULL, sigmaskp);
+#ifndef CONFIG_SOCKET_SWITCH_EPOLL
+	sigdelset(sigmaskp, SIGCHLD);
+#endif
+}
 
-	/* Set SIGALRM signal handler. */
-	sigfillset(&action.sa_mask);
-	action.sa_handler = sigalrm_handler;
-	sigaction(SIGALRM, &action, NULL);
+/**
+ * Restores the default disposition of every signal cyberd handles.
+ * Used by children which share our address space until they exec,
+ * so none of our handlers can run in them and modify our state.
+ */
+void
+signals_default(void) {
+	static const int signals[] = { SIGTERM, SIGCHLD, SIGHUP };
+	struct sigaction action;
 
-	/* Set timeout alarm. */
-	alarm(seconds);
+	sigemptyset(&action.sa_mask);
+	action.sa_flags = 0;
+	action.sa_handler = SIG_DFL;
 
-	/* Delivery signal mask. */
-	sigdelset(&oldmask, SIGCHLD);
-	*sigmaskp = oldmask;
+	for (unsigned int i = 0; i < sizeof (signals) / sizeof (*signals); i++) {
+		sigaction(signals[i], &action, NULL);
+	}
 }
@@ -4,13 +4,16 @@
 
 #include <signal.h> /* sig_atomic_t, sigset_t */
 
-extern volatile sig_atomic_t sigreboot, sigchld, sighup, sigalrm;
+extern volatile sig_atomic_t sigreboot, sigchld, sighup;
 
 void
 signals_setup(sigset_t *sigmaskp);
 
 void
-signals_alarm(sigset_t *sigmaskp, unsigned int seconds);
+signals_teardown(sigset_t *sigmaskp);
+
+void
+signals_default(void);
 
 /* SIGNALS_H */
 #endif
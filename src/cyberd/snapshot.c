@@ -0,0 +1,678 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#include "snapshot.h"
+
+#include "daemon_conf.h"
+
+#include <stdint.h> /* uint32_t, uint64_t, int64_t, uintptr_t */
+#include <stdlib.h> /* realloc, free */
+#include <string.h> /* memchr, memcpy, strlen */
+#include <stdio.h> /* snprintf, rename */
+#include <limits.h> /* PATH_MAX */
+#include <sys/mman.h> /* mmap, munmap */
+#include <sys/stat.h> /* stat, fstat, fstatat */
+#include <syslog.h> /* syslog */
+#include <fcntl.h> /* open */
+#include <unistd.h> /* write, close, unlink */
+#include <errno.h> /* errno, ENOENT, EINTR */
+
+/** First word of a snapshot, "cysn" in ASCII, in host byte order. */
+#define SNAPSHOT_MAGIC 0x6e737963
+
+/** Expands to its argument, as a string literal. */
+#define SNAPSHOT_STRINGIFY(value) #value
+/** Expands to the expansion of its argument, as a string literal. */
+#define SNAPSHOT_STRING(value) SNAPSHOT_STRINGIFY(value)
+
+/**
+ * Identity of the build, hashed in snapshots by @ref snapshot_build.
+ * Rebuilding cyberd, or changing the defaults configurations are initialized with, invalidates snapshots.
+ */
+#define SNAPSHOT_BUILD __DATE__ " " __TIME__ \
+	" " SNAPSHOT_STRING(CONFIG_DAEMON_DEFAULT_WORKDIR) \
+	" " SNAPSHOT_STRING(CONFIG_DAEMON_DEV_NULL) \
+	" " SNAPSHOT_STRING(CONFIG_DAEMON_CONF_DEFAULT_UMASK) \
+	" " SNAPSHOT_STRING(CONFIG_DAEMON_CONF_HAS_RTSIG) \
+	" " SNAPSHOT_STRING(CONFIG_DAEMON_CONF_MAX_UID) \
+	" " SNAPSHOT_STRING(CONFIG_DAEMON_CONF_MAX_GID) \
+	" " SNAPSHOT_STRING(CONFIG_DAEMON_CONF_RESTART_DELAY) \
+	" " SNAPSHOT_STRING(CONFIG_DAEMON_CONF_RESTART_DELAY_MAX) \
+	" " SNAPSHOT_STRING(CONFIG_DAEMON_CONF_CRASH_LOOP_COUNT) \
+	" " SNAPSHOT_STRING(CONFIG_DAEMON_CONF_CRASH_LOOP_WINDOW) \
+	" " SNAPSHOT_STRING(CONFIG_DAEMON_CONF_REPLACE_DELAY) \
+	" " SNAPSHOT_STRING(CONFIG_DAEMON_CONF_STOP_TIMEOUT)
+
+/** Users database, names in configurations are resolved through it. */
+#define SNAPSHOT_PASSWD "/etc/passwd"
+
+/** Groups database, names in configurations are resolved through it. */
+#define SNAPSHOT_GROUP "/etc/group"
+
+/** Converts a heap offset to the value of a pointer field of a record's configuration. */
+#define SNAPSHOT_OFFSET(offset) ((void *)(uintptr_t)(offset))
+
+/**
+ * Status of a file, as recorded by a snapshot.
+ */
+struct snapshot_source {
+	uint64_t dev;  /**< Device of the file. */
+	uint64_t ino;  /**< Inode of the file. */
+	int64_t size;  /**< Size of the file. */
+	int64_t sec;   /**< Modification time of the file, seconds. */
+	int64_t nsec;  /**< Modification time of the file, nanoseconds. */
+};
+
+/**
+ * Record of a configuration file in a snapshot.
+ */
+struct snapshot_record {
+	struct snapshot_source source; /**< Configuration file when it was parsed. */
+	uint64_t name;  /**< Heap offset of the daemon's name. */
+	uint64_t valid; /**< Whether the file was successfully parsed, @ref conf is unused else. */
+	struct daemon_conf conf; /**< Image of the parsed configuration, pointers hold heap offsets, zero for _NULL_. */
+};
+
+/**
+ * A snapshot, a flat file of parsed configurations. All values are in host byte order.
+ * Records are followed by the heap, holding names, strings and lists of strings.
+ * Offsets are relative to the heap, whose first byte is reserved so no offset is zero.
+ * It is only read by the cyberd which wrote it, see @ref SNAPSHOT_BUILD.
+ */
+struct snapshot_header {
+	uint32_t magic;    /**< @ref SNAPSHOT_MAGIC. */
+	uint32_t count;    /**< Number of records. */
+	uint64_t build;    /**< Hash of @ref SNAPSHOT_BUILD. */
+	uint64_t confsize; /**< Size of `struct daemon_conf`. */
+	uint64_t heap;     /**< Offset of the heap in the snapshot. */
+	uint64_t size;     /**< Size of the snapshot. */
+	struct snapshot_source directory; /**< Configuration directory when it was read. */
+	struct snapshot_source passwd;    /**< Users database when the configuration directory was read. */
+	struct snapshot_source group;     /**< Groups database when the configuration directory was read. */
+	struct snapshot_record records[]; /**< Records, in no particular order. */
+};
+
+/**
+ * Snapshot being built by @ref snapshot_append, until saved or discarded.
+ */
+static struct {
+	struct snapshot_record *records; /**< Records. */
+	size_t count; /**< Number of @ref records. */
+	size_t capacity; /**< Capacity of @ref records. */
+	char *heap; /**< Heap. */
+	size_t heapsize; /**< Size of @ref heap. */
+	size_t heapcapacity; /**< Capacity of @ref heap. */
+	struct snapshot_source passwd; /**< Users database, recorded by @ref snapshot_load before files are parsed. */
+	struct snapshot_source group; /**< Groups database, recorded by @ref snapshot_load before files are parsed. */
+	bool failed; /**< An allocation failed, the snapshot is incomplete and won't be saved. */
+} snapshot_builder;
+
+/**
+ * Records the status of a file.
+ * @param[out] source Recorded status.
+ * @param st Status of the file.
+ */
+static void
+snapshot_source_set(struct snapshot_source *source, const struct stat *st) {
+	source->dev = st->st_dev;
+	source->ino = st->st_ino;
+	source->size = st->st_size;
+	source->sec = st->st_mtim.tv_sec;
+	source->nsec = st->st_mtim.tv_nsec;
+}
+
+/**
+ * Checks whether a file is unchanged since its status was recorded.
+ * @param source Recorded status.
+ * @param st Status of the file.
+ * @returns Whether the file is unchanged.
+ */
+static bool
+snapshot_source_matches(const struct snapshot_source *source, const struct stat *st) {
+	return source->dev == st->st_dev && source->ino == st->st_ino
+		&& source->size == st->st_size
+		&& source->sec == st->st_mtim.tv_sec && source->nsec == st->st_mtim.tv_nsec;
+}
+
+/**
+ * Records the status of a database, zeroed if it can't be stat'ed, so it is unchanged as long as it stays missing.
+ * @param[out] source Recorded status.
+ * @param path Path of the database.
+ */
+static void
+snapshot_source_database(struct snapshot_source *source, const char *path) {
+	struct stat st;
+
+	if (stat(path, &st) == 0) {
+		snapshot_source_set(source, &st);
+	} else {
+		*source = (struct snapshot_source) { };
+	}
+}
+
+/**
+ * Checks whether two recorded status are the same.
+ * @param lhs Recorded status.
+ * @param rhs Recorded status.
+ * @returns Whether both status are the same.
+ */
+static bool
+snapshot_source_equals(const struct snapshot_source *lhs, const struct snapshot_source *rhs) {
+	return lhs->dev == rhs->dev && lhs->ino == rhs->ino
+		&& lhs->size == rhs->size
+		&& lhs->sec == rhs->sec && lhs->nsec == rhs->nsec;
+}
+
+/**
+ * Hashes @ref SNAPSHOT_BUILD, with 64 bits FNV-1a.
+ * @returns The identity of the build.
+ */
+static uint64_t
+snapshot_build(void) {
+	const char *build = SNAPSHOT_BUILD;
+	uint64_t hash = 0xcbf29ce484222325;
+
+	while (*build != '\0') {
+		hash = (hash ^ (unsigned char)*build++) * 0x100000001b3;
+	}
+
+	return hash;
+}
+
+/*******************
+ * Snapshot saving *
+ *******************/
+
+/**
+ * Reserves space at the end of the heap of the snapshot being built.
+ * @param size Size to reserve.
+ * @param alignment Alignment of the reserved space.
+ * @returns The heap offset of the reserved space, zero on error.
+ */
+static size_t
+snapshot_heap_reserve(size_t size, size_t alignment) {
+	const size_t offset = (snapshot_builder.heapsize + alignment - 1) & ~(alignment - 1);
+
+	if (offset + size > snapshot_builder.heapcapacity) {
+		size_t capacity = snapshot_builder.heapcapacity != 0 ? snapshot_builder.heapcapacity : 4096;
+
+		while (offset + size > capacity) {
+			capacity *= 2;
+		}
+
+		char * const heap = realloc(snapshot_builder.heap, capacity);
+		if (heap == NULL) {
+			syslog(LOG_ERR, "snapshot_append: realloc: %m");
+			snapshot_builder.failed = true;
+			return 0;
+		}
+
+		snapshot_builder.heap = heap;
+		snapshot_builder.heapcapacity = capacity;
+	}
+
+	snapshot_builder.heapsize = offset + size;
+
+	return offset;
+}
+
+/**
+ * Copies a string in the heap of the snapshot being built.
+ * @param string String, may be _NULL_.
+ * @returns The heap offset of the copy, zero if @p string is _NULL_ or on error.
+ */
+static size_t
+snapshot_heap_string(const char *string) {
+
+	if (string == NULL) {
+		return 0;
+	}
+
+	const size_t size = strlen(string) + 1;
+	const size_t offset = snapshot_heap_reserve(size, 1);
+
+	if (offset != 0) {
+		memcpy(snapshot_builder.heap + offset, string, size);
+	}
+
+	return offset;
+}
+
+/**
+ * Copies a list of strings in the heap of the snapshot being built.
+ * @param list List of strings, _NULL_ terminated, may be _NULL_.
+ * @returns The heap offset of the copy, zero if @p list is _NULL_ or on error.
+ */
+static size_t
+snapshot_heap_list(char * const *list) {
+
+	if (list == NULL) {
+		return 0;
+	}
+
+	size_t count = 0;
+	while (list[count] != NULL) {
+		count++;
+	}
+
+	const size_t offset = snapshot_heap_reserve((count + 1) * sizeof (*list), _Alignof (char *));
+	if (offset == 0) {
+		return 0;
+	}
+
+	for (size_t i = 0; i <= count; i++) {
+		/* The heap may move while strings are copied. */
+		char ** const copy = (char **)(snapshot_builder.heap + offset);
+		copy[i] = SNAPSHOT_OFFSET(snapshot_heap_string(list[i]));
+	}
+
+	return offset;
+}
+
+/**
+ * Appends a configuration file to the snapshot being built.
+ * Every configuration file of the directory must be appended, even those which failed to parse.
+ * @param name Name of the daemon.
+ * @param st Status of the configuration file, taken before it was parsed.
+ * @param conf Parsed configuration, _NULL_ if the file failed to parse.
+ */
+void
+snapshot_append(const char *name, const struct stat *st, const struct daemon_conf *conf) {
+
+	if (snapshot_builder.failed) {
+		return;
+	}
+
+	if (snapshot_builder.count == snapshot_builder.capacity) {
+		const size_t capacity = snapshot_builder.capacity != 0 ? snapshot_builder.capacity * 2 : 64;
+		struct snapshot_record * const records = realloc(snapshot_builder.records, capacity * sizeof (*records));
+
+		if (records == NULL) {
+			syslog(LOG_ERR, "snapshot_append: realloc: %m");
+			snapshot_builder.failed = true;
+			return;
+		}
+
+		snapshot_builder.records = records;
+		snapshot_builder.capacity = capacity;
+	}
+
+	if (snapshot_builder.heapsize == 0) {
+		/* Reserve the first byte, so zero is never a valid offset. */
+		snapshot_heap_reserve(1, 1);
+	}
+
+	struct snapshot_record record = { .valid = conf != NULL };
+
+	snapshot_source_set(&record.source, st);
+	record.name = snapshot_heap_string(name);
+
+	if (conf != NULL) {
+		record.conf = *conf;
+		record.conf.path = SNAPSHOT_OFFSET(snapshot_heap_string(conf->path));
+		record.conf.arguments = SNAPSHOT_OFFSET(snapshot_heap_list(conf->arguments));
+		record.conf.environment = SNAPSHOT_OFFSET(snapshot_heap_list(conf->environment));
+		record.conf.workdir = SNAPSHOT_OFFSET(snapshot_heap_string(conf->workdir));
+		record.conf.in = SNAPSHOT_OFFSET(snapshot_heap_string(conf->in));
+		record.conf.out = SNAPSHOT_OFFSET(snapshot_heap_string(conf->out));
+		record.conf.err = SNAPSHOT_OFFSET(snapshot_heap_string(conf->err));
+		record.conf.template = SNAPSHOT_OFFSET(snapshot_heap_string(conf->template));
+		record.conf.tag = SNAPSHOT_OFFSET(snapshot_heap_string(conf->tag));
+		record.conf.mapped = 0;
+	}
+
+	if (!snapshot_builder.failed) {
+		snapshot_builder.records[snapshot_builder.count++] = record;
+	}
+}
+
+/**
+ * Writes a buffer entirely.
+ * @param fd File descriptor.
+ * @param data Buffer.
+ * @param size Size of @p data.
+ * @returns Zero on success, -1 on error.
+ */
+static int
+snapshot_write(int fd, const void *data, size_t size) {
+	const char *buffer = data;
+
+	while (size != 0) {
+		const ssize_t written = write(fd, buffer, size);
+
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+
+		buffer += written;
+		size -= written;
+	}
+
+	return 0;
+}
+
+/**
+ * Saves the snapshot built by @ref snapshot_append, and discards it.
+ * The snapshot is written aside and renamed, so a reader never sees it partially written.
+ * @param path Path of the snapshot.
+ * @param dirst Status of the configuration directory, taken before it was read.
+ */
+void
+snapshot_save(const char *path, const struct stat *dirst) {
+	const size_t recordssize = snapshot_builder.count * sizeof (*snapshot_builder.records);
+	struct snapshot_header header = {
+		.magic = SNAPSHOT_MAGIC,
+		.count = snapshot_builder.count,
+		.build = snapshot_build(),
+		.confsize = sizeof (struct daemon_conf),
+		.heap = sizeof (header) + recordssize,
+		.size = sizeof (header) + recordssize + snapshot_builder.heapsize,
+		.passwd = snapshot_builder.passwd,
+		.group = snapshot_builder.group,
+	};
+	char tmppath[PATH_MAX];
+
+	if (snapshot_builder.failed) {
+		goto discard;
+	}
+
+	snapshot_source_set(&header.directory, dirst);
+
+	if (snprintf(tmppath, sizeof (tmppath), "%s.tmp", path) >= sizeof (tmppath)) {
+		syslog(LOG_ERR, "snapshot_save: '%s' path too long", path);
+		goto discard;
+	}
+
+	const int fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		syslog(LOG_ERR, "snapshot_save: open '%s': %m", tmppath);
+		goto discard;
+	}
+
+	if (snapshot_write(fd, &header, sizeof (header)) != 0
+		|| snapshot_write(fd, snapshot_builder.records, recordssize) != 0
+		|| snapshot_write(fd, snapshot_builder.heap, snapshot_builder.heapsize) != 0) {
+		syslog(LOG_ERR, "snapshot_save: write '%s': %m", tmppath);
+		goto write_failure;
+	}
+
+	close(fd);
+
+	if (rename(tmppath, path) != 0) {
+		syslog(LOG_ERR, "snapshot_save: rename '%s': %m", tmppath);
+		unlink(tmppath);
+		goto discard;
+	}
+
+	syslog(LOG_INFO, "snapshot_save: %u configurations saved to '%s'", header.count, path);
+
+	goto discard;
+write_failure:
+	close(fd);
+	unlink(tmppath);
+discard:
+	snapshot_discard();
+}
+
+/**
+ * Discards the snapshot built by @ref snapshot_append, if any.
+ */
+void
+snapshot_discard(void) {
+
+	free(snapshot_builder.records);
+	free(snapshot_builder.heap);
+
+	snapshot_builder.records = NULL;
+	snapshot_builder.count = 0;
+	snapshot_builder.capacity = 0;
+	snapshot_builder.heap = NULL;
+	snapshot_builder.heapsize = 0;
+	snapshot_builder.heapcapacity = 0;
+	snapshot_builder.passwd = (struct snapshot_source) { };
+	snapshot_builder.group = (struct snapshot_source) { };
+	snapshot_builder.failed = false;
+}
+
+/********************
+ * Snapshot loading *
+ ********************/
+
+/**
+ * Relocates a string of a mapped snapshot in place.
+ * @param header Mapped snapshot.
+ * @param[in,out] stringp Pointer field holding a heap offset, a pointer into the mapping once relocated.
+ * @returns Zero on success, -1 if the offset is out of the heap or the string isn't terminated.
+ */
+static int
+snapshot_relocate_string(const struct snapshot_header *header, char **stringp) {
+	const char * const heap = (const char *)header + header->heap;
+	const size_t heapsize = header->size - header->heap, offset = (uintptr_t)*stringp;
+
+	if (offset == 0) {
+		return 0;
+	}
+
+	if (offset >= heapsize || memchr(heap + offset, '\0', heapsize - offset) == NULL) {
+		return -1;
+	}
+
+	*stringp = (char *)heap + offset;
+
+	return 0;
+}
+
+/**
+ * Relocates a list of strings of a mapped snapshot in place.
+ * @param header Mapped snapshot.
+ * @param[in,out] listp Pointer field holding a heap offset, a pointer into the mapping once relocated.
+ * @returns Zero on success, -1 if the list or one of its strings is invalid.
+ */
+static int
+snapshot_relocate_list(const struct snapshot_header *header, char ***listp) {
+	char * const heap = (char *)header + header->heap;
+	const size_t heapsize = header->size - header->heap, offset = (uintptr_t)*listp;
+
+	if (offset == 0) {
+		return 0;
+	}
+
+	if (offset % _Alignof (char *) != 0 || offset >= heapsize) {
+		return -1;
+	}
+
+	char ** const list = (char **)(heap + offset);
+	const size_t capacity = (heapsize - offset) / sizeof (*list);
+	size_t i = 0;
+
+	while (i < capacity && list[i] != NULL) {
+		if (snapshot_relocate_string(header, list + i) != 0) {
+			return -1;
+		}
+		i++;
+	}
+
+	if (i == capacity) {
+		return -1;
+	}
+
+	*listp = list;
+
+	return 0;
+}
+
+/**
+ * Relocates a record's configuration in place, it then points into the mapping.
+ * @param header Mapped snapshot.
+ * @param conf Configuration of a record.
+ * @returns Zero on success, -1 if the configuration is invalid.
+ */
+static int
+snapshot_relocate_conf(const struct snapshot_header *header, struct daemon_conf *conf) {
+
+	if (snapshot_relocate_string(header, &conf->path) != 0
+		|| snapshot_relocate_list(header, &conf->arguments) != 0
+		|| snapshot_relocate_list(header, &conf->environment) != 0
+		|| snapshot_relocate_string(header, &conf->workdir) != 0
+		|| snapshot_relocate_string(header, &conf->in) != 0
+		|| snapshot_relocate_string(header, &conf->out) != 0
+		|| snapshot_relocate_string(header, &conf->err) != 0
+		|| snapshot_relocate_string(header, &conf->template) != 0
+		|| snapshot_relocate_string(header, &conf->tag) != 0) {
+		return -1;
+	}
+
+	conf->mapped = 1;
+
+	return 0;
+}
+
+/**
+ * Checks a mapped snapshot is one of ours, and its directory, configuration files and databases are unchanged.
+ * @param header Mapped snapshot.
+ * @param size Size of the mapping.
+ * @param dirfd Configuration directory.
+ * @param dirst Status of the configuration directory.
+ * @returns Zero if the snapshot is valid, -1 if not.
+ */
+static int
+snapshot_check(const struct snapshot_header *header, size_t size, int dirfd, const struct stat *dirst) {
+
+	if (header->magic != SNAPSHOT_MAGIC || header->confsize != sizeof (struct daemon_conf) || header->size != size
+		|| header->heap != sizeof (*header) + (uint64_t)header->count * sizeof (*header->records)
+		|| header->heap >= header->size) {
+		syslog(LOG_WARNING, "snapshot_load: Invalid snapshot");
+		return -1;
+	}
+
+	if (header->build != snapshot_build()) {
+		syslog(LOG_INFO, "snapshot_load: Snapshot from another build");
+		return -1;
+	}
+
+	if (!snapshot_source_equals(&header->passwd, &snapshot_builder.passwd)
+		|| !snapshot_source_equals(&header->group, &snapshot_builder.group)) {
+		syslog(LOG_INFO, "snapshot_load: Users or groups changed");
+		return -1;
+	}
+
+	if (!snapshot_source_matches(&header->directory, dirst)) {
+		syslog(LOG_INFO, "snapshot_load: Configuration directory changed");
+		return -1;
+	}
+
+	const char * const heap = (const char *)header + header->heap;
+	const size_t heapsize = header->size - header->heap;
+
+	for (uint32_t i = 0; i < header->count; i++) {
+		const struct snapshot_record * const record = &header->records[i];
+		struct stat st;
+
+		if (record->name == 0 || record->name >= heapsize
+			|| memchr(heap + record->name, '\0', heapsize - record->name) == NULL) {
+			syslog(LOG_WARNING, "snapshot_load: Invalid snapshot");
+			return -1;
+		}
+
+		const char * const name = heap + record->name;
+		if (fstatat(dirfd, name, &st, 0) != 0 || !snapshot_source_matches(&record->source, &st)) {
+			syslog(LOG_INFO, "snapshot_load: '%s' changed", name);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Loads daemons' configurations from a snapshot, if valid and up to date.
+ * The snapshot is privately mapped and its configurations relocated in place, they are
+ * used directly and never freed. Nothing is loaded unless every configuration file is unchanged,
+ * as well as the users and groups databases names were resolved through. Their status is recorded
+ * first, for the snapshot saved if configuration files must be parsed.
+ * @param path Path of the snapshot.
+ * @param dirfd Configuration directory.
+ * @param dirst Status of the configuration directory, taken before it was read.
+ * @param load Callback for each successfully parsed configuration file.
+ * @returns Zero if daemons were loaded from the snapshot, -1 if the configuration files must be parsed.
+ */
+int
+snapshot_load(const char *path, int dirfd, const struct stat *dirst,
+	void (* const load)(const char *name, const struct stat *st, const struct daemon_conf *conf)) {
+	struct stat st;
+
+	snapshot_source_database(&snapshot_builder.passwd, SNAPSHOT_PASSWD);
+	snapshot_source_database(&snapshot_builder.group, SNAPSHOT_GROUP);
+
+	const int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno != ENOENT) {
+			syslog(LOG_ERR, "snapshot_load: open '%s': %m", path);
+		}
+		goto open_failure;
+	}
+
+	if (fstat(fd, &st) != 0) {
+		syslog(LOG_ERR, "snapshot_load: fstat '%s': %m", path);
+		goto fstat_failure;
+	}
+
+	/* Configurations are trusted as if parsed, only root may have written them. */
+	if (!S_ISREG(st.st_mode) || st.st_uid != 0 || (st.st_mode & (S_IWGRP | S_IWOTH)) != 0) {
+		syslog(LOG_WARNING, "snapshot_load: '%s' is not a regular file only writable by root", path);
+		goto fstat_failure;
+	}
+
+	if (st.st_size < sizeof (struct snapshot_header)) {
+		syslog(LOG_WARNING, "snapshot_load: '%s' truncated", path);
+		goto fstat_failure;
+	}
+
+	struct snapshot_header * const header = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (header == MAP_FAILED) {
+		syslog(LOG_ERR, "snapshot_load: mmap '%s': %m", path);
+		goto fstat_failure;
+	}
+
+	close(fd);
+
+	if (snapshot_check(header, st.st_size, dirfd, dirst) != 0) {
+		goto stale;
+	}
+
+	for (uint32_t i = 0; i < header->count; i++) {
+		struct snapshot_record * const record = &header->records[i];
+
+		if (record->valid && snapshot_relocate_conf(header, &record->conf) != 0) {
+			syslog(LOG_WARNING, "snapshot_load: Invalid snapshot");
+			goto stale;
+		}
+	}
+
+	for (uint32_t i = 0; i < header->count; i++) {
+		const struct snapshot_record * const record = &header->records[i];
+
+		if (record->valid) {
+			const struct stat source = {
+				.st_dev = record->source.dev,
+				.st_ino = record->source.ino,
+				.st_size = record->source.size,
+				.st_mtim = { .tv_sec = record->source.sec, .tv_nsec = record->source.nsec },
+			};
+
+			load((const char *)header + header->heap + record->name, &source, &record->conf);
+		}
+	}
+
+	syslog(LOG_INFO, "snapshot_load: %u configurations loaded from '%s'", header->count, path);
+
+	return 0;
+stale:
+	munmap(header, st.st_size);
+	return -1;
+fstat_failure:
+	close(fd);
+open_failure:
+	return -1;
+}
@@ -0,0 +1,22 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+struct stat;
+struct daemon_conf;
+
+int
+snapshot_load(const char *path, int dirfd, const struct stat *dirst,
+	void (* const load)(const char *name, const struct stat *st, const struct daemon_conf *conf));
+
+void
+snapshot_append(const char *name, const struct stat *st, const struct daemon_conf *conf);
+
+void
+snapshot_save(const char *path, const struct stat *dirst);
+
+void
+snapshot_discard(void);
+
+/* SNAPSHOT_H */
+#endif
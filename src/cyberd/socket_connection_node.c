@@ -7,20 +7,51 @@
 #include "socket_node.h"
 #include "configuration.h"
 #include "daemon.h"
+#include "events.h"
+#include "peers.h"
+#include "protocol.h"
 
+#include <stddef.h> /* offsetof */
 #include <stdlib.h> /* malloc, realloc, free */
-#include <string.h> /* memchr */
+#include <string.h> /* memchr, memcpy, memmove */
 #include <signal.h> /* sigqueue */
 #include <syslog.h> /* syslog */
 #include <unistd.h> /* close, read */
+#include <errno.h> /* errno, EAGAIN */
+#include <assert.h> /* static_assert */
+#include <sys/socket.h> /* send, sendmmsg, recvmmsg, MSG_DONTWAIT, ... */
 #include <sys/reboot.h> /* reboot, RB_POWER_OFF, ... */
-#include <arpa/inet.h> /* ntohl */
-#include <limits.h> /* NAME_MAX */
+#include <arpa/inet.h> /* ntohl, htonl */
+#include <limits.h> /* NAME_MAX, UINT_MAX */
+#include <endian.h> /* htobe64 */
 
-/** Connection message parser and executor. */
+/** Size of a version 2 status reply, its header and its status. */
+#define PARSER_REPLY_SIZE (PROTOCOL_V2_HEADER_SIZE + 1)
+
+/** Maximum number of datagrams received, or sent, at once on SOCK_SEQPACKET connections. */
+#define SOCKET_CONNECTION_NODE_DATAGRAMS 8
+
+static_assert (CONFIG_SOCKET_CONNECTIONS_BUFFER_SIZE >= PROTOCOL_V2_HEADER_SIZE + PROTOCOL_V2_REQUEST_MAX,
+	"A version 2 request datagram must fit in the receive buffer");
+
+static_assert (PROTOCOL_V2_REPLY_MAX >= 1 + PROTOCOL_STATUS_RECORD_SIZE + NAME_MAX,
+	"A status record must fit in a partial reply");
+
+static_assert (CONFIG_SOCKET_CONNECTIONS_REPLIES_SIZE >= 2 * PARSER_REPLY_SIZE + PROTOCOL_STATUS_RECORD_SIZE + NAME_MAX,
+	"The status of one daemon must fit in the replies buffer");
+
+/**
+ * Connection message parser and executor.
+ * Version 1 messages are parsed as a stream, each command executed as soon as it is complete.
+ * Version 2 requests are framed, each executed once received, and its status replied.
+ * On SOCK_SEQPACKET connections, each datagram is a version 2 request, executed in place.
+ * Once subscribed, events are queued along replies, and dropped if they don't fit.
+ */
 struct parser {
 	capset_t capabilities; /**< Capabilities of our connection. */
+	struct peer *peer; /**< Peer whose rate limit applies to our connection, _NULL_ if privileged. */
 	enum parser_state {
+		PARSER_STATE_VERSION,
 		PARSER_STATE_COMMAND,
 		PARSER_STATE_ENDPOINT_CREATE_CAPABILITIES,
 		PARSER_STATE_ENDPOINT_CREATE_NAME,
@@ -28,6 +59,12 @@ struct parser {
 		PARSER_STATE_DAEMON_STOP_NAME,
 		PARSER_STATE_DAEMON_RELOAD_NAME,
 		PARSER_STATE_DAEMON_END_NAME,
+		PARSER_STATE_DAEMON_CLEAR_NAME,
+		PARSER_STATE_DAEMON_RESTART_NAME,
+		PARSER_STATE_DAEMON_REPLACE_NAME,
+		PARSER_STATE_FRAME_HEADER,
+		PARSER_STATE_FRAME_BODY,
+		PARSER_STATE_FRAME_SKIP,
 		PARSER_STATE_INVALID,
 	} state; /**< State of the parser */
 	union {
@@ -46,25 +83,179 @@ struct parser {
 			unsigned int len; /**< Current Length of name. */
 			char buf[NAME_MAX + 1]; /**< Name of the daemon being referenced. */
 		} daemon;
+		struct {
+			uint32_t length; /**< Length of the request's body. */
+			uint32_t request; /**< Identifier of the request, chosen by the client. */
+			uint32_t size; /**< How many bytes of the header, the body, or the skipped body, already parsed. */
+			char buf[PROTOCOL_V2_REQUEST_MAX]; /**< Header, then body of the request. */
+		} frame;
 	};
+	struct {
+		char *buf; /**< Replies not sent yet, allocated once the connection uses version 2. */
+		unsigned int len; /**< Length of the replies not sent yet. */
+		unsigned int size; /**< Size of @ref buf, grown past CONFIG_SOCKET_CONNECTIONS_REPLIES_SIZE by status snapshots. */
+		unsigned int allowance; /**< Length of the status snapshot not sent yet, exempted from the replies limit. */
+		bool snapshot; /**< A status snapshot of all daemons is being appended. */
+		bool overflow; /**< A reply didn't fit, the client doesn't read its replies. */
+		bool watched; /**< The connection is watched for writability, until its replies are sent. */
+	} replies;
+	struct {
+		struct events_subscriber subscriber; /**< Registered while subscribed. */
+		uint32_t request; /**< Identifier of the subscription request. */
+		uint32_t dropped; /**< Number of events dropped, not reported yet. */
+		bool subscribed; /**< The connection subscribed to daemons' events. */
+	} events;
 };
 
 /** Connection node, with its messages parser. */
 struct socket_connection_node {
 	struct socket_node super;
 	struct parser parser;
+	bool seqpacket; /**< Each request and each reply is one datagram. */
 };
 
-/******************************
- * Connection commands parser *
- ******************************/
+/** Number of connections of unprivileged endpoints, capped to CONFIG_SOCKET_CONNECTIONS_MAX. */
+static unsigned int socket_connections;
+
+/** Whether a connection was refused since the cap was last reached, to log it once. */
+static bool socket_connections_capped;
+
+/***********************
+ * Connection commands *
+ ***********************/
 
-static inline void
-queue_reboot(int howto) {
+static enum protocol_status
+command_reboot(int howto) {
 	const union sigval value = { .sival_int = howto };
 
 	if (sigqueue(getpid(), SIGTERM, value) != 0) {
 		syslog(LOG_ERR, "socket_connection_node: sigqueue(%#.8x): %m", howto);
+		return PROTOCOL_STATUS_FAILED;
+	}
+
+	return PROTOCOL_STATUS_OK;
+}
+
+/**
+ * Creates an endpoint.
+ * @param allowed Capabilities of the requesting connection.
+ * @param requested Requested capability set, with its flags.
+ * @param name Name of the endpoint.
+ * @returns Status of the creation.
+ */
+static enum protocol_status
+command_endpoint_create(capset_t allowed, uint32_t requested, const char *name) {
+	const capset_t capabilities = allowed & requested;
+	const int type = (requested & PROTOCOL_ENDPOINT_SEQPACKET) != 0 ? SOCK_SEQPACKET : SOCK_STREAM;
+
+	if (capabilities == 0 || *name == '\0' || *name == '.') {
+		return PROTOCOL_STATUS_INVALID;
+	}
+
+	struct socket_node * const snode = socket_endpoint_node_create(name, capabilities, type, false);
+	if (snode == NULL) {
+		return PROTOCOL_STATUS_FAILED;
+	}
+
+	if (socket_switch_insert(snode) != 0) {
+		return PROTOCOL_STATUS_FAILED;
+	}
+
+	return PROTOCOL_STATUS_OK;
+}
+
+/** Whether the last replace failed, its daemon keeping its current process, see @ref command_replace. */
+static bool command_replace_failed;
+
+/**
+ * Replaces a daemon. As a failed replace doesn't fail the daemon, the failure is recorded.
+ * @param daemon Daemon to replace.
+ */
+static void
+command_replace(struct daemon *daemon) {
+	command_replace_failed = daemon_replace(daemon) != 0;
+}
+
+/**
+ * Whether an action failed on a daemon, see @ref command_daemon.
+ * @param daemon Daemon the action was applied to.
+ * @returns Whether the daemon failed, or its replace.
+ */
+static bool
+command_failed(const struct daemon *daemon) {
+	const bool failed = daemon->state == DAEMON_FAILED || command_replace_failed;
+
+	command_replace_failed = false;
+
+	return failed;
+}
+
+/**
+ * Bulk daemon command, see @ref command_daemon.
+ */
+struct command_daemons {
+	void (* const action)(struct daemon *); /**< Action applied to each selected daemon. */
+	unsigned int failed; /**< Number of selected daemons which failed. */
+};
+
+/**
+ * Applies the action of a bulk command to one of its daemons.
+ * @param daemon Selected daemon.
+ * @param data Bulk command.
+ */
+static void
+command_daemons_apply(struct daemon *daemon, void *data) {
+	struct command_daemons * const command = data;
+
+	command->action(daemon);
+	command->failed += command_failed(daemon);
+}
+
+/**
+ * Applies an action to a daemon. If no daemon has this name and it is a tag or a pattern,
+ * see @ref configuration_select, the action is applied to all the daemons it selects.
+ * @param name Name of the daemon, or a selector.
+ * @param action Action.
+ * @returns Status of the command, failed if any selected daemon failed.
+ */
+static enum protocol_status
+command_daemon(const char *name, void (* const action)(struct daemon *)) {
+	struct daemon * const daemon = configuration_find(name);
+
+	if (daemon == NULL) {
+		struct command_daemons command = { .action = action };
+
+		if (!configuration_selector(name) || configuration_select(name, command_daemons_apply, &command) == 0) {
+			return PROTOCOL_STATUS_NOT_FOUND;
+		}
+
+		return command.failed == 0 ? PROTOCOL_STATUS_OK : PROTOCOL_STATUS_FAILED;
+	}
+
+	action(daemon);
+
+	return !command_failed(daemon) ? PROTOCOL_STATUS_OK : PROTOCOL_STATUS_FAILED;
+}
+
+/******************************
+ * Connection commands parser *
+ ******************************/
+
+/**
+ * Admits a command, according to the rate limit of the connection's peer.
+ * @param parser Parser.
+ * @returns Whether the command can be executed.
+ */
+static inline bool
+parser_admit(const struct parser *parser) {
+	return parser->peer == NULL || peers_admit(parser->peer);
+}
+
+static void
+parser_feed_reboot(struct parser *parser, int howto) {
+
+	if (parser_admit(parser)) {
+		command_reboot(howto);
 	}
 }
 
@@ -94,10 +285,27 @@ parser_feed_command(struct parser *parser, capset_t capability) {
 			parser->state = PARSER_STATE_DAEMON_END_NAME;
 			parser->daemon.len = 0;
 			break;
-		case CAPABILITY_SYSTEM_POWEROFF: queue_reboot(RB_POWER_OFF);   break;
-		case CAPABILITY_SYSTEM_HALT:     queue_reboot(RB_HALT_SYSTEM); break;
-		case CAPABILITY_SYSTEM_REBOOT:   queue_reboot(RB_AUTOBOOT);    break;
-		case CAPABILITY_SYSTEM_SUSPEND:  queue_reboot(RB_SW_SUSPEND);  break;
+		case CAPABILITY_SYSTEM_POWEROFF: parser_feed_reboot(parser, RB_POWER_OFF);   break;
+		case CAPABILITY_SYSTEM_HALT:     parser_feed_reboot(parser, RB_HALT_SYSTEM); break;
+		case CAPABILITY_SYSTEM_REBOOT:   parser_feed_reboot(parser, RB_AUTOBOOT);    break;
+		case CAPABILITY_SYSTEM_SUSPEND:  parser_feed_reboot(parser, RB_SW_SUSPEND);  break;
+		case CAPABILITY_DAEMON_CLEAR:
+			parser->state = PARSER_STATE_DAEMON_CLEAR_NAME;
+			parser->daemon.len = 0;
+			break;
+		case CAPABILITY_DAEMON_RESTART:
+			parser->state = PARSER_STATE_DAEMON_RESTART_NAME;
+			parser->daemon.len = 0;
+			break;
+		case CAPABILITY_DAEMON_REPLACE:
+			parser->state = PARSER_STATE_DAEMON_REPLACE_NAME;
+			parser->daemon.len = 0;
+			break;
+		case CAPABILITY_DAEMON_STATUS: [[fallthrough]];
+		case CAPABILITY_DAEMON_WATCH:
+			/* Version 1 messages aren't replied to. */
+			parser->state = PARSER_STATE_INVALID;
+			break;
 		default: abort();
 		}
 	} else {
@@ -119,7 +327,7 @@ name_fill(const char **inp, size_t *inlenp, char *out, unsigned int *outlenp) {
 
 	memcpy(out + *outlenp, in, len);
 	*outlenp = outlen;
-	*inlenp += len;
+	*inlenp -= len;
 	*inp += len;
 
 	return len;
@@ -134,15 +342,8 @@ parser_feed_endpoint_create_name(struct parser *parser, const char **bufferp, si
 	}
 
 	if (parser->endpoint.name.buf[parser->endpoint.name.len - 1] == '\0') {
-		const capset_t capabilities = parser->capabilities & parser->endpoint.name.capabilities;
-		const char * const name = parser->endpoint.name.buf;
-
-		if (capabilities != 0 && *name != '\0' && *name != '.') {
-			struct socket_node * const snode = socket_endpoint_node_create(name, capabilities);
-
-			if (snode != NULL) {
-				socket_switch_insert(snode);
-			}
+		if (parser_admit(parser)) {
+			command_endpoint_create(parser->capabilities, parser->endpoint.name.capabilities, parser->endpoint.name.buf);
 		}
 		parser->state = PARSER_STATE_COMMAND;
 	}
@@ -157,13 +358,452 @@ parser_feed_daemon_name(struct parser *parser, const char **bufferp, size_t *cou
 	}
 
 	if (parser->daemon.buf[parser->daemon.len - 1] == '\0') {
-		struct daemon * const daemon = configuration_find(parser->daemon.buf);
+		if (parser_admit(parser)) {
+			command_daemon(parser->daemon.buf, action);
+		}
+		parser->state = PARSER_STATE_COMMAND;
+	}
+}
+
+/*********************************
+ * Connection version 2 requests *
+ *********************************/
+
+/**
+ * Switches the parser to version 2, allocating its replies buffer.
+ * @param parser Parser, receiving its first byte.
+ */
+static void
+parser_feed_version(struct parser *parser) {
+
+	parser->replies.buf = malloc(CONFIG_SOCKET_CONNECTIONS_REPLIES_SIZE);
+	if (parser->replies.buf == NULL) {
+		syslog(LOG_ERR, "socket_connection_node: malloc: %m");
+		parser->state = PARSER_STATE_INVALID;
+		return;
+	}
+	parser->replies.size = CONFIG_SOCKET_CONNECTIONS_REPLIES_SIZE;
+
+	parser->state = PARSER_STATE_FRAME_HEADER;
+	parser->frame.size = 0;
+}
+
+/**
+ * Checks a name component ends a request body.
+ * @param name Name component.
+ * @param length Length of the name component, with its terminating nul byte.
+ * @returns Whether @p name is a valid name, and the last component.
+ */
+static bool
+parser_name_valid(const char *name, size_t length) {
+
+	return length != 0 && length <= NAME_MAX + 1
+		&& memchr(name, '\0', length) == name + length - 1
+		&& memchr(name, '/', length) == NULL;
+}
+
+/**
+ * Reserves space at the end of the replies not sent yet, growing their buffer if needed.
+ * Replies are limited to CONFIG_SOCKET_CONNECTIONS_REPLIES_SIZE, besides the status snapshot
+ * being appended or not sent yet. If the limit is exceeded, the parser stops, and the connection is closed.
+ * @param parser Parser.
+ * @param size Size to reserve.
+ * @returns The reserved space, _NULL_ on error.
+ */
+static char *
+parser_reserve(struct parser *parser, unsigned int size) {
+	const unsigned int len = parser->replies.len + size;
+
+	if (!parser->replies.snapshot && len > CONFIG_SOCKET_CONNECTIONS_REPLIES_SIZE + parser->replies.allowance) {
+		goto overflow;
+	}
+
+	if (len > parser->replies.size) {
+		unsigned int newsize = parser->replies.size;
 
-		if (daemon != NULL) {
-			action(daemon);
+		while (newsize < len) {
+			newsize *= 2;
 		}
 
-		parser->state = PARSER_STATE_COMMAND;
+		char * const newbuf = realloc(parser->replies.buf, newsize);
+		if (newbuf == NULL) {
+			syslog(LOG_ERR, "socket_connection_node: realloc: %m");
+			goto overflow;
+		}
+
+		parser->replies.buf = newbuf;
+		parser->replies.size = newsize;
+	}
+
+	char * const reserved = parser->replies.buf + parser->replies.len;
+	parser->replies.len = len;
+
+	return reserved;
+overflow:
+	parser->replies.overflow = true;
+	parser->state = PARSER_STATE_INVALID;
+	return NULL;
+}
+
+/**
+ * Appends a reply with a record to the replies not sent yet.
+ * @param parser Parser.
+ * @param request Identifier of the request replied to.
+ * @param status Status of the reply.
+ * @param record Record following the status, _NULL_ if none.
+ * @param size Size of @p record.
+ */
+static void
+parser_reply_record(struct parser *parser, uint32_t request, enum protocol_status status, const char *record, size_t size) {
+	const uint32_t words[] = { htonl(1 + size), htonl(request) };
+	char * const reply = parser_reserve(parser, PARSER_REPLY_SIZE + size);
+
+	if (reply != NULL) {
+		memcpy(reply, words, sizeof (words));
+		reply[sizeof (words)] = status;
+		if (size != 0) {
+			memcpy(reply + PARSER_REPLY_SIZE, record, size);
+		}
+	}
+}
+
+/**
+ * Appends a status reply to the replies not sent yet.
+ * @param parser Parser.
+ * @param request Identifier of the request replied to.
+ * @param status Status of the request.
+ */
+static void
+parser_reply(struct parser *parser, uint32_t request, enum protocol_status status) {
+	parser_reply_record(parser, request, status, NULL, 0);
+}
+
+/**
+ * Checks whether an event reply fits within the replies limit.
+ * @param parser Parser, subscribed.
+ * @param size Size of the event record.
+ * @returns Whether the event can be queued.
+ */
+static inline bool
+parser_event_fits(const struct parser *parser, size_t size) {
+	return !parser->replies.overflow
+		&& parser->replies.len + PARSER_REPLY_SIZE + size <= CONFIG_SOCKET_CONNECTIONS_REPLIES_SIZE + parser->replies.allowance;
+}
+
+/**
+ * Reports the events dropped so far, if it fits.
+ * @param parser Parser, subscribed, with dropped events.
+ * @returns Whether the report was queued.
+ */
+static bool
+parser_event_dropped(struct parser *parser) {
+	const uint32_t word = htonl(parser->events.dropped);
+	char record[PROTOCOL_EVENT_RECORD_SIZE] = { PROTOCOL_EVENT_DROPPED };
+
+	if (!parser_event_fits(parser, sizeof (record))) {
+		return false;
+	}
+
+	memcpy(record + 4, &word, sizeof (word));
+	parser_reply_record(parser, parser->events.request, PROTOCOL_STATUS_EVENT, record, sizeof (record));
+	parser->events.dropped = 0;
+
+	return true;
+}
+
+/**
+ * Queues an event, after the report of previously dropped ones.
+ * The event is dropped if it doesn't fit, the subscriber doesn't read its events fast enough.
+ * @param parser Parser, subscribed.
+ * @param record Event record.
+ * @param size Size of @p record.
+ */
+static void
+parser_event(struct parser *parser, const char *record, size_t size) {
+
+	if ((parser->events.dropped != 0 && !parser_event_dropped(parser))
+		|| !parser_event_fits(parser, size)) {
+		parser->events.dropped++;
+		return;
+	}
+
+	parser_reply_record(parser, parser->events.request, PROTOCOL_STATUS_EVENT, record, size);
+}
+
+/**
+ * Subscribes the connection to daemons' events.
+ * @param parser Parser.
+ * @param request Identifier of the request, copied in each event.
+ * @param length Length of the request's body, after its command.
+ * @returns Status of the request.
+ */
+static enum protocol_status
+parser_execute_watch(struct parser *parser, uint32_t request, size_t length) {
+
+	if (length != 0 || parser->events.subscribed) {
+		return PROTOCOL_STATUS_INVALID;
+	}
+
+	parser->events.request = request;
+	parser->events.dropped = 0;
+	parser->events.subscribed = true;
+	events_subscribe(&parser->events.subscriber);
+
+	return PROTOCOL_STATUS_OK;
+}
+
+/** Status reply being appended, its records split in partial replies. */
+struct parser_status {
+	struct parser * const parser;
+	const uint32_t request; /**< Identifier of the status request. */
+	unsigned int partial; /**< Offset of the current partial reply in the replies, UINT_MAX if none. */
+};
+
+/**
+ * Appends the status record of a daemon, in the current partial reply if it fits, in a new one else.
+ * @param daemon Daemon.
+ * @param data Status reply.
+ */
+static void
+parser_status_append(const struct daemon *daemon, void *data) {
+	struct parser_status * const status = data;
+	struct parser * const parser = status->parser;
+	const size_t namelen = strlen(daemon->name);
+	const unsigned int size = PROTOCOL_STATUS_RECORD_SIZE + namelen;
+
+	if (parser->replies.overflow) {
+		return;
+	}
+
+	if (status->partial == UINT_MAX
+		|| parser->replies.len - status->partial - PROTOCOL_V2_HEADER_SIZE + size > PROTOCOL_V2_REPLY_MAX) {
+		parser_reply(parser, status->request, PROTOCOL_STATUS_MORE);
+		if (parser->replies.overflow) {
+			return;
+		}
+		status->partial = parser->replies.len - PARSER_REPLY_SIZE;
+	}
+
+	char * const record = parser_reserve(parser, size);
+	if (record == NULL) {
+		return;
+	}
+
+	const bool spawned = daemon->state == DAEMON_STARTED || daemon->state == DAEMON_STOPPING;
+	const uint32_t pid = htonl(spawned ? daemon->process.pid : 0);
+	const uint64_t startedat = htobe64((uint64_t)daemon->startedat.tv_sec * 1000000000 + daemon->startedat.tv_nsec);
+	const uint32_t length = htonl(parser->replies.len - status->partial - PROTOCOL_V2_HEADER_SIZE);
+
+	record[0] = daemon->state;
+	record[1] = daemon->exitcode;
+	record[2] = daemon->exitstatus;
+	record[3] = namelen;
+	memcpy(record + 4, &pid, sizeof (pid));
+	memcpy(record + 8, &startedat, sizeof (startedat));
+	memcpy(record + PROTOCOL_STATUS_RECORD_SIZE, daemon->name, namelen);
+
+	memcpy(parser->replies.buf + status->partial, &length, sizeof (length));
+}
+
+/**
+ * Appends the status record of a selected daemon, see @ref configuration_select.
+ * @param daemon Daemon.
+ * @param data Status reply.
+ */
+static void
+parser_status_select(struct daemon *daemon, void *data) {
+	parser_status_append(daemon, data);
+}
+
+/**
+ * Appends the status records of one daemon, of the daemons a selector selects,
+ * or of all of them if @p length is zero. A status of several daemons is a snapshot,
+ * exempted from the replies limit unless a previous one wasn't sent yet.
+ * @param parser Parser.
+ * @param request Identifier of the request.
+ * @param name Name of the daemon, or a selector.
+ * @param length Length of @p name.
+ * @returns Status of the final reply.
+ */
+static enum protocol_status
+parser_execute_status(struct parser *parser, uint32_t request, const char *name, size_t length) {
+	struct parser_status status = { .parser = parser, .request = request, .partial = UINT_MAX };
+
+	if (length != 0 && !parser_name_valid(name, length)) {
+		return PROTOCOL_STATUS_INVALID;
+	}
+
+	const struct daemon * const daemon = length != 0 ? configuration_find(name) : NULL;
+	if (daemon == NULL) {
+		const unsigned int len = parser->replies.len;
+		unsigned int count = 1;
+
+		if (length != 0 && !configuration_selector(name)) {
+			return PROTOCOL_STATUS_NOT_FOUND;
+		}
+
+		parser->replies.snapshot = parser->replies.allowance == 0;
+		if (length == 0) {
+			configuration_walk(parser_status_append, &status);
+		} else {
+			count = configuration_select(name, parser_status_select, &status);
+		}
+		if (parser->replies.snapshot) {
+			parser->replies.allowance = parser->replies.len - len;
+			parser->replies.snapshot = false;
+		}
+
+		return count != 0 ? PROTOCOL_STATUS_OK : PROTOCOL_STATUS_NOT_FOUND;
+	}
+
+	parser_status_append(daemon, &status);
+
+	return PROTOCOL_STATUS_OK;
+}
+
+static enum protocol_status
+parser_execute_daemon(const char *name, size_t length, void (* const action)(struct daemon *)) {
+
+	if (!parser_name_valid(name, length)) {
+		return PROTOCOL_STATUS_INVALID;
+	}
+
+	return command_daemon(name, action);
+}
+
+/**
+ * Executes a version 2 request.
+ * @param parser Parser, holding the connection's capabilities.
+ * @param request Identifier of the request.
+ * @param body Body of the request, a version 1 message.
+ * @param length Length of @p body.
+ * @returns Status of the request.
+ */
+static enum protocol_status
+parser_execute(struct parser *parser, uint32_t request, const char *body, size_t length) {
+
+	if (length == 0) {
+		return PROTOCOL_STATUS_INVALID;
+	}
+
+	const unsigned int command = (unsigned char)*body;
+	if (command >= sizeof (capset_t) * CHAR_BIT || (CAPSET_ALL & (capset_t)1 << command) == 0) {
+		return PROTOCOL_STATUS_INVALID;
+	}
+
+	const capset_t capability = (capset_t)1 << command;
+	if (!CAPSET_HAS(parser->capabilities, capability)) {
+		return PROTOCOL_STATUS_DENIED;
+	}
+
+	if (!parser_admit(parser)) {
+		return PROTOCOL_STATUS_LIMITED;
+	}
+
+	body++;
+	length--;
+
+	switch (capability) {
+	case CAPABILITY_ENDPOINT_CREATE: {
+		uint32_t word;
+
+		if (length < sizeof (word) || !parser_name_valid(body + sizeof (word), length - sizeof (word))) {
+			return PROTOCOL_STATUS_INVALID;
+		}
+
+		memcpy(&word, body, sizeof (word));
+
+		return command_endpoint_create(parser->capabilities, ntohl(word), body + sizeof (word));
+	}
+	case CAPABILITY_DAEMON_START:   return parser_execute_daemon(body, length, daemon_start);
+	case CAPABILITY_DAEMON_STOP:    return parser_execute_daemon(body, length, daemon_stop);
+	case CAPABILITY_DAEMON_RELOAD:  return parser_execute_daemon(body, length, daemon_reload);
+	case CAPABILITY_DAEMON_END:     return parser_execute_daemon(body, length, daemon_end);
+	case CAPABILITY_DAEMON_CLEAR:   return parser_execute_daemon(body, length, daemon_clear);
+	case CAPABILITY_DAEMON_RESTART: return parser_execute_daemon(body, length, daemon_restart);
+	case CAPABILITY_DAEMON_REPLACE: return parser_execute_daemon(body, length, command_replace);
+	case CAPABILITY_DAEMON_STATUS:  return parser_execute_status(parser, request, body, length);
+	case CAPABILITY_DAEMON_WATCH:   return parser_execute_watch(parser, request, length);
+	case CAPABILITY_SYSTEM_POWEROFF: return length == 0 ? command_reboot(RB_POWER_OFF)   : PROTOCOL_STATUS_INVALID;
+	case CAPABILITY_SYSTEM_HALT:     return length == 0 ? command_reboot(RB_HALT_SYSTEM) : PROTOCOL_STATUS_INVALID;
+	case CAPABILITY_SYSTEM_REBOOT:   return length == 0 ? command_reboot(RB_AUTOBOOT)    : PROTOCOL_STATUS_INVALID;
+	case CAPABILITY_SYSTEM_SUSPEND:  return length == 0 ? command_reboot(RB_SW_SUSPEND)  : PROTOCOL_STATUS_INVALID;
+	default: abort();
+	}
+}
+
+/**
+ * Fills a part of the current frame.
+ * @param parser Parser.
+ * @param bufferp Received bytes, advanced past the consumed ones.
+ * @param countp Number of received bytes, decreased by the consumed ones.
+ * @param size Size of the part.
+ * @returns Whether the part is complete.
+ */
+static bool
+parser_fill_frame(struct parser *parser, const char **bufferp, size_t *countp, uint32_t size) {
+	const size_t missing = size - parser->frame.size;
+	const size_t len = *countp < missing ? *countp : missing;
+
+	memcpy(parser->frame.buf + parser->frame.size, *bufferp, len);
+	parser->frame.size += len;
+	*bufferp += len;
+	*countp -= len;
+
+	return parser->frame.size == size;
+}
+
+static void
+parser_feed_frame_header(struct parser *parser, const char **bufferp, size_t *countp) {
+	uint32_t words[2];
+
+	if (!parser_fill_frame(parser, bufferp, countp, sizeof (words))) {
+		return;
+	}
+
+	memcpy(words, parser->frame.buf, sizeof (words));
+	parser->frame.length = ntohl(words[0]);
+	parser->frame.request = ntohl(words[1]);
+	parser->frame.size = 0;
+
+	if (parser->frame.length == 0) {
+		parser_reply(parser, parser->frame.request, PROTOCOL_STATUS_INVALID);
+	} else if (parser->frame.length > sizeof (parser->frame.buf)) {
+		/* Too long to be valid, skip it to keep the framing. */
+		parser_reply(parser, parser->frame.request, PROTOCOL_STATUS_INVALID);
+		if (parser->state != PARSER_STATE_INVALID) {
+			parser->state = PARSER_STATE_FRAME_SKIP;
+		}
+	} else {
+		parser->state = PARSER_STATE_FRAME_BODY;
+	}
+}
+
+static void
+parser_feed_frame_body(struct parser *parser, const char **bufferp, size_t *countp) {
+
+	if (!parser_fill_frame(parser, bufferp, countp, parser->frame.length)) {
+		return;
+	}
+
+	parser->state = PARSER_STATE_FRAME_HEADER;
+	parser->frame.size = 0;
+	parser_reply(parser, parser->frame.request,
+		parser_execute(parser, parser->frame.request, parser->frame.buf, parser->frame.length));
+}
+
+static void
+parser_feed_frame_skip(struct parser *parser, const char **bufferp, size_t *countp) {
+	const size_t missing = parser->frame.length - parser->frame.size;
+	const size_t len = *countp < missing ? *countp : missing;
+
+	parser->frame.size += len;
+	*bufferp += len;
+	*countp -= len;
+
+	if (parser->frame.size == parser->frame.length) {
+		parser->state = PARSER_STATE_FRAME_HEADER;
+		parser->frame.size = 0;
 	}
 }
 
@@ -172,6 +812,15 @@ parser_feed(struct parser *parser, const char *buffer, size_t count) {
 
 	while (count != 0) {
 		switch (parser->state) {
+		case PARSER_STATE_VERSION:
+			if ((unsigned char)*buffer == PROTOCOL_V2) {
+				parser_feed_version(parser);
+				buffer++;
+				count--;
+			} else {
+				parser->state = PARSER_STATE_COMMAND;
+			}
+			break;
 		case PARSER_STATE_COMMAND:
 			parser_feed_command(parser, (capset_t)1 << (unsigned int)*buffer);
 			buffer++;
@@ -195,6 +844,12 @@ parser_feed(struct parser *parser, const char *buffer, size_t count) {
 		case PARSER_STATE_DAEMON_STOP_NAME:   parser_feed_daemon_name(parser, &buffer, &count, daemon_stop);   break;
 		case PARSER_STATE_DAEMON_RELOAD_NAME: parser_feed_daemon_name(parser, &buffer, &count, daemon_reload); break;
 		case PARSER_STATE_DAEMON_END_NAME:    parser_feed_daemon_name(parser, &buffer, &count, daemon_end);    break;
+		case PARSER_STATE_DAEMON_CLEAR_NAME:   parser_feed_daemon_name(parser, &buffer, &count, daemon_clear);   break;
+		case PARSER_STATE_DAEMON_RESTART_NAME: parser_feed_daemon_name(parser, &buffer, &count, daemon_restart); break;
+		case PARSER_STATE_DAEMON_REPLACE_NAME: parser_feed_daemon_name(parser, &buffer, &count, command_replace); break;
+		case PARSER_STATE_FRAME_HEADER: parser_feed_frame_header(parser, &buffer, &count); break;
+		case PARSER_STATE_FRAME_BODY:   parser_feed_frame_body(parser, &buffer, &count);   break;
+		case PARSER_STATE_FRAME_SKIP:   parser_feed_frame_skip(parser, &buffer, &count);   break;
 		case PARSER_STATE_INVALID:
 			buffer += count;
 			count = 0;
@@ -203,47 +858,394 @@ parser_feed(struct parser *parser, const char *buffer, size_t count) {
 	}
 }
 
+/**
+ * Executes a version 2 request datagram, in place.
+ * A datagram too short to hold a request identifier isn't replied to.
+ * @param parser Parser.
+ * @param datagram Received datagram.
+ * @param size Size of @p datagram.
+ */
 static void
-socket_connection_node_operate(struct socket_node *snode) {
+parser_feed_datagram(struct parser *parser, const char *datagram, size_t size) {
+	uint32_t words[2];
+
+	if (parser->state == PARSER_STATE_INVALID || size < sizeof (words)) {
+		return;
+	}
+
+	memcpy(words, datagram, sizeof (words));
+
+	const uint32_t length = ntohl(words[0]);
+	const uint32_t request = ntohl(words[1]);
+	if (length != size - sizeof (words)) {
+		parser_reply(parser, request, PROTOCOL_STATUS_INVALID);
+		return;
+	}
+
+	parser_reply(parser, request, parser_execute(parser, request, datagram + sizeof (words), length));
+}
+
+/**
+ * Sends the replies not sent yet as datagrams, in batches.
+ * @param connection Connection, using SOCK_SEQPACKET.
+ * @returns The number of bytes of replies sent, -1 on error with errno set.
+ */
+static ssize_t
+socket_connection_node_send_datagrams(struct socket_connection_node *connection) {
+	const struct parser * const parser = &connection->parser;
+	size_t sent = 0;
+
+	while (sent != parser->replies.len) {
+		struct iovec iovs[SOCKET_CONNECTION_NODE_DATAGRAMS];
+		struct mmsghdr msgs[SOCKET_CONNECTION_NODE_DATAGRAMS];
+		size_t offset = sent;
+		unsigned int count = 0;
+
+		while (count < SOCKET_CONNECTION_NODE_DATAGRAMS && offset != parser->replies.len) {
+			uint32_t length;
+
+			memcpy(&length, parser->replies.buf + offset, sizeof (length));
+			iovs[count].iov_base = parser->replies.buf + offset;
+			iovs[count].iov_len = PROTOCOL_V2_HEADER_SIZE + ntohl(length);
+			msgs[count] = (struct mmsghdr) { .msg_hdr = { .msg_iov = &iovs[count], .msg_iovlen = 1 } };
+			offset += iovs[count].iov_len;
+			count++;
+		}
+
+		const int batch = sendmmsg(connection->super.fd, msgs, count, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (batch < 0) {
+			if (sent != 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				break;
+			}
+			return -1;
+		}
+
+		for (int i = 0; i < batch; i++) {
+			sent += iovs[i].iov_len;
+		}
+
+		if ((unsigned int)batch != count) {
+			break;
+		}
+	}
+
+	return sent;
+}
+
+/**
+ * Sends as many replies not sent yet as possible, without blocking.
+ * @param connection Connection, using version 2.
+ * @returns Zero on success, even if some replies weren't sent, -1 on error with errno set.
+ */
+static int
+socket_connection_node_send(struct socket_connection_node *connection) {
+	struct parser * const parser = &connection->parser;
+	ssize_t sent = 0;
+
+	if (parser->replies.len != 0) {
+		if (connection->seqpacket) {
+			sent = socket_connection_node_send_datagrams(connection);
+		} else {
+			sent = send(connection->super.fd, parser->replies.buf, parser->replies.len, MSG_DONTWAIT | MSG_NOSIGNAL);
+		}
+		if (sent < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				return -1;
+			}
+			sent = 0;
+		}
+	}
+
+	parser->replies.len -= sent;
+	parser->replies.allowance -= parser->replies.allowance < sent ? parser->replies.allowance : sent;
+	memmove(parser->replies.buf, parser->replies.buf + sent, parser->replies.len);
+
+	return 0;
+}
+
+/**
+ * Sends the replies not sent yet, without blocking. The connection is watched
+ * for writability until all of them are sent, and closed on error.
+ * @param connection Connection, using version 2.
+ */
+static void
+socket_connection_node_flush(struct socket_connection_node *connection) {
+	struct parser * const parser = &connection->parser;
+
+	if (socket_connection_node_send(connection) != 0) {
+		syslog(LOG_ERR, "socket_connection_node_flush: send: %m");
+		socket_switch_remove(&connection->super);
+		return;
+	}
+
+	if (parser->events.dropped != 0) {
+		parser_event_dropped(parser);
+	}
+
+	if (parser->replies.len == 0 && parser->replies.size > CONFIG_SOCKET_CONNECTIONS_REPLIES_SIZE) {
+		/* Release the memory of a sent status snapshot. */
+		char * const buf = realloc(parser->replies.buf, CONFIG_SOCKET_CONNECTIONS_REPLIES_SIZE);
+		if (buf != NULL) {
+			parser->replies.buf = buf;
+			parser->replies.size = CONFIG_SOCKET_CONNECTIONS_REPLIES_SIZE;
+		}
+	}
+
+	const bool watch = parser->replies.len != 0;
+	if (watch != parser->replies.watched) {
+		socket_switch_writable(&connection->super, watch);
+		parser->replies.watched = watch;
+	}
+}
+
+/**
+ * Sends the replies of the requests just executed, closing the connection
+ * if it overflowed its replies buffer.
+ * @param connection Connection.
+ */
+static void
+socket_connection_node_replied(struct socket_connection_node *connection) {
+
+	if (connection->parser.replies.overflow) {
+		syslog(LOG_WARNING, "socket_connection_node: Connection doesn't read its replies, closing it");
+		socket_switch_remove(&connection->super);
+		return;
+	}
+
+	if (connection->parser.replies.buf != NULL) {
+		socket_connection_node_flush(connection);
+	}
+}
+
+static void
+socket_connection_node_received(struct socket_node *snode, const char *buffer, size_t count) {
 	struct socket_connection_node * const connection = (struct socket_connection_node *)snode;
+
+	if (count == 0) {
+		socket_switch_remove(&connection->super);
+		return;
+	}
+
+	if (connection->seqpacket) {
+		parser_feed_datagram(&connection->parser, buffer, count);
+	} else {
+		parser_feed(&connection->parser, buffer, count);
+	}
+
+	socket_connection_node_replied(connection);
+}
+
+static void
+socket_connection_node_operate(struct socket_node *snode) {
 	char buffer[CONFIG_SOCKET_CONNECTIONS_BUFFER_SIZE];
 
-	const ssize_t readval = read(connection->super.fd, buffer, sizeof (buffer));
-	switch (readval) {
-	case -1:
+	const ssize_t readval = read(snode->fd, buffer, sizeof (buffer));
+	if (readval < 0) {
 		syslog(LOG_ERR, "socket_connection_node_operate: read: %m");
-		[[fallthrough]];
-	case 0:
-		socket_switch_remove(&connection->super);
+		socket_switch_remove(snode);
+		return;
+	}
+
+	socket_connection_node_received(snode, buffer, readval);
+}
+
+/** Receives a batch of datagrams, executing all of them before sending their replies at once. */
+static void
+socket_connection_node_seqpacket_operate(struct socket_node *snode) {
+	struct socket_connection_node * const connection = (struct socket_connection_node *)snode;
+	char buffers[SOCKET_CONNECTION_NODE_DATAGRAMS][CONFIG_SOCKET_CONNECTIONS_BUFFER_SIZE];
+	struct iovec iovs[SOCKET_CONNECTION_NODE_DATAGRAMS];
+	struct mmsghdr msgs[SOCKET_CONNECTION_NODE_DATAGRAMS];
+
+	for (unsigned int i = 0; i < SOCKET_CONNECTION_NODE_DATAGRAMS; i++) {
+		iovs[i].iov_base = buffers[i];
+		iovs[i].iov_len = sizeof (buffers[i]);
+		msgs[i] = (struct mmsghdr) { .msg_hdr = { .msg_iov = &iovs[i], .msg_iovlen = 1 } };
+	}
+
+	const int count = recvmmsg(snode->fd, msgs, SOCKET_CONNECTION_NODE_DATAGRAMS, MSG_DONTWAIT, NULL);
+	if (count < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			syslog(LOG_ERR, "socket_connection_node_seqpacket_operate: recvmmsg: %m");
+			socket_switch_remove(snode);
+		}
 		return;
 	}
 
-	parser_feed(&connection->parser, buffer, readval);
+	for (int i = 0; i < count; i++) {
+		if (msgs[i].msg_len == 0) {
+			socket_switch_remove(snode);
+			return;
+		}
+		parser_feed_datagram(&connection->parser, buffers[i], msgs[i].msg_len);
+	}
+
+	socket_connection_node_replied(connection);
+}
+
+static void
+socket_connection_node_writable(struct socket_node *snode) {
+	socket_connection_node_flush((struct socket_connection_node *)snode);
+}
+
+/**
+ * Queues an event for a subscribed connection, sent once the connection is writable,
+ * so events published at once are sent together. If the event doesn't fit, queued
+ * ones are sent right away to make room, an error being handled once writable.
+ * @param subscriber Subscriber of the connection.
+ * @param record Event record.
+ * @param size Size of @p record.
+ */
+static void
+socket_connection_node_event(struct events_subscriber *subscriber, const char *record, size_t size) {
+	struct socket_connection_node * const connection = (struct socket_connection_node *)((char *)subscriber
+		- offsetof (struct socket_connection_node, parser.events.subscriber));
+	struct parser * const parser = &connection->parser;
+
+	if (!parser_event_fits(parser, size)) {
+		socket_connection_node_send(connection);
+	}
+
+	parser_event(parser, record, size);
+
+	if (parser->replies.len != 0 && !parser->replies.watched) {
+		socket_switch_writable(&connection->super, true);
+		parser->replies.watched = true;
+	}
 }
 
 static void
 socket_connection_node_destroy(struct socket_node *snode) {
 	struct socket_connection_node * const connection = (struct socket_connection_node *)snode;
+
+	if (connection->parser.peer != NULL) {
+		peers_release(connection->parser.peer);
+		socket_connections--;
+	}
+
+	if (connection->parser.events.subscribed) {
+		events_unsubscribe(&connection->parser.events.subscriber);
+	}
+
 	close(connection->super.fd);
+	free(connection->parser.replies.buf);
 	free(connection);
 }
 
+/**
+ * Create a new connection.
+ * @param fd Accepted connection.
+ * @param capabilities Capabilities of the connection's endpoint.
+ * @param type Socket type of the connection, SOCK_STREAM or SOCK_SEQPACKET.
+ * @param privileged Whether the connection is exempted from the connections cap and its peer's rate limit,
+ * it is then operated along with reaping and timers instead of in the background.
+ * @returns The new connection, _NULL_ on error, or if too many connections are open.
+ */
 struct socket_node *
-socket_connection_node_create(int fd, capset_t capabilities) {
-	static const struct socket_node_class socket_connection_node_class = {
-		.operate = socket_connection_node_operate,
-		.destroy = socket_connection_node_destroy,
+socket_connection_node_create(int fd, capset_t capabilities, int type, bool privileged) {
+	/* Indexed by privileged, the first endpoint's connections don't queue behind clients. */
+	static const struct socket_node_class socket_connection_node_classes[] = {
+		{
+			.operate = socket_connection_node_operate,
+			.destroy = socket_connection_node_destroy,
+			.received = socket_connection_node_received,
+			.writable = socket_connection_node_writable,
+			.background = true,
+		},
+		{
+			.operate = socket_connection_node_operate,
+			.destroy = socket_connection_node_destroy,
+			.received = socket_connection_node_received,
+			.writable = socket_connection_node_writable,
+		},
 	};
-	struct socket_connection_node * const connection = malloc(sizeof (*connection));
+	static const struct socket_node_class socket_connection_node_seqpacket_classes[] = {
+		{
+			.operate = socket_connection_node_seqpacket_operate,
+			.destroy = socket_connection_node_destroy,
+			.received = socket_connection_node_received,
+			.writable = socket_connection_node_writable,
+			.background = true,
+		},
+		{
+			.operate = socket_connection_node_seqpacket_operate,
+			.destroy = socket_connection_node_destroy,
+			.received = socket_connection_node_received,
+			.writable = socket_connection_node_writable,
+		},
+	};
+	struct peer *peer = NULL;
+
+	if (!privileged) {
+		struct ucred ucred;
+		socklen_t len = sizeof (ucred);
+
+		if (socket_connections >= CONFIG_SOCKET_CONNECTIONS_MAX) {
+			if (!socket_connections_capped) {
+				syslog(LOG_WARNING, "socket_connection_node_create: %u connections open, refusing new ones", socket_connections);
+				socket_connections_capped = true;
+			}
+			goto cap_failure;
+		}
+		socket_connections_capped = false;
+
+		if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &ucred, &len) != 0) {
+			syslog(LOG_ERR, "socket_connection_node_create: getsockopt: %m");
+			goto getsockopt_failure;
+		}
+
+		peer = peers_acquire(ucred.uid);
+		if (peer == NULL) {
+			goto peers_failure;
+		}
+	}
 
+	struct socket_connection_node * const connection = malloc(sizeof (*connection));
 	if (connection == NULL) {
-		return NULL;
+		goto malloc_failure;
 	}
 
-	connection->super.class = &socket_connection_node_class;
 	connection->super.fd = fd;
 	connection->parser.capabilities = capabilities;
-	connection->parser.state = PARSER_STATE_COMMAND;
+	connection->parser.peer = peer;
+	connection->parser.replies.buf = NULL;
+	connection->parser.replies.len = 0;
+	connection->parser.replies.size = CONFIG_SOCKET_CONNECTIONS_REPLIES_SIZE;
+	connection->parser.replies.allowance = 0;
+	connection->parser.replies.snapshot = false;
+	connection->parser.replies.overflow = false;
+	connection->parser.replies.watched = false;
+	connection->parser.events.subscriber.receive = socket_connection_node_event;
+	connection->parser.events.dropped = 0;
+	connection->parser.events.subscribed = false;
+
+	if (type == SOCK_SEQPACKET) {
+		connection->parser.replies.buf = malloc(CONFIG_SOCKET_CONNECTIONS_REPLIES_SIZE);
+		if (connection->parser.replies.buf == NULL) {
+			goto replies_failure;
+		}
+		connection->super.class = &socket_connection_node_seqpacket_classes[privileged];
+		connection->parser.state = PARSER_STATE_FRAME_HEADER;
+		connection->seqpacket = true;
+	} else {
+		connection->super.class = &socket_connection_node_classes[privileged];
+		connection->parser.state = PARSER_STATE_VERSION;
+		connection->seqpacket = false;
+	}
+
+	if (peer != NULL) {
+		socket_connections++;
+	}
 
 	return &connection->super;
+replies_failure:
+	free(connection);
+malloc_failure:
+	if (peer != NULL) {
+		peers_release(peer);
+	}
+peers_failure:
+getsockopt_failure:
+cap_failure:
+	return NULL;
 }
@@ -5,7 +5,7 @@
 #include "capabilities.h"
 
 struct socket_node *
-socket_connection_node_create(int fd, capset_t capabilities);
+socket_connection_node_create(int fd, capset_t capabilities, int type, bool privileged);
 
 /* SOCKET_CONNECTION_NODE_H */
 #endif
@@ -20,21 +20,36 @@
 struct socket_endpoint_node {
 	struct socket_node super; /**< Parent socket node */
 	capset_t capabilities; /**< Associated capabilities */
+	int type; /**< Socket type of the endpoint and its connections, SOCK_STREAM or SOCK_SEQPACKET. */
+	bool privileged; /**< Connections are neither capped nor rate limited. */
 };
 
 /** Socket endpoints location in the host filesystem. Initialized by @ref socket_switch_setup. */
 const char *socket_endpoints_path;
 
+/** Socket endpoint accepted, record an accepted close-on-exec connection in socket switch. */
+static void
+socket_endpoint_node_accepted(struct socket_node *snode, int fd) {
+	const struct socket_endpoint_node * const endpoint = (const struct socket_endpoint_node *)snode;
+
+	snode = socket_connection_node_create(fd, endpoint->capabilities, endpoint->type, endpoint->privileged);
+	if (snode == NULL) {
+		close(fd);
+		return;
+	}
+
+	socket_switch_insert(snode);
+}
+
 /** Socket endpoint operate, accept incoming connection and record it in socket switch. */
 static void
 socket_endpoint_node_operate(struct socket_node *snode) {
-	const struct socket_endpoint_node * const endpoint = (const struct socket_endpoint_node *)snode;
 	struct sockaddr_un addr;
 	socklen_t len;
 	int fd;
 
 	len = sizeof (addr);
-	fd = accept(endpoint->super.fd, (struct sockaddr *)&addr, &len);
+	fd = accept(snode->fd, (struct sockaddr *)&addr, &len);
 	if (fd < 0) {
 		syslog(LOG_ERR, "socket_endpoint_node_operate: accept: %m");
 		return;
@@ -46,13 +61,7 @@ socket_endpoint_node_operate(struct socket_node *snode) {
 		return;
 	}
 
-	snode = socket_connection_node_create(fd, endpoint->capabilities);
-	if (snode == NULL) {
-		close(fd);
-		return;
-	}
-
-	socket_switch_insert(snode);
+	socket_endpoint_node_accepted(snode, fd);
 }
 
 /** Socket endpoint destroy, unlink endpoint in filesystem and close/free resources. */
@@ -70,12 +79,20 @@ socket_endpoint_node_destroy(struct socket_node *snode) {
 	free(snode);
 }
 
-/** Create a new endpoint. Like creating any network socket. */
+/**
+ * Create a new endpoint. Like creating any network socket.
+ * @param name Name of the endpoint, in the endpoints directory.
+ * @param capabilities Capabilities of the endpoint's connections.
+ * @param type Socket type of the endpoint, SOCK_STREAM or SOCK_SEQPACKET.
+ * @param privileged Whether connections are exempted from the connections cap and the peers' rate limits.
+ * @returns The new endpoint, _NULL_ on error.
+ */
 struct socket_node *
-socket_endpoint_node_create(const char *name, capset_t capabilities) {
+socket_endpoint_node_create(const char *name, capset_t capabilities, int type, bool privileged) {
 	static const struct socket_node_class socket_endpoint_node_class = {
 		.operate = socket_endpoint_node_operate,
 		.destroy = socket_endpoint_node_destroy,
+		.accepted = socket_endpoint_node_accepted,
 	};
 	struct socket_endpoint_node * const endpoint = malloc(sizeof (*endpoint));
 
@@ -83,7 +100,7 @@ socket_endpoint_node_create(const char *name, capset_t capabilities) {
 		goto malloc_failure;
 	}
 
-	const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	const int fd = socket(AF_UNIX, type | SOCK_CLOEXEC, 0);
 	if (fd < 0) {
 		syslog(LOG_ERR, "socket_endpoint_node_create: socket %s: %m", name);
 		goto socket_failure;
@@ -109,6 +126,8 @@ socket_endpoint_node_create(const char *name, capset_t capabilities) {
 	endpoint->super.class = &socket_endpoint_node_class;
 	endpoint->super.fd = fd;
 	endpoint->capabilities = capabilities;
+	endpoint->type = type;
+	endpoint->privileged = privileged;
 
 	return &endpoint->super;
 listen_failure:
@@ -7,7 +7,7 @@
 extern const char *socket_endpoints_path;
 
 struct socket_node *
-socket_endpoint_node_create(const char *name, capset_t capabilities);
+socket_endpoint_node_create(const char *name, capset_t capabilities, int type, bool privileged);
 
 /* SOCKET_ENDPOINT_NODE_H */
 #endif
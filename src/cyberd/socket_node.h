@@ -2,14 +2,23 @@
 #ifndef SOCKET_NODE_H
 #define SOCKET_NODE_H
 
-#include "tree.h"
+#include <stddef.h> /* size_t */
 
 struct socket_node;
 
-/** Dynamic dispatch table of a socket node. */
+/**
+ * Dynamic dispatch table of a socket node.
+ * Backends of the socket switch able to accept connections or receive data themselves
+ * use @ref accepted or @ref received if non-_NULL_, instead of @ref operate.
+ * Nodes ready at once are operated in two passes, @ref background ones last.
+ */
 struct socket_node_class {
 	void (* const operate)(struct socket_node *); /**< Operation to run when a fd is ready for read. */
-	void (* const destroy)(struct socket_node *); /**< Destroy and free a socket node. */
+	void (* const destroy)(struct socket_node *); /**< Destroy and free a socket node, _NULL_ if the node is owned outside of the socket switch. */
+	void (* const accepted)(struct socket_node *, int); /**< Operation to run with a connection accepted on a listening fd, _NULL_ if none. */
+	void (* const received)(struct socket_node *, const char *, size_t); /**< Operation to run with data received on a fd, zero-sized on end of file, _NULL_ if none. */
+	void (* const writable)(struct socket_node *); /**< Operation to run when a fd watched for writability is ready for write, _NULL_ if never watched. */
+	const bool background; /**< Operated after other nodes, such as clients' connections, so they never delay reaping and timers. */
 };
 
 /** Socket node. */
@@ -18,8 +27,5 @@ struct socket_node {
 	int fd; /**< File descriptor of the node. */
 };
 
-int
-socket_nodes_compare(const tree_element_t *lhs, const tree_element_t *rhs);
-
 /* SOCKET_NODE_H */
 #endif
@@ -3,27 +3,80 @@
 
 #include "socket_endpoint_node.h"
 #include "socket_node.h"
+#ifdef CONFIG_SOCKET_SWITCH_IO_URING
+#include "socket_switch_uring.h"
+#endif
 
-#include <stdlib.h> /* NULL */
-#include <string.h> /* memcpy */
+#include <stdlib.h> /* NULL, abort, realloc, free */
+#include <string.h> /* memcpy, memset */
 #include <sys/stat.h> /* mkdir */
 #include <syslog.h> /* syslog */
 #include <errno.h> /* errno, ... */
+#include <sys/socket.h> /* SOCK_STREAM */
+#ifdef CONFIG_SOCKET_SWITCH_EPOLL
+#include <sys/epoll.h> /* epoll_create1, epoll_ctl, epoll_pwait */
+#else
+#include <sys/select.h> /* pselect, fd_set */
+#endif
 
 #include <assert.h> /* assert */
 
+#ifdef CONFIG_SOCKET_SWITCH_EPOLL
+/** Maximum number of events operated for one wait. */
+#define SOCKET_SWITCH_EVENTS 64
+#endif
+
 /**
  * Main socket nodes storage, where all socket nodes are allocated/operated.
- * This storage is index using the node's file descriptors as identifiers.
+ * This storage is an array indexed by the nodes' file descriptors, which are dense small integers.
  */
 static struct {
-	struct tree snodes; /**< Socket node storage tree. */
+	struct socket_node **snodes; /**< Socket nodes, indexed by fd, _NULL_ if none. */
+	unsigned int capacity; /**< Number of allocated entries in @ref snodes. */
+	int maxfd; /**< Highest fd of a node, -1 if none. */
+#ifdef CONFIG_SOCKET_SWITCH_IO_URING
+	bool uring; /**< Whether nodes are operated by the io_uring backend, instead of epoll. */
+#endif
+#ifdef CONFIG_SOCKET_SWITCH_EPOLL
+	int epfd; /**< epoll instance, each node registered with itself as data. */
+	struct epoll_event events[SOCKET_SWITCH_EVENTS]; /**< Events of the last wait. */
+	int count; /**< Number of events of the last wait. */
+#else
 	fd_set activeset; /**< Active sockets. */
 	fd_set readset; /**< Exchange socket set. */
+	fd_set writableset; /**< Sockets watched for writability. */
+	fd_set writeset; /**< Exchange socket set, for writability. */
+#endif
 } socket_switch = {
-	.snodes = { .compare = socket_nodes_compare },
+	.maxfd = -1,
+#ifdef CONFIG_SOCKET_SWITCH_EPOLL
+	.epfd = -1,
+#endif
 };
 
+/**
+ * Initializes the socket switch, before any node is inserted.
+ * If io_uring isn't available, epoll is used instead.
+ * Aborts if the event backend can't be created, as nothing could be operated.
+ */
+void
+socket_switch_init(void) {
+#ifdef CONFIG_SOCKET_SWITCH_IO_URING
+	if (socket_switch_uring_setup() == 0) {
+		socket_switch.uring = true;
+		return;
+	}
+	syslog(LOG_WARNING, "socket_switch_init: io_uring unavailable, using epoll: %m");
+#endif
+#ifdef CONFIG_SOCKET_SWITCH_EPOLL
+	socket_switch.epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (socket_switch.epfd < 0) {
+		syslog(LOG_ERR, "socket_switch_init: epoll_create1: %m");
+		abort();
+	}
+#endif
+}
+
 /** Create the first communication endpoint. */
 void
 socket_switch_setup(const char *path, const char *root) {
@@ -35,7 +88,7 @@ socket_switch_setup(const char *path, const char *root) {
 		return;
 	}
 
-	snode = socket_endpoint_node_create(root, CAPSET_ALL);
+	snode = socket_endpoint_node_create(root, CAPSET_ALL, SOCK_STREAM, true);
 	if (snode == NULL) {
 		syslog(LOG_ERR, "socket_switch_setup: Unable to create '%s' root endpoint", root);
 		return;
@@ -45,89 +98,293 @@ socket_switch_setup(const char *path, const char *root) {
 }
 
 /**
- * Recursively destroy a socket node tree elements.
- * @param element Socket node.
+ * Stops watching a socket node's file descriptor.
+ * A node removed while events of the last wait are operated is not operated anymore.
+ * @param snode Socket node being removed.
+ */
+static void
+socket_switch_unwatch(struct socket_node *snode) {
+#ifdef CONFIG_SOCKET_SWITCH_IO_URING
+	if (socket_switch.uring) {
+		socket_switch_uring_remove(snode);
+		return;
+	}
+#endif
+#ifdef CONFIG_SOCKET_SWITCH_EPOLL
+	if (epoll_ctl(socket_switch.epfd, EPOLL_CTL_DEL, snode->fd, NULL) != 0) {
+		syslog(LOG_ERR, "socket_switch_unwatch: epoll_ctl %d: %m", snode->fd);
+	}
+
+	for (int i = 0; i < socket_switch.count; i++) {
+		if (socket_switch.events[i].data.ptr == snode) {
+			socket_switch.events[i].data.ptr = NULL;
+		}
+	}
+#else
+	FD_CLR(snode->fd, &socket_switch.activeset);
+	FD_CLR(snode->fd, &socket_switch.readset);
+	FD_CLR(snode->fd, &socket_switch.writableset);
+	FD_CLR(snode->fd, &socket_switch.writeset);
+#endif
+}
+
+/**
+ * Forgets a socket node, lowering the highest fd if it was the highest one.
+ * @param fd File descriptor of the node.
  */
 static void
-socket_switch_destroy_element(tree_element_t *element) {
-	struct socket_node * const snode = element;
-	snode->class->destroy(snode);
+socket_switch_forget(int fd) {
+
+	socket_switch.snodes[fd] = NULL;
+	if (fd == socket_switch.maxfd) {
+		do {
+			socket_switch.maxfd--;
+		} while (socket_switch.maxfd >= 0 && socket_switch.snodes[socket_switch.maxfd] == NULL);
+	}
 }
 
-/** Destroy all socket nodes */
+/**
+ * Destroy all socket nodes owned by the socket switch, unlinking endpoints.
+ * Nodes owned elsewhere, such as spawned daemons' ones, are kept
+ * and can still be operated until their owners remove them.
+ */
 void
 socket_switch_teardown(void) {
-	tree_mutate(&socket_switch.snodes, socket_switch_destroy_element);
-#ifndef NDEBUG
-	tree_deinit(&socket_switch.snodes);
-#endif
+
+	for (int fd = socket_switch.maxfd; fd >= 0; fd--) {
+		struct socket_node * const snode = socket_switch.snodes[fd];
+
+		if (snode != NULL && snode->class->destroy != NULL) {
+			socket_switch_unwatch(snode);
+			socket_switch_forget(fd);
+			snode->class->destroy(snode);
+		}
+	}
 }
 
-/** Insert a new socket node */
-void
+/**
+ * Records a socket node at its fd, growing the storage if needed.
+ * @param snode Socket node.
+ * @returns Zero on success, -1 on error.
+ */
+static int
+socket_switch_record(struct socket_node *snode) {
+	const int fd = snode->fd;
+
+	assert(fd >= 0);
+
+	if ((unsigned int)fd >= socket_switch.capacity) {
+		unsigned int capacity = socket_switch.capacity != 0 ? socket_switch.capacity : 64;
+		while ((unsigned int)fd >= capacity) {
+			capacity *= 2;
+		}
+
+		struct socket_node ** const snodes = realloc(socket_switch.snodes, capacity * sizeof (*snodes));
+		if (snodes == NULL) {
+			syslog(LOG_ERR, "socket_switch_record: realloc: %m");
+			return -1;
+		}
+
+		memset(snodes + socket_switch.capacity, 0, (capacity - socket_switch.capacity) * sizeof (*snodes));
+		socket_switch.snodes = snodes;
+		socket_switch.capacity = capacity;
+	}
+
+	assert(socket_switch.snodes[fd] == NULL);
+
+	socket_switch.snodes[fd] = snode;
+	if (fd > socket_switch.maxfd) {
+		socket_switch.maxfd = fd;
+	}
+
+	return 0;
+}
+
+/**
+ * Insert a new socket node.
+ * If it can't be operated, a node owned by the socket switch is destroyed.
+ * With _pselect(2)_, nodes whose fd doesn't fit in an _fd\_set_ can't be operated.
+ * @param snode Socket node.
+ * @returns Zero on success, -1 if the node can't be operated.
+ */
+int
 socket_switch_insert(struct socket_node *snode) {
+
+#ifndef CONFIG_SOCKET_SWITCH_EPOLL
+	if (snode->fd >= FD_SETSIZE) {
+		syslog(LOG_ERR, "socket_switch_insert: fd %d exceeds FD_SETSIZE", snode->fd);
+		goto insert_failure;
+	}
+#endif
+
+	if (socket_switch_record(snode) != 0) {
+		goto insert_failure;
+	}
+
+#ifdef CONFIG_SOCKET_SWITCH_IO_URING
+	if (socket_switch.uring) {
+		if (socket_switch_uring_insert(snode) != 0) {
+			socket_switch_forget(snode->fd);
+			goto insert_failure;
+		}
+		return 0;
+	}
+#endif
+#ifdef CONFIG_SOCKET_SWITCH_EPOLL
+	struct epoll_event event = {
+		.events = EPOLLIN,
+		.data.ptr = snode,
+	};
+
+	if (epoll_ctl(socket_switch.epfd, EPOLL_CTL_ADD, snode->fd, &event) != 0) {
+		syslog(LOG_ERR, "socket_switch_insert: epoll_ctl %d: %m", snode->fd);
+	}
+#else
 	FD_SET(snode->fd, &socket_switch.activeset);
-	tree_insert(&socket_switch.snodes, snode);
+#endif
+
+	return 0;
+insert_failure:
+	if (snode->class->destroy != NULL) {
+		snode->class->destroy(snode);
+	}
+	return -1;
 }
 
-/** Remove a socket node */
+/** Remove a socket node, and destroy it if owned by the socket switch */
 void
 socket_switch_remove(struct socket_node *snode) {
-	[[maybe_unused]] struct socket_node * const removed = tree_remove(&socket_switch.snodes, snode);
 
-	assert(removed == snode);
+	assert(snode->fd >= 0 && (unsigned int)snode->fd < socket_switch.capacity && socket_switch.snodes[snode->fd] == snode);
 
-	FD_CLR(snode->fd, &socket_switch.activeset);
-	snode->class->destroy(snode);
+	socket_switch_unwatch(snode);
+	socket_switch_forget(snode->fd);
+	if (snode->class->destroy != NULL) {
+		snode->class->destroy(snode);
+	}
 }
 
 /**
- * Prepare the file descriptor sets for _pselect(2)_.
- * @param[out] readfdsp
- * @returns Maximum file descriptor value, or zero if none in the switch.
+ * Watches, or stops watching, a node's fd for writability.
+ * While watched, the node's writable operation is run each time its fd is ready for write.
+ * @param snode Socket node, inserted, whose class has a writable operation.
+ * @param watch Whether to watch the node for writability.
  */
-int
-socket_switch_prepare(fd_set **readfdsp) {
-	const struct socket_node *snode;
-	int nfds;
+void
+socket_switch_writable(struct socket_node *snode, bool watch) {
 
-	*readfdsp = memcpy(&socket_switch.readset, &socket_switch.activeset, sizeof (**readfdsp));
+	assert(snode->class->writable != NULL);
 
-	snode = tree_last(&socket_switch.snodes);
-	if (snode != NULL) {
-		nfds = snode->fd + 1;
-	} else {
-		nfds = 0;
+#ifdef CONFIG_SOCKET_SWITCH_IO_URING
+	if (socket_switch.uring) {
+		socket_switch_uring_writable(snode, watch);
+		return;
 	}
+#endif
+#ifdef CONFIG_SOCKET_SWITCH_EPOLL
+	struct epoll_event event = {
+		.events = watch ? EPOLLIN | EPOLLOUT : EPOLLIN,
+		.data.ptr = snode,
+	};
 
-	return nfds;
+	if (epoll_ctl(socket_switch.epfd, EPOLL_CTL_MOD, snode->fd, &event) != 0) {
+		syslog(LOG_ERR, "socket_switch_writable: epoll_ctl %d: %m", snode->fd);
+	}
+#else
+	if (watch) {
+		FD_SET(snode->fd, &socket_switch.writableset);
+	} else {
+		FD_CLR(snode->fd, &socket_switch.writableset);
+		FD_CLR(snode->fd, &socket_switch.writeset);
+	}
+#endif
 }
 
+#ifdef CONFIG_SOCKET_SWITCH_EPOLL
 /**
- * Find a socket node from its file descriptor
- * @param fd A filedescriptor associated with one socket node.
- * @returns Node associated with @p fd.
+ * Waits for ready socket nodes with _epoll\_pwait(2)_, and operates them, background ones last.
+ * Each event holds its node, so no lookup is needed.
+ * With io_uring, signals are never delivered and @p sigmask is unused.
+ * @param sigmask Signal mask while waiting.
+ * @returns Zero on success, -1 on error with errno set, EINTR if interrupted by a signal.
  */
-static inline struct socket_node *
-socket_switch_find(int fd) {
-	const struct socket_node element = { .fd = fd };
+int
+socket_switch_wait(const sigset_t *sigmask) {
+#ifdef CONFIG_SOCKET_SWITCH_IO_URING
+	if (socket_switch.uring) {
+		return socket_switch_uring_wait();
+	}
+#endif
+	const int count = epoll_pwait(socket_switch.epfd, socket_switch.events, SOCKET_SWITCH_EVENTS, -1, sigmask);
 
-	return tree_find(&socket_switch.snodes, &element);
-}
+	if (count < 0) {
+		return -1;
+	}
+
+	socket_switch.count = count;
+	for (int pass = 0; pass < 2; pass++) {
+		const bool background = pass != 0;
+
+		for (int i = 0; i < socket_switch.count; i++) {
+			const struct epoll_event * const event = &socket_switch.events[i];
+			struct socket_node * const snode = event->data.ptr;
+
+			if (snode == NULL || snode->class->background != background) {
+				continue;
+			}
 
+			if ((event->events & ~EPOLLOUT) != 0) {
+				snode->class->operate(snode);
+			}
+
+			/* The node may have been removed while operated. */
+			if (event->data.ptr != NULL && (event->events & EPOLLOUT) != 0) {
+				snode->class->writable(snode);
+			}
+		}
+	}
+	socket_switch.count = 0;
+
+	return 0;
+}
+#else
 /**
- * Operate at most @p nfds.
- * @param nfds Number of ready file descriptors.
+ * Waits for ready socket nodes with _pselect(2)_, and operates them, background ones last.
+ * @param sigmask Signal mask while waiting.
+ * @returns Zero on success, -1 on error with errno set, EINTR if interrupted by a signal.
  */
-void
-socket_switch_operate(int nfds) {
+int
+socket_switch_wait(const sigset_t *sigmask) {
+	const int nfds = socket_switch.maxfd + 1;
+
+	memcpy(&socket_switch.readset, &socket_switch.activeset, sizeof (socket_switch.readset));
+	memcpy(&socket_switch.writeset, &socket_switch.writableset, sizeof (socket_switch.writeset));
+
+	if (pselect(nfds, &socket_switch.readset, &socket_switch.writeset, NULL, NULL, sigmask) < 0) {
+		return -1;
+	}
 
-	for (int fd = 0; fd < FD_SETSIZE && nfds != 0; fd++) {
-		if (!FD_ISSET(fd, &socket_switch.readset)) {
-			continue;
+	for (int pass = 0; pass < 2; pass++) {
+		const bool background = pass != 0;
+
+		for (int fd = 0; fd < nfds; fd++) {
+			const struct socket_node * const snode = socket_switch.snodes[fd];
+
+			if (snode == NULL || snode->class->background != background) {
+				continue;
+			}
+
+			if (FD_ISSET(fd, &socket_switch.readset)) {
+				socket_switch.snodes[fd]->class->operate(socket_switch.snodes[fd]);
+			}
+
+			/* Cleared if the node was removed, or stopped being watched, while operated. */
+			if (FD_ISSET(fd, &socket_switch.writeset)) {
+				socket_switch.snodes[fd]->class->writable(socket_switch.snodes[fd]);
+			}
 		}
-		struct socket_node * const snode = socket_switch_find(fd);
-		snode->class->operate(snode);
-		nfds--;
 	}
+
+	return 0;
 }
+#endif
@@ -2,27 +2,30 @@
 #ifndef SOCKET_SWITCH_H
 #define SOCKET_SWITCH_H
 
-#include <sys/select.h> /* fd_set */
+#include <signal.h> /* sigset_t */
 
 struct socket_node;
 
+void
+socket_switch_init(void);
+
 void
 socket_switch_setup(const char *path, const char *root);
 
 void
 socket_switch_teardown(void);
 
-void
+int
 socket_switch_insert(struct socket_node *snode);
 
 void
 socket_switch_remove(struct socket_node *snode);
 
-int
-socket_switch_prepare(fd_set **readfdsp);
-
 void
-socket_switch_operate(int nfds);
+socket_switch_writable(struct socket_node *snode, bool watch);
+
+int
+socket_switch_wait(const sigset_t *sigmask);
 
 /* SOCKET_SWITCH_H */
 #endif
@@ -0,0 +1,548 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#include "socket_switch_uring.h"
+
+#include "socket_node.h"
+
+#include <stdlib.h> /* malloc, realloc, free */
+#include <string.h> /* memset */
+#include <stdint.h> /* uint32_t, uint64_t, UINT64_MAX */
+#include <syslog.h> /* syslog */
+#include <unistd.h> /* close, syscall, write */
+#include <errno.h> /* errno, EINVAL, ENOBUFS */
+#include <poll.h> /* POLLIN, POLLOUT */
+#include <sys/mman.h> /* mmap, munmap */
+#include <sys/socket.h> /* socketpair, SOCK_CLOEXEC */
+#include <sys/syscall.h> /* SYS_io_uring_setup, SYS_io_uring_enter, SYS_io_uring_register */
+#include <linux/io_uring.h> /* struct io_uring_params, struct io_uring_sqe, ... */
+
+/** Number of submission queue entries. */
+#define SOCKET_SWITCH_URING_ENTRIES 256
+
+/** Number of buffers provided for receptions, a power of two. */
+#define SOCKET_SWITCH_URING_BUFFERS 64
+
+/** Buffer group of the provided buffers. */
+#define SOCKET_SWITCH_URING_BUFFER_GROUP 0
+
+/** User data of requests whose completions are ignored. */
+#define SOCKET_SWITCH_URING_IGNORED UINT64_MAX
+
+/** Flag of the user data of writability polls, fds never use their sign bit. */
+#define SOCKET_SWITCH_URING_WRITABLE ((uint64_t)1 << 31)
+
+/**
+ * A file descriptor's slot. Requests are tagged with their fd and the slot's generation,
+ * incremented when its node is removed, so completions of removed nodes are ignored.
+ */
+struct socket_switch_uring_slot {
+	struct socket_node *snode; /**< Node of the fd, _NULL_ if none. */
+	uint32_t generation; /**< Generation of the node. */
+	bool writable; /**< Whether the node is watched for writability. */
+	bool polling; /**< Whether a writability poll is in flight, it may outlive @ref writable. */
+};
+
+/**
+ * io_uring backend of the socket switch.
+ * Listening nodes are operated with multishot accepts, receiving nodes with multishot receptions
+ * into provided buffers, and every other node with a poll, re-armed each time it was operated.
+ */
+static struct {
+	int fd; /**< io_uring instance. */
+	struct {
+		unsigned int *head, *tail, *mask, *array;
+		struct io_uring_sqe *sqes;
+		unsigned int entries;
+		unsigned int local; /**< Tail of filled, but not yet submitted, entries. */
+	} sq; /**< Submission queue. */
+	struct {
+		unsigned int *head, *tail, *mask;
+		struct io_uring_cqe *cqes;
+	} cq; /**< Completion queue. */
+	struct {
+		struct io_uring_buf_ring *ring;
+		char *buffers;
+	} br; /**< Provided buffers ring. */
+	struct socket_switch_uring_slot *slots; /**< Slots, indexed by fd. */
+	unsigned int capacity; /**< Number of allocated slots. */
+} socket_switch_uring = {
+	.fd = -1,
+};
+
+static inline uint64_t
+socket_switch_uring_user_data(int fd) {
+	return (uint64_t)socket_switch_uring.slots[fd].generation << 32 | (uint32_t)fd;
+}
+
+/**
+ * Provides a buffer back to the kernel, once the data it received was operated.
+ * @param bid Buffer identifier.
+ */
+static void
+socket_switch_uring_provide(unsigned int bid) {
+	struct io_uring_buf_ring * const ring = socket_switch_uring.br.ring;
+	const uint16_t tail = ring->tail;
+	struct io_uring_buf * const buf = &ring->bufs[tail & (SOCKET_SWITCH_URING_BUFFERS - 1)];
+
+	buf->addr = (uintptr_t)(socket_switch_uring.br.buffers + bid * CONFIG_SOCKET_CONNECTIONS_BUFFER_SIZE);
+	buf->len = CONFIG_SOCKET_CONNECTIONS_BUFFER_SIZE;
+	buf->bid = bid;
+
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Submits filled entries.
+ * @param wait Whether to wait for a completion.
+ * @returns Zero on success, -1 on error with errno set.
+ */
+static int
+socket_switch_uring_enter(bool wait) {
+	const unsigned int submitted = __atomic_load_n(socket_switch_uring.sq.tail, __ATOMIC_RELAXED);
+	const unsigned int count = socket_switch_uring.sq.local - submitted;
+
+	__atomic_store_n(socket_switch_uring.sq.tail, socket_switch_uring.sq.local, __ATOMIC_RELEASE);
+
+	if (count == 0 && !wait) {
+		return 0;
+	}
+
+	if (syscall(SYS_io_uring_enter, socket_switch_uring.fd, count, wait ? 1 : 0,
+		wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0) < 0) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Gets a free submission entry, submitting filled ones if the queue is full.
+ * @param opcode Operation of the request.
+ * @param fd File descriptor of the request.
+ * @param user_data User data of the request.
+ * @returns A zeroed entry, with opcode, fd and user data set.
+ */
+static struct io_uring_sqe *
+socket_switch_uring_sqe(uint8_t opcode, int fd, uint64_t user_data) {
+	unsigned int head = __atomic_load_n(socket_switch_uring.sq.head, __ATOMIC_ACQUIRE);
+
+	if (socket_switch_uring.sq.local - head == socket_switch_uring.sq.entries) {
+		if (socket_switch_uring_enter(false) != 0) {
+			syslog(LOG_ERR, "socket_switch_uring_sqe: io_uring_enter: %m");
+		}
+	}
+
+	const unsigned int index = socket_switch_uring.sq.local & *socket_switch_uring.sq.mask;
+	struct io_uring_sqe * const sqe = &socket_switch_uring.sq.sqes[index];
+
+	memset(sqe, 0, sizeof (*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->user_data = user_data;
+
+	socket_switch_uring.sq.array[index] = index;
+	socket_switch_uring.sq.local++;
+
+	return sqe;
+}
+
+/**
+ * Arms the request operating a node.
+ * @param snode Socket node, in its slot.
+ */
+static void
+socket_switch_uring_arm(struct socket_node *snode) {
+	const uint64_t user_data = socket_switch_uring_user_data(snode->fd);
+
+	if (snode->class->accepted != NULL) {
+		struct io_uring_sqe * const sqe = socket_switch_uring_sqe(IORING_OP_ACCEPT, snode->fd, user_data);
+
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+		sqe->accept_flags = SOCK_CLOEXEC;
+	} else if (snode->class->received != NULL) {
+		struct io_uring_sqe * const sqe = socket_switch_uring_sqe(IORING_OP_RECV, snode->fd, user_data);
+
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = SOCKET_SWITCH_URING_BUFFER_GROUP;
+	} else {
+		struct io_uring_sqe * const sqe = socket_switch_uring_sqe(IORING_OP_POLL_ADD, snode->fd, user_data);
+
+		sqe->poll32_events = POLLIN;
+	}
+}
+
+/**
+ * Arms the writability poll of a node.
+ * @param snode Socket node, in its slot.
+ */
+static void
+socket_switch_uring_arm_writable(struct socket_node *snode) {
+	const uint64_t user_data = socket_switch_uring_user_data(snode->fd) | SOCKET_SWITCH_URING_WRITABLE;
+	struct io_uring_sqe * const sqe = socket_switch_uring_sqe(IORING_OP_POLL_ADD, snode->fd, user_data);
+
+	sqe->poll32_events = POLLOUT;
+	socket_switch_uring.slots[snode->fd].polling = true;
+}
+
+/**
+ * Checks multishot receptions are supported, they need Linux 6.0 where
+ * every other request used only needs 5.19. A byte written on a socket pair
+ * is received by a multishot reception, which must complete with more to come.
+ * It is then cancelled, its last completions are ignored by the first wait.
+ * @returns Zero if supported, -1 else with errno set.
+ */
+static int
+socket_switch_uring_probe(void) {
+	int fds[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) {
+		goto socketpair_failure;
+	}
+
+	if (write(fds[1], "", 1) != 1) {
+		goto write_failure;
+	}
+
+	struct io_uring_sqe *sqe = socket_switch_uring_sqe(IORING_OP_RECV, fds[0], SOCKET_SWITCH_URING_IGNORED);
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = SOCKET_SWITCH_URING_BUFFER_GROUP;
+
+	if (socket_switch_uring_enter(true) != 0) {
+		goto enter_failure;
+	}
+
+	const unsigned int head = *socket_switch_uring.cq.head;
+	const struct io_uring_cqe cqe = socket_switch_uring.cq.cqes[head & *socket_switch_uring.cq.mask];
+	__atomic_store_n(socket_switch_uring.cq.head, head + 1, __ATOMIC_RELEASE);
+
+	if ((cqe.flags & IORING_CQE_F_BUFFER) != 0) {
+		socket_switch_uring_provide(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+	}
+
+	if ((cqe.flags & IORING_CQE_F_MORE) != 0) {
+		sqe = socket_switch_uring_sqe(IORING_OP_ASYNC_CANCEL, fds[0], SOCKET_SWITCH_URING_IGNORED);
+		sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+		if (socket_switch_uring_enter(false) != 0) {
+			goto enter_failure;
+		}
+	}
+
+	if (cqe.res != 1 || (cqe.flags & IORING_CQE_F_MORE) == 0) {
+		errno = cqe.res < 0 ? -cqe.res : EINVAL;
+		goto multishot_failure;
+	}
+
+	close(fds[1]);
+	close(fds[0]);
+
+	return 0;
+multishot_failure:
+enter_failure:
+write_failure:
+	close(fds[1]);
+	close(fds[0]);
+socketpair_failure:
+	return -1;
+}
+
+/**
+ * Creates the io_uring instance, maps its queues and provides reception buffers.
+ * Multishot receptions are then probed, see @ref socket_switch_uring_probe.
+ * @returns Zero on success, -1 on error with errno set, the socket switch must then use another backend.
+ */
+int
+socket_switch_uring_setup(void) {
+	struct io_uring_params params = { };
+
+	const int fd = syscall(SYS_io_uring_setup, SOCKET_SWITCH_URING_ENTRIES, &params);
+	if (fd < 0) {
+		goto setup_failure;
+	}
+
+	size_t sqsize = params.sq_off.array + params.sq_entries * sizeof (unsigned int);
+	size_t cqsize = params.cq_off.cqes + params.cq_entries * sizeof (struct io_uring_cqe);
+	const bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+
+	if (single) {
+		sqsize = cqsize = sqsize > cqsize ? sqsize : cqsize;
+	}
+
+	char * const sq = mmap(NULL, sqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED) {
+		goto mmap_sq_failure;
+	}
+
+	char * const cq = single ? sq : mmap(NULL, cqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	if (cq == MAP_FAILED) {
+		goto mmap_cq_failure;
+	}
+
+	const size_t sqessize = params.sq_entries * sizeof (struct io_uring_sqe);
+	struct io_uring_sqe * const sqes = mmap(NULL, sqessize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED) {
+		goto mmap_sqes_failure;
+	}
+
+	const size_t brsize = SOCKET_SWITCH_URING_BUFFERS * sizeof (struct io_uring_buf);
+	struct io_uring_buf_ring * const ring = mmap(NULL, brsize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring == MAP_FAILED) {
+		goto mmap_br_failure;
+	}
+
+	char * const buffers = malloc(SOCKET_SWITCH_URING_BUFFERS * CONFIG_SOCKET_CONNECTIONS_BUFFER_SIZE);
+	if (buffers == NULL) {
+		goto malloc_failure;
+	}
+
+	struct io_uring_buf_reg reg = {
+		.ring_addr = (uintptr_t)ring,
+		.ring_entries = SOCKET_SWITCH_URING_BUFFERS,
+		.bgid = SOCKET_SWITCH_URING_BUFFER_GROUP,
+	};
+	if (syscall(SYS_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+		goto register_failure;
+	}
+
+	socket_switch_uring.fd = fd;
+	socket_switch_uring.sq.head = (unsigned int *)(sq + params.sq_off.head);
+	socket_switch_uring.sq.tail = (unsigned int *)(sq + params.sq_off.tail);
+	socket_switch_uring.sq.mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+	socket_switch_uring.sq.array = (unsigned int *)(sq + params.sq_off.array);
+	socket_switch_uring.sq.sqes = sqes;
+	socket_switch_uring.sq.entries = params.sq_entries;
+	socket_switch_uring.sq.local = *socket_switch_uring.sq.tail;
+	socket_switch_uring.cq.head = (unsigned int *)(cq + params.cq_off.head);
+	socket_switch_uring.cq.tail = (unsigned int *)(cq + params.cq_off.tail);
+	socket_switch_uring.cq.mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+	socket_switch_uring.cq.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	socket_switch_uring.br.ring = ring;
+	socket_switch_uring.br.buffers = buffers;
+
+	for (unsigned int bid = 0; bid < SOCKET_SWITCH_URING_BUFFERS; bid++) {
+		socket_switch_uring_provide(bid);
+	}
+
+	if (socket_switch_uring_probe() != 0) {
+		goto probe_failure;
+	}
+
+	return 0;
+probe_failure:
+	socket_switch_uring.fd = -1;
+register_failure:
+	free(buffers);
+malloc_failure:
+	munmap(ring, brsize);
+mmap_br_failure:
+	munmap(sqes, sqessize);
+mmap_sqes_failure:
+	if (!single) {
+		munmap(cq, cqsize);
+	}
+mmap_cq_failure:
+	munmap(sq, sqsize);
+mmap_sq_failure:
+	close(fd);
+setup_failure:
+	return -1;
+}
+
+/**
+ * Insert a socket node, arming its request.
+ * @returns Zero on success, -1 if the node's slot couldn't be allocated.
+ */
+int
+socket_switch_uring_insert(struct socket_node *snode) {
+
+	if (snode->fd >= socket_switch_uring.capacity) {
+		unsigned int capacity = socket_switch_uring.capacity != 0 ? socket_switch_uring.capacity : 64;
+		while (snode->fd >= capacity) {
+			capacity *= 2;
+		}
+
+		struct socket_switch_uring_slot * const slots = realloc(socket_switch_uring.slots, capacity * sizeof (*slots));
+		if (slots == NULL) {
+			syslog(LOG_ERR, "socket_switch_uring_insert: realloc: %m");
+			return -1;
+		}
+
+		memset(slots + socket_switch_uring.capacity, 0, (capacity - socket_switch_uring.capacity) * sizeof (*slots));
+		socket_switch_uring.slots = slots;
+		socket_switch_uring.capacity = capacity;
+	}
+
+	socket_switch_uring.slots[snode->fd].snode = snode;
+	socket_switch_uring_arm(snode);
+
+	return 0;
+}
+
+/**
+ * Remove a socket node, cancelling its requests. The cancellation is submitted right away,
+ * while the fd still refers to the node's file, its completions are ignored afterwards.
+ */
+void
+socket_switch_uring_remove(struct socket_node *snode) {
+
+	if (snode->fd >= socket_switch_uring.capacity || socket_switch_uring.slots[snode->fd].snode != snode) {
+		return;
+	}
+
+	struct socket_switch_uring_slot * const slot = &socket_switch_uring.slots[snode->fd];
+	struct io_uring_sqe * const sqe = socket_switch_uring_sqe(IORING_OP_ASYNC_CANCEL, snode->fd, SOCKET_SWITCH_URING_IGNORED);
+
+	sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+	slot->snode = NULL;
+	slot->generation++;
+	slot->writable = false;
+	slot->polling = false;
+
+	if (socket_switch_uring_enter(false) != 0) {
+		syslog(LOG_ERR, "socket_switch_uring_remove: io_uring_enter: %m");
+	}
+}
+
+/**
+ * Watches, or stops watching, a node for writability. A poll is armed only
+ * if none is in flight, a poll completing while the node isn't watched anymore is ignored.
+ */
+void
+socket_switch_uring_writable(struct socket_node *snode, bool watch) {
+	struct socket_switch_uring_slot * const slot = &socket_switch_uring.slots[snode->fd];
+
+	slot->writable = watch;
+	if (watch && !slot->polling) {
+		socket_switch_uring_arm_writable(snode);
+	}
+}
+
+/**
+ * Operates the completion of a writability poll.
+ * @param cqe Completion, copied out of the queue.
+ * @param fd File descriptor of the node.
+ */
+static void
+socket_switch_uring_complete_writable(const struct io_uring_cqe *cqe, int fd) {
+	struct socket_node * const snode = socket_switch_uring.slots[fd].snode;
+
+	socket_switch_uring.slots[fd].polling = false;
+	if (!socket_switch_uring.slots[fd].writable) {
+		return;
+	}
+
+	if (cqe->res < 0) {
+		syslog(LOG_ERR, "socket_switch_uring: poll %d: %s", fd, strerror(-cqe->res));
+	}
+	snode->class->writable(snode);
+
+	/* Re-arm if still watched, and the node wasn't removed meanwhile. */
+	if (socket_switch_uring.slots[fd].snode == snode
+		&& socket_switch_uring.slots[fd].writable
+		&& !socket_switch_uring.slots[fd].polling) {
+		socket_switch_uring_arm_writable(snode);
+	}
+}
+
+/**
+ * Operates a completion.
+ * @param cqe Completion, copied out of the queue.
+ */
+static void
+socket_switch_uring_complete(const struct io_uring_cqe *cqe) {
+	const bool buffered = (cqe->flags & IORING_CQE_F_BUFFER) != 0;
+	const unsigned int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+	if (cqe->user_data == SOCKET_SWITCH_URING_IGNORED) {
+		return;
+	}
+
+	const int fd = (uint32_t)(cqe->user_data & ~SOCKET_SWITCH_URING_WRITABLE);
+	const uint32_t generation = cqe->user_data >> 32;
+	struct socket_node * const snode = socket_switch_uring.slots[fd].snode;
+
+	if (snode == NULL || socket_switch_uring.slots[fd].generation != generation) {
+		/* Completion of a removed node. */
+		if (buffered) {
+			socket_switch_uring_provide(bid);
+		}
+		return;
+	}
+
+	if ((cqe->user_data & SOCKET_SWITCH_URING_WRITABLE) != 0) {
+		return socket_switch_uring_complete_writable(cqe, fd);
+	}
+
+	if (snode->class->accepted != NULL) {
+		if (cqe->res >= 0) {
+			snode->class->accepted(snode, cqe->res);
+		} else {
+			syslog(LOG_ERR, "socket_switch_uring: accept %d: %s", fd, strerror(-cqe->res));
+		}
+	} else if (snode->class->received != NULL) {
+		if (buffered) {
+			snode->class->received(snode, socket_switch_uring.br.buffers + bid * CONFIG_SOCKET_CONNECTIONS_BUFFER_SIZE, cqe->res);
+			socket_switch_uring_provide(bid);
+		} else if (cqe->res == 0) {
+			snode->class->received(snode, NULL, 0);
+		} else if (cqe->res != -ENOBUFS) {
+			syslog(LOG_ERR, "socket_switch_uring: recv %d: %s", fd, strerror(-cqe->res));
+			snode->class->received(snode, NULL, 0);
+		}
+	} else {
+		if (cqe->res < 0) {
+			syslog(LOG_ERR, "socket_switch_uring: poll %d: %s", fd, strerror(-cqe->res));
+		}
+		snode->class->operate(snode);
+	}
+
+	/* Re-arm if the request ended, and the node wasn't removed meanwhile. */
+	if ((cqe->flags & IORING_CQE_F_MORE) == 0
+		&& socket_switch_uring.slots[fd].snode == snode
+		&& socket_switch_uring.slots[fd].generation == generation) {
+		socket_switch_uring_arm(snode);
+	}
+}
+
+/**
+ * Submits armed requests, waits for completions if none is available, and operates them.
+ * Available completions are operated in two passes, those of background nodes last.
+ * Completions of the first pass are marked ignored in the ring, which is only
+ * consumed once both passes are done.
+ * @returns Zero on success, -1 on error with errno set, EINTR if interrupted by a signal.
+ */
+int
+socket_switch_uring_wait(void) {
+	const unsigned int head = *socket_switch_uring.cq.head;
+
+	if (socket_switch_uring_enter(head == __atomic_load_n(socket_switch_uring.cq.tail, __ATOMIC_ACQUIRE)) != 0) {
+		return -1;
+	}
+
+	const unsigned int tail = __atomic_load_n(socket_switch_uring.cq.tail, __ATOMIC_ACQUIRE);
+
+	for (unsigned int current = head; current != tail; current++) {
+		struct io_uring_cqe * const cqe = &socket_switch_uring.cq.cqes[current & *socket_switch_uring.cq.mask];
+
+		if (cqe->user_data != SOCKET_SWITCH_URING_IGNORED) {
+			const int fd = (uint32_t)(cqe->user_data & ~SOCKET_SWITCH_URING_WRITABLE);
+			const struct socket_node * const snode = socket_switch_uring.slots[fd].snode;
+
+			if (snode == NULL || !snode->class->background) {
+				const struct io_uring_cqe copy = *cqe;
+				cqe->user_data = SOCKET_SWITCH_URING_IGNORED;
+				socket_switch_uring_complete(&copy);
+			}
+		}
+	}
+
+	for (unsigned int current = head; current != tail; current++) {
+		const struct io_uring_cqe cqe = socket_switch_uring.cq.cqes[current & *socket_switch_uring.cq.mask];
+
+		socket_switch_uring_complete(&cqe);
+	}
+
+	__atomic_store_n(socket_switch_uring.cq.head, tail, __ATOMIC_RELEASE);
+
+	return 0;
+}
@@ -0,0 +1,23 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#ifndef SOCKET_SWITCH_URING_H
+#define SOCKET_SWITCH_URING_H
+
+struct socket_node;
+
+int
+socket_switch_uring_setup(void);
+
+int
+socket_switch_uring_insert(struct socket_node *snode);
+
+void
+socket_switch_uring_remove(struct socket_node *snode);
+
+void
+socket_switch_uring_writable(struct socket_node *snode, bool watch);
+
+int
+socket_switch_uring_wait(void);
+
+/* SOCKET_SWITCH_URING_H */
+#endif
@@ -0,0 +1,570 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#include "spawners.h"
+
+#include "daemon.h"
+#include "process.h"
+#include "socket_switch.h"
+#include "socket_node.h"
+
+#include <stdlib.h> /* calloc, free, malloc, _exit */
+#include <stdnoreturn.h> /* noreturn */
+#include <string.h> /* memcpy, memchr, strlen */
+#include <syslog.h> /* syslog */
+#include <unistd.h> /* close, sysconf, syscall */
+#include <errno.h> /* errno, EINTR, EAGAIN, EBADMSG */
+#include <sys/socket.h> /* socketpair, send, sendmsg, recvmsg, ... */
+#include <sys/wait.h> /* waitid, __WALL */
+#include <sys/syscall.h> /* SYS_clone3 */
+#include <linux/sched.h> /* struct clone_args */
+#include <signal.h> /* kill */
+
+/**
+ * Maximum size of a spawn request.
+ * Daemons whose spawn plan doesn't fit are spawned by cyberd itself.
+ */
+#define SPAWNERS_REQUEST_SIZE 65536
+
+/**
+ * Maximum count of requests in flight for a single spawner.
+ * When all spawners are busy, daemons are spawned by cyberd itself.
+ */
+#define SPAWNERS_PENDING_MAX 64
+
+/**
+ * Fixed-size part of a spawn request, followed by the NUL-terminated strings
+ * of the spawn plan: path, in, out, err if any, workdir, arguments and environment.
+ */
+struct spawners_request {
+	uid_t uid;
+	gid_t gid;
+	mode_t umask;
+	int priority;
+	bool nosid;
+	bool err; /**< Whether the standard error has its own path. */
+	unsigned int argc; /**< Number of arguments. */
+	unsigned int envc; /**< Number of environment variables. */
+};
+
+/**
+ * A spawner is a small process forked at setup, before any configuration is loaded.
+ * It receives spawn plans through a sequenced packet socket, and spawns daemons
+ * as siblings (_CLONE_PARENT_), so they are children of cyberd, like any other daemon.
+ * Each spawn is answered with a @ref process_spawn, and the pidfd of the process if one was created.
+ * Answers are received in the order of requests, the daemons waiting for them are queued.
+ */
+struct spawner {
+	struct socket_node super; /**< Parent socket node, cyberd's end of the socket pair. */
+	pid_t pid; /**< Pid of the spawner. */
+	unsigned int first; /**< Index of the first pending request. */
+	unsigned int count; /**< Count of pending requests. */
+	struct daemon *pending[SPAWNERS_PENDING_MAX]; /**< Daemons waiting for a spawn, _NULL_ if cancelled. */
+};
+
+/** All spawners, a spawner whose socket is -1 was lost. */
+static struct spawner *spawners;
+
+/** Number of spawners. */
+static unsigned int spawners_count;
+
+/*************************
+ * Spawner process' side *
+ *************************/
+
+/**
+ * Reads the next string of a spawn request.
+ * @param[in,out] stringp Current string, next string on return.
+ * @param end End of the request.
+ * @returns The current string, _NULL_ if the request is truncated.
+ */
+static char *
+spawners_request_string(char **stringp, const char *end) {
+	char * const string = *stringp;
+
+	if (string == NULL) {
+		return NULL;
+	}
+
+	char * const nul = memchr(string, '\0', end - string);
+	*stringp = nul != NULL ? nul + 1 : NULL;
+
+	return nul != NULL ? string : NULL;
+}
+
+/**
+ * Reads a spawn plan from a spawn request. Strings point into the request.
+ * @param buffer Spawn request.
+ * @param length Length of @p buffer.
+ * @param[out] conf Spawn plan, its arguments and environment arrays must be freed with `conf->arguments`.
+ * @returns Zero on success, -1 if the request is invalid, or on memory allocation failure.
+ */
+static int
+spawners_request_decode(char *buffer, size_t length, struct daemon_conf *conf) {
+	const char * const end = buffer + length;
+	struct spawners_request request;
+
+	if (length < sizeof (request)) {
+		return -1;
+	}
+
+	memcpy(&request, buffer, sizeof (request));
+	if (request.argc > length || request.envc > length) {
+		return -1;
+	}
+
+	char **vectors = malloc((request.argc + request.envc + 2) * sizeof (*vectors));
+	if (vectors == NULL) {
+		return -1;
+	}
+
+	char *string = buffer + sizeof (request);
+
+	*conf = (struct daemon_conf) {
+		.uid = request.uid,
+		.gid = request.gid,
+		.nosid = request.nosid,
+		.umask = request.umask,
+		.priority = request.priority,
+		.arguments = vectors,
+		.environment = vectors + request.argc + 1,
+	};
+
+	conf->path = spawners_request_string(&string, end);
+	conf->in = spawners_request_string(&string, end);
+	conf->out = spawners_request_string(&string, end);
+	if (request.err) {
+		conf->err = spawners_request_string(&string, end);
+	}
+	conf->workdir = spawners_request_string(&string, end);
+
+	for (unsigned int i = 0; i < request.argc; i++) {
+		conf->arguments[i] = spawners_request_string(&string, end);
+	}
+	conf->arguments[request.argc] = NULL;
+
+	for (unsigned int i = 0; i < request.envc; i++) {
+		conf->environment[i] = spawners_request_string(&string, end);
+	}
+	conf->environment[request.envc] = NULL;
+
+	/* Once a string is missing, all the following ones are too. */
+	if (string == NULL) {
+		free(vectors);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Answers a spawn request, attaching the pidfd of the process if one was created.
+ * @param fd Spawner's end of the socket pair.
+ * @param spawn Outcome of the spawn.
+ * @returns Zero on success, -1 on error to _sendmsg(2)_.
+ */
+static int
+spawners_reply(int fd, const struct process_spawn *spawn) {
+	union {
+		struct cmsghdr header;
+		char buffer[CMSG_SPACE(sizeof (int))];
+	} control;
+	struct iovec iov = {
+		.iov_base = (void *)spawn,
+		.iov_len = sizeof (*spawn),
+	};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+	};
+
+	if (spawn->pid > 0) {
+		msg.msg_control = control.buffer;
+		msg.msg_controllen = sizeof (control.buffer);
+
+		struct cmsghdr * const cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof (int));
+		memcpy(CMSG_DATA(cmsg), &spawn->pidfd, sizeof (int));
+	}
+
+	return sendmsg(fd, &msg, MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+/**
+ * Main loop of a spawner, spawns daemons until cyberd closes its end of the socket pair.
+ * Signals are still blocked as in cyberd, and never unblocked, processes reset their procmask.
+ * @param fd Spawner's end of the socket pair.
+ * @returns Never.
+ */
+static void noreturn
+spawners_main(int fd) {
+	static char buffer[SPAWNERS_REQUEST_SIZE];
+
+	for (;;) {
+		struct process_spawn spawn = { .pid = -1, .errnum = EBADMSG };
+		struct daemon_conf conf;
+
+		const ssize_t length = recv(fd, buffer, sizeof (buffer), 0);
+		if (length <= 0) {
+			_exit(length == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+
+		if (spawners_request_decode(buffer, length, &conf) == 0) {
+			process_spawn(&conf, -1, true, &spawn);
+			free(conf.arguments);
+		}
+
+		if (spawners_reply(fd, &spawn) != 0) {
+			_exit(EXIT_FAILURE);
+		}
+
+		if (spawn.pid > 0) {
+			close(spawn.pidfd);
+		}
+	}
+}
+
+/*************************
+ * Cyberd's process side *
+ *************************/
+
+/**
+ * Appends a string to a spawn request.
+ * @param string String to append.
+ * @param position Current end of the request, _NULL_ if it already overflowed.
+ * @param end End of the request's buffer.
+ * @returns The new end of the request, _NULL_ if it overflows.
+ */
+static char *
+spawners_request_append(const char *string, char *position, const char *end) {
+
+	if (position == NULL) {
+		return NULL;
+	}
+
+	const size_t size = strlen(string) + 1;
+	if ((size_t)(end - position) < size) {
+		return NULL;
+	}
+
+	return (char *)memcpy(position, string, size) + size;
+}
+
+/**
+ * Writes the spawn plan of a daemon as a spawn request.
+ * @param conf Spawn plan.
+ * @param buffer Buffer of @ref SPAWNERS_REQUEST_SIZE bytes.
+ * @returns Length of the request, zero if it doesn't fit in @p buffer.
+ */
+static size_t
+spawners_request_encode(const struct daemon_conf *conf, char *buffer) {
+	const char * const end = buffer + SPAWNERS_REQUEST_SIZE;
+	struct spawners_request request = {
+		.uid = conf->uid,
+		.gid = conf->gid,
+		.umask = conf->umask,
+		.priority = conf->priority,
+		.nosid = conf->nosid,
+		.err = conf->err != NULL,
+	};
+	char *position = buffer + sizeof (request);
+
+	position = spawners_request_append(conf->path, position, end);
+	position = spawners_request_append(conf->in, position, end);
+	position = spawners_request_append(conf->out, position, end);
+	if (conf->err != NULL) {
+		position = spawners_request_append(conf->err, position, end);
+	}
+	position = spawners_request_append(conf->workdir, position, end);
+
+	for (char * const *argument = conf->arguments; *argument != NULL; argument++, request.argc++) {
+		position = spawners_request_append(*argument, position, end);
+	}
+
+	for (char * const *variable = conf->environment; *variable != NULL; variable++, request.envc++) {
+		position = spawners_request_append(*variable, position, end);
+	}
+
+	if (position == NULL) {
+		return 0;
+	}
+
+	memcpy(buffer, &request, sizeof (request));
+
+	return position - buffer;
+}
+
+/**
+ * Forgets a spawner which closed its end of the socket pair or was killed, and reaps it.
+ * Its pending daemons are started again, by other spawners or by cyberd itself.
+ * @param spawner Lost spawner.
+ */
+static void
+spawners_lost(struct spawner *spawner) {
+	siginfo_t info;
+
+	syslog(LOG_ERR, "spawners: Spawner %d lost with %u pending spawns", spawner->pid, spawner->count);
+
+	socket_switch_remove(&spawner->super);
+	close(spawner->super.fd);
+	spawner->super.fd = -1;
+
+	while (waitid(P_PID, spawner->pid, &info, WEXITED | __WALL) != 0 && errno == EINTR);
+
+	for (; spawner->count != 0; spawner->count--) {
+		struct daemon * const daemon = spawner->pending[spawner->first];
+
+		spawner->first = (spawner->first + 1) % SPAWNERS_PENDING_MAX;
+		process_remote_answered(-1, &info);
+		if (daemon != NULL) {
+			daemon->state = DAEMON_FAILED;
+			daemon_start(daemon);
+		}
+	}
+}
+
+/**
+ * Receives the answer to the first pending request of a spawner,
+ * and completes the start of its daemon. If the daemon was removed
+ * in the meantime, its process is watched as an orphan. If the process
+ * was already reaped, its termination is delivered right away.
+ * @param snode Socket node of the spawner.
+ */
+static void
+spawners_node_operate(struct socket_node *snode) {
+	struct spawner * const spawner = (struct spawner *)snode;
+	union {
+		struct cmsghdr header;
+		char buffer[CMSG_SPACE(sizeof (int))];
+	} control;
+	struct process_spawn spawn;
+	struct iovec iov = {
+		.iov_base = &spawn,
+		.iov_len = sizeof (spawn),
+	};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buffer,
+		.msg_controllen = sizeof (control.buffer),
+	};
+
+	const ssize_t length = recvmsg(snode->fd, &msg, MSG_CMSG_CLOEXEC);
+	if (length <= 0) {
+		if (length < 0) {
+			syslog(LOG_ERR, "spawners_node_operate: recvmsg: %m");
+		}
+		spawners_lost(spawner);
+		return;
+	}
+
+	const struct cmsghdr * const cmsg = CMSG_FIRSTHDR(&msg);
+	const bool haspidfd = cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS
+		&& cmsg->cmsg_len == CMSG_LEN(sizeof (int));
+	if (haspidfd) {
+		memcpy(&spawn.pidfd, CMSG_DATA(cmsg), sizeof (int));
+	}
+
+	if (length != sizeof (spawn) || spawner->count == 0 || (spawn.pid > 0) != haspidfd) {
+		syslog(LOG_ERR, "spawners_node_operate: Invalid answer from spawner %d", spawner->pid);
+		if (haspidfd) {
+			close(spawn.pidfd);
+		}
+		/* Answers can't be matched to requests anymore. */
+		kill(spawner->pid, SIGKILL);
+		spawners_lost(spawner);
+		return;
+	}
+
+	struct daemon * const daemon = spawner->pending[spawner->first];
+	spawner->first = (spawner->first + 1) % SPAWNERS_PENDING_MAX;
+	spawner->count--;
+
+	siginfo_t info;
+	const bool reaped = process_remote_answered(spawn.pid, &info);
+
+	if (daemon != NULL) {
+		daemon_spawned(daemon, &spawn, reaped ? &info : NULL);
+	} else if (reaped) {
+		process_orphan_reaped(&info);
+		close(spawn.pidfd);
+	} else if (spawn.pid > 0) {
+		process_orphan(spawn.pidfd);
+	}
+}
+
+/**
+ * Spawner node class. The nodes belong to the spawners,
+ * and are kept in the socket switch during teardown.
+ */
+static const struct socket_node_class spawners_node_class = {
+	.operate = spawners_node_operate,
+};
+
+/**
+ * Forks a spawner. It sends no signal on termination, and is reaped explicitly.
+ * @param spawner Spawner to setup.
+ * @returns Zero on success, -1 on error with errno set.
+ */
+static int
+spawners_fork(struct spawner *spawner) {
+	struct clone_args args = { .exit_signal = 0 };
+	int fds[2];
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) != 0) {
+		return -1;
+	}
+
+	const pid_t pid = syscall(SYS_clone3, &args, sizeof (args));
+	switch (pid) {
+	case -1:
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	case 0:
+		/* Only keep our end of the socket pair. */
+		for (struct spawner *previous = spawners; previous != spawner; previous++) {
+			close(previous->super.fd);
+		}
+		close(fds[0]);
+		spawners_main(fds[1]);
+	default:
+		close(fds[1]);
+		break;
+	}
+
+	spawner->super.class = &spawners_node_class;
+	spawner->super.fd = fds[0];
+	spawner->pid = pid;
+	spawner->first = 0;
+	spawner->count = 0;
+
+	if (socket_switch_insert(&spawner->super) != 0) {
+		siginfo_t info;
+
+		/* The spawner exits once its end of the socket pair is closed. */
+		close(fds[0]);
+		while (waitid(P_PID, pid, &info, WEXITED | __WALL) != 0 && errno == EINTR);
+		errno = EMFILE;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Forks spawners, one per online processor, at most CONFIG_DAEMON_SPAWNERS.
+ * Must be called before the socket switch setup, so spawners don't hold its endpoints.
+ */
+void
+spawners_setup(void) {
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (count < 1) {
+		count = 1;
+	} else if (count > CONFIG_DAEMON_SPAWNERS) {
+		count = CONFIG_DAEMON_SPAWNERS;
+	}
+
+	spawners = calloc(count, sizeof (*spawners));
+	if (spawners == NULL) {
+		syslog(LOG_ERR, "spawners_setup: calloc: %m");
+		return;
+	}
+
+	while (spawners_count < count) {
+		if (spawners_fork(spawners + spawners_count) != 0) {
+			syslog(LOG_ERR, "spawners_setup: Unable to fork spawner: %m");
+			break;
+		}
+		spawners_count++;
+	}
+}
+
+/**
+ * Closes the spawners' sockets, and reaps them. Called once every requested
+ * spawn was answered, spawners are killed first so none can delay the reboot.
+ * Requests still counted, if any, are answered as failed.
+ */
+void
+spawners_teardown(void) {
+
+	for (struct spawner *spawner = spawners; spawner != spawners + spawners_count; spawner++) {
+		if (spawner->super.fd >= 0) {
+			siginfo_t info;
+
+			socket_switch_remove(&spawner->super);
+			close(spawner->super.fd);
+			kill(spawner->pid, SIGKILL);
+			while (waitid(P_PID, spawner->pid, &info, WEXITED | __WALL) != 0 && errno == EINTR);
+
+			for (; spawner->count != 0; spawner->count--) {
+				process_remote_answered(-1, &info);
+			}
+		}
+	}
+
+	free(spawners);
+	spawners = NULL;
+	spawners_count = 0;
+}
+
+/**
+ * Requests the spawn of a daemon to the least busy spawner.
+ * The request never blocks, so spawners and cyberd can't wait on each other.
+ * @param daemon Daemon to spawn, its answer is given to @ref daemon_spawned.
+ * @returns Zero if the spawn was requested, -1 if the daemon must be spawned by the caller.
+ */
+int
+spawners_request(struct daemon *daemon) {
+	static char buffer[SPAWNERS_REQUEST_SIZE];
+	struct spawner *chosen = NULL;
+
+	for (struct spawner *spawner = spawners; spawner != spawners + spawners_count; spawner++) {
+		if (spawner->super.fd >= 0 && spawner->count < SPAWNERS_PENDING_MAX
+			&& (chosen == NULL || spawner->count < chosen->count)) {
+			chosen = spawner;
+		}
+	}
+
+	if (chosen == NULL) {
+		return -1;
+	}
+
+	const size_t length = spawners_request_encode(&daemon->conf, buffer);
+	if (length == 0) {
+		return -1;
+	}
+
+	if (send(chosen->super.fd, buffer, length, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+		if (errno != EAGAIN) {
+			syslog(LOG_ERR, "spawners_request: send '%s': %m", daemon->name);
+		}
+		return -1;
+	}
+
+	chosen->pending[(chosen->first + chosen->count) % SPAWNERS_PENDING_MAX] = daemon;
+	chosen->count++;
+	process_remote_requested();
+
+	return 0;
+}
+
+/**
+ * Forgets a daemon pending for a spawn, its process
+ * will be watched as an orphan if it gets spawned.
+ * @param daemon Removed daemon.
+ */
+void
+spawners_cancel(const struct daemon *daemon) {
+
+	for (struct spawner *spawner = spawners; spawner != spawners + spawners_count; spawner++) {
+		for (unsigned int i = 0; i < spawner->count; i++) {
+			struct daemon ** const pendingp = spawner->pending + (spawner->first + i) % SPAWNERS_PENDING_MAX;
+
+			if (*pendingp == daemon) {
+				*pendingp = NULL;
+			}
+		}
+	}
+}
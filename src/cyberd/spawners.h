@@ -0,0 +1,20 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#ifndef SPAWNERS_H
+#define SPAWNERS_H
+
+struct daemon;
+
+void
+spawners_setup(void);
+
+void
+spawners_teardown(void);
+
+int
+spawners_request(struct daemon *daemon);
+
+void
+spawners_cancel(const struct daemon *daemon);
+
+/* SPAWNERS_H */
+#endif
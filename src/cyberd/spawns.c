@@ -1,50 +1,78 @@
 /* SPDX-License-Identifier: BSD-3-Clause */
 #include "spawns.h"
 
+#include "configuration.h"
 #include "daemon.h"
 #include "tree.h"
 
 #include <syslog.h> /* syslog */
 
 /**
- * Spawns tree comparison function. Identifies by the daemon's pid.
+ * Spawns tree comparison function. Identifies by the process' pid.
  * @param lhs Left hand side operand.
  * @param rhs Right hand side operand.
  * @returns The comparison between @p lhs and @p rhs pids.
  */
 static int
 spawns_compare_function(const tree_element_t *lhs, const tree_element_t *rhs) {
-	const struct daemon * const ldaemon = lhs, * const rdaemon = rhs;
-	return ldaemon->pid - rdaemon->pid;
+	const struct daemon_process * const lprocess = lhs, * const rprocess = rhs;
+	return lprocess->pid - rprocess->pid;
 }
 
 /**
- * Spawns storage. All nodes' element belong to `src/cyberd/configuration.c`.
- * To avoid memory usage mishaps, spawns manipulation is basically restricted to three components:
- * - `src/cyberd/main.c`: During @ref teardown, to ensure the respect of the timeout from child processes.
- * - `src/cyberd/signals.c`: During @ref sigchld_handler, __ONLY__ when reaping a process, if it indeed is a daemon.
- * - `src/cyberd/daemon.c`: All other states, ensuring a @ref daemon_start spawns something, and @ref daemon_destroy doesn't left invalid nodes.
- * This storage is indexed using the daemon's pid as identifiers. All daemon should be in a non-@ref DAEMON_STOPPED state.
+ * Spawns storage. All nodes' element are processes of daemons belonging to `src/cyberd/configuration.c`.
+ * To avoid memory usage mishaps, spawns manipulation is basically restricted to two components:
+ * - `src/cyberd/main.c`: During @ref teardown, to ensure the respect of the timeout from child processes, and when reaping children on _SIGCHLD_.
+ * - `src/cyberd/daemon.c`: All other states, ensuring a @ref daemon_start spawns something, its pidfd node reaping removes it, and @ref daemon_destroy doesn't left invalid nodes.
+ * This storage is indexed using the processes' pids as identifiers. All daemon should be in either a @ref DAEMON_STARTED or a @ref DAEMON_STOPPING state.
+ * A daemon being replaced has two processes recorded, see @ref daemon_replace.
  */
 static struct tree spawns = { .compare = spawns_compare_function };
 
+/** Whether spawns are stopping, see @ref spawns_stop. */
+static bool spawns_stopping;
+
+/**
+ * Deactivate possible respawns, and politely ask for termination.
+ * @param element Process of a daemon.
+ */
+static void
+spawns_stop_element(tree_element_t *element) {
+	struct daemon * const daemon = ((struct daemon_process *)element)->daemon;
+
+	/* It's important to disallow daemons' restart when stopping */
+	daemon->conf.start.load = 0;
+	daemon->conf.start.reload = 0;
+	daemon->conf.start.exitsuccess = 0;
+	daemon->conf.start.exitfailure = 0;
+	daemon->conf.start.killed = 0;
+	daemon->conf.start.dumped = 0;
+
+	daemon_stop(daemon);
+}
+
 /**
- * Register a running daemon.
- * @param daemon A daemon which must not be @ref DAEMON_STOPPED.
+ * Register a running daemon's process. If spawns are stopping, the
+ * daemon was started in the meantime and is stopped right away.
+ * @param process Process of a daemon which must be @ref DAEMON_STARTED.
  */
 void
-spawns_record(struct daemon *daemon) {
-	tree_insert(&spawns, daemon);
+spawns_record(struct daemon_process *process) {
+	tree_insert(&spawns, process);
+
+	if (spawns_stopping) {
+		spawns_stop_element(process);
+	}
 }
 
 /**
- * Retrieve a spawned daemon.
- * @param pid Pid of the running daemon, if any is associated.
- * @returns The daemon if spawned, _NULL_ if none found.
+ * Retrieve a spawned daemon's process.
+ * @param pid Pid of the running process, if any is associated.
+ * @returns The process if spawned, _NULL_ if none found.
  */
-struct daemon *
+struct daemon_process *
 spawns_retrieve(pid_t pid) {
-	const struct daemon element = { .pid = pid };
+	const struct daemon_process element = { .pid = pid };
 	return tree_remove(&spawns, &element);
 }
 
@@ -58,28 +86,37 @@ spawns_empty(void) {
 }
 
 /**
- * Deactivate possible respawns, and politely ask for termination.
- * @param element Daemon.
+ * Cancel a delayed automatic restart, so it doesn't fire during the teardown,
+ * and end a starting daemon, whose process may never exec if spawned by cyberd.
+ * @param daemon Configured daemon, not spawned.
+ * @param data Unused.
  */
 static void
-spawns_stop_element(tree_element_t *element) {
-	struct daemon * const daemon = element;
-
-	/* It's important to disallow daemons' restart when stopping */
-	daemon->conf.start.load = 0;
-	daemon->conf.start.reload = 0;
-	daemon->conf.start.exitsuccess = 0;
-	daemon->conf.start.exitfailure = 0;
-	daemon->conf.start.killed = 0;
-	daemon->conf.start.dumped = 0;
+spawns_stop_unspawned(struct daemon *daemon, void *data) {
 
-	daemon_stop(daemon);
+	switch (daemon->state) {
+	case DAEMON_RESTARTING:
+		daemon_stop(daemon);
+		break;
+	case DAEMON_STARTING:
+		daemon_end(daemon);
+		break;
+	default:
+		break;
+	}
 }
 
-/** Deactivate daemon's spawning and stop all of them */
+/**
+ * Deactivate daemon's spawning and stop all of them,
+ * including the ones recorded from now on.
+ * Pending starts of stopping daemons and delayed restarts are cancelled,
+ * and processes spawned by cyberd which didn't exec yet are killed.
+ */
 void
 spawns_stop(void) {
+	spawns_stopping = true;
 	tree_mutate(&spawns, spawns_stop_element);
+	configuration_select("*", spawns_stop_unspawned, NULL);
 }
 
 #ifndef NDEBUG
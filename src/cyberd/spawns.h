@@ -4,12 +4,12 @@
 
 #include <sys/types.h> /* pid_t */
 
-struct daemon;
+struct daemon_process;
 
 void
-spawns_record(struct daemon *daemon);
+spawns_record(struct daemon_process *process);
 
-struct daemon *
+struct daemon_process *
 spawns_retrieve(pid_t pid);
 
 bool
@@ -0,0 +1,233 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#include "status_page.h"
+
+#include "daemon.h"
+#include "protocol.h"
+
+#include <stdatomic.h> /* atomic_load_explicit, atomic_store_explicit, atomic_thread_fence */
+#include <string.h> /* memcpy, strlen */
+#include <sys/mman.h> /* mmap, mremap, munmap */
+#include <syslog.h> /* syslog */
+#include <fcntl.h> /* open */
+#include <unistd.h> /* ftruncate, unlink, close */
+
+/** Number of slots of a new status page, doubled whenever full. */
+#define STATUS_PAGE_INITIAL_COUNT 64
+
+/**
+ * The status page, its path, its file and our writable mapping of it.
+ * The mapping moves when the page grows, only slot indexes are kept by daemons.
+ */
+static struct {
+	const char *path; /**< Path of the status page, _NULL_ if none. */
+	int fd; /**< File of the status page, -1 if none. */
+	struct protocol_status_page *page; /**< Mapping of the file, _NULL_ if none. */
+	uint32_t first; /**< No free slot is before this one. */
+} status_page = { .fd = -1 };
+
+/**
+ * Size of a status page.
+ * @param count Number of slots.
+ * @returns The size of the page's file.
+ */
+static size_t
+status_page_size(uint32_t count) {
+	return sizeof (struct protocol_status_page) + (size_t)count * sizeof (struct protocol_status_slot);
+}
+
+/**
+ * Creates the status page, empty. Daemons are published in it once inserted.
+ * Without a status page, insertions and updates are ignored.
+ * @param path Path of the status page, it should be on a tmpfs.
+ */
+void
+status_page_setup(const char *path) {
+	const size_t size = status_page_size(STATUS_PAGE_INITIAL_COUNT);
+
+	status_page.fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0644);
+	if (status_page.fd < 0) {
+		syslog(LOG_ERR, "status_page_setup: open '%s': %m", path);
+		goto open_failure;
+	}
+
+	if (ftruncate(status_page.fd, size) != 0) {
+		syslog(LOG_ERR, "status_page_setup: ftruncate '%s': %m", path);
+		goto ftruncate_failure;
+	}
+
+	status_page.page = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, status_page.fd, 0);
+	if (status_page.page == MAP_FAILED) {
+		syslog(LOG_ERR, "status_page_setup: mmap '%s': %m", path);
+		goto mmap_failure;
+	}
+
+	status_page.path = path;
+	status_page.page->magic = PROTOCOL_STATUS_PAGE_MAGIC;
+	status_page.page->version = PROTOCOL_STATUS_PAGE_VERSION;
+	status_page.page->size = sizeof (struct protocol_status_slot);
+	atomic_store_explicit(&status_page.page->count, STATUS_PAGE_INITIAL_COUNT, memory_order_release);
+
+	return;
+mmap_failure:
+	status_page.page = NULL;
+ftruncate_failure:
+	unlink(path);
+	close(status_page.fd);
+	status_page.fd = -1;
+open_failure:
+	return;
+}
+
+/**
+ * Unlinks the status page, it keeps being updated until we reboot.
+ */
+void
+status_page_teardown(void) {
+
+	if (status_page.path != NULL && unlink(status_page.path) != 0) {
+		syslog(LOG_ERR, "status_page_teardown: unlink '%s': %m", status_page.path);
+	}
+}
+
+/**
+ * Doubles the number of slots of the status page. The file grows
+ * before the slots count, so readers never map beyond its end.
+ * @returns Zero on success, -1 on error.
+ */
+static int
+status_page_grow(void) {
+	const uint32_t count = status_page.page->count;
+	const size_t oldsize = status_page_size(count), newsize = status_page_size(count * 2);
+
+	if (ftruncate(status_page.fd, newsize) != 0) {
+		syslog(LOG_ERR, "status_page_grow: ftruncate: %m");
+		return -1;
+	}
+
+	struct protocol_status_page * const page = mremap(status_page.page, oldsize, newsize, MREMAP_MAYMOVE);
+	if (page == MAP_FAILED) {
+		syslog(LOG_ERR, "status_page_grow: mremap: %m");
+		return -1;
+	}
+
+	status_page.page = page;
+	atomic_store_explicit(&page->count, count * 2, memory_order_release);
+
+	return 0;
+}
+
+/**
+ * Begins writing a slot, readers retry until @ref status_page_unlock.
+ * @param slot Slot.
+ * @returns The sequence of the slot before writing it.
+ */
+static uint32_t
+status_page_lock(struct protocol_status_slot *slot) {
+	const uint32_t sequence = atomic_load_explicit(&slot->sequence, memory_order_relaxed);
+
+	atomic_store_explicit(&slot->sequence, sequence + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	return sequence;
+}
+
+/**
+ * Ends writing a slot.
+ * @param slot Slot.
+ * @param sequence Sequence returned by @ref status_page_lock.
+ */
+static void
+status_page_unlock(struct protocol_status_slot *slot, uint32_t sequence) {
+	atomic_store_explicit(&slot->sequence, sequence + 2, memory_order_release);
+}
+
+/**
+ * Writes a daemon's values in its slot, which must be locked.
+ * @param slot Slot of the daemon.
+ * @param daemon Daemon.
+ */
+static void
+status_page_write(struct protocol_status_slot *slot, const struct daemon *daemon) {
+	const bool spawned = daemon->state == DAEMON_STARTED || daemon->state == DAEMON_STOPPING;
+
+	slot->state = daemon->state;
+	slot->exitcode = daemon->exitcode;
+	slot->exitstatus = daemon->exitstatus;
+	slot->pid = spawned ? daemon->process.pid : 0;
+	slot->restarts = daemon->restarts;
+	slot->startedat = (uint64_t)daemon->startedat.tv_sec * 1000000000 + daemon->startedat.tv_nsec;
+}
+
+/**
+ * Publishes a daemon in a free slot of the status page, growing it if full.
+ * The daemon isn't published if the page couldn't grow.
+ * @param daemon Daemon, not published yet.
+ */
+void
+status_page_insert(struct daemon *daemon) {
+
+	if (status_page.page == NULL) {
+		return;
+	}
+
+	uint32_t index = status_page.first;
+	while (index < status_page.page->count && status_page.page->slots[index].namelen != 0) {
+		index++;
+	}
+
+	if (index == status_page.page->count && status_page_grow() != 0) {
+		syslog(LOG_WARNING, "status_page_insert: '%s' not published", daemon->name);
+		return;
+	}
+
+	struct protocol_status_slot * const slot = &status_page.page->slots[index];
+	const size_t namelen = strlen(daemon->name);
+	const uint32_t sequence = status_page_lock(slot);
+
+	memcpy(slot->name, daemon->name, namelen + 1);
+	slot->namelen = namelen;
+	status_page_write(slot, daemon);
+	status_page_unlock(slot, sequence);
+
+	daemon->statusslot = index;
+	status_page.first = index + 1;
+}
+
+/**
+ * Frees the slot of a published daemon.
+ * @param daemon Daemon, published or not.
+ */
+void
+status_page_remove(struct daemon *daemon) {
+
+	if (daemon->statusslot < 0) {
+		return;
+	}
+
+	struct protocol_status_slot * const slot = &status_page.page->slots[daemon->statusslot];
+	const uint32_t sequence = status_page_lock(slot);
+
+	slot->namelen = 0;
+	status_page_unlock(slot, sequence);
+
+	if ((uint32_t)daemon->statusslot < status_page.first) {
+		status_page.first = daemon->statusslot;
+	}
+	daemon->statusslot = -1;
+}
+
+/**
+ * Updates the slot of a daemon after a transition.
+ * @param daemon Daemon, published or not.
+ */
+void
+status_page_update(const struct daemon *daemon) {
+
+	if (daemon->statusslot >= 0) {
+		struct protocol_status_slot * const slot = &status_page.page->slots[daemon->statusslot];
+		const uint32_t sequence = status_page_lock(slot);
+
+		status_page_write(slot, daemon);
+		status_page_unlock(slot, sequence);
+	}
+}
@@ -0,0 +1,23 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#ifndef STATUS_PAGE_H
+#define STATUS_PAGE_H
+
+struct daemon;
+
+void
+status_page_setup(const char *path);
+
+void
+status_page_teardown(void);
+
+void
+status_page_insert(struct daemon *daemon);
+
+void
+status_page_remove(struct daemon *daemon);
+
+void
+status_page_update(const struct daemon *daemon);
+
+/* STATUS_PAGE_H */
+#endif
@@ -250,6 +250,47 @@ tree_node_preorder_mutate(struct tree_node *node, void (* const mutate)(tree_ele
 	}
 }
 
+/**
+ * Execute an in-order traversal of the tree node and visit its elements.
+ * @param node Node to traverse.
+ * @param visit Visit callback.
+ * @param data Argument of @p visit.
+ */
+void
+tree_node_inorder_walk(const struct tree_node *node, void (* const visit)(const tree_element_t *element, void *data), void *data) {
+
+	if (node != NULL) {
+		tree_node_inorder_walk(node->left, visit, data);
+		visit(node->element, data);
+		tree_node_inorder_walk(node->right, visit, data);
+	}
+}
+
+/**
+ * Execute an in-order traversal of the tree node's elements greater than or equal to a lower bound.
+ * Subtrees lesser than the bound are skipped, and the traversal stops once @p visit returns false.
+ * @param node Node to traverse.
+ * @param lower Lower bound of the traversal.
+ * @param compare Comparison function used to compare node elements.
+ * @param visit Visit callback, returns whether the traversal continues.
+ * @param data Argument of @p visit.
+ * @returns Whether the traversal continues.
+ */
+bool
+tree_node_inorder_range(struct tree_node *node, const tree_element_t *lower, int (* const compare)(const tree_element_t *, const tree_element_t *), bool (* const visit)(tree_element_t *element, void *data), void *data) {
+
+	if (node == NULL) {
+		return true;
+	}
+
+	if (compare(lower, node->element) <= 0
+		&& (!tree_node_inorder_range(node->left, lower, compare, visit, data) || !visit(node->element, data))) {
+		return false;
+	}
+
+	return tree_node_inorder_range(node->right, lower, compare, visit, data);
+}
+
 /********
  * Tree *
  ********/
@@ -35,6 +35,32 @@ tree_mutate(struct tree *tree, void (* const mutate)(tree_element_t *element)) {
 	tree_node_preorder_mutate(tree->root, mutate);
 }
 
+/**
+ * Execute an in-order traversal of the tree, visiting elements from the least to the greatest.
+ * @param tree Tree to traverse.
+ * @param visit Visit callback.
+ * @param data Argument of @p visit.
+ */
+static inline void
+tree_walk(const struct tree *tree, void (* const visit)(const tree_element_t *element, void *data), void *data) {
+	extern void tree_node_inorder_walk(const struct tree_node *node, void (* const visit)(const tree_element_t *element, void *data), void *data);
+	tree_node_inorder_walk(tree->root, visit, data);
+}
+
+/**
+ * Execute an in-order traversal of the elements greater than or equal to @p lower,
+ * until @p visit returns false. Elements before @p lower are not traversed.
+ * @param tree Tree to traverse.
+ * @param lower Lower bound of the traversal, compared with elements.
+ * @param visit Visit callback, returns whether the traversal continues.
+ * @param data Argument of @p visit.
+ */
+static inline void
+tree_range(struct tree *tree, const tree_element_t *lower, bool (* const visit)(tree_element_t *element, void *data), void *data) {
+	extern bool tree_node_inorder_range(struct tree_node *node, const tree_element_t *lower, int (* const compare)(const tree_element_t *, const tree_element_t *), bool (* const visit)(tree_element_t *element, void *data), void *data);
+	tree_node_inorder_range(tree->root, lower, tree->compare, visit, data);
+}
+
 /**
  * Insert a new node in a tree.
  * @param tree Tree to insert in.
@@ -0,0 +1,531 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#include "zygotes.h"
+
+#include "daemon.h"
+#include "events.h"
+#include "process.h"
+#include "socket_switch.h"
+#include "socket_node.h"
+#include "status_page.h"
+
+#include <stdio.h> /* FILE, fopen, getline, snprintf, sscanf */
+#include <stdlib.h> /* free, malloc */
+#include <string.h> /* memcpy, strlen */
+#include <syslog.h> /* syslog */
+#include <unistd.h> /* close, syscall */
+#include <fcntl.h> /* open, fcntl */
+#include <errno.h> /* EBADMSG, ECHILD */
+#include <time.h> /* clock_gettime */
+#include <sys/socket.h> /* sendmsg, recvmsg, ... */
+#include <sys/wait.h> /* waitid, P_PIDFD, __WALL */
+#include <sys/syscall.h> /* SYS_pidfd_open */
+
+/** Maximum size of a start request, larger spawn plans can't be started from a template. */
+#define ZYGOTES_REQUEST_SIZE 65536
+
+/** Maximum count of requests in flight for a single zygote. */
+#define ZYGOTES_PENDING_MAX 64
+
+/** A daemon waiting for the answer of a zygote. */
+struct zygote_pending {
+	struct daemon *daemon; /**< Daemon to start, _NULL_ if cancelled. */
+	struct timespec begin; /**< When the request was sent. */
+};
+
+/**
+ * Control of a spawned zygote daemon. Zygotes are pre-initialized processes,
+ * such as runtimes with their libraries loaded, which fork ready children
+ * for the daemons using them as a template, instead of cyberd exec'ing them.
+ * A zygote is spawned with its end of a sequenced packet socket pair as @ref PROCESS_CONTROL_FILENO,
+ * see `docs/zygotes.md` for the protocol. Children are forked with _CLONE_PARENT_, so they are
+ * children of cyberd, watched through their pidfds and recorded in spawns like any other daemon.
+ */
+struct zygote {
+	struct socket_node super; /**< Parent socket node, cyberd's end of the control socket, -1 once closed. */
+	const struct daemon *daemon; /**< Zygote daemon. */
+	struct zygote *next; /**< Next zygote in @ref zygotes. */
+	unsigned int first; /**< Index of the first pending request. */
+	unsigned int count; /**< Count of pending requests. */
+	struct zygote_pending pending[ZYGOTES_PENDING_MAX]; /**< Daemons waiting for an answer. */
+};
+
+/** All zygotes, to cancel requests of removed daemons. */
+static struct zygote *zygotes;
+
+/**
+ * Pops the first pending request of a zygote.
+ * @param zygote Zygote with pending requests.
+ * @returns The first pending request.
+ */
+static struct zygote_pending
+zygote_pop(struct zygote *zygote) {
+	const struct zygote_pending pending = zygote->pending[zygote->first];
+
+	zygote->first = (zygote->first + 1) % ZYGOTES_PENDING_MAX;
+	zygote->count--;
+
+	return pending;
+}
+
+/**
+ * Closes the control socket of a zygote, its pending daemons failed to start.
+ * @param zygote Zygote whose control socket is still open.
+ */
+static void
+zygote_close(struct zygote *zygote) {
+
+	socket_switch_remove(&zygote->super);
+	close(zygote->super.fd);
+	zygote->super.fd = -1;
+
+	while (zygote->count != 0) {
+		const struct zygote_pending pending = zygote_pop(zygote);
+		siginfo_t info;
+
+		process_remote_answered(-1, &info);
+		if (pending.daemon != NULL) {
+			syslog(LOG_INFO, "daemon_start: '%s' start failed, zygote '%s' is gone", pending.daemon->name, zygote->daemon->name);
+			pending.daemon->state = DAEMON_FAILED;
+			status_page_update(pending.daemon);
+			events_publish(PROTOCOL_EVENT_FAILED, pending.daemon, 0, NULL);
+		}
+	}
+}
+
+/**
+ * Reads the pid a pidfd refers to, from its _proc(5)_ fdinfo.
+ * @param pidfd Pidfd.
+ * @returns The pid, -1 if it can't be read.
+ */
+static pid_t
+zygote_pidfd_pid(int pidfd) {
+	char path[64], *line = NULL;
+	size_t size = 0;
+	pid_t pid = -1;
+
+	snprintf(path, sizeof (path), "/proc/self/fdinfo/%d", pidfd);
+
+	FILE * const filep = fopen(path, "re");
+	if (filep == NULL) {
+		return -1;
+	}
+
+	while (getline(&line, &size, filep) > 0) {
+		if (sscanf(line, "Pid: %d", &pid) == 1) {
+			break;
+		}
+	}
+
+	free(line);
+	fclose(filep);
+
+	return pid;
+}
+
+/**
+ * Retrieves the pidfd of a child forked by a zygote, and checks it is a child of cyberd.
+ * An attached pidfd is only used if it refers to @p pid, else cyberd opens its own.
+ * @param zygote Zygote which forked the child.
+ * @param pid Pid of the child.
+ * @param pidfd Pidfd attached to the answer, -1 if none.
+ * @returns The pidfd of the child, -1 on error.
+ */
+static int
+zygote_child_pidfd(const struct zygote *zygote, pid_t pid, int pidfd) {
+	siginfo_t info;
+
+	if (pidfd >= 0) {
+		const pid_t pidfdpid = zygote_pidfd_pid(pidfd);
+
+		if (pidfdpid != pid) {
+			if (pidfdpid > 0) {
+				syslog(LOG_WARNING, "zygote_node_operate: '%s' answered pid %d with the pidfd of %d", zygote->daemon->name, pid, pidfdpid);
+			}
+			close(pidfd);
+			pidfd = -1;
+		}
+	}
+
+	if (pidfd < 0) {
+		/* An unreaped child's pid can't be reused, it is safe to open. */
+		pidfd = syscall(SYS_pidfd_open, pid, 0);
+		if (pidfd < 0) {
+			return -1;
+		}
+	}
+
+	if (waitid(P_PIDFD, pidfd, &info, WEXITED | WNOHANG | WNOWAIT | __WALL) != 0) {
+		close(pidfd);
+		return -1;
+	}
+
+	return pidfd;
+}
+
+/**
+ * Receives the answer to the first pending request of a zygote,
+ * and completes the start of its daemon. If the daemon was removed
+ * in the meantime, its process is watched as an orphan.
+ * @param snode Socket node of the zygote.
+ */
+static void
+zygote_node_operate(struct socket_node *snode) {
+	struct zygote * const zygote = (struct zygote *)snode;
+	union {
+		struct cmsghdr header;
+		char buffer[CMSG_SPACE(sizeof (int))];
+	} control;
+	struct zygote_answer answer;
+	struct iovec iov = {
+		.iov_base = &answer,
+		.iov_len = sizeof (answer),
+	};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buffer,
+		.msg_controllen = sizeof (control.buffer),
+	};
+	struct timespec end;
+	int pidfd = -1;
+
+	const ssize_t length = recvmsg(snode->fd, &msg, MSG_CMSG_CLOEXEC);
+	if (length <= 0) {
+		if (length < 0) {
+			syslog(LOG_ERR, "zygote_node_operate: recvmsg '%s': %m", zygote->daemon->name);
+		} else {
+			syslog(LOG_WARNING, "zygote_node_operate: '%s' closed its control socket", zygote->daemon->name);
+		}
+		zygote_close(zygote);
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	const struct cmsghdr * const cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS
+		&& cmsg->cmsg_len == CMSG_LEN(sizeof (int))) {
+		memcpy(&pidfd, CMSG_DATA(cmsg), sizeof (int));
+	}
+
+	if (length != sizeof (answer) || zygote->count == 0) {
+		/* Answers can't be matched with requests anymore. */
+		syslog(LOG_ERR, "zygote_node_operate: Invalid answer from '%s', closing its control socket", zygote->daemon->name);
+		if (pidfd >= 0) {
+			close(pidfd);
+		}
+		zygote_close(zygote);
+		return;
+	}
+
+	const struct zygote_pending pending = zygote_pop(zygote);
+	struct process_spawn spawn = {
+		.pid = -1,
+		.pidfd = -1,
+		.ns = (uint64_t)(end.tv_sec - pending.begin.tv_sec) * 1000000000 + end.tv_nsec - pending.begin.tv_nsec,
+		.errnum = answer.errnum != 0 ? answer.errnum : EBADMSG,
+	};
+	siginfo_t info;
+	bool reaped = false;
+
+	if (answer.pid > 0) {
+		reaped = process_remote_answered(answer.pid, &info);
+		if (!reaped) {
+			spawn.pidfd = zygote_child_pidfd(zygote, answer.pid, pidfd);
+			if (spawn.pidfd >= 0) {
+				spawn.pid = answer.pid;
+				spawn.errnum = 0;
+			} else {
+				syslog(LOG_ERR, "zygote_node_operate: '%s' pid %d is not a child of cyberd: %m", zygote->daemon->name, answer.pid);
+				spawn.errnum = ECHILD;
+			}
+		} else {
+			/* Exited before we got its answer, its pidfd is useless now. */
+			if (pidfd >= 0) {
+				close(pidfd);
+			}
+			spawn.pid = answer.pid;
+			spawn.errnum = 0;
+		}
+	} else {
+		process_remote_answered(-1, &info);
+		if (pidfd >= 0) {
+			close(pidfd);
+		}
+	}
+
+	if (pending.daemon != NULL) {
+		daemon_spawned(pending.daemon, &spawn, reaped ? &info : NULL);
+	} else if (reaped) {
+		process_orphan_reaped(&info);
+	} else if (spawn.pid > 0) {
+		process_orphan(spawn.pidfd);
+	}
+}
+
+/**
+ * Zygote node class. The nodes belong to the zygotes,
+ * and are kept in the socket switch during teardown.
+ */
+static const struct socket_node_class zygote_node_class = {
+	.operate = zygote_node_operate,
+};
+
+/**
+ * Appends a string to a start request.
+ * @param string String to append.
+ * @param position Current end of the request, _NULL_ if it already overflowed.
+ * @param end End of the request's buffer.
+ * @returns The new end of the request, _NULL_ if it overflows.
+ */
+static char *
+zygote_request_append(const char *string, char *position, const char *end) {
+
+	if (position == NULL) {
+		return NULL;
+	}
+
+	const size_t size = strlen(string) + 1;
+	if ((size_t)(end - position) < size) {
+		return NULL;
+	}
+
+	return (char *)memcpy(position, string, size) + size;
+}
+
+/**
+ * Writes the spawn plan of a daemon as a start request.
+ * @param conf Spawn plan.
+ * @param buffer Buffer of @ref ZYGOTES_REQUEST_SIZE bytes.
+ * @returns Length of the request, zero if it doesn't fit in @p buffer.
+ */
+static size_t
+zygote_request_encode(const struct daemon_conf *conf, char *buffer) {
+	const char * const end = buffer + ZYGOTES_REQUEST_SIZE;
+	struct zygote_request request = {
+		.uid = conf->uid,
+		.gid = conf->gid,
+		.umask = conf->umask,
+		.priority = conf->priority,
+		.nosid = conf->nosid,
+	};
+	char *position = buffer + sizeof (request);
+
+	position = zygote_request_append(conf->workdir, position, end);
+
+	for (char * const *argument = conf->arguments; *argument != NULL; argument++, request.argc++) {
+		position = zygote_request_append(*argument, position, end);
+	}
+
+	for (char * const *variable = conf->environment; *variable != NULL; variable++, request.envc++) {
+		position = zygote_request_append(*variable, position, end);
+	}
+
+	if (position == NULL) {
+		return 0;
+	}
+
+	memcpy(buffer, &request, sizeof (request));
+
+	return position - buffer;
+}
+
+/**
+ * Opens a standard stream of a daemon, on behalf of its future child.
+ * Cyberd must neither acquire a controlling terminal, nor block until the other end
+ * of a FIFO is opened, so the stream is opened non-blocking, and made blocking afterwards.
+ * @param path Path of the stream.
+ * @param flags Access mode of the stream.
+ * @returns The stream, -1 on error with errno set.
+ */
+static int
+zygote_request_stream(const char *path, int flags) {
+	const int fd = open(path, flags | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+
+	if (fd >= 0) {
+		const int status = fcntl(fd, F_GETFL);
+
+		if (status < 0 || fcntl(fd, F_SETFL, status & ~O_NONBLOCK) != 0) {
+			close(fd);
+			return -1;
+		}
+	}
+
+	return fd;
+}
+
+/**
+ * Opens the standard streams of a daemon, on behalf of its future child.
+ * @param conf Spawn plan of the daemon.
+ * @param[out] fds Standard input, output and error.
+ * @returns Zero on success, -1 on error with errno set.
+ */
+static int
+zygote_request_streams(const struct daemon_conf *conf, int fds[3]) {
+
+	fds[0] = zygote_request_stream(conf->in, O_RDONLY);
+	if (fds[0] < 0) {
+		goto open_stdin_failure;
+	}
+
+	fds[1] = zygote_request_stream(conf->out, O_WRONLY);
+	if (fds[1] < 0) {
+		goto open_stdout_failure;
+	}
+
+	if (conf->err != NULL) {
+		fds[2] = zygote_request_stream(conf->err, O_WRONLY);
+		if (fds[2] < 0) {
+			goto open_stderr_failure;
+		}
+	} else {
+		fds[2] = fds[1];
+	}
+
+	return 0;
+open_stderr_failure:
+	close(fds[1]);
+open_stdout_failure:
+	close(fds[0]);
+open_stdin_failure:
+	return -1;
+}
+
+/**
+ * Starts watching the control socket of a spawned zygote.
+ * @param daemon Zygote daemon, outliving the zygote.
+ * @param fd Cyberd's end of the control socket, owned by the zygote on success.
+ * @returns The new zygote, _NULL_ on error.
+ */
+struct zygote *
+zygote_create(const struct daemon *daemon, int fd) {
+	struct zygote * const zygote = malloc(sizeof (*zygote));
+
+	if (zygote == NULL) {
+		syslog(LOG_ERR, "zygote_create: '%s': %m", daemon->name);
+		return NULL;
+	}
+
+	zygote->super.class = &zygote_node_class;
+	zygote->super.fd = fd;
+	zygote->daemon = daemon;
+	zygote->first = 0;
+	zygote->count = 0;
+
+	if (socket_switch_insert(&zygote->super) != 0) {
+		free(zygote);
+		return NULL;
+	}
+
+	zygote->next = zygotes;
+	zygotes = zygote;
+
+	return zygote;
+}
+
+/**
+ * Stops watching a zygote, once its daemon was reaped or removed.
+ * Pending daemons failed to start.
+ * @param zygote Zygote to destroy.
+ */
+void
+zygote_destroy(struct zygote *zygote) {
+	struct zygote **zygotep = &zygotes;
+
+	if (zygote->super.fd >= 0) {
+		zygote_close(zygote);
+	}
+
+	while (*zygotep != zygote) {
+		zygotep = &(*zygotep)->next;
+	}
+	*zygotep = zygote->next;
+
+	free(zygote);
+}
+
+/**
+ * Requests a zygote to fork a child for a daemon. The standard streams
+ * are opened by cyberd, and sent with the spawn plan. The request never blocks.
+ * @param zygote Zygote of the daemon's template.
+ * @param daemon Daemon to start, its answer is given to @ref daemon_spawned.
+ * @returns Zero if the start was requested, -1 on error.
+ */
+int
+zygote_request(struct zygote *zygote, struct daemon *daemon) {
+	static char buffer[ZYGOTES_REQUEST_SIZE];
+	union {
+		struct cmsghdr header;
+		char buffer[CMSG_SPACE(3 * sizeof (int))];
+	} control;
+	struct iovec iov = { .iov_base = buffer };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buffer,
+		.msg_controllen = sizeof (control.buffer),
+	};
+	int fds[3];
+
+	if (zygote->super.fd < 0 || zygote->count == ZYGOTES_PENDING_MAX) {
+		syslog(LOG_ERR, "zygote_request: '%s' zygote '%s' is not available", daemon->name, zygote->daemon->name);
+		return -1;
+	}
+
+	iov.iov_len = zygote_request_encode(&daemon->conf, buffer);
+	if (iov.iov_len == 0) {
+		syslog(LOG_ERR, "zygote_request: '%s' spawn plan is too large", daemon->name);
+		return -1;
+	}
+
+	if (zygote_request_streams(&daemon->conf, fds) != 0) {
+		syslog(LOG_ERR, "zygote_request: '%s' standard streams: %m", daemon->name);
+		return -1;
+	}
+
+	struct cmsghdr * const cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof (fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof (fds));
+
+	const ssize_t sent = sendmsg(zygote->super.fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+	if (fds[2] != fds[1]) {
+		close(fds[2]);
+	}
+	close(fds[1]);
+	close(fds[0]);
+
+	if (sent < 0) {
+		syslog(LOG_ERR, "zygote_request: '%s' send to '%s': %m", daemon->name, zygote->daemon->name);
+		return -1;
+	}
+
+	struct zygote_pending * const pending = zygote->pending + (zygote->first + zygote->count) % ZYGOTES_PENDING_MAX;
+	pending->daemon = daemon;
+	clock_gettime(CLOCK_MONOTONIC, &pending->begin);
+	zygote->count++;
+	process_remote_requested();
+
+	return 0;
+}
+
+/**
+ * Forgets a daemon pending for a zygote's answer, its process
+ * will be watched as an orphan if it gets forked.
+ * @param daemon Removed daemon.
+ */
+void
+zygotes_cancel(const struct daemon *daemon) {
+
+	for (struct zygote *zygote = zygotes; zygote != NULL; zygote = zygote->next) {
+		for (unsigned int i = 0; i < zygote->count; i++) {
+			struct zygote_pending * const pending = zygote->pending + (zygote->first + i) % ZYGOTES_PENDING_MAX;
+
+			if (pending->daemon == daemon) {
+				pending->daemon = NULL;
+			}
+		}
+	}
+}
@@ -0,0 +1,48 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#ifndef ZYGOTES_H
+#define ZYGOTES_H
+
+#include <sys/types.h> /* pid_t, uid_t, gid_t, mode_t */
+
+/**
+ * Start request sent to a zygote on its control socket, in a single message.
+ * It is followed by the NUL-terminated working directory, @ref argc arguments,
+ * and @ref envc environment variables. Standard input, output and error
+ * are attached, in this order, as an _SCM_RIGHTS_ control message.
+ */
+struct zygote_request {
+	uid_t uid; /**< User-id of the child. */
+	gid_t gid; /**< Group-id of the child. */
+	mode_t umask; /**< umask of the child. */
+	int priority; /**< Scheduling priority of the child. */
+	int nosid; /**< Non-zero if the child must not call _setsid(2)_. */
+	unsigned int argc; /**< Number of arguments. */
+	unsigned int envc; /**< Number of environment variables. */
+};
+
+/**
+ * Answer of a zygote to a start request, in a single message, in the order of requests.
+ * The pidfd of the child may be attached as an _SCM_RIGHTS_ control message.
+ */
+struct zygote_answer {
+	pid_t pid; /**< Pid of the child, -1 if it couldn't be forked. */
+	int errnum; /**< errno of the failure if the child couldn't be forked, ignored else. */
+};
+
+struct daemon;
+struct zygote;
+
+struct zygote *
+zygote_create(const struct daemon *daemon, int fd);
+
+void
+zygote_destroy(struct zygote *zygote);
+
+int
+zygote_request(struct zygote *zygote, struct daemon *daemon);
+
+void
+zygotes_cancel(const struct daemon *daemon);
+
+/* ZYGOTES_H */
+#endif
@@ -0,0 +1,197 @@
+#include <stdio.h> /* printf, snprintf */
+#include <stdlib.h> /* calloc, free, mkdtemp */
+#include <string.h> /* strdup */
+#include <inttypes.h> /* PRIu64 */
+#include <unistd.h> /* unlink, rmdir, symlink */
+#include <fcntl.h> /* open */
+#include <time.h> /* clock_gettime */
+#include <err.h> /* err, errx */
+
+#include "cyberd/configuration.c"
+#include "cyberd/daemon_conf.c"
+#include "cyberd/tree.c"
+
+#define TEST_CONFIGURATION_DAEMONS 2000
+#define TEST_CONFIGURATION_CHANGED 2
+#define TEST_CONFIGURATION_RELOADS 20
+
+static unsigned int test_configuration_started, test_configuration_reloaded, test_configuration_destroyed;
+
+/* Daemons aren't spawned nor published, only their configurations are loaded. */
+
+struct daemon *
+daemon_create(const char *name) {
+	struct daemon * const daemon = calloc(1, sizeof (*daemon));
+
+	if (daemon == NULL || (daemon->name = strdup(name)) == NULL) {
+		err(EXIT_FAILURE, "daemon_create");
+	}
+
+	daemon->state = DAEMON_STOPPED;
+	daemon_conf_init(&daemon->conf);
+
+	return daemon;
+}
+
+void
+daemon_destroy(struct daemon *daemon) {
+	test_configuration_destroyed++;
+	daemon_conf_deinit(&daemon->conf);
+	free(daemon->name);
+	free(daemon);
+}
+
+void
+daemon_start(struct daemon *daemon) {
+	test_configuration_started++;
+}
+
+void
+events_publish(enum protocol_event event, const struct daemon *daemon, pid_t pid, const siginfo_t *info) {
+	if (event == PROTOCOL_EVENT_RELOADED) {
+		test_configuration_reloaded++;
+	}
+}
+
+void
+status_page_insert(struct daemon *daemon) {
+}
+
+static void
+test_configuration_count_visit(const struct daemon *daemon, void *data) {
+	(*(unsigned int *)data)++;
+}
+
+static unsigned int
+test_configuration_count(void) {
+	unsigned int count = 0;
+
+	configuration_walk(test_configuration_count_visit, &count);
+
+	return count;
+}
+
+static void
+test_configuration_write(const char *path, unsigned int index, const char *extra) {
+	char name[PATH_MAX];
+
+	snprintf(name, sizeof (name), "%s/daemon.%04u", path, index);
+
+	FILE * const filep = fopen(name, "w");
+	if (filep == NULL) {
+		err(EXIT_FAILURE, "fopen %s", name);
+	}
+
+	fprintf(filep, "path=/bin/sh\narguments=sh -c true\n%s[start]\nload\n", extra);
+	fclose(filep);
+}
+
+static uint64_t
+test_configuration_elapsed(const struct timespec *begin) {
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return (uint64_t)(end.tv_sec - begin->tv_sec) * 1000000 + (end.tv_nsec - begin->tv_nsec) / 1000;
+}
+
+int
+main(int argc, char *argv[]) {
+	char path[] = "/tmp/cyberd-configuration.XXXXXX", name[PATH_MAX];
+	struct timespec begin;
+
+	setlogmask(LOG_UPTO(LOG_WARNING));
+
+	/******************
+	 * Initialization *
+	 ******************/
+	if (mkdtemp(path) == NULL) {
+		err(EXIT_FAILURE, "mkdtemp");
+	}
+
+	for (unsigned int i = 0; i < TEST_CONFIGURATION_DAEMONS; i++) {
+		test_configuration_write(path, i, "");
+	}
+
+	/********
+	 * Load *
+	 ********/
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	configuration_load(path);
+	printf("Load of %u daemons: %"PRIu64"us\n", TEST_CONFIGURATION_DAEMONS, test_configuration_elapsed(&begin));
+
+	if (test_configuration_count() != TEST_CONFIGURATION_DAEMONS || test_configuration_started != TEST_CONFIGURATION_DAEMONS) {
+		errx(EXIT_FAILURE, "Daemons were not all loaded and started");
+	}
+
+	/********************
+	 * Unchanged reload *
+	 ********************/
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	for (unsigned int i = 0; i < TEST_CONFIGURATION_RELOADS; i++) {
+		configuration_reload();
+	}
+	printf("Reload of %u unchanged daemons: %"PRIu64"us\n", TEST_CONFIGURATION_DAEMONS, test_configuration_elapsed(&begin) / TEST_CONFIGURATION_RELOADS);
+
+	if (test_configuration_reloaded != 0 || test_configuration_count() != TEST_CONFIGURATION_DAEMONS) {
+		errx(EXIT_FAILURE, "Unchanged daemons were reparsed or removed");
+	}
+
+	/******************
+	 * Changed reload *
+	 ******************/
+	for (unsigned int i = 0; i < TEST_CONFIGURATION_CHANGED; i++) {
+		test_configuration_write(path, i * (TEST_CONFIGURATION_DAEMONS / TEST_CONFIGURATION_CHANGED), "umask=077\n");
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	configuration_reload();
+	printf("Reload of %u daemons, %u changed: %"PRIu64"us\n", TEST_CONFIGURATION_DAEMONS, TEST_CONFIGURATION_CHANGED, test_configuration_elapsed(&begin));
+
+	if (test_configuration_reloaded != TEST_CONFIGURATION_CHANGED) {
+		errx(EXIT_FAILURE, "Changed daemons were not all reparsed, or unchanged ones were");
+	}
+
+	/******************
+	 * Skipped reload *
+	 ******************/
+	snprintf(name, sizeof (name), "%s/daemon.%04u", path, TEST_CONFIGURATION_DAEMONS - 1);
+	if (unlink(name) != 0) {
+		err(EXIT_FAILURE, "unlink %s", name);
+	}
+
+	/* A dangling symbolic link can't be stat'ed, it may be the removed file. */
+	snprintf(name, sizeof (name), "%s/dangling", path);
+	if (symlink("missing", name) != 0) {
+		err(EXIT_FAILURE, "symlink %s", name);
+	}
+
+	configuration_reload();
+	if (test_configuration_destroyed != 0) {
+		errx(EXIT_FAILURE, "Daemons were removed while a file was skipped");
+	}
+
+	if (unlink(name) != 0) {
+		err(EXIT_FAILURE, "unlink %s", name);
+	}
+
+	configuration_reload();
+	if (test_configuration_destroyed != 1 || test_configuration_count() != TEST_CONFIGURATION_DAEMONS - 1) {
+		errx(EXIT_FAILURE, "Removed daemon was not removed");
+	}
+
+	/****************
+	 * Finalization *
+	 ****************/
+#ifndef NDEBUG
+	configuration_cleanup();
+#endif
+
+	for (unsigned int i = 0; i < TEST_CONFIGURATION_DAEMONS - 1; i++) {
+		snprintf(name, sizeof (name), "%s/daemon.%04u", path, i);
+		unlink(name);
+	}
+	rmdir(path);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,131 @@
+#include <stdio.h> /* printf, fprintf */
+#include <stdlib.h> /* mkstemp */
+#include <inttypes.h> /* PRIu64 */
+#include <unistd.h> /* lseek, unlink, close */
+#include <time.h> /* clock_gettime */
+#include <err.h> /* err, errx */
+
+#include "cyberd/daemon_conf.c"
+
+#define TEST_DAEMON_CONF_ENVIRONMENT 1000
+#define TEST_DAEMON_CONF_LARGE_PARSES 100
+#define TEST_DAEMON_CONF_SMALL_PARSES 10000
+
+static void
+test_daemon_conf_keys(const struct daemon_conf_section *section) {
+
+	for (unsigned int i = 0; i < DAEMON_CONF_HASH_SIZE; i++) {
+		const struct daemon_conf_value * const value = section->values + i;
+
+		if (value->key != NULL && daemon_conf_parser(section, value->key, strlen(value->key)) != value) {
+			errx(EXIT_FAILURE, "Key '%s' of section '%s' doesn't resolve to itself", value->key, section->name);
+		}
+	}
+}
+
+static int
+test_daemon_conf_file(const char *content, unsigned int environment) {
+	char path[] = "/tmp/cyberd-daemon_conf.XXXXXX";
+	const int fd = mkstemp(path);
+
+	if (fd < 0) {
+		err(EXIT_FAILURE, "mkstemp");
+	}
+
+	unlink(path);
+
+	FILE * const filep = fdopen(dup(fd), "w");
+	if (filep == NULL) {
+		err(EXIT_FAILURE, "fdopen");
+	}
+
+	fputs(content, filep);
+	if (environment != 0) {
+		fputs("[environment]\n", filep);
+		for (unsigned int i = 0; i < environment; i++) {
+			fprintf(filep, "VARIABLE_%u = value of the variable %u\n", i, i);
+		}
+	}
+	fclose(filep);
+
+	return fd;
+}
+
+static uint64_t
+test_daemon_conf_parse(int fd, unsigned int parses, unsigned int environment) {
+	struct timespec begin, end;
+
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	for (unsigned int i = 0; i < parses; i++) {
+		struct daemon_conf conf;
+
+		daemon_conf_init(&conf);
+
+		if (lseek(fd, 0, SEEK_SET) != 0 || daemon_conf_parse_file(&conf, fd) != 0) {
+			errx(EXIT_FAILURE, "Unable to parse configuration");
+		}
+
+		unsigned int count = 0;
+		while (conf.environment != NULL && conf.environment[count] != NULL) {
+			count++;
+		}
+
+		if (conf.path == NULL || count != environment) {
+			errx(EXIT_FAILURE, "Configuration was not parsed entirely");
+		}
+
+		daemon_conf_deinit(&conf);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return ((uint64_t)(end.tv_sec - begin.tv_sec) * 1000000000 + (end.tv_nsec - begin.tv_nsec)) / parses;
+}
+
+int
+main(int argc, char *argv[]) {
+	static const char general[] =
+		"path = /bin/sh\n"
+		"arguments = sh -c true\n"
+		"# Comment\n"
+		"workdir = /\n"
+		"umask = 077\n"
+		"sigfinish = TERM\n"
+		"stoptimeout = 1000\n"
+		"unknown = ignored\n"
+		"[start]\n"
+		"load\n"
+		"exit failure\n"
+		"delay = 100\n";
+
+	setlogmask(LOG_UPTO(LOG_WARNING));
+
+	/********
+	 * Keys *
+	 ********/
+	for (unsigned int i = 0; i < sizeof (sections) / sizeof (*sections); i++) {
+		const struct daemon_conf_section * const section = sections + i;
+
+		if (section->values != NULL) {
+			test_daemon_conf_keys(section);
+		}
+
+		if (daemon_conf_parser(section, "unknown", sizeof ("unknown") - 1) != section->any) {
+			errx(EXIT_FAILURE, "Unknown key of section '%s' resolves to a parser", section->name);
+		}
+	}
+
+	/**************
+	 * Throughput *
+	 **************/
+	const int small = test_daemon_conf_file(general, 0);
+	printf("Parse of a small file: %"PRIu64"ns\n",
+		test_daemon_conf_parse(small, TEST_DAEMON_CONF_SMALL_PARSES, 0));
+	close(small);
+
+	const int large = test_daemon_conf_file(general, TEST_DAEMON_CONF_ENVIRONMENT);
+	printf("Parse of a file with %u environment variables: %"PRIu64"ns\n", TEST_DAEMON_CONF_ENVIRONMENT,
+		test_daemon_conf_parse(large, TEST_DAEMON_CONF_LARGE_PARSES, TEST_DAEMON_CONF_ENVIRONMENT));
+	close(large);
+
+	return EXIT_SUCCESS;
+}
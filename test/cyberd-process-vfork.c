@@ -0,0 +1,3 @@
+/* Same benchmarks with the vfork-like backend of process_spawn. */
+#define CONFIG_DAEMON_SPAWN_VFORK
+#include "cyberd-process.c"
@@ -0,0 +1,265 @@
+#include <stdio.h> /* printf, snprintf */
+#include <stdlib.h> /* malloc, free */
+#include <string.h> /* memset, strcmp */
+#include <inttypes.h> /* PRIu64 */
+#include <unistd.h> /* read, write, close, fork, getuid, getgid */
+#include <sys/socket.h> /* socketpair, send, recv */
+#include <err.h> /* err, errx */
+
+#include "cyberd/process.c"
+
+#define TEST_PROCESS_RUNTIME_SIZE (16 << 20)
+#define TEST_PROCESS_RESIDENT_SIZE (128 << 20)
+#define TEST_PROCESS_SPAWNS 100
+
+#ifdef CONFIG_DAEMON_SPAWN_VFORK
+#define TEST_PROCESS_BACKEND "vfork"
+#else
+#define TEST_PROCESS_BACKEND "clone3"
+#endif
+
+/* Daemons are this program re-executed, ready once they wrote a byte on their standard output. */
+
+int
+socket_switch_insert(struct socket_node *snode) {
+	return 0;
+}
+
+void
+socket_switch_remove(struct socket_node *snode) {
+}
+
+void
+signals_default(void) {
+}
+
+/**
+ * Stands in for the initialization of a daemon's runtime, such as an interpreter loading its modules.
+ * @returns The memory initialized.
+ */
+static char *
+test_process_runtime(void) {
+	char * const runtime = malloc(TEST_PROCESS_RUNTIME_SIZE);
+
+	if (runtime == NULL) {
+		err(EXIT_FAILURE, "malloc");
+	}
+
+	memset(runtime, 1, TEST_PROCESS_RUNTIME_SIZE);
+
+	return runtime;
+}
+
+/**
+ * Notifies readiness of a daemon.
+ * @param fd Where the daemon notifies its readiness.
+ */
+static void
+test_process_ready(int fd) {
+	static const char byte;
+
+	if (write(fd, &byte, sizeof (byte)) != sizeof (byte)) {
+		_exit(EXIT_FAILURE);
+	}
+}
+
+/**
+ * Waits for a daemon to be ready.
+ * @param fd Where the daemon notifies its readiness.
+ */
+static void
+test_process_wait_ready(int fd) {
+	char byte;
+
+	if (read(fd, &byte, sizeof (byte)) != sizeof (byte)) {
+		errx(EXIT_FAILURE, "Daemon exited before being ready");
+	}
+}
+
+/**
+ * Spawns daemons with @ref process_spawn, and reaps them.
+ * @param conf Spawn plan of the daemons.
+ * @param readyfd Where the daemons notify their readiness, -1 to not wait for it.
+ * @param[out] readyp Average time until a daemon was ready, untouched if @p readyfd is -1.
+ * @returns Average fork-to-exec time of a daemon.
+ */
+static uint64_t
+test_process_cold(const struct daemon_conf *conf, int readyfd, uint64_t *readyp) {
+	uint64_t fork2exec = 0, ready = 0;
+
+	for (unsigned int i = 0; i < TEST_PROCESS_SPAWNS; i++) {
+		const uint64_t begin = process_now();
+		struct process_spawn spawn;
+		siginfo_t info;
+
+		if (process_spawn(conf, -1, false, &spawn) != 0) {
+			err(EXIT_FAILURE, "process_spawn");
+		}
+
+		if (spawn.errnum != 0) {
+			errno = spawn.errnum;
+			err(EXIT_FAILURE, "Spawn failed at %s", process_step_name(spawn.step));
+		}
+
+		fork2exec += spawn.ns;
+
+		if (readyfd >= 0) {
+			test_process_wait_ready(readyfd);
+			ready += process_now() - begin;
+		}
+
+		if (waitid(P_PIDFD, spawn.pidfd, &info, WEXITED | __WALL) != 0) {
+			err(EXIT_FAILURE, "waitid");
+		}
+		close(spawn.pidfd);
+	}
+
+	if (readyfd >= 0) {
+		*readyp = ready / TEST_PROCESS_SPAWNS;
+	}
+
+	return fork2exec / TEST_PROCESS_SPAWNS;
+}
+
+/**
+ * Stub zygote, initializes its runtime once, and forks a daemon for each request it receives.
+ * @param control Control socket, closed by cyberd to terminate the zygote.
+ * @param readyfd Where the daemons notify their readiness.
+ * @returns Never.
+ */
+static void noreturn
+test_process_zygote(int control, int readyfd) {
+	char * const runtime = test_process_runtime();
+	char byte;
+
+	while (recv(control, &byte, sizeof (byte), 0) == sizeof (byte)) {
+		const pid_t pid = fork();
+
+		switch (pid) {
+		case -1:
+			_exit(EXIT_FAILURE);
+		case 0:
+			test_process_ready(readyfd);
+			_exit(EXIT_SUCCESS);
+		default:
+			waitpid(pid, NULL, 0);
+			break;
+		}
+	}
+
+	free(runtime);
+	_exit(EXIT_SUCCESS);
+}
+
+int
+main(int argc, char *argv[]) {
+	static const char byte;
+	char out[sizeof ("/dev/fd/") + 10];
+	char *arguments[] = { argv[0], "daemon", NULL };
+	char *environment[] = { NULL };
+	struct daemon_conf conf = {
+		.path = "/proc/self/exe",
+		.arguments = arguments,
+		.environment = environment,
+		.workdir = "/",
+		.in = "/dev/null",
+		.out = "/dev/null",
+		.uid = getuid(),
+		.gid = getgid(),
+		.umask = 022,
+	};
+	uint64_t fork2exec, ready;
+	int fds[2];
+
+	setlogmask(LOG_UPTO(LOG_WARNING));
+
+	/**********
+	 * Daemon *
+	 **********/
+	if (argc == 2 && strcmp(argv[1], "daemon") == 0) {
+		char * const runtime = test_process_runtime();
+
+		test_process_ready(STDOUT_FILENO);
+		free(runtime);
+
+		return EXIT_SUCCESS;
+	}
+
+	/****************
+	 * Fork-to-exec *
+	 ****************/
+	/* Daemons write to /dev/null, the time until they're ready is not measured. */
+	printf("Fork-to-exec with " TEST_PROCESS_BACKEND ": %"PRIu64"ns\n", test_process_cold(&conf, -1, NULL));
+
+	char * const resident = malloc(TEST_PROCESS_RESIDENT_SIZE);
+	if (resident == NULL) {
+		err(EXIT_FAILURE, "malloc");
+	}
+	memset(resident, 1, TEST_PROCESS_RESIDENT_SIZE);
+	printf("Fork-to-exec with " TEST_PROCESS_BACKEND " and %u MiB resident: %"PRIu64"ns\n",
+		TEST_PROCESS_RESIDENT_SIZE >> 20, test_process_cold(&conf, -1, NULL));
+	free(resident);
+
+	/******************
+	 * Cold vs zygote *
+	 ******************/
+	if (pipe2(fds, O_CLOEXEC) != 0) {
+		err(EXIT_FAILURE, "pipe2");
+	}
+
+	/* The write end is opened by the child before its exec, while it still has it. */
+	snprintf(out, sizeof (out), "/dev/fd/%d", fds[1]);
+	conf.out = out;
+
+	fork2exec = test_process_cold(&conf, fds[0], &ready);
+	printf("Cold spawn with " TEST_PROCESS_BACKEND ": %"PRIu64"ns fork-to-exec, %"PRIu64"ns until ready\n", fork2exec, ready);
+
+	int control[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, control) != 0) {
+		err(EXIT_FAILURE, "socketpair");
+	}
+
+	const pid_t zygote = fork();
+	switch (zygote) {
+	case -1:
+		err(EXIT_FAILURE, "fork");
+	case 0:
+		close(control[0]);
+		close(fds[0]);
+		test_process_zygote(control[1], fds[1]);
+	default:
+		close(control[1]);
+		break;
+	}
+
+	/* Wait for the zygote to have initialized its runtime. */
+	if (send(control[0], &byte, sizeof (byte), 0) != sizeof (byte)) {
+		err(EXIT_FAILURE, "send");
+	}
+	test_process_wait_ready(fds[0]);
+
+	ready = 0;
+	for (unsigned int i = 0; i < TEST_PROCESS_SPAWNS; i++) {
+		const uint64_t begin = process_now();
+
+		if (send(control[0], &byte, sizeof (byte), 0) != sizeof (byte)) {
+			err(EXIT_FAILURE, "send");
+		}
+		test_process_wait_ready(fds[0]);
+		ready += process_now() - begin;
+	}
+	printf("Zygote spawn: %"PRIu64"ns until ready\n", ready / TEST_PROCESS_SPAWNS);
+
+	/****************
+	 * Finalization *
+	 ****************/
+	close(control[0]);
+	if (waitpid(zygote, NULL, 0) != zygote) {
+		err(EXIT_FAILURE, "waitpid");
+	}
+
+	close(fds[0]);
+	close(fds[1]);
+
+	return EXIT_SUCCESS;
+}
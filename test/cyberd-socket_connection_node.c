@@ -0,0 +1,311 @@
+#include <stdlib.h> /* EXIT_FAILURE, EXIT_SUCCESS */
+#include <string.h> /* memcpy, memset, strcmp */
+#include <unistd.h> /* write, close */
+#include <sys/socket.h> /* socketpair, recv, setsockopt */
+#include <arpa/inet.h> /* htonl, ntohl */
+#include <err.h> /* err, errx */
+
+#include "cyberd/socket_connection_node.c"
+
+#define TEST_SOCKET_CONNECTION_NODE_DAEMON "test"
+#define TEST_SOCKET_CONNECTION_NODE_OVERFLOW_REQUESTS 100000
+
+static struct daemon test_socket_connection_node_daemon = {
+	.name = TEST_SOCKET_CONNECTION_NODE_DAEMON,
+	.state = DAEMON_STARTED,
+};
+
+static unsigned int test_socket_connection_node_started, test_socket_connection_node_removed;
+
+/* Connections are operated directly, commands only count their executions. */
+
+int
+socket_switch_insert(struct socket_node *snode) {
+	return 0;
+}
+
+void
+socket_switch_remove(struct socket_node *snode) {
+	test_socket_connection_node_removed++;
+	snode->class->destroy(snode);
+}
+
+void
+socket_switch_writable(struct socket_node *snode, bool watch) {
+}
+
+struct socket_node *
+socket_endpoint_node_create(const char *name, capset_t capabilities, int type, bool privileged) {
+	return NULL;
+}
+
+struct daemon *
+configuration_find(const char *name) {
+	return strcmp(name, TEST_SOCKET_CONNECTION_NODE_DAEMON) == 0 ? &test_socket_connection_node_daemon : NULL;
+}
+
+bool
+configuration_selector(const char *name) {
+	return false;
+}
+
+unsigned int
+configuration_select(const char *selector, void (* const action)(struct daemon *daemon, void *data), void *data) {
+	return 0;
+}
+
+void
+configuration_walk(void (* const visit)(const struct daemon *daemon, void *data), void *data) {
+	visit(&test_socket_connection_node_daemon, data);
+}
+
+void
+daemon_start(struct daemon *daemon) {
+	test_socket_connection_node_started++;
+}
+
+void
+daemon_stop(struct daemon *daemon) {
+}
+
+void
+daemon_reload(struct daemon *daemon) {
+}
+
+void
+daemon_end(struct daemon *daemon) {
+}
+
+void
+daemon_clear(struct daemon *daemon) {
+}
+
+void
+daemon_restart(struct daemon *daemon) {
+}
+
+int
+daemon_replace(struct daemon *daemon) {
+	return 0;
+}
+
+void
+events_subscribe(struct events_subscriber *subscriber) {
+}
+
+void
+events_unsubscribe(struct events_subscriber *subscriber) {
+}
+
+struct peer *
+peers_acquire(uid_t uid) {
+	return NULL;
+}
+
+void
+peers_release(struct peer *peer) {
+}
+
+bool
+peers_admit(struct peer *peer) {
+	return true;
+}
+
+/**
+ * Creates a connection, and the client's end of it.
+ * @param type Socket type of the connection.
+ * @param[out] clientp Client's end.
+ * @returns The connection.
+ */
+static struct socket_node *
+test_socket_connection_node_create(int type, int *clientp) {
+	int fds[2];
+
+	if (socketpair(AF_UNIX, type | SOCK_CLOEXEC, 0, fds) != 0) {
+		err(EXIT_FAILURE, "socketpair");
+	}
+
+	struct socket_node * const snode = socket_connection_node_create(fds[0], CAPSET_ALL, type, true);
+	if (snode == NULL) {
+		errx(EXIT_FAILURE, "Unable to create connection");
+	}
+
+	*clientp = fds[1];
+
+	return snode;
+}
+
+/**
+ * Sends bytes from the client, and operates the connection until it received all of them.
+ * @param snode Connection.
+ * @param client Client's end.
+ * @param buffer Bytes sent, one datagram on SOCK_SEQPACKET connections.
+ * @param size Size of @p buffer.
+ */
+static void
+test_socket_connection_node_send(struct socket_node *snode, int client, const void *buffer, size_t size) {
+	const unsigned int removed = test_socket_connection_node_removed;
+	char byte;
+
+	if (write(client, buffer, size) != size) {
+		err(EXIT_FAILURE, "write");
+	}
+
+	do {
+		snode->class->operate(snode);
+	} while (test_socket_connection_node_removed == removed && recv(snode->fd, &byte, sizeof (byte), MSG_PEEK | MSG_DONTWAIT) > 0);
+}
+
+/**
+ * Encodes a version 2 request.
+ * @param buffer Encoded request.
+ * @param request Identifier of the request.
+ * @param length Length announced in its header.
+ * @param body Body of the request.
+ * @param size Size of @p body.
+ * @returns The size of the request.
+ */
+static size_t
+test_socket_connection_node_request(char *buffer, uint32_t request, uint32_t length, const char *body, size_t size) {
+	const uint32_t words[] = { htonl(length), htonl(request) };
+
+	memcpy(buffer, words, sizeof (words));
+	memcpy(buffer + sizeof (words), body, size);
+
+	return sizeof (words) + size;
+}
+
+/**
+ * Receives a status reply, and checks it.
+ * @param client Client's end.
+ * @param request Expected identifier.
+ * @param status Expected status.
+ */
+static void
+test_socket_connection_node_reply(int client, uint32_t request, enum protocol_status status) {
+	char reply[PARSER_REPLY_SIZE];
+	uint32_t words[2];
+
+	if (recv(client, reply, sizeof (reply), MSG_DONTWAIT) != sizeof (reply)) {
+		errx(EXIT_FAILURE, "Missing reply to request %u", request);
+	}
+
+	memcpy(words, reply, sizeof (words));
+	if (ntohl(words[0]) != 1 || ntohl(words[1]) != request || reply[sizeof (words)] != status) {
+		errx(EXIT_FAILURE, "Invalid reply to request %u", request);
+	}
+}
+
+/**
+ * Checks no more bytes are available to the client.
+ * @param client Client's end.
+ */
+static void
+test_socket_connection_node_no_reply(int client) {
+	char byte;
+
+	if (recv(client, &byte, sizeof (byte), MSG_DONTWAIT) >= 0) {
+		errx(EXIT_FAILURE, "Unexpected reply");
+	}
+}
+
+int
+main(int argc, char *argv[]) {
+	static const char start[] = { 1, 't', 'e', 's', 't', '\0' };
+	static const char missing[] = { 1, 'n', 'o', 'n', 'e', '\0' };
+	char buffer[CONFIG_SOCKET_CONNECTIONS_REPLIES_SIZE];
+	struct socket_node *snode;
+	size_t size;
+	int client;
+
+	setlogmask(LOG_UPTO(LOG_ERR));
+
+	/*********************
+	 * Version 1 streams *
+	 *********************/
+	snode = test_socket_connection_node_create(SOCK_STREAM, &client);
+
+	/* The first byte is a command, not PROTOCOL_V2. */
+	memcpy(buffer, start, sizeof (start));
+	memcpy(buffer + sizeof (start), start, sizeof (start));
+	test_socket_connection_node_send(snode, client, buffer, 2 * sizeof (start));
+	if (test_socket_connection_node_started != 2) {
+		errx(EXIT_FAILURE, "Version 1 commands were not executed");
+	}
+	test_socket_connection_node_no_reply(client);
+
+	snode->class->destroy(snode);
+	close(client);
+
+	/*********************
+	 * Version 2 streams *
+	 *********************/
+	snode = test_socket_connection_node_create(SOCK_STREAM, &client);
+
+	buffer[0] = PROTOCOL_V2;
+	size = 1 + test_socket_connection_node_request(buffer + 1, 1, sizeof (start), start, sizeof (start));
+	size += test_socket_connection_node_request(buffer + size, 2, sizeof (missing), missing, sizeof (missing));
+	test_socket_connection_node_send(snode, client, buffer, size);
+	test_socket_connection_node_reply(client, 1, PROTOCOL_STATUS_OK);
+	test_socket_connection_node_reply(client, 2, PROTOCOL_STATUS_NOT_FOUND);
+
+	/* Headers and bodies split across reads. */
+	size = test_socket_connection_node_request(buffer, 3, sizeof (start), start, sizeof (start));
+	for (size_t i = 0; i < size; i++) {
+		test_socket_connection_node_send(snode, client, buffer + i, 1);
+	}
+	test_socket_connection_node_reply(client, 3, PROTOCOL_STATUS_OK);
+
+	/* An oversized frame is skipped, keeping the framing. */
+	size = test_socket_connection_node_request(buffer, 4, 2 * PROTOCOL_V2_REQUEST_MAX, "", 0);
+	memset(buffer + size, 1, 2 * PROTOCOL_V2_REQUEST_MAX);
+	size += 2 * PROTOCOL_V2_REQUEST_MAX;
+	size += test_socket_connection_node_request(buffer + size, 5, sizeof (start), start, sizeof (start));
+	test_socket_connection_node_send(snode, client, buffer, size);
+	test_socket_connection_node_reply(client, 4, PROTOCOL_STATUS_INVALID);
+	test_socket_connection_node_reply(client, 5, PROTOCOL_STATUS_OK);
+	test_socket_connection_node_no_reply(client);
+
+	if (test_socket_connection_node_started != 5 || test_socket_connection_node_removed != 0) {
+		errx(EXIT_FAILURE, "Version 2 requests were not all executed");
+	}
+
+	/* Replies overflow if the client doesn't read them. */
+	static const int bufsize = 1;
+	if (setsockopt(snode->fd, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof (bufsize)) != 0
+		|| setsockopt(client, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof (bufsize)) != 0) {
+		err(EXIT_FAILURE, "setsockopt");
+	}
+
+	size = test_socket_connection_node_request(buffer, 6, sizeof (start), start, sizeof (start));
+	for (unsigned int i = 0; test_socket_connection_node_removed == 0; i++) {
+		if (i == TEST_SOCKET_CONNECTION_NODE_OVERFLOW_REQUESTS) {
+			errx(EXIT_FAILURE, "Connection not closed after its replies overflowed");
+		}
+		test_socket_connection_node_send(snode, client, buffer, size);
+	}
+	close(client);
+
+	/****************************
+	 * Version 2 SOCK_SEQPACKET *
+	 ****************************/
+	snode = test_socket_connection_node_create(SOCK_SEQPACKET, &client);
+
+	size = test_socket_connection_node_request(buffer, 7, sizeof (start), start, sizeof (start));
+	test_socket_connection_node_send(snode, client, buffer, size);
+	test_socket_connection_node_reply(client, 7, PROTOCOL_STATUS_OK);
+
+	/* The announced length must be the datagram's. */
+	size = test_socket_connection_node_request(buffer, 8, sizeof (start) + 1, start, sizeof (start));
+	test_socket_connection_node_send(snode, client, buffer, size);
+	test_socket_connection_node_reply(client, 8, PROTOCOL_STATUS_INVALID);
+
+	/* Too short to be replied to. */
+	test_socket_connection_node_send(snode, client, buffer, PROTOCOL_V2_HEADER_SIZE - 1);
+	test_socket_connection_node_no_reply(client);
+
+	snode->class->destroy(snode);
+	close(client);
+
+	return EXIT_SUCCESS;
+}
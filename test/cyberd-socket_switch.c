@@ -0,0 +1,153 @@
+#include <stdio.h> /* printf */
+#include <stdlib.h> /* malloc, free */
+#include <stdint.h> /* uint64_t */
+#include <inttypes.h> /* PRIu64 */
+#include <unistd.h> /* read, write, close */
+#include <time.h> /* clock_gettime */
+#include <sys/eventfd.h> /* eventfd */
+#include <sys/resource.h> /* getrlimit, setrlimit */
+#include <err.h> /* err, errx */
+
+#include "cyberd/socket_switch.c"
+
+#define TEST_SOCKET_SWITCH_CONNECTIONS 10000
+#define TEST_SOCKET_SWITCH_READY 64
+#define TEST_SOCKET_SWITCH_WAITS 10000
+
+/* Open connections are stood in by eventfds, readable once written, one fd each. */
+
+const char *socket_endpoints_path;
+
+struct socket_node *
+socket_endpoint_node_create(const char *name, capset_t capabilities, int type, bool privileged) {
+	return NULL;
+}
+
+static unsigned int test_socket_switch_operated;
+
+static void
+test_socket_switch_operate(struct socket_node *snode) {
+	uint64_t value;
+
+	if (read(snode->fd, &value, sizeof (value)) != sizeof (value)) {
+		err(EXIT_FAILURE, "read");
+	}
+
+	test_socket_switch_operated++;
+}
+
+static uint64_t
+test_socket_switch_elapsed(const struct timespec *begin) {
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return (uint64_t)(end.tv_sec - begin->tv_sec) * 1000000000 + (end.tv_nsec - begin->tv_nsec);
+}
+
+int
+main(int argc, char *argv[]) {
+	static const struct socket_node_class test_socket_switch_class = {
+		.operate = test_socket_switch_operate,
+	};
+	static const uint64_t one = 1;
+	unsigned int count = TEST_SOCKET_SWITCH_CONNECTIONS;
+	struct timespec begin;
+	struct rlimit rlimit;
+	uint64_t elapsed;
+
+	setlogmask(LOG_UPTO(LOG_WARNING));
+
+	/******************
+	 * Initialization *
+	 ******************/
+	/* Spare a few fds for the standard streams and the backend. */
+	if (getrlimit(RLIMIT_NOFILE, &rlimit) != 0) {
+		err(EXIT_FAILURE, "getrlimit");
+	}
+	rlimit.rlim_cur = rlimit.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rlimit);
+	getrlimit(RLIMIT_NOFILE, &rlimit);
+	if (rlimit.rlim_cur != RLIM_INFINITY && count > rlimit.rlim_cur - 16) {
+		count = rlimit.rlim_cur - 16;
+	}
+
+#ifndef CONFIG_SOCKET_SWITCH_EPOLL
+	/* pselect(2) can't watch fds beyond FD_SETSIZE. */
+	if (count > FD_SETSIZE - 16) {
+		count = FD_SETSIZE - 16;
+	}
+#endif
+
+	struct socket_node * const snodes = malloc(count * sizeof (*snodes));
+	if (snodes == NULL) {
+		err(EXIT_FAILURE, "malloc");
+	}
+
+	socket_switch_init();
+
+	for (unsigned int i = 0; i < count; i++) {
+		snodes[i].class = &test_socket_switch_class;
+		snodes[i].fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (snodes[i].fd < 0) {
+			err(EXIT_FAILURE, "eventfd");
+		}
+		if (socket_switch_insert(&snodes[i]) != 0) {
+			errx(EXIT_FAILURE, "Unable to insert node %u", i);
+		}
+	}
+
+	/************
+	 * Dispatch *
+	 ************/
+	elapsed = 0;
+	for (unsigned int i = 0; i < TEST_SOCKET_SWITCH_WAITS; i++) {
+		/* Spread ready nodes over the whole table. */
+		for (unsigned int j = 0; j < TEST_SOCKET_SWITCH_READY; j++) {
+			const struct socket_node * const snode = &snodes[(i + j * (count / TEST_SOCKET_SWITCH_READY)) % count];
+
+			if (write(snode->fd, &one, sizeof (one)) != sizeof (one)) {
+				err(EXIT_FAILURE, "write");
+			}
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &begin);
+		while (test_socket_switch_operated != (i + 1) * TEST_SOCKET_SWITCH_READY) {
+			if (socket_switch_wait(NULL) != 0) {
+				err(EXIT_FAILURE, "socket_switch_wait");
+			}
+		}
+		elapsed += test_socket_switch_elapsed(&begin);
+	}
+	printf("Dispatch with %u connections, %u ready: %"PRIu64"ns per event\n", count, TEST_SOCKET_SWITCH_READY,
+		elapsed / ((uint64_t)TEST_SOCKET_SWITCH_WAITS * TEST_SOCKET_SWITCH_READY));
+
+	/******************
+	 * Remove, insert *
+	 ******************/
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	for (unsigned int i = 0; i < TEST_SOCKET_SWITCH_WAITS; i++) {
+		struct socket_node * const snode = &snodes[i % count];
+
+		socket_switch_remove(snode);
+		socket_switch_insert(snode);
+	}
+	printf("Remove and insert with %u connections: %"PRIu64"ns\n", count,
+		test_socket_switch_elapsed(&begin) / TEST_SOCKET_SWITCH_WAITS);
+
+	/****************
+	 * Finalization *
+	 ****************/
+	for (unsigned int i = 0; i < count; i++) {
+		socket_switch_remove(&snodes[i]);
+		close(snodes[i].fd);
+	}
+
+	if (socket_switch.maxfd != -1) {
+		errx(EXIT_FAILURE, "Highest fd not lowered once all nodes were removed");
+	}
+
+	free(snodes);
+
+	return EXIT_SUCCESS;
+}
@@ -8,11 +8,25 @@
 #define TEST_TREE_INTEGER_POOL_MAX INT16_MAX
 #define TEST_TREE_INTEGER_POOL_COUNT (1U + TEST_TREE_INTEGER_POOL_MAX - TEST_TREE_INTEGER_POOL_MIN)
 
+#define TEST_TREE_RANGE_LOWER -100
+#define TEST_TREE_RANGE_UPPER 200
+
 static int
 test_tree_compare(const tree_element_t *lhs, const tree_element_t *rhs) {
 	return (intptr_t)lhs - (intptr_t)rhs;
 }
 
+static bool
+test_tree_range_visit(tree_element_t *element, void *data) {
+	intptr_t * const next = data;
+
+	if ((intptr_t)element != *next) {
+		errx(EXIT_FAILURE, "Range element is invalid");
+	}
+
+	return (*next)++ != TEST_TREE_RANGE_UPPER;
+}
+
 int
 main(int argc, char *argv[]) {
 	struct tree test_tree = { .compare = test_tree_compare };
@@ -62,6 +76,21 @@ main(int argc, char *argv[]) {
 		errx(EXIT_FAILURE, "Last element is not maximum");
 	}
 
+	/*********
+	 * Range *
+	 *********/
+	intptr_t next = TEST_TREE_RANGE_LOWER;
+	tree_range(&test_tree, (const tree_element_t *)next, test_tree_range_visit, &next);
+	if (next != TEST_TREE_RANGE_UPPER + 1) {
+		errx(EXIT_FAILURE, "Range stopped early");
+	}
+
+	next = TEST_TREE_INTEGER_POOL_MAX;
+	tree_range(&test_tree, (const tree_element_t *)next, test_tree_range_visit, &next);
+	if (next != TEST_TREE_INTEGER_POOL_MAX + 1) {
+		errx(EXIT_FAILURE, "Range of the last element is invalid");
+	}
+
 	/***********
 	 * Removal *
 	 ***********/